@@ -1,8 +1,8 @@
 #include <glad/glad.h>
 #include <GLFW/glfw3.h>
 #include <iostream>
+#include <memory>
 #include <vector>
-#include <map>
 
 #include "includes/stb_image.h"
 #include "includes/shader.h"
@@ -15,6 +15,32 @@
 #include <gtc/type_ptr.hpp>
 #include "includes/imgui/imgui_impl_opengl3.h"
 #include "includes/model.h"
+#include "includes/benchmarks.h"
+#include "includes/animation_baking.h"
+#include "includes/animation_compression.h"
+#include "includes/batch_render.h"
+#include "includes/camera_path.h"
+#include "includes/cascaded_shadows.h"
+#include "includes/clustered_lighting.h"
+#include "includes/command_list.h"
+#include "includes/deferred.h"
+#include "includes/frame_capture.h"
+#include "includes/environment_lighting.h"
+#include "includes/frame_pacing.h"
+#include "includes/gpu_timer.h"
+#include "includes/headless_context.h"
+#include "includes/job_system.h"
+#include "includes/occlusion.h"
+#include "includes/occlusion_query.h"
+#include "includes/oit.h"
+#include "includes/post_process.h"
+#include "includes/poster_render.h"
+#include "includes/render_graph.h"
+#include "includes/render_targets.h"
+#include "includes/simulation.h"
+#include "includes/skeletal_animation.h"
+#include "includes/stats.h"
+#include "includes/transparent_sort.h"
 #include "includes/LogHelper.h"
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height);
@@ -25,13 +51,17 @@ void mousebutton_callback(GLFWwindow* window, int button, int action, int mods);
 unsigned int loadTexture(char const* path, bool flipVertically = true);
 unsigned int loadCubemap(const std::vector<std::string>& faces);
 
-void CreateFrameBuffer(unsigned int& fbo);
-void CreateFrameTexture(unsigned int& texture, bool needDepthAndStencil);
-void CreateRenderBuffer(unsigned int& rbo);
-
 const unsigned int SCR_WIDTH = 800;
 const unsigned int SCR_HEIGHT = 600;
 
+// framebuffer size of the window, kept up to date by framebuffer_size_callback
+int windowWidth = SCR_WIDTH;
+int windowHeight = SCR_HEIGHT;
+
+// renders the scene at a lower resolution when the gpu misses the target and upscales it
+bool dynamicResolution = false;
+float targetGpuMs = 8.0f;
+
 Camera camera(glm::vec3(0.0f, 0.0f, 3.0f));
 
 float deltaTime = 0.0f;
@@ -47,6 +77,80 @@ float mixValue = 0.0f;
 bool firstMouse = true;
 bool enableMouse = false;
 
+enum OcclusionMode
+{
+    OCCLUSION_NONE,
+    OCCLUSION_CPU,
+    OCCLUSION_GPU_QUERY
+};
+
+int occlusionMode = OCCLUSION_CPU;
+
+enum SkyMode
+{
+    SKY_CUBEMAP,
+    SKY_PROCEDURAL
+};
+
+// the skybox cubemap or a gradient with a sun around sunDirection
+int skyMode = SKY_CUBEMAP;
+
+// weighted blended transparency instead of sorting the windows
+bool orderIndependentTransparency = false;
+
+// camera movement runs on a fixed timestep thread instead of once per frame
+bool decoupledSimulation = true;
+SimulationInput pendingInput;
+
+// lights the boxes with many small lights through clustered forward shading
+bool clusteredLighting = false;
+int clusteredLightCount = 1024;
+
+// boxes go through a G-buffer and are lit in screen space by the clustered lights
+bool deferredShading = false;
+// 0 = lit image, 1 = G-buffer normals/depth, 2 = G-buffer albedo/specular
+int gbufferView = 0;
+
+// boxes lit by the baked skybox irradiance and reflections instead of one refracted sample
+bool imageBasedLighting = true;
+float environmentRoughness = 0.4f;
+
+// directional light shadows for the clustered and deferred lighting paths
+bool cascadedShadows = true;
+glm::vec3 sunDirection(-0.2f, -1.0f, -0.3f);
+
+// opaque geometry lays down depth first, shading then only runs for the visible fragment
+bool depthPrepass = false;
+
+// how far the cpu may run ahead of the gpu, and an optional fps cap (0 = off)
+int maxFramesInFlight = 2;
+int frameRateLimit = 0;
+
+// writes the presented frames to capture_N_* in the working directory
+bool captureFrames = false;
+int captureFormat = CAPTURE_PNG;
+
+// playback rate of the skinned characters loaded with --character
+float animationSpeed = 1.0f;
+// the characters play clips baked into a texture and are drawn instanced instead of with a palette each
+bool bakedAnimation = false;
+BakeSettings bakeSettings;
+// the palettes sample key reduced, quantized copies of the clips
+bool compressedAnimation = false;
+CompressionSettings compressionSettings;
+
+FrameStats frameStats;
+
+// command packets are sorted by layer first
+enum RenderLayer
+{
+    LAYER_DEPTH,
+    LAYER_GBUFFER,
+    LAYER_OPAQUE,
+    LAYER_SKY,
+    LAYER_TRANSPARENT
+};
+
 glm::vec3 lightPos(2.0f, 0.0f, 0.0f);
 
 const char* glsl_version = "#version 130";
@@ -73,37 +177,110 @@ void DrawMesh(const MeshData& data)
     glBindVertexArray(0);
 }
 
-int main()
+// Shuts ImGui and GLFW down when main returns. Made right after the context, so every
+// object declared later that owns gl resources is destroyed while the context still exists.
+struct WindowShutdown
 {
-    glfwInit();
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    bool Enabled;
 
-#ifdef __APPLE__
-    glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-#endif
-    GLFWwindow* window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "LearnOpenGL", NULL, NULL);
-    if (window == NULL)
+    ~WindowShutdown()
     {
-        std::cout << "Failed to create GLFW window" << std::endl;
+        if (!Enabled)
+            return;
+        ImGui_ImplOpenGL3_Shutdown();
+        ImGui_ImplGlfw_Shutdown();
+        ImGui::DestroyContext();
+
         glfwTerminate();
+    }
+};
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && std::string(argv[1]) == "--bench")
+    {
+        return RunBenchmarks(argc > 2 ? argv[2] : "");
+    }
+
+    HeadlessOptions headlessOptions;
+    if (!ParseHeadlessOptions(argc, argv, headlessOptions))
+    {
+        std::cout << "usage: MakeTriangles [--bench [name]]" << std::endl;
+        std::cout << "       MakeTriangles --headless [--size WIDTHxHEIGHT] [--frames N] [--fps N] [--path camera.txt] [--out directory] [--format png|ppm|y4m]" << std::endl;
+        std::cout << "                     [--workers N] [--range FIRST COUNT] [--progress] [--part] [--poster WIDTHxHEIGHT]" << std::endl;
+        std::cout << "       either with [--character model] [--characters N] [--baked]" << std::endl;
+        return -1;
+    }
+    CaptureFormat headlessFormat;
+    if (!ParseCaptureFormat(headlessOptions.OutputFormat, headlessFormat))
+    {
+        std::cout << "unknown capture format " << headlessOptions.OutputFormat << std::endl;
         return -1;
     }
-    glfwMakeContextCurrent(window);
-    glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+    if (headlessOptions.Enabled && headlessOptions.Workers > 1)
+    {
+        return RunBatch(argv[0], headlessOptions, headlessOptions.Workers);
+    }
+    // no window, a scripted camera and frames written to disk
+    bool headless = headlessOptions.Enabled;
+
+    GLFWwindow* window = NULL;
+    HeadlessContext headlessContext;
+    if (headless)
+    {
+        if (!headlessContext.Create(headlessOptions.Width, headlessOptions.Height))
+        {
+            return -1;
+        }
+        if (!gladLoadGLLoader((GLADloadproc)HeadlessContext::GetProcAddress))
+        {
+            std::cout << "Failed to initialize GLAD" << std::endl;
+            return -1;
+        }
+        headlessContext.CreateFramebuffer();
+        windowWidth = headlessOptions.Width;
+        windowHeight = headlessOptions.Height;
+    }
+    else
+    {
+        glfwInit();
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+        glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+#ifdef __APPLE__
+        glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#endif
+        window = glfwCreateWindow(SCR_WIDTH, SCR_HEIGHT, "LearnOpenGL", NULL, NULL);
+        if (window == NULL)
+        {
+            std::cout << "Failed to create GLFW window" << std::endl;
+            glfwTerminate();
+            return -1;
+        }
+        glfwMakeContextCurrent(window);
+        glfwSetFramebufferSizeCallback(window, framebuffer_size_callback);
+        // differs from the window size on high dpi screens
+        glfwGetFramebufferSize(window, &windowWidth, &windowHeight);
     
-    glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
+        glfwSetInputMode(window, GLFW_CURSOR, GLFW_CURSOR_NORMAL);
     
-    glfwSetCursorPosCallback(window, mouse_callback);
-    glfwSetScrollCallback(window, mousescroll_callback);
-    glfwSetMouseButtonCallback(window, mousebutton_callback);
+        glfwSetCursorPosCallback(window, mouse_callback);
+        glfwSetScrollCallback(window, mousescroll_callback);
+        glfwSetMouseButtonCallback(window, mousebutton_callback);
 
-    if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
-    {
-        std::cout << "Failed to initialize GLAD" << std::endl;
-        return -1;
+        if (!gladLoadGLLoader((GLADloadproc)glfwGetProcAddress))
+        {
+            std::cout << "Failed to initialize GLAD" << std::endl;
+            return -1;
+        }
+
+        IMGUI_CHECKVERSION();
+        ImGui::CreateContext();
+        ImGui_ImplGlfw_InitForOpenGL(window, true);
+        ImGui_ImplOpenGL3_Init(glsl_version);
     }
+    WindowShutdown windowShutdown = { !headless };
 
     GLCall(glEnable(GL_DEPTH_TEST));
     GLCall(glDepthFunc(GL_LESS));
@@ -189,51 +366,6 @@ int main()
          1.0f,  1.0f,  1.0f, 1.0f
     };
 
-    float skyboxVertices[] = {
-        // positions          
-        -1.0f,  1.0f, -1.0f,
-        -1.0f, -1.0f, -1.0f,
-         1.0f, -1.0f, -1.0f,
-         1.0f, -1.0f, -1.0f,
-         1.0f,  1.0f, -1.0f,
-        -1.0f,  1.0f, -1.0f,
-
-        -1.0f, -1.0f,  1.0f,
-        -1.0f, -1.0f, -1.0f,
-        -1.0f,  1.0f, -1.0f,
-        -1.0f,  1.0f, -1.0f,
-        -1.0f,  1.0f,  1.0f,
-        -1.0f, -1.0f,  1.0f,
-
-         1.0f, -1.0f, -1.0f,
-         1.0f, -1.0f,  1.0f,
-         1.0f,  1.0f,  1.0f,
-         1.0f,  1.0f,  1.0f,
-         1.0f,  1.0f, -1.0f,
-         1.0f, -1.0f, -1.0f,
-
-        -1.0f, -1.0f,  1.0f,
-        -1.0f,  1.0f,  1.0f,
-         1.0f,  1.0f,  1.0f,
-         1.0f,  1.0f,  1.0f,
-         1.0f, -1.0f,  1.0f,
-        -1.0f, -1.0f,  1.0f,
-
-        -1.0f,  1.0f, -1.0f,
-         1.0f,  1.0f, -1.0f,
-         1.0f,  1.0f,  1.0f,
-         1.0f,  1.0f,  1.0f,
-        -1.0f,  1.0f,  1.0f,
-        -1.0f,  1.0f, -1.0f,
-
-        -1.0f, -1.0f, -1.0f,
-        -1.0f, -1.0f,  1.0f,
-         1.0f, -1.0f, -1.0f,
-         1.0f, -1.0f, -1.0f,
-        -1.0f, -1.0f,  1.0f,
-         1.0f, -1.0f,  1.0f
-    };
-
     unsigned int cubeVAO, cubeVBO;
     glGenVertexArrays(1, &cubeVAO);
     glGenBuffers(1, &cubeVBO);
@@ -282,21 +414,40 @@ int main()
     GLCall(glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)(2 * sizeof(float))));
     GLCall(glBindVertexArray(0));
 
-    unsigned int skyboxVAO, skyboxVBO;
-    GLCall(glGenVertexArrays(1, &skyboxVAO));
-    GLCall(glGenBuffers(1, &skyboxVBO));
-    GLCall(glBindVertexArray(skyboxVAO));
-    GLCall(glBindBuffer(GL_ARRAY_BUFFER, skyboxVBO));
-    GLCall(glBufferData(GL_ARRAY_BUFFER, sizeof(skyboxVertices), &skyboxVertices, GL_STATIC_DRAW));
-    GLCall(glEnableVertexAttribArray(0));
-    GLCall(glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0));
-    GLCall(glBindVertexArray(0));
+    // the sky triangle comes from gl_VertexID, the core profile still wants some vao bound
+    unsigned int skyVAO;
+    GLCall(glGenVertexArrays(1, &skyVAO));
 
     Shader shader("src/shaders/basic.vs", "src/shaders/basic.fsc");
     Shader outlineShader("src/shaders/basic2.vs", "src/shaders/basic2.fsc");
     Shader modelShader("src/shaders/model_loading.vs", "src/shaders/model_loading.fsc");
-    Shader screenShader("src/shaders/BufferShader.vs", "src/shaders/BufferShader.fsc");
     Shader skyboxShader("src/shaders/skybox.vs", "src/shaders/skybox.fsc");
+    Shader proceduralSkyShader("src/shaders/skybox.vs", "src/shaders/sky_procedural.fsc");
+    Shader oitShader("src/shaders/basic.vs", "src/shaders/basic_oit.fsc");
+    Shader oitCompositeShader("src/shaders/BufferShader.vs", "src/shaders/oit_composite.fsc");
+    Shader clusteredShader("src/shaders/light_multiple.vs", "src/shaders/light_clustered.fsc");
+    Shader gbufferShader("src/shaders/model_loading.vs", "src/shaders/gbuffer.fsc");
+    Shader deferredLightingShader("src/shaders/BufferShader.vs", "src/shaders/deferred_lighting.fsc");
+    Shader depthShader("src/shaders/depth_only.vs");
+    Shader skinnedShader("src/shaders/skinned.vs", "src/shaders/model_loading.fsc");
+    Shader skinnedGbufferShader("src/shaders/skinned.vs", "src/shaders/gbuffer.fsc");
+    Shader skinnedDepthShader("src/shaders/skinned.vs");
+    SkinningPalettes::BindBlock(skinnedShader);
+    SkinningPalettes::BindBlock(skinnedGbufferShader);
+    SkinningPalettes::BindBlock(skinnedDepthShader);
+    Shader bakedShader("src/shaders/skinned_baked.vs", "src/shaders/model_loading.fsc");
+    Shader bakedGbufferShader("src/shaders/skinned_baked.vs", "src/shaders/gbuffer.fsc");
+    Shader bakedDepthShader("src/shaders/skinned_baked.vs");
+
+    // scene to window, per pixel effects are fused into one generated pass
+    PostStack postStack("src/shaders/BufferShader.vs");
+    postStack.GetEffect(postStack.Add(TonemapEffect())).Enabled = false;
+    postStack.Add(ColorGradingEffect());
+    postStack.GetEffect(postStack.Add(SharpenEffect())).Enabled = false;
+    postStack.GetEffect(postStack.Add(BlurEffect())).Enabled = false;
+    postStack.GetEffect(postStack.Add(GrayscaleEffect())).Enabled = false;
+    postStack.GetEffect(postStack.Add(InvertEffect())).Enabled = false;
+    postStack.GetEffect(postStack.Add(VignetteEffect())).Enabled = false;
 
     unsigned int cubeTexture = loadTexture("resources/textures/container2.png");
     unsigned int floorTexture = loadTexture("resources/textures/Ground.png");
@@ -316,28 +467,139 @@ int main()
 
     modelShader.use();
     modelShader.setInt("skybox", skyboxIdx);
+    skinnedShader.use();
+    skinnedShader.setInt("skybox", skyboxIdx);
+    bakedShader.use();
+    bakedShader.setInt("skybox", skyboxIdx);
+
+    clusteredShader.use();
+    clusteredShader.setVec3("dirLight.direction", sunDirection);
+    clusteredShader.setVec3("dirLight.ambient", glm::vec3(0.05f));
+    clusteredShader.setVec3("dirLight.diffuse", glm::vec3(0.1f));
+    clusteredShader.setVec3("dirLight.specular", glm::vec3(0.1f));
+    clusteredShader.setFloat("material.shininess", 32.0f);
+
+    deferredLightingShader.use();
+    deferredLightingShader.setVec3("dirLight.direction", sunDirection);
+    deferredLightingShader.setVec3("dirLight.ambient", glm::vec3(0.05f));
+    deferredLightingShader.setVec3("dirLight.diffuse", glm::vec3(0.1f));
+    deferredLightingShader.setVec3("dirLight.specular", glm::vec3(0.1f));
+    deferredLightingShader.setFloat("shininess", 32.0f);
+
+    JobSystem jobSystem;
+
+    Model boxModel("resources/models/Boxes.obj", &jobSystem);
+    Model windowModel("resources/models/Window.obj", &jobSystem);
+
+    EnvironmentLighting environmentLighting;
+    environmentLighting.Bake(faces, cubeMapTexture, screenQuadVAO, &jobSystem);
+    environmentLighting.SetUniforms(modelShader);
+    environmentLighting.SetUniforms(skinnedShader);
+    environmentLighting.SetUniforms(bakedShader);
+
+    // skinned characters in a grid in front of the boxes, each one at its own point of one of the clips
+    std::unique_ptr<Model> characterModel;
+    std::vector<glm::mat4> characterTransforms;
+    SkinningPalettes skinningPalettes;
+    skinningPalettes.SetJobSystem(&jobSystem);
+    skinningPalettes.Create();
+    if (!headlessOptions.CharacterPath.empty())
+    {
+        characterModel.reset(new Model(headlessOptions.CharacterPath.c_str(), &jobSystem));
+        if (!characterModel->IsSkinned() || characterModel->GetAnimations().empty())
+        {
+            LOG("SKINNING::" << headlessOptions.CharacterPath << " has no skinned meshes or no animations, it is drawn in the bind pose");
+        }
 
-    screenShader.use();
-    screenShader.setInt("screenTexture", 0);
-
-    Model boxModel("resources/models/Boxes.obj");
-    Model windowModel("resources/models/Window.obj");
+        // a unit tall character standing on the floor
+        const AABB& characterBounds = characterModel->GetBounds();
+        float characterScale = 1.0f / std::max(characterBounds.Max.y - characterBounds.Min.y, 0.001f);
+        int columns = static_cast<int>(std::ceil(std::sqrt(static_cast<float>(headlessOptions.CharacterCount))));
+        for (int i = 0; i < headlessOptions.CharacterCount; i++)
+        {
+            glm::vec3 position(((i % columns) - 0.5f * (columns - 1)) * 0.75f, -0.5f, 1.5f + (i / columns) * 0.75f);
+            glm::mat4 transform = glm::translate(glm::mat4(1.0f), position);
+            transform = glm::scale(transform, glm::vec3(characterScale));
+            transform = glm::translate(transform, glm::vec3(0.0f, -characterBounds.Min.y, 0.0f));
+            characterTransforms.push_back(transform);
+
+            AnimatedInstance instance;
+            instance.Rig = &characterModel->GetSkeleton();
+            instance.Clip = characterModel->GetAnimations().empty() ? nullptr : &characterModel->GetAnimations()[i % characterModel->GetAnimations().size()];
+            instance.Time = i * 0.37f;
+            skinningPalettes.GetInstances().push_back(instance);
+        }
+    }
+    bakedAnimation = bakedAnimation || headlessOptions.BakedAnimation;
+
+    // the crowd flavor, every clip baked once and the characters drawn with one instanced draw per mesh
+    BakedAnimations bakedAnimations;
+    bakedAnimations.SetJobSystem(&jobSystem);
+    bool animationsBaked = false;
+    float animationTime = 0.0f;
+    unsigned int characterInstanceVBO = 0;
+    std::vector<CompressedClip> compressedClips;
+    CompressionSettings compressedSettings;
+    size_t clipSize = 0;
+    size_t compressedClipSize = 0;
+    if (characterModel)
+    {
+        GLCall(glGenBuffers(1, &characterInstanceVBO));
+        characterModel->SetInstanceBuffer(characterInstanceVBO);
+    }
 
-    unsigned int fbo, textureColorBuffer, rbo;
-    glGenFramebuffers(1, &fbo);
-    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    // the box stacks are the big occluders of the scene
+    OcclusionCuller occlusionCuller;
+    occlusionCuller.SetJobSystem(&jobSystem);
+    OcclusionQueryPool occlusionQueries;
+    ClusteredLighting clusteredLights;
+    clusteredLights.SetJobSystem(&jobSystem);
+    std::vector<glm::mat4> boxTransforms;
+    float modelScale = 0.5f;
+    glm::mat4 boxTransform = glm::mat4(1.0f);
+    boxTransform = glm::translate(boxTransform, glm::vec3(-1.0f, 0.0f, -1.0f));
+    boxTransform = glm::scale(boxTransform, glm::vec3(modelScale));
+    boxTransforms.push_back(boxTransform);
+    boxTransform = glm::mat4(1.0f);
+    boxTransform = glm::translate(boxTransform, glm::vec3(2.0f, 0.0f, 0.0f));
+    boxTransform = glm::scale(boxTransform, glm::vec3(modelScale));
+    boxTransforms.push_back(boxTransform);
+
+    occlusionQueries.Resize(static_cast<unsigned int>(boxTransforms.size()));
+    // per frame results, kept so the loop doesn't allocate them every frame
+    std::vector<bool> boxVisible;
+    std::vector<bool> windowVisible;
+    std::vector<bool> cameraInside;
+
+    // maps the unit cube of cubeVertices onto the box model bounds
+    const AABB& boxBounds = boxModel.GetBounds();
+    glm::mat4 boxBoundsTransform = glm::mat4(1.0f);
+    boxBoundsTransform = glm::translate(boxBoundsTransform, (boxBounds.Min + boxBounds.Max) * 0.5f);
+    boxBoundsTransform = glm::scale(boxBoundsTransform, boxBounds.Max - boxBounds.Min);
+
+    // bounds of transparentVertices
+    AABB windowBounds{ glm::vec3(0.0f, -0.5f, 0.0f), glm::vec3(1.0f, 0.5f, 0.0f) };
+
+    // offscreen color and depth, the oit and G-buffer passes attach their targets to the same framebuffer
+    RenderTargets renderTargets;
+    renderTargets.Create(std::max(windowWidth, 1), std::max(windowHeight, 1));
+    unsigned int fbo = renderTargets.GetFramebuffer();
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    WeightedBlendedOIT oit;
+    if (!oit.IsSupported())
+    {
+        LOG("OIT::Needs OpenGL 4.0, falling back to sorted transparency");
+    }
 
-    glGenTextures(1, &textureColorBuffer);
-    glBindTexture(GL_TEXTURE_2D, textureColorBuffer);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, SCR_WIDTH, SCR_HEIGHT, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textureColorBuffer, 0);
+    DeferredRenderer deferred;
+    RenderGraph renderGraph;
 
-    glGenRenderbuffers(1, &rbo);
-    glBindRenderbuffer(GL_RENDERBUFFER, rbo);
-    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, SCR_WIDTH, SCR_HEIGHT); // use a single renderbuffer object for both a depth AND stencil buffer.
-    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, rbo);
+    CascadedShadowMaps shadowMaps;
+    shadowMaps.Create();
+    shadowMaps.SetShadowDistance(0.1f, 30.0f);
+    std::vector<ShadowCaster> shadowCasters;
+    glm::vec3 shaderSunDirection = sunDirection;
 
     if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
     {
@@ -356,135 +618,1036 @@ int main()
     windows.push_back(glm::vec3(-0.3f, 0.0f, -2.3f));
     windows.push_back(glm::vec3(0.5f, 0.0f, -0.6f));
 
-    while (!glfwWindowShouldClose(window))
+    TransparentSorter transparentSorter;
+    transparentSorter.Reserve(static_cast<unsigned int>(windows.size()));
+
+    // one command list per job system thread, merged by the queue on submit.
+    // Only pool threads record, any other thread would index past the end.
+    std::vector<CommandList> commandLists(jobSystem.GetThreadCount());
+    CommandQueue commandQueue;
+
+    FramePacer framePacer;
+    FragmentCounter gbufferFragments;
+    FragmentCounter opaqueFragments;
+    // last count seen with the prepass off and on
+    GLuint64 opaqueFragmentsByMode[2] = {};
+
+    Simulation simulation;
+    RollingStats frameTimes;
+    double lastShownInputTime = 0.0;
+
+    // the post stack presents into this, the window or the headless stand-in
+    unsigned int presentFramebuffer = headless ? headlessContext.GetFramebuffer() : 0;
+    CameraPath cameraPath;
+    FrameCapture frameCapture;
+    // render thread time spent on capture over the headless run
+    float captureMs = 0.0f;
+    // a batch worker only renders its range of the path
+    int headlessFrame = headlessOptions.RangeFirst;
+    int headlessEnd = headlessOptions.RangeFirst + headlessOptions.RangeCount;
+    CpuTimer headlessTimer;
+    // a poster renders one tile per frame, all of them at the start of the path
+    bool poster = headless && headlessOptions.PosterWidth > 0;
+    PosterTiles posterTiles(headlessOptions.PosterWidth, headlessOptions.PosterHeight, windowWidth, windowHeight);
+    std::string posterPath = headlessOptions.OutputDirectory + "/poster.ppm";
+    if (headless)
+    {
+        if (headlessOptions.CameraPath.empty() || !cameraPath.Load(headlessOptions.CameraPath))
+        {
+            cameraPath.MakeOrbit(glm::vec3(0.0f), 6.0f, 2.0f, headlessOptions.Frames / headlessOptions.FramesPerSecond);
+        }
+        // the path drives the camera, frame times are fixed so runs are repeatable
+        decoupledSimulation = false;
+        // starts the frame times where the range starts
+        lastFrame = poster ? 0.0f : headlessFrame / headlessOptions.FramesPerSecond;
+        // a range that covers every frame is still a part when a batch has a single worker
+        bool worker = headlessOptions.Part;
+        if (poster)
+        {
+            // workers write their tiles into the image the coordinator created, never frames of their own
+            if (!headlessOptions.OutputDirectory.empty() && !worker && !posterTiles.CreateImage(posterPath))
+            {
+                return -1;
+            }
+        }
+        else if (!headlessOptions.OutputDirectory.empty())
+        {
+            // y4m is a single stream, workers write parts that the coordinator joins
+            bool part = headlessFormat == CAPTURE_Y4M && worker;
+            captureFrames = frameCapture.Start(part ? BatchPartPrefix(headlessOptions.OutputDirectory, headlessFrame) : headlessOptions.OutputDirectory + "/frame",
+                headlessFormat, windowWidth, windowHeight, headlessOptions.FramesPerSecond, headlessFrame);
+        }
+    }
+    int captureCount = 0;
+
+    while (headless ? headlessFrame < headlessEnd : !glfwWindowShouldClose(window))
     {
-        float currentTime = static_cast<float>(glfwGetTime());
+        // wait for the gpu before sampling input, not after
+        framePacer.SetMaxFramesInFlight(maxFramesInFlight);
+        framePacer.SetFrameRateLimit(frameRateLimit);
+        framePacer.BeginFrame();
+
+        float currentTime = headless ? (poster ? 0.0f : headlessFrame / headlessOptions.FramesPerSecond) : static_cast<float>(glfwGetTime());
         deltaTime = currentTime - lastFrame;
         lastFrame = currentTime;
 
         yaw = -90.0f;
 
-        processInput(window);
-            
-        std::map<float, glm::vec3> sorted;
-        for (unsigned int i = 0; i < windows.size(); i++)
+        if (headless)
         {
-            float distance = glm::length(camera.Position - windows[i]);
-            sorted[distance] = windows[i];
+            CameraState state = cameraPath.Sample(currentTime);
+            camera.SetState(state.Position, state.Yaw, state.Pitch, state.Zoom);
+        }
+        else
+        {
+            processInput(window);
         }
 
-        glBindFramebuffer(GL_FRAMEBUFFER, fbo);
-        glEnable(GL_DEPTH_TEST); // enable depth testing (is disabled for rendering screen-space quad)
+        // when the input of this frame was sampled, if it reaches the screen with it
+        double frameInputTime = 0.0;
+        if (decoupledSimulation)
+        {
+            if (!simulation.IsRunning())
+            {
+                simulation.Start(camera, boxTransforms, lightPos);
+            }
+            simulation.PostInput(pendingInput);
+
+            bool newSnapshot = simulation.Acquire();
+            const FrameSnapshot& snapshot = simulation.GetSnapshot();
+            if (snapshot.Tick > 0)
+            {
+                CameraState state = snapshot.Interpolate(SimulationNow() - snapshot.Step);
+                camera.SetState(state.Position, state.Yaw, state.Pitch, state.Zoom);
+                boxTransforms = snapshot.Transforms;
+                lightPos = snapshot.LightPosition;
+            }
+            if (newSnapshot && snapshot.InputTime > lastShownInputTime)
+            {
+                frameInputTime = snapshot.InputTime;
+            }
+        }
+        else
+        {
+            if (simulation.IsRunning())
+            {
+                simulation.Stop();
+            }
+            ApplyInput(camera, pendingInput, deltaTime);
+            frameInputTime = pendingInput.EventTime;
+        }
+        pendingInput.ClearEvents();
 
-        // make sure we clear the framebuffer's content
-        glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+        // targets follow the window, the scene only covers the scaled part of them
+        renderTargets.Resize(windowWidth, windowHeight);
+        renderTargets.SetDynamicScale(dynamicResolution, targetGpuMs);
+        renderTargets.UpdateScale(framePacer.GpuBusyMs);
+        int renderWidth = renderTargets.GetRenderWidth();
+        int renderHeight = renderTargets.GetRenderHeight();
+        float aspect = poster ? posterTiles.GetAspect() : (float)renderTargets.GetWidth() / (float)renderTargets.GetHeight();
 
         glm::mat4 model = glm::mat4(1.0f);
         glm::mat4 view = camera.GetViewMatrix();
-        glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), (float)SCR_WIDTH / (float)SCR_HEIGHT, 0.1f, 100.0f);
+        glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), aspect, 0.1f, 100.0f);
+        if (poster)
+        {
+            // shadows still fit the whole poster so the tiles match
+            projection = posterTiles.GetTileProjection(headlessFrame, projection);
+        }
 
-        shader.use();
-        shader.setMat4("view", view);
-        shader.setMat4("projection", projection);
+        // blended oit does not care about the order
+        bool useOit = orderIndependentTransparency && oit.IsSupported();
+        transparentSorter.Clear();
+        if (!useOit)
+        {
+            transparentSorter.Add(windows, view);
+            transparentSorter.Sort();
+        }
 
-        /*glStencilMask(0x00);*/
+        occlusionCuller.BeginFrame(projection * view);
+        if (occlusionMode == OCCLUSION_CPU)
+        {
+            for (unsigned int i = 0; i < boxTransforms.size(); i++)
+            {
+                occlusionCuller.AddOccluder(boxModel, boxTransforms[i]);
+            }
+            occlusionCuller.Rasterize();
+        }
+
+        // visibility is decided up front, the culler is not thread safe
+        boxVisible.assign(boxTransforms.size(), true);
+        windowVisible.assign(windows.size(), true);
+        if (occlusionMode == OCCLUSION_CPU)
+        {
+            for (unsigned int i = 0; i < boxTransforms.size(); i++)
+            {
+                boxVisible[i] = occlusionCuller.IsVisible(boxBounds, boxTransforms[i]);
+            }
+            for (unsigned int i = 0; i < windows.size(); i++)
+            {
+                windowVisible[i] = occlusionCuller.IsVisible(windowBounds, glm::translate(glm::mat4(1.0f), windows[i]));
+            }
+        }
+
+        // boxes are lit by the clustered lights instead of reflecting the skybox
+        bool useDeferred = deferredShading;
+        bool useClusteredLighting = clusteredLighting && clusteredLightCount > 0 && !useDeferred;
+        Shader& boxShader = useDeferred ? gbufferShader : (useClusteredLighting ? clusteredShader : modelShader);
+        bool useEnvironmentShader = !useDeferred && !useClusteredLighting;
+        if (useClusteredLighting || useDeferred)
+        {
+            if (clusteredLights.GetLights().size() != static_cast<size_t>(clusteredLightCount))
+            {
+                GenerateTestLights(clusteredLights.GetLights(), clusteredLightCount);
+            }
+            clusteredLights.Assign(view, projection, renderWidth, renderHeight, 0.1f, 100.0f);
+            clusteredLights.Upload();
+            clusteredLights.ReportStats(frameStats);
+        }
 
-        unsigned int floorIndices = 6;
-        MeshData meshData{ &planeVAO, &floorTexture, shader, model, floorIndices };
-        // floor
+        // the boxes cast shadows, they never move so all of them are static
+        bool useShadows = cascadedShadows && (useClusteredLighting || useDeferred);
+        if (useShadows)
+        {
+            if (glm::length(sunDirection) > 0.01f)
+            {
+                shadowMaps.SetLightDirection(sunDirection);
+                if (sunDirection != shaderSunDirection)
+                {
+                    shaderSunDirection = sunDirection;
+                    clusteredShader.use();
+                    clusteredShader.setVec3("dirLight.direction", sunDirection);
+                    deferredLightingShader.use();
+                    deferredLightingShader.setVec3("dirLight.direction", sunDirection);
+                }
+            }
+
+            shadowCasters.resize(boxTransforms.size());
+            for (unsigned int i = 0; i < boxTransforms.size(); i++)
+            {
+                shadowCasters[i].Bounds = boxBounds;
+                shadowCasters[i].Transform = boxTransforms[i];
+                shadowCasters[i].Static = true;
+            }
+            shadowMaps.Update(view, glm::radians(camera.Zoom), aspect, shadowCasters);
+        }
 
-        glEnable(GL_CULL_FACE);
-        glCullFace(GL_FRONT);
-        DrawMesh(meshData);
+        bool useBakedAnimation = bakedAnimation && characterModel;
+        if (useBakedAnimation && (!animationsBaked || bakedAnimations.GetSettings() != bakeSettings))
+        {
+            // new settings take a new bake, and the instances point at rows of it
+            bakedAnimations.Bake(characterModel->GetSkeleton(), characterModel->GetAnimations(), bakeSettings);
+            animationsBaked = bakedAnimations.Upload();
+            std::vector<InstanceData> instances(characterTransforms.size());
+            for (unsigned int i = 0; i < instances.size(); i++)
+            {
+                instances[i].Model = characterTransforms[i];
+                instances[i].Params = bakedAnimations.GetInstanceParams(i, i * 0.37f, 1.0f);
+            }
+            GLCall(glBindBuffer(GL_ARRAY_BUFFER, characterInstanceVBO));
+            GLCall(glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(InstanceData), instances.data(), GL_STATIC_DRAW));
+            GLCall(glBindBuffer(GL_ARRAY_BUFFER, 0));
+            if (!animationsBaked)
+            {
+                bakedAnimation = false;
+                useBakedAnimation = false;
+            }
+        }
+        if (useBakedAnimation)
+        {
+            // nothing per character, the shader finds the frame from the time
+            // headless runs take the frame time, a batch worker has to start where its range starts
+            animationTime = headless ? currentTime * animationSpeed : animationTime + deltaTime * animationSpeed;
+            bakedAnimations.ReportStats(frameStats);
+        }
+        else if (characterModel)
+        {
+            const std::vector<AnimationClip>& clips = characterModel->GetAnimations();
+            std::vector<AnimatedInstance>& animated = skinningPalettes.GetInstances();
+            if (compressedAnimation && (compressedClips.size() != clips.size() || compressedSettings != compressionSettings))
+            {
+                compressedClips.assign(clips.size(), CompressedClip());
+                clipSize = 0;
+                compressedClipSize = 0;
+                for (unsigned int c = 0; c < clips.size(); c++)
+                {
+                    compressedClips[c].Compress(clips[c], compressionSettings);
+                    clipSize += clips[c].GetMemorySize();
+                    compressedClipSize += compressedClips[c].GetMemorySize();
+                }
+                compressedSettings = compressionSettings;
+                // the cursors still hold keys of the old clips
+                for (AnimatedInstance& instance : animated)
+                    instance.Cursor = CompressedClipCursor();
+            }
+            for (unsigned int i = 0; i < animated.size(); i++)
+                animated[i].Compressed = compressedAnimation && !compressedClips.empty() ? &compressedClips[i % compressedClips.size()] : nullptr;
+            if (compressedAnimation)
+            {
+                frameStats.Set("Clips KB", clipSize / 1024.0f);
+                frameStats.Set("Compressed clips KB", compressedClipSize / 1024.0f);
+            }
+
+            // the palettes of every character go up in one buffer before anything records a draw
+            if (headless)
+            {
+                // times from the frame time, not added up, so a batch worker starts its range where a single run would be
+                for (unsigned int i = 0; i < animated.size(); i++)
+                    animated[i].Time = i * 0.37f + currentTime * animationSpeed * animated[i].Speed;
+                skinningPalettes.Update(0.0f);
+            }
+            else
+            {
+                skinningPalettes.Update(deltaTime * animationSpeed);
+            }
+            skinningPalettes.Upload();
+            skinningPalettes.ReportStats(frameStats);
+        }
+        // palettes bound one character at a time, or all of them in one draw per mesh
+        auto recordCharacters = [&](CommandList& list)
+        {
+            if (useBakedAnimation)
+            {
+                bakedAnimations.Record(list, animationTime);
+                characterModel->RecordInstanced(list, static_cast<GLsizei>(characterTransforms.size()));
+                return;
+            }
+            for (unsigned int i = 0; i < characterTransforms.size(); i++)
+            {
+                skinningPalettes.Record(list, i);
+                characterModel->Record(list, characterTransforms[i]);
+            }
+        };
+
+        // build: every pass records into the command list of the thread it runs on
+        CpuTimer buildTimer;
+        for (unsigned int i = 0; i < commandLists.size(); i++)
+        {
+            commandLists[i].Reset();
+        }
 
-        /*glStencilFunc(GL_ALWAYS, 1, 0xFF);
-        glStencilMask(0xFF);*/
-        // 1st pass
-        // cubes
+        JobCounter buildCounter;
+        bool useDepthPrepass = depthPrepass;
+        if (useDepthPrepass)
+        {
+            jobSystem.Run([&]()
+            {
+                // floor and boxes with positions only, the color writes are masked off on submit
+                CommandList& list = commandLists[jobSystem.GetThreadIndex()];
+                list.BeginPacket(MakeSortKey(LAYER_DEPTH, 0));
+                list.Enable(GL_CULL_FACE);
+                list.CullFace(GL_FRONT);
+                list.UseProgram(depthShader.ID);
+                list.SetMat4("view", view);
+                list.SetMat4("projection", projection);
+                list.BindVertexArray(planeVAO);
+                list.SetMat4("model", glm::mat4(1.0f));
+                list.DrawArrays(GL_TRIANGLES, 0, 6);
+
+                // posed by the same shader as in the shading pass, so the depth matches
+                if (!characterTransforms.empty())
+                {
+                    list.CullFace(GL_BACK);
+                    list.UseProgram(useBakedAnimation ? bakedDepthShader.ID : skinnedDepthShader.ID);
+                    list.SetMat4("view", view);
+                    list.SetMat4("projection", projection);
+                    recordCharacters(list);
+                }
+
+                // boxes with occlusion queries are drawn on submit and skip the prepass
+                if (occlusionMode == OCCLUSION_GPU_QUERY)
+                    return;
+
+                list.CullFace(GL_BACK);
+                for (unsigned int i = 0; i < boxTransforms.size(); i++)
+                {
+                    if (!boxVisible[i])
+                        continue;
+
+                    boxModel.RecordDepth(list, boxTransforms[i]);
+                }
+            }, &buildCounter);
+        }
 
-        glCullFace(GL_BACK);
-        float modelScale = 0.5f;
+        jobSystem.Run([&]()
+        {
+            // floor
+            CommandList& list = commandLists[jobSystem.GetThreadIndex()];
+            list.BeginPacket(MakeSortKey(LAYER_OPAQUE, 0));
+            list.Enable(GL_CULL_FACE);
+            list.CullFace(GL_FRONT);
+            list.UseProgram(shader.ID);
+            list.SetMat4("view", view);
+            list.SetMat4("projection", projection);
+            list.BindVertexArray(planeVAO);
+            list.BindTexture(GL_TEXTURE0, GL_TEXTURE_2D, floorTexture);
+            list.SetMat4("model", glm::mat4(1.0f));
+            list.DrawArrays(GL_TRIANGLES, 0, 6);
+        }, &buildCounter);
+
+        if (occlusionMode != OCCLUSION_GPU_QUERY)
+        {
+            for (unsigned int i = 0; i < boxTransforms.size(); i++)
+            {
+                if (!boxVisible[i])
+                    continue;
+
+                jobSystem.Run([&, i]()
+                {
+                    CommandList& list = commandLists[jobSystem.GetThreadIndex()];
+                    list.BeginPacket(MakeSortKey(useDeferred ? LAYER_GBUFFER : LAYER_OPAQUE, 1 + i));
+                    list.Enable(GL_CULL_FACE);
+                    list.CullFace(GL_BACK);
+                    list.UseProgram(boxShader.ID);
+                    list.SetMat4("view", view);
+                    list.SetMat4("projection", projection);
+                    list.SetVec3("cameraPos", camera.Position);
+                    if (useEnvironmentShader)
+                    {
+                        list.SetInt("useIbl", imageBasedLighting ? 1 : 0);
+                        list.SetFloat("roughness", environmentRoughness);
+                        environmentLighting.Record(list);
+                    }
+                    if (useClusteredLighting)
+                    {
+                        list.SetVec3("viewPos", camera.Position);
+                        clusteredLights.Record(list);
+                        list.SetInt("shadowsEnabled", useShadows ? 1 : 0);
+                        if (useShadows)
+                        {
+                            shadowMaps.Record(list);
+                        }
+                    }
+                    boxModel.Record(list, boxTransforms[i]);
+                }, &buildCounter);
+            }
+        }
 
-        modelShader.use();
-        modelShader.setMat4("view", view);
-        modelShader.setMat4("projection", projection);
-        modelShader.setVec3("cameraPos", camera.Position);
+        if (!characterTransforms.empty())
+        {
+            jobSystem.Run([&]()
+            {
+                // characters are lit like the boxes without clustered lights, or written to the G-buffer
+                CommandList& list = commandLists[jobSystem.GetThreadIndex()];
+                list.BeginPacket(MakeSortKey(useDeferred ? LAYER_GBUFFER : LAYER_OPAQUE, 1 + boxTransforms.size()));
+                list.Enable(GL_CULL_FACE);
+                list.CullFace(GL_BACK);
+                if (useBakedAnimation)
+                    list.UseProgram(useDeferred ? bakedGbufferShader.ID : bakedShader.ID);
+                else
+                    list.UseProgram(useDeferred ? skinnedGbufferShader.ID : skinnedShader.ID);
+                list.SetMat4("view", view);
+                list.SetMat4("projection", projection);
+                if (!useDeferred)
+                {
+                    list.SetVec3("cameraPos", camera.Position);
+                    list.SetInt("useIbl", imageBasedLighting ? 1 : 0);
+                    list.SetFloat("roughness", environmentRoughness);
+                    environmentLighting.Record(list);
+                }
+                recordCharacters(list);
+            }, &buildCounter);
+        }
 
-        model = glm::mat4(1.0f);
-        model = glm::translate(model, glm::vec3(-1.0f, 0.0f, -1.0f));
-        model = glm::scale(model, glm::vec3(modelScale));
+        jobSystem.Run([&]()
+        {
+            CommandList& list = commandLists[jobSystem.GetThreadIndex()];
+            // one triangle after the opaque geometry, the depth test rejects every covered pixel
+            // before shading with the default GL_LESS, the sky doesn't need to write depth
+            list.BeginPacket(MakeSortKey(LAYER_SKY, 0));
+            list.Enable(GL_CULL_FACE);
+            list.CullFace(GL_BACK);
+            list.DepthMask(GL_FALSE);
+            if (skyMode == SKY_PROCEDURAL)
+            {
+                list.UseProgram(proceduralSkyShader.ID);
+                list.SetVec3("sunDirection", sunDirection);
+            }
+            else
+            {
+                list.UseProgram(skyboxShader.ID);
+                list.BindTexture(skyboxTexture, GL_TEXTURE_CUBE_MAP, cubeMapTexture);
+                list.SetInt("skybox", skyboxIdx);
+            }
+            list.SetMat4("inverseViewProjection", glm::inverse(projection * glm::mat4(glm::mat3(view))));
+            list.BindVertexArray(skyVAO);
+            list.DrawArrays(GL_TRIANGLES, 0, 3);
+            list.DepthMask(GL_TRUE);
+        }, &buildCounter);
+
+        if (!useOit)
+        {
+            jobSystem.Run([&]()
+            {
+                // vegetation, back to front as sorted above
+                CommandList& list = commandLists[jobSystem.GetThreadIndex()];
+                for (unsigned int i = 0; i < transparentSorter.Size(); i++)
+                {
+                    unsigned int window = transparentSorter[i];
+                    if (!windowVisible[window])
+                        continue;
+
+                    list.BeginPacket(MakeSortKey(LAYER_TRANSPARENT, i));
+                    list.Disable(GL_CULL_FACE);
+                    list.UseProgram(shader.ID);
+                    list.SetMat4("view", view);
+                    list.SetMat4("projection", projection);
+                    list.BindVertexArray(vegetationVAO);
+                    list.BindTexture(GL_TEXTURE0, GL_TEXTURE_2D, transparentTexture);
+                    list.SetMat4("model", glm::translate(glm::mat4(1.0f), windows[window]));
+                    list.DrawArrays(GL_TRIANGLES, 0, 6);
+                }
+            }, &buildCounter);
+        }
 
-        modelShader.setMat4("model", model);
+        jobSystem.Wait(buildCounter);
+        frameStats.Set("Build ms", buildTimer.ElapsedMs());
 
-        boxModel.Draw(modelShader);
+        // submit: the only place that talks to gl
+        CpuTimer submitTimer;
+        // boxes with occlusion queries are drawn right here instead of being recorded
+        auto drawBoxesWithQueries = [&]()
+        {
+            // whatever was visible last time is drawn right away and occludes the rest
+            glEnable(GL_CULL_FACE);
+            glCullFace(GL_BACK);
+            boxShader.use();
+            boxShader.setMat4("view", view);
+            boxShader.setMat4("projection", projection);
+            boxShader.setVec3("cameraPos", camera.Position);
+            if (useEnvironmentShader)
+            {
+                boxShader.setInt("useIbl", imageBasedLighting ? 1 : 0);
+                boxShader.setFloat("roughness", environmentRoughness);
+                environmentLighting.Bind();
+            }
+            if (useClusteredLighting)
+            {
+                boxShader.setVec3("viewPos", camera.Position);
+                clusteredLights.Bind(boxShader);
+                boxShader.setInt("shadowsEnabled", useShadows ? 1 : 0);
+                if (useShadows)
+                {
+                    shadowMaps.Bind(boxShader);
+                }
+            }
+
+            occlusionQueries.BeginFrame();
+            for (unsigned int i = 0; i < boxTransforms.size(); i++)
+            {
+                occlusionQueries.Poll(i);
+                if (!occlusionQueries.WasVisible(i))
+                    continue;
+
+                boxModel.Draw(boxShader, boxTransforms[i]);
+            }
+
+            // bounding boxes of every object are tested against that depth
+            outlineShader.use();
+            outlineShader.setMat4("view", view);
+            outlineShader.setMat4("projection", projection);
+            glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+            glDepthMask(GL_FALSE);
+            glDepthFunc(GL_LEQUAL);
+            glDisable(GL_CULL_FACE);
+            glBindVertexArray(cubeVAO);
+            cameraInside.assign(boxTransforms.size(), false);
+            for (unsigned int i = 0; i < boxTransforms.size(); i++)
+            {
+                // the near plane would clip the box away
+                AABB worldBounds = TransformBounds(boxBounds, boxTransforms[i]);
+                cameraInside[i] = glm::all(glm::greaterThan(camera.Position, worldBounds.Min - glm::vec3(0.1f))) &&
+                    glm::all(glm::lessThan(camera.Position, worldBounds.Max + glm::vec3(0.1f)));
+
+                outlineShader.setMat4("model", boxTransforms[i] * boxBoundsTransform);
+                occlusionQueries.BeginQuery(i);
+                glDrawArrays(GL_TRIANGLES, 0, 36);
+                occlusionQueries.EndQuery(i);
+            }
+            glBindVertexArray(0);
+            glEnable(GL_CULL_FACE);
+            glDepthFunc(GL_LESS);
+            glDepthMask(GL_TRUE);
+            glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+
+            // the previously hidden ones only get drawn if their box passed this frame
+            boxShader.use();
+            for (unsigned int i = 0; i < boxTransforms.size(); i++)
+            {
+                if (occlusionQueries.WasVisible(i))
+                    continue;
+
+                if (cameraInside[i])
+                {
+                    boxModel.Draw(boxShader, boxTransforms[i]);
+                    continue;
+                }
+                occlusionQueries.BeginConditionalRender(i);
+                boxModel.Draw(boxShader, boxTransforms[i]);
+                occlusionQueries.EndConditionalRender();
+            }
+        };
+
+        // after the prepass only the fragments that ended up in front get shaded
+        auto beginEqualDepth = [&]()
+        {
+            if (!useDepthPrepass)
+                return;
+            glDepthFunc(GL_EQUAL);
+            glDepthMask(GL_FALSE);
+        };
+        auto endEqualDepth = [&]()
+        {
+            if (!useDepthPrepass)
+                return;
+            glDepthFunc(GL_LESS);
+            glDepthMask(GL_TRUE);
+        };
+
+        commandQueue.Merge(commandLists);
+
+        // the frame as a graph of passes, the G-buffer, oit and post targets are transient
+        renderGraph.Reset();
+        RenderGraphTextureDesc targetDesc;
+        targetDesc.Width = renderTargets.GetWidth();
+        targetDesc.Height = renderTargets.GetHeight();
+        targetDesc.Format = GL_RGB8;
+        RenderGraphResource sceneColor = renderGraph.ImportTexture("Scene color", renderTargets.GetColorTexture(), targetDesc);
+        targetDesc.Format = GL_DEPTH24_STENCIL8;
+        RenderGraphResource sceneDepth = renderGraph.ImportTexture("Scene depth", renderTargets.GetDepthStencil(), targetDesc);
+        RenderGraphTextureDesc shadowDesc;
+        shadowDesc.Width = CascadedShadowMaps::RESOLUTION;
+        shadowDesc.Height = CascadedShadowMaps::RESOLUTION;
+        shadowDesc.Format = GL_DEPTH_COMPONENT24;
+        shadowDesc.Layers = CascadedShadowMaps::CASCADES;
+        RenderGraphResource shadowMap = renderGraph.ImportTexture("Shadow map", shadowMaps.GetDepthTexture(), shadowDesc);
+        RenderGraphTextureDesc windowDesc;
+        windowDesc.Width = windowWidth;
+        windowDesc.Height = windowHeight;
+        RenderGraphResource backbuffer = renderGraph.ImportTexture("Backbuffer", 0, windowDesc);
+
+        // passes can be reordered, every scene pass binds the offscreen target itself
+        auto bindScene = [&]()
+        {
+            glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+            glViewport(0, 0, renderWidth, renderHeight);
+            glEnable(GL_DEPTH_TEST);
+        };
 
-        model = glm::mat4(1.0f);
-        model = glm::translate(model, glm::vec3(2.0f, 0.0f, 0.0f));
-        model = glm::scale(model, glm::vec3(modelScale));
+        renderGraph.AddPass("Clear", [&](RenderGraphBuilder& builder)
+        {
+            builder.Overwrite(sceneColor);
+            builder.Overwrite(sceneDepth);
+        },
+        [&](RenderGraphContext&)
+        {
+            bindScene();
+            // make sure we clear the framebuffer's content
+            glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT);
+        });
 
-        modelShader.setMat4("model", model);
-        boxModel.Draw(modelShader);
+        if (useShadows)
+        {
+            renderGraph.AddPass("Shadows", [&](RenderGraphBuilder& builder)
+            {
+                // cached cascades are kept from earlier frames
+                builder.Write(shadowMap);
+                builder.SideEffect();
+            },
+            [&](RenderGraphContext&)
+            {
+                shadowMaps.Render(depthShader, [&](unsigned int caster)
+                {
+                    boxModel.DrawDepth(depthShader, boxTransforms[caster]);
+                });
+                shadowMaps.ReportStats(frameStats);
+            });
+        }
 
-        GLCall(glDepthFunc(GL_LEQUAL));
-        //GLCall(glDepthMask(GL_FALSE));
-        glm::mat4 skyboxView = glm::mat4(glm::mat3(view));
+        if (useDepthPrepass)
+        {
+            renderGraph.AddPass("Depth prepass", [&](RenderGraphBuilder& builder)
+            {
+                builder.Write(sceneDepth);
+            },
+            [&](RenderGraphContext&)
+            {
+                bindScene();
+                glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+                commandQueue.Execute(LAYER_DEPTH, LAYER_DEPTH);
+                glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+            });
+        }
 
-        skyboxShader.use();
-        skyboxShader.setMat4("view", skyboxView);
-        skyboxShader.setMat4("projection", projection);
+        // samples passed is an occlusion query too and can't overlap the per box ones
+        bool countFragments = opaqueFragments.CountsInvocations() || occlusionMode != OCCLUSION_GPU_QUERY;
+        RenderGraphResource gbufferNormal = INVALID_RENDER_GRAPH_RESOURCE;
+        RenderGraphResource gbufferAlbedoSpecular = INVALID_RENDER_GRAPH_RESOURCE;
+        RenderGraphResource gbufferDepth = INVALID_RENDER_GRAPH_RESOURCE;
+        if (useDeferred)
+        {
+            RenderGraphTextureDesc gbufferDesc;
+            gbufferDesc.Width = renderTargets.GetWidth();
+            gbufferDesc.Height = renderTargets.GetHeight();
+            gbufferDesc.Format = DeferredRenderer::NORMAL_FORMAT;
+            gbufferNormal = renderGraph.CreateTexture("G-buffer normal", gbufferDesc);
+            gbufferDesc.Format = DeferredRenderer::ALBEDO_SPECULAR_FORMAT;
+            gbufferAlbedoSpecular = renderGraph.CreateTexture("G-buffer albedo specular", gbufferDesc);
+            gbufferDesc.Format = DeferredRenderer::DEPTH_FORMAT;
+            gbufferDepth = renderGraph.CreateTexture("G-buffer depth", gbufferDesc);
+
+            renderGraph.AddPass("G-buffer", [&](RenderGraphBuilder& builder)
+            {
+                builder.Overwrite(gbufferNormal);
+                builder.Overwrite(gbufferAlbedoSpecular);
+                builder.Overwrite(gbufferDepth);
+                builder.Write(sceneDepth);
+            },
+            [&](RenderGraphContext& context)
+            {
+                bindScene();
+                if (countFragments)
+                {
+                    gbufferFragments.Begin();
+                }
+                deferred.BeginGeometryPass(context.GetTexture(gbufferNormal), context.GetTexture(gbufferAlbedoSpecular), context.GetTexture(gbufferDepth));
+                beginEqualDepth();
+                commandQueue.Execute(LAYER_GBUFFER, LAYER_GBUFFER);
+                endEqualDepth();
+                if (occlusionMode == OCCLUSION_GPU_QUERY)
+                {
+                    drawBoxesWithQueries();
+                }
+                deferred.EndGeometryPass();
+                if (countFragments)
+                {
+                    gbufferFragments.End();
+                }
+            });
+
+            renderGraph.AddPass("Deferred lighting", [&](RenderGraphBuilder& builder)
+            {
+                builder.Read(gbufferNormal);
+                builder.Read(gbufferAlbedoSpecular);
+                builder.Read(gbufferDepth);
+                if (useShadows)
+                {
+                    builder.Read(shadowMap);
+                }
+                builder.Write(sceneColor);
+            },
+            [&](RenderGraphContext& context)
+            {
+                bindScene();
+                deferredLightingShader.use();
+                deferredLightingShader.setInt("shadowsEnabled", useShadows ? 1 : 0);
+                if (useShadows)
+                {
+                    shadowMaps.Bind(deferredLightingShader);
+                }
+                deferred.LightingPass(deferredLightingShader, screenQuadVAO, clusteredLights, view, projection, camera.Position,
+                    context.GetTexture(gbufferNormal), context.GetTexture(gbufferAlbedoSpecular), context.GetTexture(gbufferDepth));
+            });
+        }
 
-        GLCall(glBindVertexArray(skyboxVAO));
-        GLCall(glActiveTexture(skyboxTexture));
-        GLCall(glBindTexture(GL_TEXTURE_CUBE_MAP, cubeMapTexture));
-        skyboxShader.setInt("skybox", skyboxIdx);
-        GLCall(glDrawArrays(GL_TRIANGLES, 0, 36));
-        GLCall(glBindVertexArray(0));
+        renderGraph.AddPass("Opaque", [&](RenderGraphBuilder& builder)
+        {
+            if (useShadows)
+            {
+                builder.Read(shadowMap);
+            }
+            builder.Write(sceneColor);
+            builder.Write(sceneDepth);
+        },
+        [&](RenderGraphContext&)
+        {
+            bindScene();
+            if (countFragments)
+            {
+                opaqueFragments.Begin();
+            }
+            beginEqualDepth();
+            commandQueue.Execute(LAYER_OPAQUE, LAYER_OPAQUE);
+            endEqualDepth();
+            if (!useDeferred && occlusionMode == OCCLUSION_GPU_QUERY)
+            {
+                drawBoxesWithQueries();
+            }
+            if (countFragments)
+            {
+                opaqueFragments.End();
+                GLuint64 fragments = opaqueFragments.Count + (useDeferred ? gbufferFragments.Count : 0);
+                opaqueFragmentsByMode[useDepthPrepass ? 1 : 0] = fragments;
+            }
+        });
+
+        renderGraph.AddPass("Sky and sorted transparency", [&](RenderGraphBuilder& builder)
+        {
+            builder.Read(sceneDepth);
+            builder.Write(sceneColor);
+        },
+        [&](RenderGraphContext&)
+        {
+            bindScene();
+            commandQueue.Execute(LAYER_SKY, LAYER_TRANSPARENT);
+        });
 
-        //GLCall(glDepthMask(GL_TRUE));
-        GLCall(glDepthFunc(GL_LESS));
+        if (useOit)
+        {
+            RenderGraphTextureDesc oitDesc;
+            oitDesc.Width = renderTargets.GetWidth();
+            oitDesc.Height = renderTargets.GetHeight();
+            oitDesc.Format = WeightedBlendedOIT::ACCUM_FORMAT;
+            RenderGraphResource oitAccum = renderGraph.CreateTexture("OIT accumulation", oitDesc);
+            oitDesc.Format = WeightedBlendedOIT::REVEALAGE_FORMAT;
+            RenderGraphResource oitRevealage = renderGraph.CreateTexture("OIT revealage", oitDesc);
+
+            // the handles go out of scope before the graph runs
+            renderGraph.AddPass("OIT accumulate", [&](RenderGraphBuilder& builder)
+            {
+                builder.Read(sceneDepth);
+                builder.Overwrite(oitAccum);
+                builder.Overwrite(oitRevealage);
+            },
+            [&, oitAccum, oitRevealage](RenderGraphContext& context)
+            {
+                bindScene();
+                glDisable(GL_CULL_FACE);
+                oitShader.use();
+                oitShader.setMat4("view", view);
+                oitShader.setMat4("projection", projection);
+                unsigned int windowIndices = 6;
+                MeshData oitMeshData{ &vegetationVAO, &transparentTexture, oitShader, model, windowIndices };
+
+                oit.BeginTransparentPass(context.GetTexture(oitAccum), context.GetTexture(oitRevealage));
+                for (unsigned int i = 0; i < windows.size(); i++)
+                {
+                    if (!windowVisible[i])
+                        continue;
+
+                    model = glm::translate(glm::mat4(1.0f), windows[i]);
+                    DrawMesh(oitMeshData);
+                }
+                oit.EndTransparentPass();
+            });
+
+            renderGraph.AddPass("OIT composite", [&, oitAccum, oitRevealage](RenderGraphBuilder& builder)
+            {
+                builder.Read(oitAccum);
+                builder.Read(oitRevealage);
+                builder.Write(sceneColor);
+            },
+            [&, oitAccum, oitRevealage](RenderGraphContext& context)
+            {
+                bindScene();
+                oit.Composite(oitCompositeShader, screenQuadVAO, context.GetTexture(oitAccum), context.GetTexture(oitRevealage));
+            });
+        }
 
+        RenderGraphResource screenSource = sceneColor;
+        if (useDeferred && gbufferView == 1)
+            screenSource = gbufferNormal;
+        else if (useDeferred && gbufferView == 2)
+            screenSource = gbufferAlbedoSpecular;
+        else if (useDeferred && gbufferView == 3)
+            screenSource = gbufferDepth;
+        if (poster)
+        {
+            // per pixel effects like the vignette span the poster instead of starting over in every tile
+            glm::vec2 windowOffset, windowScale;
+            posterTiles.GetTileWindow(headlessFrame, windowOffset, windowScale);
+            postStack.SetScreenWindow(windowOffset, windowScale);
+        }
+        // the last pass covers the whole window, no clear needed
+        postStack.AddPasses(renderGraph, screenSource, renderTargets.GetUvScaleX(), renderTargets.GetUvScaleY(),
+            backbuffer, presentFramebuffer, windowWidth, windowHeight, screenQuadVAO);
 
-        glDisable(GL_CULL_FACE);
-        shader.use();
-        // vegetation
-        meshData.VAO = &vegetationVAO;
-        meshData.texture = &transparentTexture;
-        meshData.numberOfIndexToDraw = floorIndices;
+        renderGraph.Compile();
+        renderGraph.Execute();
 
-        for (auto it = sorted.rbegin(); it != sorted.rend(); ++it)
+        if (poster && !headlessOptions.OutputDirectory.empty())
         {
-            model = glm::mat4(1.0f);
-            model = glm::translate(model, it->second);
-            meshData.model = model;
-            DrawMesh(meshData);
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, presentFramebuffer);
+            posterTiles.WriteTile(posterPath, headlessFrame);
         }
 
+        // the presented frame without the ui
+        if (captureFrames && !frameCapture.IsCapturing())
+        {
+            captureFrames = frameCapture.Start("capture_" + std::to_string(captureCount++), static_cast<CaptureFormat>(captureFormat),
+                windowWidth, windowHeight, 60.0f);
+        }
+        else if (!captureFrames && frameCapture.IsCapturing())
+        {
+            frameCapture.Stop();
+        }
+        if (captureFrames)
+        {
+            if (frameCapture.Capture(presentFramebuffer, windowWidth, windowHeight))
+            {
+                captureMs += frameCapture.CaptureMs;
+            }
+            else
+            {
+                // a resized window ends the sequence
+                captureFrames = false;
+                frameCapture.Stop();
+            }
+        }
         glBindVertexArray(0);
+        glActiveTexture(GL_TEXTURE0);
+        frameStats.Set("Submit ms", submitTimer.ElapsedMs());
 
-        glDisable(GL_DEPTH_TEST);
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-        glClearColor(1.0f, 1.0f, 1.0f, 1.0f); // set clear color to white (not really necessary actually, since we won't be able to see behind the quad anyways)
-        glClear(GL_COLOR_BUFFER_BIT);
+        if (occlusionMode == OCCLUSION_CPU)
+        {
+            occlusionCuller.ReportStats(frameStats);
+        }
+        else if (occlusionMode == OCCLUSION_GPU_QUERY)
+        {
+            occlusionQueries.ReportStats(frameStats);
+        }
+        transparentSorter.ReportStats(frameStats);
+        commandQueue.ReportStats(frameStats);
+        if (decoupledSimulation)
+        {
+            simulation.ReportStats(frameStats);
+        }
+        framePacer.ReportStats(frameStats);
+        renderTargets.ReportStats(frameStats);
+        postStack.ReportStats(frameStats);
+        renderGraph.ReportStats(frameStats);
+        frameCapture.ReportStats(frameStats);
+        // floor and boxes, lit forward or through the G-buffer
+        float opaqueMs = renderGraph.GetPassMs("Depth prepass") + renderGraph.GetPassMs("G-buffer") +
+            renderGraph.GetPassMs("Deferred lighting") + renderGraph.GetPassMs("Opaque");
+        frameStats.Set("Opaque GPU ms", opaqueMs);
+        frameStats.Set("Opaque ns per pixel", opaqueMs * 1000000.0f / (renderWidth * renderHeight));
+        frameStats.Set(opaqueFragments.CountsInvocations() ? "Opaque fragment invocations" : "Opaque fragments passed",
+            static_cast<float>(opaqueFragmentsByMode[useDepthPrepass ? 1 : 0]));
+        frameStats.Set("Opaque fragments, no prepass", static_cast<float>(opaqueFragmentsByMode[0]));
+        frameStats.Set("Opaque fragments, prepass", static_cast<float>(opaqueFragmentsByMode[1]));
+        frameTimes.Add(deltaTime * 1000.0f);
+        frameStats.Set("Frame ms", deltaTime * 1000.0f);
+        frameStats.Set("Frame jitter ms", frameTimes.StdDev());
+
+        // no ui without a window
+        if (!headless)
+        {
+            ImGui_ImplOpenGL3_NewFrame();
+            ImGui_ImplGlfw_NewFrame();
+            ImGui::NewFrame();
+
+            ImGui::Begin("Renderer");
+            ImGui::Combo("Occlusion", &occlusionMode, "None\0CPU Hi-Z\0GPU queries\0");
+            ImGui::Checkbox("Order independent transparency", &orderIndependentTransparency);
+            ImGui::Checkbox("Fixed timestep simulation thread", &decoupledSimulation);
+            ImGui::Combo("Sky", &skyMode, "Cubemap\0Procedural\0");
+            ImGui::Checkbox("Image based lighting", &imageBasedLighting);
+            ImGui::SliderFloat("Environment roughness", &environmentRoughness, 0.0f, 1.0f);
+            ImGui::Checkbox("Clustered lighting", &clusteredLighting);
+            ImGui::SliderInt("Lights", &clusteredLightCount, 0, 4096);
+            ImGui::Checkbox("Depth prepass", &depthPrepass);
+            ImGui::Checkbox("Cascaded shadows", &cascadedShadows);
+            ImGui::SliderFloat3("Sun direction", &sunDirection.x, -1.0f, 1.0f);
+            ImGui::Checkbox("Deferred shading", &deferredShading);
+            ImGui::Combo("G-buffer view", &gbufferView, "Lit\0Normal\0Albedo / specular\0Depth\0");
+            ImGui::Checkbox("Dynamic resolution", &dynamicResolution);
+            ImGui::SliderFloat("GPU target ms", &targetGpuMs, 2.0f, 33.0f);
+            ImGui::SliderInt("Frames in flight", &maxFramesInFlight, 1, FramePacer::MAX_FRAMES_IN_FLIGHT);
+            ImGui::SliderInt("Frame limit", &frameRateLimit, 0, 240);
+            ImGui::Checkbox("Capture frames", &captureFrames);
+            ImGui::Combo("Capture format", &captureFormat, "PNG\0PPM\0Y4M\0");
+            if (characterModel)
+            {
+                ImGui::SliderFloat("Animation speed", &animationSpeed, 0.0f, 2.0f);
+                ImGui::Checkbox("Baked animation", &bakedAnimation);
+                ImGui::SliderFloat("Baked frames per second", &bakeSettings.FramesPerSecond, 5.0f, 120.0f);
+                ImGui::Checkbox("Half float bake", &bakeSettings.HalfFloat);
+                ImGui::Checkbox("Blend baked frames", &bakeSettings.Interpolate);
+                ImGui::Checkbox("Compressed clips", &compressedAnimation);
+                ImGui::SliderFloat("Clip position tolerance", &compressionSettings.PositionTolerance, 0.0f, 0.01f, "%.4f");
+                ImGui::SliderFloat("Clip rotation tolerance", &compressionSettings.RotationTolerance, 0.0f, 0.01f, "%.4f");
+            }
+            ImGui::End();
+
+            ImGui::Begin("Post process");
+            for (unsigned int i = 0; i < postStack.GetEffectCount(); i++)
+            {
+                PostEffect& effect = postStack.GetEffect(i);
+                ImGui::PushID(i);
+                ImGui::Checkbox(effect.Name.c_str(), &effect.Enabled);
+                for (unsigned int p = 0; p < effect.Params.size() && effect.Enabled; p++)
+                {
+                    ImGui::DragFloat(effect.Params[p].first.c_str(), &effect.Params[p].second, 0.01f);
+                }
+                ImGui::PopID();
+            }
+            ImGui::Text("%s", postStack.Describe().c_str());
+            ImGui::End();
+
+            ImGui::Begin("Render graph");
+            ImGui::Text("%s", renderGraph.Describe().c_str());
+            ImGui::End();
+            frameStats.Draw();
+
+            ImGui::Render();
+            ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+        }
+        frameStats.EndFrame();
 
-        screenShader.use(); 
-        glBindVertexArray(screenQuadVAO);
-        glBindTexture(GL_TEXTURE_2D, textureColorBuffer);	// use the color attachment texture as the texture of the quad plane
-        glDrawArrays(GL_TRIANGLES, 0, 6);
-        
-        
-        glfwSwapBuffers(window);
-        glfwPollEvents();
+        if (headless)
+        {
+            headlessFrame++;
+            if (headlessOptions.Progress)
+            {
+                std::cout << "PROGRESS " << headlessFrame - headlessOptions.RangeFirst << std::endl;
+            }
+        }
+        else
+        {
+            glfwSwapBuffers(window);
+        }
+        framePacer.EndFrame();
+
+        // input to swap, the compositor adds its own delay on top
+        if (frameInputTime > 0.0)
+        {
+            frameStats.Set("Input latency ms", static_cast<float>((SimulationNow() - frameInputTime) * 1000.0));
+            lastShownInputTime = frameInputTime;
+        }
+
+        if (!headless)
+        {
+            glfwPollEvents();
+        }
+    }
+
+    simulation.Stop();
+    // the last frames are still on their way to disk, flush them while the context is current
+    frameCapture.Stop();
+
+    if (headless)
+    {
+        float seconds = headlessTimer.ElapsedMs() / 1000.0f;
+        headlessFrame -= headlessOptions.RangeFirst;
+        std::cout << "HEADLESS:: " << headlessFrame << " frames at " << windowWidth << "x" << windowHeight << " in " << seconds << " s, "
+            << (headlessFrame > 0 ? seconds * 1000.0f / headlessFrame : 0.0f) << " ms per frame, "
+            << (seconds > 0.0f ? headlessFrame / seconds : 0.0f) << " fps" << std::endl;
+        if (!headlessOptions.OutputDirectory.empty())
+        {
+            std::cout << "HEADLESS:: capture took " << (headlessFrame > 0 ? captureMs / headlessFrame : 0.0f) << " ms per frame on the render thread" << std::endl;
+        }
     }
 
     glDeleteVertexArrays(1, &cubeVAO);
     glDeleteVertexArrays(1, &planeVAO);
     glDeleteVertexArrays(1, &screenQuadVAO);
+    glDeleteVertexArrays(1, &skyVAO);
+    glDeleteBuffers(1, &characterInstanceVBO);
     glDeleteBuffers(1, &cubeVBO);
     glDeleteBuffers(1, &planeVBO);
     glDeleteBuffers(1, &screenQuadVBO);
-
-    glfwTerminate();
     return 0;
 }
 
@@ -507,7 +1670,8 @@ void mousebutton_callback(GLFWwindow* window, int button, int action, int mods)
 
 void mousescroll_callback(GLFWwindow* window, double xOffset, double yOffset)
 {
-    camera.ProcessMouseScroll(static_cast<float>(yOffset));
+    pendingInput.Scroll += static_cast<float>(yOffset);
+    pendingInput.MarkEvent();
 }
 
 void mouse_callback(GLFWwindow* window, double xPos, double yPos)
@@ -526,7 +1690,9 @@ void mouse_callback(GLFWwindow* window, double xPos, double yPos)
     lastMouseX = xPos;
     lastMouseY = yPos;
 
-    camera.ProcessMouseMovement(xOffset, yOffset);
+    pendingInput.MouseX += xOffset;
+    pendingInput.MouseY += yOffset;
+    pendingInput.MarkEvent();
 }
 
 void processInput(GLFWwindow* window)
@@ -555,35 +1721,27 @@ void processInput(GLFWwindow* window)
         }
     }
 
-    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
-    {
-        camera.ProcessKeyboard(FORWARD, deltaTime);
-    }
-    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
-    {
-        camera.ProcessKeyboard(BACKWARD, deltaTime);
-    }
-    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
+    // movement is applied by the simulation, or right away in lockstep mode
+    pendingInput.Move[FORWARD] = glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS;
+    pendingInput.Move[BACKWARD] = glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS;
+    pendingInput.Move[LEFT] = glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS;
+    pendingInput.Move[RIGHT] = glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS;
+    pendingInput.Move[UP] = glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS;
+    pendingInput.Move[DOWN] = glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS;
+    for (int i = 0; i < 6; i++)
     {
-        camera.ProcessKeyboard(LEFT, deltaTime);
-    }
-    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
-    {
-        camera.ProcessKeyboard(RIGHT, deltaTime);
-    }
-    if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS)
-    {
-        camera.ProcessKeyboard(UP, deltaTime);
-    }
-    if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS)
-    {
-        camera.ProcessKeyboard(DOWN, deltaTime);
+        if (pendingInput.Move[i])
+        {
+            pendingInput.MarkEvent();
+        }
     }
 }
 
 void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
     glViewport(0, 0, width, height);
+    windowWidth = width;
+    windowHeight = height;
 }
 
 unsigned int loadTexture(char const* path, bool flipVertically)
@@ -653,45 +1811,6 @@ bool GLLogCall(const char* function, const char* file, int line)
 }
 
 
-void CreateFrameBuffer(unsigned int& fbo)
-{
-    GLCall(glGenFramebuffers(1, &fbo));
-    GLCall(glBindFramebuffer(GL_FRAMEBUFFER, fbo));
-}
-
-void CreateFrameTexture(unsigned int& texture, bool needDepthAndStencil)
-{
-    glGenTextures(1, &texture);
-    glBindTexture(GL_TEXTURE_2D, texture);
-
-    // Creating a texture attachment
-    GLCall(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 800, 600, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL));
-
-    GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
-    GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
-
-    GLCall(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture, 0));
-
-    if (needDepthAndStencil) 
-    {
-        GLCall(glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH24_STENCIL8, 800, 600, 0,
-            GL_DEPTH_STENCIL, GL_UNSIGNED_INT_24_8, NULL));
-        GLCall(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, texture, 0));
-    }
-    
-    //GLCall(glBindTexture(GL_TEXTURE_2D, 0));
-}
-void CreateRenderBuffer(unsigned int& rbo) 
-{
-    GLCall(glGenRenderbuffers(1, &rbo));
-    GLCall(glBindRenderbuffer(GL_RENDERBUFFER, rbo));
-
-    GLCall(glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, 800, 600));
-    GLCall(glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, rbo));
-
-    //GLCall(glBindRenderbuffer(GL_RENDERBUFFER, 0));
-}
-
 unsigned int loadCubemap(const std::vector<std::string>& faces)
 {
     unsigned int textureId;
@@ -0,0 +1,258 @@
+#ifndef ANIMATION_BAKING_H
+#define ANIMATION_BAKING_H
+
+#include <glad/glad.h>
+#include <glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <vector>
+
+#include "command_list.h"
+#include "job_system.h"
+#include "shader.h"
+#include "skeletal_animation.h"
+#include "stats.h"
+#include "LogHelper.h"
+
+// size against quality of the baked texture
+struct BakeSettings
+{
+	// rows per second of clip, more rows follow fast motion closer
+	float FramesPerSecond = 30.0f;
+	// RGBA16F halves the texture, positions far from the origin lose precision first
+	bool HalfFloat = false;
+	// GL_LINEAR blends the two closest rows, GL_NEAREST steps from row to row
+	bool Interpolate = true;
+
+	bool operator==(const BakeSettings& other) const
+	{
+		return FramesPerSecond == other.FramesPerSecond && HalfFloat == other.HalfFloat && Interpolate == other.Interpolate;
+	}
+	bool operator!=(const BakeSettings& other) const { return !(*this == other); }
+};
+
+// rows of one clip in the texture, the last one repeats the first so looping never blends across clips
+struct BakedClip
+{
+	unsigned int FirstRow = 0;
+	unsigned int Intervals = 1;
+	float Duration = 0.0f;
+};
+
+// Every clip of a skeleton sampled ahead of time into a float texture, one
+// row per frame with the bone palette in it, three texels per bone holding
+// the rows of its 3x4 matrix. Instances only carry their clip and time in
+// InstanceData::Params and skinned_baked.vs looks the palette up, so a crowd
+// sharing a few clips is one instanced draw per mesh with no per character
+// work on the cpu. What it costs is the texture memory and the error between
+// baked frames, both set through BakeSettings.
+class BakedAnimations
+{
+public:
+	static const unsigned int TEXTURE_UNIT = 8;
+
+	~BakedAnimations()
+	{
+		if (texture)
+		{
+			glDeleteTextures(1, &texture);
+		}
+	}
+
+	void SetJobSystem(JobSystem* jobs) { this->jobs = jobs; }
+
+	// Samples the clips into rows on the cpu. A skeleton without clips gets a single clip of its bind pose.
+	void Bake(const Skeleton& skeleton, const std::vector<AnimationClip>& clips, const BakeSettings& settings)
+	{
+		CpuTimer timer;
+		this->settings = settings;
+		boneCount = std::max(skeleton.GetBoneCount(), 1u);
+
+		bakedClips.clear();
+		std::vector<const AnimationClip*> rowClips;
+		std::vector<float> rowTimes;
+		unsigned int clipCount = std::max(static_cast<unsigned int>(clips.size()), 1u);
+		for (unsigned int c = 0; c < clipCount; c++)
+		{
+			const AnimationClip* clip = c < clips.size() ? &clips[c] : nullptr;
+			BakedClip baked;
+			baked.FirstRow = static_cast<unsigned int>(rowClips.size());
+			baked.Duration = clip ? clip->Duration : 0.0f;
+			baked.Intervals = std::max(1u, static_cast<unsigned int>(std::ceil(baked.Duration * settings.FramesPerSecond)));
+			for (unsigned int f = 0; f <= baked.Intervals; f++)
+			{
+				rowClips.push_back(clip);
+				rowTimes.push_back(baked.Duration * f / baked.Intervals);
+			}
+			bakedClips.push_back(baked);
+		}
+		rowCount = static_cast<unsigned int>(rowClips.size());
+
+		unsigned int rowFloats = boneCount * 12;
+		data.assign(static_cast<size_t>(rowCount) * rowFloats, 0.0f);
+		std::function<void(unsigned int, unsigned int)> bake = [&](unsigned int begin, unsigned int end)
+		{
+			std::vector<glm::mat4> locals;
+			std::vector<glm::mat4> worlds(skeleton.GetJointCount());
+			std::vector<glm::mat4> palette(boneCount, glm::mat4(1.0f));
+			for (unsigned int row = begin; row < end; row++)
+			{
+				locals = skeleton.GetBindLocals();
+				if (rowClips[row])
+					rowClips[row]->Sample(rowTimes[row], locals.data());
+				skeleton.ComputePalette(locals.data(), worlds.data(), palette.data());
+
+				float* out = &data[static_cast<size_t>(row) * rowFloats];
+				for (unsigned int b = 0; b < boneCount; b++)
+				{
+					// transposed, the last row of an affine matrix is always 0 0 0 1
+					for (int r = 0; r < 3; r++)
+					{
+						for (int c = 0; c < 4; c++)
+						{
+							out[b * 12 + r * 4 + c] = settings.HalfFloat ? RoundToHalf(palette[b][c][r]) : palette[b][c][r];
+						}
+					}
+				}
+			}
+		};
+		if (jobs)
+		{
+			jobs->ParallelFor(rowCount, 8, bake);
+		}
+		else
+		{
+			bake(0, rowCount);
+		}
+		BakeTimeMs = timer.ElapsedMs();
+
+		MaxError = MeasureError(skeleton, clips);
+	}
+
+	// the texture of the last Bake(), needs a context
+	bool Upload()
+	{
+		GLint maxSize = 0;
+		glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxSize);
+		if (static_cast<GLint>(rowCount) > maxSize || static_cast<GLint>(boneCount * 3) > maxSize)
+		{
+			LOG("BAKED_ANIMATION:: " << boneCount * 3 << "x" << rowCount << " is larger than the " << maxSize << " texels a texture can have, lower the frame rate");
+			return false;
+		}
+
+		if (!texture)
+		{
+			glGenTextures(1, &texture);
+		}
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexImage2D(GL_TEXTURE_2D, 0, settings.HalfFloat ? GL_RGBA16F : GL_RGBA32F, boneCount * 3, rowCount, 0, GL_RGBA, GL_FLOAT, data.data());
+		// the shader samples texel centers across, filtering only ever blends two rows of the same bone
+		GLint filter = settings.Interpolate ? GL_LINEAR : GL_NEAREST;
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, filter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, filter);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		return true;
+	}
+
+	// InstanceData::Params of an instance playing clip, time offset in seconds
+	glm::vec4 GetInstanceParams(unsigned int clip, float timeOffset, float speed) const
+	{
+		const BakedClip& baked = bakedClips[clip % bakedClips.size()];
+		// rows per second of animation time, a clip without length stays on its first row
+		float rate = baked.Duration > 0.0f ? baked.Intervals / baked.Duration * speed : 0.0f;
+		return glm::vec4(static_cast<float>(baked.FirstRow), static_cast<float>(baked.Intervals), timeOffset, rate);
+	}
+
+	void Bind(Shader& shader, float time) const
+	{
+		glActiveTexture(GL_TEXTURE0 + TEXTURE_UNIT);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glActiveTexture(GL_TEXTURE0);
+		shader.setInt("bakedBones", TEXTURE_UNIT);
+		shader.setFloat("animationTime", time);
+	}
+
+	void Record(CommandList& list, float time) const
+	{
+		list.BindTexture(GL_TEXTURE0 + TEXTURE_UNIT, GL_TEXTURE_2D, texture);
+		list.SetInt("bakedBones", TEXTURE_UNIT);
+		list.SetFloat("animationTime", time);
+	}
+
+	const BakeSettings& GetSettings() const { return settings; }
+	unsigned int GetClipCount() const { return static_cast<unsigned int>(bakedClips.size()); }
+	unsigned int GetRowCount() const { return rowCount; }
+	size_t GetTextureSize() const { return static_cast<size_t>(rowCount) * boneCount * 3 * (settings.HalfFloat ? 8 : 16); }
+
+	void ReportStats(FrameStats& stats) const
+	{
+		stats.Set("Baked frames", static_cast<float>(rowCount));
+		stats.Set("Baked texture KB", GetTextureSize() / 1024.0f);
+		stats.Set("Bake ms", BakeTimeMs);
+		stats.Set("Baked max error", MaxError);
+	}
+
+	float BakeTimeMs = 0.0f;
+	// largest difference of a palette element between the texture and the clip, halfway between rows
+	float MaxError = 0.0f;
+
+private:
+	JobSystem* jobs = nullptr;
+	BakeSettings settings;
+	std::vector<BakedClip> bakedClips;
+	std::vector<float> data;
+	unsigned int boneCount = 0;
+	unsigned int rowCount = 0;
+	GLuint texture = 0;
+
+	// what the gpu keeps of a float in a 16 bit texture, 11 significant bits
+	static float RoundToHalf(float value)
+	{
+		int exponent;
+		float mantissa = std::frexp(value, &exponent);
+		return std::ldexp(std::round(mantissa * 2048.0f) / 2048.0f, exponent);
+	}
+
+	// the worst case is halfway between rows, where the filter blends or snaps
+	float MeasureError(const Skeleton& skeleton, const std::vector<AnimationClip>& clips) const
+	{
+		float error = 0.0f;
+		unsigned int rowFloats = boneCount * 12;
+		std::vector<glm::mat4> locals;
+		std::vector<glm::mat4> worlds(skeleton.GetJointCount());
+		std::vector<glm::mat4> palette(boneCount, glm::mat4(1.0f));
+		for (unsigned int c = 0; c < clips.size(); c++)
+		{
+			const BakedClip& baked = bakedClips[c];
+			for (unsigned int f = 0; f < baked.Intervals; f++)
+			{
+				locals = skeleton.GetBindLocals();
+				clips[c].Sample(baked.Duration * (f + 0.5f) / baked.Intervals, locals.data());
+				skeleton.ComputePalette(locals.data(), worlds.data(), palette.data());
+
+				const float* a = &data[static_cast<size_t>(baked.FirstRow + f) * rowFloats];
+				const float* b = a + rowFloats;
+				for (unsigned int i = 0; i < boneCount; i++)
+				{
+					for (int r = 0; r < 3; r++)
+					{
+						for (int col = 0; col < 4; col++)
+						{
+							unsigned int k = i * 12 + r * 4 + col;
+							float value = settings.Interpolate ? 0.5f * (a[k] + b[k]) : a[k];
+							error = std::max(error, std::fabs(value - palette[i][col][r]));
+						}
+					}
+				}
+			}
+		}
+		return error;
+	}
+};
+
+#endif // !ANIMATION_BAKING_H
@@ -0,0 +1,106 @@
+#ifndef ANIMATION_CLIP_H
+#define ANIMATION_CLIP_H
+
+#include <glm.hpp>
+#include <gtc/quaternion.hpp>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+struct VectorKey
+{
+	float Time;
+	glm::vec3 Value;
+};
+
+struct RotationKey
+{
+	float Time;
+	glm::quat Value;
+};
+
+// keys of one joint, every list has at least one key
+struct AnimationChannel
+{
+	unsigned int Joint = 0;
+	std::vector<VectorKey> Positions;
+	std::vector<RotationKey> Rotations;
+	std::vector<VectorKey> Scales;
+};
+
+// local = translate * rotate * scale
+inline void ComposeTransform(const glm::vec3& translation, const glm::quat& rotation, const glm::vec3& scale, glm::mat4& out)
+{
+	out = glm::mat4_cast(rotation);
+	out[0] = out[0] * scale.x;
+	out[1] = out[1] * scale.y;
+	out[2] = out[2] * scale.z;
+	out[3] = glm::vec4(translation, 1.0f);
+}
+
+// index of the last key at or before time, keys are sorted by time
+template<typename Key>
+unsigned int FindKey(const std::vector<Key>& keys, float time)
+{
+	typename std::vector<Key>::const_iterator next = std::upper_bound(keys.begin(), keys.end(), time,
+		[](float t, const Key& key) { return t < key.Time; });
+	return next == keys.begin() ? 0 : static_cast<unsigned int>(next - keys.begin() - 1);
+}
+
+// Keyframes of the joints a clip animates, times in seconds.
+class AnimationClip
+{
+public:
+	std::string Name;
+	float Duration = 0.0f;
+	std::vector<AnimationChannel> Channels;
+
+	// writes the local matrices of the animated joints, the others keep what is in locals
+	void Sample(float time, glm::mat4* locals) const
+	{
+		for (unsigned int i = 0; i < Channels.size(); i++)
+		{
+			const AnimationChannel& channel = Channels[i];
+			ComposeTransform(SampleVector(channel.Positions, time), SampleRotation(channel.Rotations, time),
+				SampleVector(channel.Scales, time), locals[channel.Joint]);
+		}
+	}
+
+	unsigned int GetKeyCount() const
+	{
+		size_t count = 0;
+		for (const AnimationChannel& channel : Channels)
+			count += channel.Positions.size() + channel.Rotations.size() + channel.Scales.size();
+		return static_cast<unsigned int>(count);
+	}
+
+	size_t GetMemorySize() const
+	{
+		size_t size = Channels.size() * sizeof(AnimationChannel);
+		for (const AnimationChannel& channel : Channels)
+			size += (channel.Positions.size() + channel.Scales.size()) * sizeof(VectorKey) + channel.Rotations.size() * sizeof(RotationKey);
+		return size;
+	}
+
+private:
+	static glm::vec3 SampleVector(const std::vector<VectorKey>& keys, float time)
+	{
+		unsigned int i = FindKey(keys, time);
+		if (i + 1 >= keys.size())
+			return keys[i].Value;
+		float t = glm::clamp((time - keys[i].Time) / (keys[i + 1].Time - keys[i].Time), 0.0f, 1.0f);
+		return glm::mix(keys[i].Value, keys[i + 1].Value, t);
+	}
+
+	static glm::quat SampleRotation(const std::vector<RotationKey>& keys, float time)
+	{
+		unsigned int i = FindKey(keys, time);
+		if (i + 1 >= keys.size())
+			return keys[i].Value;
+		float t = glm::clamp((time - keys[i].Time) / (keys[i + 1].Time - keys[i].Time), 0.0f, 1.0f);
+		return glm::normalize(glm::slerp(keys[i].Value, keys[i + 1].Value, t));
+	}
+};
+
+#endif // !ANIMATION_CLIP_H
@@ -0,0 +1,509 @@
+#ifndef ANIMATION_COMPRESSION_H
+#define ANIMATION_COMPRESSION_H
+
+#include <glm.hpp>
+#include <gtc/quaternion.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "simd.h"
+#include "animation_clip.h"
+
+// how far a removed key may move its track, the quantization error comes on top
+struct CompressionSettings
+{
+	// model units
+	float PositionTolerance = 0.0005f;
+	float ScaleTolerance = 0.0005f;
+	// per quaternion component, 0.0005 is about 0.06 degrees
+	float RotationTolerance = 0.0005f;
+
+	bool operator==(const CompressionSettings& other) const
+	{
+		return PositionTolerance == other.PositionTolerance && ScaleTolerance == other.ScaleTolerance && RotationTolerance == other.RotationTolerance;
+	}
+	bool operator!=(const CompressionSettings& other) const { return !(*this == other); }
+};
+
+// A key of one track, 12 bytes instead of the 16 or 20 of VectorKey and RotationKey.
+// Times are fractions of the clip in 1/65535 steps. Rotations are smallest three,
+// 15 bits per component and the index of the dropped largest one in the top bits
+// of the first two. Positions and scales are 16 bits across the range of their track.
+struct PackedKey
+{
+	uint16_t Track;
+	uint16_t Time;
+	uint16_t Value[3];
+	// when the sampler needs the key, the time of the key before it in the track
+	uint16_t NeededTime;
+};
+
+// Where an instance is in a CompressedClip, playing forward only ever reads on.
+struct CompressedClipCursor
+{
+	// next key of the stream to read
+	unsigned int Next = 0;
+	float Time = -1.0f;
+	// the keys before and after Time, two per track
+	std::vector<PackedKey> Keys;
+};
+
+// An AnimationClip after key reduction and quantization.
+// Every channel has three tracks, translation, rotation and scale, track
+// 3 * channel + n. Keys that interpolating their neighbours reproduces within
+// the tolerance are dropped, a track that never moves keeps one key.
+// All keys of all tracks sit in one stream sorted by the time the sampler
+// first needs them, so forward playback walks through memory once, keeping
+// the two keys around the current time of every track in its cursor.
+// Sample() then decodes and blends four channels at a time with SSE.
+class CompressedClip
+{
+public:
+	std::string Name;
+	float Duration = 0.0f;
+
+	void Compress(const AnimationClip& clip, const CompressionSettings& settings)
+	{
+		Name = clip.Name;
+		Duration = clip.Duration;
+		joints.clear();
+		ranges.clear();
+		keys.clear();
+		float timeScale = Duration > 0.0f ? 65535.0f / Duration : 0.0f;
+
+		for (unsigned int c = 0; c < clip.Channels.size(); c++)
+		{
+			const AnimationChannel& channel = clip.Channels[c];
+			joints.push_back(channel.Joint);
+			if (c % 4 == 0)
+				ranges.push_back(LaneRanges());
+			LaneRanges& range = ranges.back();
+			unsigned int track = c * 3;
+			AddVectorTrack(channel.Positions, track, ReduceVectorKeys(channel.Positions, settings.PositionTolerance), timeScale,
+				range.TranslationMin, range.TranslationStep, c % 4);
+			AddRotationTrack(channel.Rotations, track + 1, ReduceRotationKeys(channel.Rotations, settings.RotationTolerance), timeScale);
+			AddVectorTrack(channel.Scales, track + 2, ReduceVectorKeys(channel.Scales, settings.ScaleTolerance), timeScale,
+				range.ScaleMin, range.ScaleStep, c % 4);
+		}
+
+		// keys of a track keep their order, their needed times only grow
+		std::stable_sort(keys.begin(), keys.end(), [](const PackedKey& a, const PackedKey& b) { return a.NeededTime < b.NeededTime; });
+	}
+
+	// same as AnimationClip::Sample, the cursor belongs to the instance playing the clip
+	void Sample(float time, CompressedClipCursor& cursor, glm::mat4* locals) const
+	{
+		float u = Duration > 0.0f ? glm::clamp(time / Duration, 0.0f, 1.0f) * 65535.0f : 0.0f;
+		Advance(u, cursor);
+
+		unsigned int channelCount = static_cast<unsigned int>(joints.size());
+		for (unsigned int first = 0; first < channelCount; first += 4)
+		{
+			SampleLanes(cursor, u, first, std::min(4u, channelCount - first), locals);
+		}
+	}
+
+	unsigned int GetKeyCount() const { return static_cast<unsigned int>(keys.size()); }
+
+	size_t GetMemorySize() const
+	{
+		return keys.size() * sizeof(PackedKey) + ranges.size() * sizeof(LaneRanges) + joints.size() * sizeof(unsigned int);
+	}
+
+private:
+	// Translations and scales are quantized across the range of their track,
+	// value = min + step * q. Four channels side by side, the way Sample() loads them.
+	struct LaneRanges
+	{
+		float TranslationMin[3][4];
+		float TranslationStep[3][4];
+		float ScaleMin[3][4];
+		float ScaleStep[3][4];
+	};
+
+	// one lane per channel, components of the keys before and after the time
+	struct LaneKeys
+	{
+		float A[3][4];
+		float B[3][4];
+		float Blend[4];
+	};
+
+	std::vector<unsigned int> joints;
+	std::vector<LaneRanges> ranges;
+	std::vector<PackedKey> keys;
+
+	// indices of the keys to keep, greedy: a segment grows while it stays within tolerance of every key it skips
+	template<typename Key, typename Blend, typename Distance>
+	static std::vector<unsigned int> ReduceKeys(const std::vector<Key>& source, float tolerance, Blend blend, Distance distance)
+	{
+		std::vector<unsigned int> kept(1, 0);
+		unsigned int anchor = 0;
+		for (unsigned int candidate = 2; candidate < source.size(); candidate++)
+		{
+			bool fits = true;
+			for (unsigned int k = anchor + 1; k < candidate && fits; k++)
+			{
+				float t = (source[k].Time - source[anchor].Time) / std::max(source[candidate].Time - source[anchor].Time, 1e-6f);
+				fits = distance(blend(source[anchor].Value, source[candidate].Value, t), source[k].Value) <= tolerance;
+			}
+			if (!fits)
+			{
+				anchor = candidate - 1;
+				kept.push_back(anchor);
+			}
+		}
+		if (source.size() > 1)
+			kept.push_back(static_cast<unsigned int>(source.size() - 1));
+
+		// a constant track, the segment from the first to the last key already stays within tolerance
+		if (kept.size() == 2 && distance(source.front().Value, source.back().Value) <= tolerance)
+			kept.pop_back();
+		return kept;
+	}
+
+	static std::vector<unsigned int> ReduceVectorKeys(const std::vector<VectorKey>& source, float tolerance)
+	{
+		return ReduceKeys(source, tolerance,
+			[](const glm::vec3& a, const glm::vec3& b, float t) { return glm::mix(a, b, t); },
+			[](const glm::vec3& a, const glm::vec3& b) { glm::vec3 d = glm::abs(a - b); return std::max(d.x, std::max(d.y, d.z)); });
+	}
+
+	// judged with the normalized lerp the sampler blends with
+	static std::vector<unsigned int> ReduceRotationKeys(const std::vector<RotationKey>& source, float tolerance)
+	{
+		return ReduceKeys(source, tolerance,
+			[](const glm::quat& a, const glm::quat& b, float t) { return NormalizedLerp(a, b, t); },
+			[](const glm::quat& a, const glm::quat& b)
+			{
+				float sign = glm::dot(a, b) < 0.0f ? -1.0f : 1.0f;
+				return std::max(std::max(std::fabs(a.x - sign * b.x), std::fabs(a.y - sign * b.y)), std::max(std::fabs(a.z - sign * b.z), std::fabs(a.w - sign * b.w)));
+			});
+	}
+
+	static glm::quat NormalizedLerp(const glm::quat& a, const glm::quat& b, float t)
+	{
+		float sign = glm::dot(a, b) < 0.0f ? -1.0f : 1.0f;
+		return glm::normalize(glm::quat(a.w + (sign * b.w - a.w) * t, a.x + (sign * b.x - a.x) * t, a.y + (sign * b.y - a.y) * t, a.z + (sign * b.z - a.z) * t));
+	}
+
+	static uint16_t QuantizeTime(float time, float timeScale)
+	{
+		return static_cast<uint16_t>(glm::clamp(time * timeScale + 0.5f, 0.0f, 65535.0f));
+	}
+
+	// the first two keys of a track are needed from the start, every other one once the key before it is reached
+	void AddKey(PackedKey key, unsigned int index, unsigned int track)
+	{
+		key.Track = static_cast<uint16_t>(track);
+		key.NeededTime = index < 2 ? 0 : keys[keys.size() - 1].Time;
+		keys.push_back(key);
+	}
+
+	void AddVectorTrack(const std::vector<VectorKey>& source, unsigned int track, const std::vector<unsigned int>& kept, float timeScale,
+		float (&laneMin)[3][4], float (&laneStep)[3][4], unsigned int lane)
+	{
+		glm::vec3 min = source[kept[0]].Value;
+		glm::vec3 max = min;
+		for (unsigned int i : kept)
+		{
+			min = glm::min(min, source[i].Value);
+			max = glm::max(max, source[i].Value);
+		}
+		glm::vec3 extent = max - min;
+		for (int c = 0; c < 3; c++)
+		{
+			laneMin[c][lane] = min[c];
+			laneStep[c][lane] = extent[c] / 65535.0f;
+		}
+
+		for (unsigned int k = 0; k < kept.size(); k++)
+		{
+			const VectorKey& key = source[kept[k]];
+			PackedKey packed;
+			packed.Time = QuantizeTime(key.Time, timeScale);
+			for (int c = 0; c < 3; c++)
+			{
+				float normalized = extent[c] > 0.0f ? (key.Value[c] - min[c]) / extent[c] : 0.0f;
+				packed.Value[c] = static_cast<uint16_t>(glm::clamp(normalized * 65535.0f + 0.5f, 0.0f, 65535.0f));
+			}
+			AddKey(packed, k, track);
+		}
+	}
+
+	void AddRotationTrack(const std::vector<RotationKey>& source, unsigned int track, const std::vector<unsigned int>& kept, float timeScale)
+	{
+		for (unsigned int k = 0; k < kept.size(); k++)
+		{
+			const RotationKey& key = source[kept[k]];
+			glm::quat q = glm::normalize(key.Value);
+			float components[4] = { q.x, q.y, q.z, q.w };
+			int largest = 0;
+			for (int c = 1; c < 4; c++)
+			{
+				if (std::fabs(components[c]) > std::fabs(components[largest]))
+					largest = c;
+			}
+			// q and -q are the same rotation, the dropped component is always positive
+			float sign = components[largest] < 0.0f ? -1.0f : 1.0f;
+
+			PackedKey packed;
+			packed.Time = QuantizeTime(key.Time, timeScale);
+			int stored = 0;
+			for (int c = 0; c < 4; c++)
+			{
+				if (c == largest)
+					continue;
+				float normalized = (components[c] * sign + 0.70710678f) / 1.41421356f;
+				packed.Value[stored++] = static_cast<uint16_t>(glm::clamp(normalized * 32767.0f + 0.5f, 0.0f, 32767.0f));
+			}
+			packed.Value[0] |= static_cast<uint16_t>((largest >> 1) << 15);
+			packed.Value[1] |= static_cast<uint16_t>((largest & 1) << 15);
+			AddKey(packed, k, track);
+		}
+	}
+
+	// reads every key needed up to u, starts over when the time went back
+	void Advance(float u, CompressedClipCursor& cursor) const
+	{
+		unsigned int trackCount = static_cast<unsigned int>(joints.size() * 3);
+		if (u < cursor.Time || cursor.Keys.size() != trackCount * 2)
+		{
+			PackedKey empty = {};
+			empty.Track = 0xFFFF;
+			cursor.Keys.assign(trackCount * 2, empty);
+			cursor.Next = 0;
+		}
+		cursor.Time = u;
+
+		while (cursor.Next < keys.size() && keys[cursor.Next].NeededTime <= u)
+		{
+			const PackedKey& key = keys[cursor.Next++];
+			PackedKey* pair = &cursor.Keys[key.Track * 2];
+			// the first key of a track is both ends until the second one comes
+			pair[0] = pair[1].Track == 0xFFFF ? key : pair[1];
+			pair[1] = key;
+		}
+	}
+
+	static void GatherLane(const PackedKey* pair, float u, uint16_t mask, unsigned int lane, LaneKeys& lanes)
+	{
+		for (int c = 0; c < 3; c++)
+		{
+			lanes.A[c][lane] = static_cast<float>(pair[0].Value[c] & mask);
+			lanes.B[c][lane] = static_cast<float>(pair[1].Value[c] & mask);
+		}
+		float span = static_cast<float>(pair[1].Time) - pair[0].Time;
+		lanes.Blend[lane] = span > 0.0f ? glm::clamp((u - pair[0].Time) / span, 0.0f, 1.0f) : 0.0f;
+	}
+
+	static int LargestComponent(const PackedKey& key)
+	{
+		return ((key.Value[0] >> 15) << 1) | (key.Value[1] >> 15);
+	}
+
+	void SampleLanes(const CompressedClipCursor& cursor, float u, unsigned int first, unsigned int laneCount, glm::mat4* locals) const
+	{
+		LaneKeys translationKeys, rotationKeys, scaleKeys;
+		int largestA[4] = {}, largestB[4] = {};
+		if (laneCount < 4)
+		{
+			// unused lanes decode zeros, their results are thrown away
+			translationKeys = rotationKeys = scaleKeys = LaneKeys();
+		}
+		for (unsigned int lane = 0; lane < laneCount; lane++)
+		{
+			unsigned int track = (first + lane) * 3;
+			const PackedKey* rotation = &cursor.Keys[(track + 1) * 2];
+			GatherLane(&cursor.Keys[track * 2], u, 0xFFFF, lane, translationKeys);
+			GatherLane(rotation, u, 0x7FFF, lane, rotationKeys);
+			GatherLane(&cursor.Keys[(track + 2) * 2], u, 0xFFFF, lane, scaleKeys);
+			largestA[lane] = LargestComponent(rotation[0]);
+			largestB[lane] = LargestComponent(rotation[1]);
+		}
+
+		const LaneRanges& range = ranges[first / 4];
+		float translation[3][4], scale[3][4];
+		DecodeVectors(translationKeys, range.TranslationMin, range.TranslationStep, translation);
+		DecodeVectors(scaleKeys, range.ScaleMin, range.ScaleStep, scale);
+		float rotationA[4][4], rotationB[4][4], rotation[4][4];
+		DecodeRotations(rotationKeys.A, largestA, rotationA);
+		DecodeRotations(rotationKeys.B, largestB, rotationB);
+		BlendRotations(rotationA, rotationB, rotationKeys.Blend, rotation);
+
+		glm::mat4 matrices[4];
+		ComposeLanes(translation, rotation, scale, matrices);
+		for (unsigned int lane = 0; lane < laneCount; lane++)
+		{
+			locals[joints[first + lane]] = matrices[lane];
+		}
+	}
+
+	// min + step * q, blended between the two keys
+	static void DecodeVectors(const LaneKeys& lanes, const float (&min)[3][4], const float (&step)[3][4], float (&out)[3][4])
+	{
+#ifdef USE_SSE
+		__m128 blend = _mm_loadu_ps(lanes.Blend);
+		for (int c = 0; c < 3; c++)
+		{
+			__m128 low = _mm_loadu_ps(min[c]);
+			__m128 scale = _mm_loadu_ps(step[c]);
+			__m128 a = _mm_add_ps(low, _mm_mul_ps(_mm_loadu_ps(lanes.A[c]), scale));
+			__m128 b = _mm_add_ps(low, _mm_mul_ps(_mm_loadu_ps(lanes.B[c]), scale));
+			_mm_storeu_ps(out[c], _mm_add_ps(a, _mm_mul_ps(_mm_sub_ps(b, a), blend)));
+		}
+#else
+		for (int c = 0; c < 3; c++)
+		{
+			for (int lane = 0; lane < 4; lane++)
+			{
+				float a = min[c][lane] + lanes.A[c][lane] * step[c][lane];
+				float b = min[c][lane] + lanes.B[c][lane] * step[c][lane];
+				out[c][lane] = a + (b - a) * lanes.Blend[lane];
+			}
+		}
+#endif
+	}
+
+	// the three stored components and the dropped largest one back in x y z w order
+	static void DecodeRotations(const float (&stored)[3][4], const int (&largest)[4], float (&out)[4][4])
+	{
+		// the dropped component goes last
+		float components[4][4];
+#ifdef USE_SSE
+		__m128 step = _mm_set1_ps(1.41421356f / 32767.0f);
+		__m128 offset = _mm_set1_ps(0.70710678f);
+		__m128 sum = _mm_setzero_ps();
+		for (int c = 0; c < 3; c++)
+		{
+			__m128 value = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(stored[c]), step), offset);
+			sum = _mm_add_ps(sum, _mm_mul_ps(value, value));
+			_mm_storeu_ps(components[c], value);
+		}
+		_mm_storeu_ps(components[3], _mm_sqrt_ps(_mm_max_ps(_mm_sub_ps(_mm_set1_ps(1.0f), sum), _mm_setzero_ps())));
+#else
+		for (int lane = 0; lane < 4; lane++)
+		{
+			float sum = 0.0f;
+			for (int c = 0; c < 3; c++)
+			{
+				components[c][lane] = stored[c][lane] * 1.41421356f / 32767.0f - 0.70710678f;
+				sum += components[c][lane] * components[c][lane];
+			}
+			components[3][lane] = std::sqrt(std::max(1.0f - sum, 0.0f));
+		}
+#endif
+		// which of the components x y z and w is, by the index of the dropped one
+		static const int sources[4][4] = { { 3, 0, 1, 2 }, { 0, 3, 1, 2 }, { 0, 1, 3, 2 }, { 0, 1, 2, 3 } };
+		for (int lane = 0; lane < 4; lane++)
+		{
+			const int* source = sources[largest[lane]];
+			for (int c = 0; c < 4; c++)
+			{
+				out[c][lane] = components[source[c]][lane];
+			}
+		}
+	}
+
+	// normalized lerp along the shorter arc
+	static void BlendRotations(const float (&a)[4][4], const float (&b)[4][4], const float* blend, float (&out)[4][4])
+	{
+#ifdef USE_SSE
+		__m128 t = _mm_loadu_ps(blend);
+		__m128 qa[4], qb[4];
+		__m128 dot = _mm_setzero_ps();
+		for (int c = 0; c < 4; c++)
+		{
+			qa[c] = _mm_loadu_ps(a[c]);
+			qb[c] = _mm_loadu_ps(b[c]);
+			dot = _mm_add_ps(dot, _mm_mul_ps(qa[c], qb[c]));
+		}
+		// flips b where the dot product is negative
+		__m128 sign = _mm_and_ps(dot, _mm_set1_ps(-0.0f));
+		__m128 length = _mm_setzero_ps();
+		__m128 q[4];
+		for (int c = 0; c < 4; c++)
+		{
+			q[c] = _mm_add_ps(qa[c], _mm_mul_ps(_mm_sub_ps(_mm_xor_ps(qb[c], sign), qa[c]), t));
+			length = _mm_add_ps(length, _mm_mul_ps(q[c], q[c]));
+		}
+		length = _mm_sqrt_ps(length);
+		for (int c = 0; c < 4; c++)
+		{
+			_mm_storeu_ps(out[c], _mm_div_ps(q[c], length));
+		}
+#else
+		for (int lane = 0; lane < 4; lane++)
+		{
+			glm::quat qa(a[3][lane], a[0][lane], a[1][lane], a[2][lane]);
+			glm::quat qb(b[3][lane], b[0][lane], b[1][lane], b[2][lane]);
+			glm::quat q = NormalizedLerp(qa, qb, blend[lane]);
+			out[0][lane] = q.x;
+			out[1][lane] = q.y;
+			out[2][lane] = q.z;
+			out[3][lane] = q.w;
+		}
+#endif
+	}
+
+	// translate * rotate * scale of four joints, same as ComposeTransform
+	static void ComposeLanes(const float (&translation)[3][4], const float (&rotation)[4][4], const float (&scale)[3][4], glm::mat4* out)
+	{
+#ifdef USE_SSE
+		__m128 x = _mm_loadu_ps(rotation[0]);
+		__m128 y = _mm_loadu_ps(rotation[1]);
+		__m128 z = _mm_loadu_ps(rotation[2]);
+		__m128 w = _mm_loadu_ps(rotation[3]);
+		__m128 sx = _mm_loadu_ps(scale[0]);
+		__m128 sy = _mm_loadu_ps(scale[1]);
+		__m128 sz = _mm_loadu_ps(scale[2]);
+		__m128 one = _mm_set1_ps(1.0f);
+		__m128 two = _mm_set1_ps(2.0f);
+		__m128 xx = _mm_mul_ps(x, x), yy = _mm_mul_ps(y, y), zz = _mm_mul_ps(z, z);
+		__m128 xy = _mm_mul_ps(x, y), xz = _mm_mul_ps(x, z), yz = _mm_mul_ps(y, z);
+		__m128 wx = _mm_mul_ps(w, x), wy = _mm_mul_ps(w, y), wz = _mm_mul_ps(w, z);
+
+		// one register per matrix element, a lane per joint
+		__m128 columns[4][4];
+		columns[0][0] = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz))), sx);
+		columns[0][1] = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xy, wz)), sx);
+		columns[0][2] = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xz, wy)), sx);
+		columns[0][3] = _mm_setzero_ps();
+		columns[1][0] = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(xy, wz)), sy);
+		columns[1][1] = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz))), sy);
+		columns[1][2] = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(yz, wx)), sy);
+		columns[1][3] = _mm_setzero_ps();
+		columns[2][0] = _mm_mul_ps(_mm_mul_ps(two, _mm_add_ps(xz, wy)), sz);
+		columns[2][1] = _mm_mul_ps(_mm_mul_ps(two, _mm_sub_ps(yz, wx)), sz);
+		columns[2][2] = _mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy))), sz);
+		columns[2][3] = _mm_setzero_ps();
+		columns[3][0] = _mm_loadu_ps(translation[0]);
+		columns[3][1] = _mm_loadu_ps(translation[1]);
+		columns[3][2] = _mm_loadu_ps(translation[2]);
+		columns[3][3] = one;
+
+		// transposing a column's four elements gives that column of the four matrices
+		for (int c = 0; c < 4; c++)
+		{
+			_MM_TRANSPOSE4_PS(columns[c][0], columns[c][1], columns[c][2], columns[c][3]);
+			for (int lane = 0; lane < 4; lane++)
+			{
+				_mm_storeu_ps(&out[lane][c][0], columns[c][lane]);
+			}
+		}
+#else
+		for (int lane = 0; lane < 4; lane++)
+		{
+			ComposeTransform(glm::vec3(translation[0][lane], translation[1][lane], translation[2][lane]),
+				glm::quat(rotation[3][lane], rotation[0][lane], rotation[1][lane], rotation[2][lane]),
+				glm::vec3(scale[0][lane], scale[1][lane], scale[2][lane]), out[lane]);
+		}
+#endif
+	}
+};
+
+#endif // !ANIMATION_COMPRESSION_H
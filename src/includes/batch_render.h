@@ -0,0 +1,236 @@
+#ifndef BATCH_RENDER_H
+#define BATCH_RENDER_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "camera_path.h"
+#include "frame_capture.h"
+#include "headless_context.h"
+#include "stats.h"
+#include "LogHelper.h"
+
+#ifdef _WIN32
+#define BATCH_POPEN _popen
+#define BATCH_PCLOSE _pclose
+#else
+#define BATCH_POPEN popen
+#define BATCH_PCLOSE pclose
+#endif
+
+// Offline rendering of a camera path with several headless processes.
+// "--headless --workers N ..." starts N copies of the executable, each with
+// "--range first count --part" for a contiguous part of the frames, so every
+// worker has its own context (llvmpipe only uses so many threads per context)
+// and its frames stay in path order for the caches that follow the camera.
+// Workers write their frames straight into the output directory under
+// their final names and report "PROGRESS n" lines on stdout. The coordinator
+// shows the combined progress, and for y4m output, where every worker writes
+// its own stream, joins the parts into one sequence at the end.
+// A poster is split the same way with tiles instead of frames.
+
+struct BatchRange
+{
+	int First = 0;
+	int Count = 0;
+};
+
+// contiguous ranges, the first ones get the remainder
+inline std::vector<BatchRange> SplitFrames(int frames, int workers)
+{
+	std::vector<BatchRange> ranges;
+	workers = std::max(1, std::min(workers, frames));
+	int first = 0;
+	for (int i = 0; i < workers; i++)
+	{
+		BatchRange range;
+		range.First = first;
+		range.Count = frames / workers + (i < frames % workers ? 1 : 0);
+		ranges.push_back(range);
+		first += range.Count;
+	}
+	return ranges;
+}
+
+// where a worker writes its y4m part
+inline std::string BatchPartPrefix(const std::string& outputDirectory, int first)
+{
+	char name[32];
+	std::snprintf(name, sizeof(name), "/frame_part%05d", first);
+	return outputDirectory + name;
+}
+
+// Appends the frames of a y4m stream to out, the header is skipped.
+inline bool AppendY4mFrames(FILE* out, const std::string& path, bool writeHeader)
+{
+	FILE* part = std::fopen(path.c_str(), "rb");
+	if (!part)
+	{
+		LOG("BATCH:: Missing " << path);
+		return false;
+	}
+	std::string header;
+	int c;
+	while ((c = std::fgetc(part)) != EOF && c != '\n')
+		header += static_cast<char>(c);
+	if (writeHeader)
+		std::fprintf(out, "%s\n", header.c_str());
+
+	std::vector<char> buffer(1 << 20);
+	size_t read;
+	while ((read = std::fread(buffer.data(), 1, buffer.size(), part)) > 0)
+		std::fwrite(buffer.data(), 1, read, out);
+	std::fclose(part);
+	return true;
+}
+
+// Coordinator side, executable is argv[0]. Returns the exit code.
+inline int RunBatch(const std::string& executable, const HeadlessOptions& options, int workers)
+{
+	// fail once here instead of in every worker
+	if (!options.CameraPath.empty())
+	{
+		CameraPath path;
+		if (!path.Load(options.CameraPath))
+			return -1;
+	}
+	CaptureFormat format;
+	if (!ParseCaptureFormat(options.OutputFormat, format))
+		return -1;
+
+	std::vector<BatchRange> ranges = SplitFrames(options.Frames, workers);
+
+	// the workers only fill in their tiles
+	PosterTiles poster(options.PosterWidth, options.PosterHeight, options.Width, options.Height);
+	if (options.PosterWidth > 0 && !options.OutputDirectory.empty() && !poster.CreateImage(options.OutputDirectory + "/poster.ppm"))
+		return -1;
+
+	// llvmpipe starts a rasterizer thread per core in every process, the workers share the cores instead
+	if (!std::getenv("LP_NUM_THREADS"))
+	{
+		std::string threads = std::to_string(std::max(1u, std::thread::hardware_concurrency() / static_cast<unsigned int>(ranges.size())));
+#ifdef _WIN32
+		_putenv_s("LP_NUM_THREADS", threads.c_str());
+#else
+		setenv("LP_NUM_THREADS", threads.c_str(), 1);
+#endif
+	}
+
+	std::vector<FILE*> pipes;
+	for (const BatchRange& range : ranges)
+	{
+		std::string command = "\"" + executable + "\" --headless --size " + std::to_string(options.Width) + "x" + std::to_string(options.Height) +
+			" --frames " + std::to_string(options.Frames) + " --fps " + std::to_string(options.FramesPerSecond) +
+			" --range " + std::to_string(range.First) + " " + std::to_string(range.Count) + " --progress --part";
+		if (!options.CameraPath.empty())
+			command += " --path \"" + options.CameraPath + "\"";
+		if (!options.OutputDirectory.empty())
+			command += " --out \"" + options.OutputDirectory + "\" --format " + options.OutputFormat;
+		if (options.PosterWidth > 0)
+			command += " --poster " + std::to_string(options.PosterWidth) + "x" + std::to_string(options.PosterHeight);
+		if (!options.CharacterPath.empty())
+			command += " --character \"" + options.CharacterPath + "\" --characters " + std::to_string(options.CharacterCount) + (options.BakedAnimation ? " --baked" : "");
+#ifdef _WIN32
+		// cmd.exe drops the outer quotes of a command that starts with one
+		command = "\"" + command + "\"";
+#endif
+		FILE* pipe = BATCH_POPEN(command.c_str(), "r");
+		if (!pipe)
+		{
+			LOG("BATCH:: Could not start " << command);
+			for (FILE* started : pipes)
+				BATCH_PCLOSE(started);
+			return -1;
+		}
+		pipes.push_back(pipe);
+	}
+	std::cout << "BATCH:: " << options.Frames << " frames on " << ranges.size() << " workers" << std::endl;
+
+	// one reader per worker, a blocking read of a pipe is the portable way to wait on it
+	CpuTimer timer;
+	std::vector<std::atomic<int>> progress(ranges.size());
+	std::vector<int> exitCodes(ranges.size(), 0);
+	std::atomic<int> running(static_cast<int>(ranges.size()));
+	std::vector<std::thread> readers;
+	for (unsigned int i = 0; i < ranges.size(); i++)
+	{
+		progress[i] = 0;
+		readers.push_back(std::thread([&, i]()
+		{
+			char line[512];
+			while (std::fgets(line, sizeof(line), pipes[i]))
+			{
+				int done = 0;
+				if (std::sscanf(line, "PROGRESS %d", &done) == 1)
+					progress[i] = done;
+				else if (std::strncmp(line, "HEADLESS::", 10) == 0 || std::strncmp(line, "ERROR", 5) == 0)
+					std::cout << "BATCH::WORKER " << i << ":: " << line << std::flush;
+			}
+			exitCodes[i] = BATCH_PCLOSE(pipes[i]);
+			running--;
+		}));
+	}
+
+	int lastShown = -1;
+	while (running > 0)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(500));
+		int done = 0;
+		for (unsigned int i = 0; i < ranges.size(); i++)
+			done += progress[i];
+		if (done != lastShown)
+		{
+			float seconds = timer.ElapsedMs() / 1000.0f;
+			std::cout << "BATCH:: " << done << " / " << options.Frames << " frames, " << (seconds > 0.0f ? done / seconds : 0.0f) << " fps" << std::endl;
+			lastShown = done;
+		}
+	}
+	for (std::thread& reader : readers)
+		reader.join();
+	float seconds = timer.ElapsedMs() / 1000.0f;
+
+	int failed = 0;
+	for (unsigned int i = 0; i < ranges.size(); i++)
+	{
+		if (exitCodes[i] != 0 || progress[i] != ranges[i].Count)
+		{
+			LOG("BATCH:: Worker " << i << " for frames " << ranges[i].First << " to " << ranges[i].First + ranges[i].Count - 1 << " failed");
+			failed++;
+		}
+	}
+
+	// a poster has no frames to join, only the tiles its workers wrote into poster.ppm
+	if (failed == 0 && format == CAPTURE_Y4M && options.PosterWidth == 0 && !options.OutputDirectory.empty())
+	{
+		std::string path = options.OutputDirectory + "/frame.y4m";
+		FILE* out = std::fopen(path.c_str(), "wb");
+		if (!out)
+		{
+			LOG("BATCH:: Could not write " << path);
+			return -1;
+		}
+		for (unsigned int i = 0; i < ranges.size(); i++)
+		{
+			std::string part = BatchPartPrefix(options.OutputDirectory, ranges[i].First) + ".y4m";
+			if (AppendY4mFrames(out, part, i == 0))
+				std::remove(part.c_str());
+			else
+				failed++;
+		}
+		std::fclose(out);
+	}
+
+	std::cout << "BATCH:: " << options.Frames << " frames in " << seconds << " s, " << (seconds > 0.0f ? options.Frames / seconds : 0.0f) << " fps with "
+		<< ranges.size() << " workers" << (failed > 0 ? ", FAILED" : "") << std::endl;
+	return failed > 0 ? -1 : 0;
+}
+
+#endif // !BATCH_RENDER_H
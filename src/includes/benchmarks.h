@@ -0,0 +1,689 @@
+#ifndef BENCHMARKS_H
+#define BENCHMARKS_H
+
+#include <glm.hpp>
+#include <gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "animation_baking.h"
+#include "animation_compression.h"
+#include "clustered_lighting.h"
+#include "command_list.h"
+#include "headless_context.h"
+#include "job_system.h"
+#include "mesh.h"
+#include "occlusion.h"
+#include "scene_graph.h"
+#include "shader.h"
+#include "skeletal_animation.h"
+#include "stats.h"
+#include "transparent_sort.h"
+
+// Cpu side micro benchmarks, run with "MakeTriangles --bench [name]".
+// They need no window or GL context. The gpu ones make a headless context
+// and only run when asked for by name.
+
+// 1M nodes in a 4-ary tree, 1% of the local matrices change every iteration
+inline void BenchmarkSceneGraph(std::ostream& out)
+{
+	const unsigned int nodeCount = 1000000;
+	const unsigned int changedCount = nodeCount / 100;
+	const int iterations = 20;
+
+	SceneGraph graph;
+	graph.Reserve(nodeCount);
+	for (unsigned int i = 0; i < nodeCount; i++)
+	{
+		unsigned int parent = i == 0 ? SceneGraph::NO_PARENT : (i - 1) / 4;
+		graph.AddNode(parent, glm::translate(glm::mat4(1.0f), glm::vec3(1.0f, 0.0f, 0.0f)));
+	}
+	graph.Update();
+
+	std::mt19937 random(1234);
+	std::uniform_int_distribution<unsigned int> pick(0, nodeCount - 1);
+
+	float partialMs = 0.0f;
+	unsigned int partialNodes = 0;
+	for (int it = 0; it < iterations; it++)
+	{
+		for (unsigned int i = 0; i < changedCount; i++)
+		{
+			unsigned int node = pick(random);
+			graph.SetLocal(node, glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, static_cast<float>(it), 0.0f)));
+		}
+		graph.Update();
+		partialMs += graph.UpdateTimeMs;
+		partialNodes += graph.UpdatedCount;
+	}
+
+	// touching the root dirties everything
+	float fullMs = 0.0f;
+	for (int it = 0; it < iterations; it++)
+	{
+		graph.SetLocal(0, graph.GetLocal(0));
+		graph.Update();
+		fullMs += graph.UpdateTimeMs;
+	}
+
+	out << "scene graph: " << nodeCount << " nodes, " << changedCount << " changed per update\n";
+	out << "  dirty update: " << partialMs / iterations << " ms, " << partialNodes / iterations << " nodes recomputed\n";
+	out << "  full update:  " << fullMs / iterations << " ms\n";
+}
+
+// cost of an empty job, and ParallelFor scaling over a fixed amount of matrix work
+inline void BenchmarkJobSystem(std::ostream& out)
+{
+	const unsigned int jobCount = 100000;
+	unsigned int maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+
+	{
+		JobSystem jobs;
+		JobCounter counter;
+		CpuTimer timer;
+		for (unsigned int i = 0; i < jobCount; i++)
+		{
+			jobs.Run([]() {}, &counter);
+		}
+		jobs.Wait(counter);
+		out << "job system: " << jobs.GetThreadCount() << " threads, "
+			<< timer.ElapsedMs() * 1000000.0f / jobCount << " ns per empty job\n";
+	}
+
+	const unsigned int itemCount = 1 << 20;
+	std::vector<glm::mat4> matrices(itemCount, glm::mat4(1.0f));
+	float singleMs = 0.0f;
+	for (unsigned int threads = 1; threads <= maxThreads; threads *= 2)
+	{
+		JobSystem jobs(threads);
+		CpuTimer timer;
+		for (int it = 0; it < 10; it++)
+		{
+			jobs.ParallelFor(itemCount, 4096, [&matrices](unsigned int begin, unsigned int end)
+			{
+				glm::mat4 step = glm::translate(glm::mat4(1.0f), glm::vec3(0.001f));
+				for (unsigned int i = begin; i < end; i++)
+				{
+					MultiplyMat4(matrices[i], step, matrices[i]);
+				}
+			});
+		}
+		float ms = timer.ElapsedMs() / 10.0f;
+		if (threads == 1)
+			singleMs = ms;
+		out << "  parallel for, " << threads << " threads: " << ms << " ms, speedup " << singleMs / ms << "\n";
+
+		if (threads < maxThreads && threads * 2 > maxThreads)
+			threads = maxThreads / 2;
+	}
+}
+
+// cpu light assignment for a growing number of lights, the view looks at the scene from 8 units away
+inline void BenchmarkClusteredLighting(std::ostream& out)
+{
+	const int iterations = 20;
+	JobSystem jobs;
+	glm::mat4 view = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -1.0f, -8.0f));
+
+	out << "clustered lighting: " << ClusteredLighting::CLUSTERS_X << "x" << ClusteredLighting::CLUSTERS_Y << "x"
+		<< ClusteredLighting::CLUSTERS_Z << " clusters, " << jobs.GetThreadCount() << " threads\n";
+	for (unsigned int count = 64; count <= 16384; count *= 4)
+	{
+		ClusteredLighting lighting;
+		lighting.SetJobSystem(&jobs);
+		GenerateTestLights(lighting.GetLights(), count);
+
+		float ms = 0.0f;
+		for (int it = 0; it < iterations; it++)
+		{
+			lighting.Assign(view, glm::radians(45.0f), 800, 600, 0.1f, 100.0f);
+			ms += lighting.AssignTimeMs;
+		}
+
+		// a fragment shades its cluster's lights instead of all of them
+		out << "  " << count << " lights: assign " << ms / iterations << " ms, "
+			<< static_cast<float>(lighting.IndexCount) / ClusteredLighting::CLUSTER_COUNT << " lights per cluster on average, "
+			<< lighting.MaxLightsPerCluster << " at most\n";
+	}
+}
+
+// Software occlusion culling of a fixed scene: a 4x2 wall 5 units in front of the
+// camera, with 2000 small random quads behind it to give the rasterizer work. The
+// results are checked first: the wall's depth, the hierarchy never being nearer
+// than what it covers, the same buffer with and without the job system, and boxes
+// with a known answer. Then both are timed.
+inline void BenchmarkOcclusion(std::ostream& out)
+{
+	const unsigned int quadCount = 2000;
+	const unsigned int boxCount = 1000;
+	const int iterations = 50;
+	JobSystem jobs;
+	glm::mat4 viewProjection = glm::perspective(glm::radians(60.0f), 2.0f, 0.1f, 100.0f);
+
+	// counter clockwise seen from the camera at the origin, looking down -z
+	std::vector<glm::vec3> positions;
+	std::vector<unsigned int> indices;
+	positions.push_back(glm::vec3(-2.0f, -1.0f, -5.0f));
+	positions.push_back(glm::vec3(2.0f, -1.0f, -5.0f));
+	positions.push_back(glm::vec3(2.0f, 1.0f, -5.0f));
+	positions.push_back(glm::vec3(-2.0f, 1.0f, -5.0f));
+	unsigned int wall[] = { 0, 1, 2, 0, 2, 3 };
+	indices.insert(indices.end(), wall, wall + 6);
+
+	std::mt19937 random(3);
+	std::uniform_real_distribution<float> across(-20.0f, 20.0f);
+	std::uniform_real_distribution<float> depth(-60.0f, -6.0f);
+	for (unsigned int i = 0; i < quadCount; i++)
+	{
+		glm::vec3 corner(across(random), across(random) * 0.5f, depth(random));
+		unsigned int base = static_cast<unsigned int>(positions.size());
+		positions.push_back(corner);
+		positions.push_back(corner + glm::vec3(1.0f, 0.0f, 0.0f));
+		positions.push_back(corner + glm::vec3(1.0f, 1.0f, 0.0f));
+		positions.push_back(corner + glm::vec3(0.0f, 1.0f, 0.0f));
+		unsigned int quad[] = { base, base + 1, base + 2, base, base + 2, base + 3 };
+		indices.insert(indices.end(), quad, quad + 6);
+	}
+
+	OcclusionCuller serial;
+	OcclusionCuller culler;
+	culler.SetJobSystem(&jobs);
+	OcclusionCuller* cullers[] = { &serial, &culler };
+	for (OcclusionCuller* c : cullers)
+	{
+		c->BeginFrame(viewProjection);
+		c->AddOccluder(positions, indices, glm::mat4(1.0f));
+		c->Rasterize();
+	}
+
+	unsigned int failures = 0;
+	// 1/w of the wall is 1/5 wherever it covers
+	if (std::abs(culler.GetDepth(culler.GetWidth() / 2, culler.GetHeight() / 2) - 0.2f) > 1e-5f)
+	{
+		out << "  wrong depth at the center of the wall\n";
+		failures++;
+	}
+	unsigned int differing = 0;
+	unsigned int nearerParents = 0;
+	for (int level = 0; level < culler.GetLevelCount(); level++)
+	{
+		int levelWidth = std::max(1, culler.GetWidth() >> level);
+		int levelHeight = std::max(1, culler.GetHeight() >> level);
+		for (int y = 0; y < levelHeight; y++)
+		{
+			for (int x = 0; x < levelWidth; x++)
+			{
+				float value = culler.GetDepth(x, y, level);
+				if (value != serial.GetDepth(x, y, level))
+					differing++;
+				if (level > 0 && value > culler.GetDepth(std::min(x * 2, (levelWidth * 2) - 1), std::min(y * 2, (levelHeight * 2) - 1), level - 1))
+					nearerParents++;
+			}
+		}
+	}
+	if (differing > 0)
+	{
+		out << "  " << differing << " texels differ between the serial and the job system raster\n";
+		failures++;
+	}
+	if (nearerParents > 0)
+	{
+		out << "  " << nearerParents << " hierarchy texels are nearer than a texel they cover\n";
+		failures++;
+	}
+
+	// behind the middle of the wall, in front of it, beside it and straddling its edge
+	AABB unit;
+	unit.Min = glm::vec3(-0.25f);
+	unit.Max = glm::vec3(0.25f);
+	glm::vec3 centers[] = { glm::vec3(0.0f, 0.0f, -10.0f), glm::vec3(0.0f, 0.0f, -3.0f), glm::vec3(6.0f, 0.0f, -10.0f), glm::vec3(4.0f, 0.0f, -10.0f) };
+	bool expected[] = { false, true, true, true };
+	for (int i = 0; i < 4; i++)
+	{
+		if (culler.IsVisible(unit, glm::translate(glm::mat4(1.0f), centers[i])) != expected[i])
+		{
+			out << "  box " << i << " should be " << (expected[i] ? "visible" : "hidden") << "\n";
+			failures++;
+		}
+	}
+
+	std::vector<glm::mat4> boxes(boxCount);
+	for (unsigned int i = 0; i < boxCount; i++)
+		boxes[i] = glm::translate(glm::mat4(1.0f), glm::vec3(across(random), across(random) * 0.5f, depth(random)));
+
+	out << "occlusion: " << culler.GetWidth() << "x" << culler.GetHeight() << " buffer, " << indices.size() / 3 << " occluder triangles, "
+		<< boxCount << " boxes, " << (failures == 0 ? "results correct" : "RESULTS WRONG") << "\n";
+	const char* names[] = { "serial", "job system" };
+	for (int c = 0; c < 2; c++)
+	{
+		float rasterMs = 0.0f;
+		float testMs = 0.0f;
+		unsigned int occluded = 0;
+		for (int it = 0; it < iterations; it++)
+		{
+			cullers[c]->BeginFrame(viewProjection);
+			cullers[c]->AddOccluder(positions, indices, glm::mat4(1.0f));
+			cullers[c]->Rasterize();
+			for (unsigned int i = 0; i < boxCount; i++)
+				cullers[c]->IsVisible(unit, boxes[i]);
+			rasterMs += cullers[c]->RasterTimeMs;
+			testMs += cullers[c]->TestTimeMs;
+			occluded = cullers[c]->OccludedCount;
+		}
+		out << "  " << names[c] << ": raster " << rasterMs / iterations << " ms, test " << testMs / iterations << " ms, "
+			<< occluded << " boxes hidden\n";
+	}
+}
+
+// TransparentSorter against std::sort on the same depths, which are rounded to a
+// millimetre so many are tied and some are negative, behind the camera. The
+// radix sort has to give the exact order of the comparison sort: farthest
+// first and equal depths in the order they were added.
+inline void BenchmarkTransparentSort(std::ostream& out)
+{
+	const int iterations = 20;
+	std::mt19937 random(5);
+	std::uniform_real_distribution<float> distance(-10.0f, 100.0f);
+
+	out << "transparent sort:\n";
+	for (unsigned int count = 1000; count <= 1000000; count *= 10)
+	{
+		std::vector<float> depths(count);
+		for (unsigned int i = 0; i < count; i++)
+			depths[i] = std::floor(distance(random) * 1000.0f) / 1000.0f;
+
+		TransparentSorter sorter;
+		sorter.Reserve(count);
+		float radixMs = 0.0f;
+		for (int it = 0; it < iterations; it++)
+		{
+			sorter.Clear();
+			for (unsigned int i = 0; i < count; i++)
+				sorter.Add(i, depths[i]);
+			sorter.Sort();
+			radixMs += sorter.SortTimeMs;
+		}
+
+		std::vector<unsigned int> order(count);
+		float sortMs = 0.0f;
+		for (int it = 0; it < iterations; it++)
+		{
+			for (unsigned int i = 0; i < count; i++)
+				order[i] = i;
+			CpuTimer timer;
+			std::sort(order.begin(), order.end(), [&depths](unsigned int a, unsigned int b)
+			{
+				return depths[a] != depths[b] ? depths[a] > depths[b] : a < b;
+			});
+			sortMs += timer.ElapsedMs();
+		}
+
+		unsigned int mismatches = 0;
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (sorter[i] != order[i])
+				mismatches++;
+		}
+
+		out << "  " << count << " objects: radix " << radixMs / iterations << " ms, std::sort " << sortMs / iterations << " ms ("
+			<< sortMs / radixMs << "x), " << (mismatches == 0 ? "same order" : "ORDER DIFFERS") << "\n";
+	}
+}
+
+// bone palettes of 1000 characters sharing a 64 joint rig, each at its own point of a 30 keys per second clip
+inline void BenchmarkSkinning(std::ostream& out)
+{
+	const unsigned int characterCount = 1000;
+	const unsigned int jointCount = 64;
+	const int iterations = 20;
+	unsigned int maxThreads = std::max(std::thread::hardware_concurrency(), 1u);
+
+	Skeleton skeleton;
+	GenerateTestSkeleton(skeleton, jointCount);
+	AnimationClip clip;
+	GenerateTestClip(skeleton, clip, 2.0f, 30.0f);
+
+	out << "skinning: " << characterCount << " characters, " << jointCount << " bones, " << clip.GetKeyCount() << " keys, "
+		<< characterCount * jointCount * sizeof(glm::mat4) / 1024 << " KB of palettes per frame\n";
+	float singleMs = 0.0f;
+	for (unsigned int threads = 1; threads <= maxThreads; threads *= 2)
+	{
+		JobSystem jobs(threads);
+		SkinningPalettes palettes;
+		palettes.SetJobSystem(&jobs);
+		for (unsigned int i = 0; i < characterCount; i++)
+		{
+			AnimatedInstance instance;
+			instance.Rig = &skeleton;
+			instance.Clip = &clip;
+			instance.Time = i * 0.37f;
+			palettes.GetInstances().push_back(instance);
+		}
+
+		float ms = 0.0f;
+		for (int it = 0; it < iterations; it++)
+		{
+			palettes.Update(1.0f / 60.0f);
+			ms += palettes.UpdateTimeMs;
+		}
+		ms /= iterations;
+		if (threads == 1)
+			singleMs = ms;
+		out << "  " << threads << " threads: " << ms << " ms, " << ms * 1000.0f / characterCount << " us per character, speedup " << singleMs / ms << "\n";
+
+		if (threads < maxThreads && threads * 2 > maxThreads)
+			threads = maxThreads / 2;
+	}
+
+	// the baked alternative costs nothing per character and frame, only texture memory and accuracy
+	JobSystem jobs;
+	std::vector<AnimationClip> clips(1, clip);
+	const float rates[] = { 10.0f, 30.0f, 60.0f };
+	for (float rate : rates)
+	{
+		for (int half = 0; half < 2; half++)
+		{
+			BakeSettings settings;
+			settings.FramesPerSecond = rate;
+			settings.HalfFloat = half == 1;
+			BakedAnimations baked;
+			baked.SetJobSystem(&jobs);
+			baked.Bake(skeleton, clips, settings);
+			out << "  baked at " << rate << " fps" << (settings.HalfFloat ? ", half float: " : ": ") << baked.GetTextureSize() / 1024 << " KB, bake "
+				<< baked.BakeTimeMs << " ms, max error " << baked.MaxError << "\n";
+		}
+	}
+}
+
+// The vertex stage of the BenchmarkSkinning crowd on the gpu: rigid vertices as the
+// base line, bone palettes with a draw per character, and baked animations in one
+// instanced draw. Everything is behind the camera, so the triangles are clipped and
+// nothing is rasterized.
+// Run from the repository root, the shaders are loaded from src/shaders.
+inline void BenchmarkSkinningGpu(std::ostream& out)
+{
+	const unsigned int characterCount = 1000;
+	const unsigned int jointCount = 64;
+	// a grid of 64 x 64 vertices per character
+	const unsigned int gridSize = 64;
+	const int iterations = 20;
+
+	HeadlessContext context;
+	if (!context.Create(64, 64) || !gladLoadGLLoader((GLADloadproc)HeadlessContext::GetProcAddress))
+	{
+		out << "skinning gpu: no context\n";
+		return;
+	}
+	context.CreateFramebuffer();
+	glBindFramebuffer(GL_FRAMEBUFFER, context.GetFramebuffer());
+	glEnable(GL_DEPTH_TEST);
+
+	Skeleton skeleton;
+	GenerateTestSkeleton(skeleton, jointCount);
+	AnimationClip clip;
+	GenerateTestClip(skeleton, clip, 2.0f, 30.0f);
+
+	// every vertex weighted to four random bones
+	std::mt19937 random(11);
+	std::uniform_int_distribution<int> bone(0, static_cast<int>(skeleton.GetBoneCount()) - 1);
+	std::vector<Vertex> vertices(gridSize * gridSize);
+	for (unsigned int i = 0; i < vertices.size(); i++)
+	{
+		Vertex& vertex = vertices[i];
+		vertex = Vertex();
+		vertex.Position = glm::vec3((i % gridSize) / static_cast<float>(gridSize), (i / gridSize) / static_cast<float>(gridSize), 0.0f);
+		vertex.Normal = glm::vec3(0.0f, 0.0f, 1.0f);
+		for (int j = 0; j < MAX_BONE_INFLUENCE; j++)
+		{
+			vertex.m_BoneIDs[j] = bone(random);
+			vertex.m_Weights[j] = 1.0f / MAX_BONE_INFLUENCE;
+		}
+	}
+	std::vector<unsigned int> indices;
+	for (unsigned int y = 0; y + 1 < gridSize; y++)
+	{
+		for (unsigned int x = 0; x + 1 < gridSize; x++)
+		{
+			unsigned int corner = y * gridSize + x;
+			unsigned int quad[] = { corner, corner + 1, corner + gridSize, corner + 1, corner + gridSize + 1, corner + gridSize };
+			indices.insert(indices.end(), quad, quad + 6);
+		}
+	}
+	Mesh mesh(vertices, indices, std::vector<Texture>());
+
+	// vertex stages only, like the depth prepass
+	Shader rigidShader("src/shaders/model_loading.vs");
+	Shader paletteShader("src/shaders/skinned.vs");
+	SkinningPalettes::BindBlock(paletteShader);
+	Shader bakedShader("src/shaders/skinned_baked.vs");
+	// the camera looks away from the crowd
+	glm::mat4 view = glm::lookAt(glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(0.0f, 0.0f, -2.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+	glm::mat4 projection = glm::perspective(glm::radians(45.0f), 1.0f, 0.1f, 100.0f);
+	Shader* shaders[] = { &rigidShader, &paletteShader, &bakedShader };
+	for (Shader* shader : shaders)
+	{
+		shader->use();
+		shader->setMat4("view", view);
+		shader->setMat4("projection", projection);
+		shader->setMat4("model", glm::mat4(1.0f));
+	}
+
+	SkinningPalettes palettes;
+	palettes.Create();
+	for (unsigned int i = 0; i < characterCount; i++)
+	{
+		AnimatedInstance instance;
+		instance.Rig = &skeleton;
+		instance.Clip = &clip;
+		instance.Time = i * 0.37f;
+		palettes.GetInstances().push_back(instance);
+	}
+	palettes.Update(0.0f);
+	palettes.Upload();
+
+	BakedAnimations baked;
+	baked.Bake(skeleton, std::vector<AnimationClip>(1, clip), BakeSettings());
+	baked.Upload();
+	std::vector<InstanceData> instances(characterCount);
+	for (unsigned int i = 0; i < characterCount; i++)
+	{
+		instances[i].Model = glm::translate(glm::mat4(1.0f), glm::vec3(static_cast<float>(i % 32), static_cast<float>(i / 32), 0.0f));
+		instances[i].Params = baked.GetInstanceParams(0, i * 0.37f, 1.0f);
+	}
+	GLuint instanceBuffer;
+	glGenBuffers(1, &instanceBuffer);
+	glBindBuffer(GL_ARRAY_BUFFER, instanceBuffer);
+	glBufferData(GL_ARRAY_BUFFER, instances.size() * sizeof(InstanceData), instances.data(), GL_STATIC_DRAW);
+	mesh.SetInstanceBuffer(instanceBuffer);
+
+	std::vector<CommandList> lists(3);
+	lists[0].UseProgram(rigidShader.ID);
+	lists[1].UseProgram(paletteShader.ID);
+	for (unsigned int i = 0; i < characterCount; i++)
+	{
+		lists[0].SetMat4("model", instances[i].Model);
+		mesh.Record(lists[0]);
+		palettes.Record(lists[1], i);
+		lists[1].SetMat4("model", instances[i].Model);
+		mesh.Record(lists[1]);
+	}
+	lists[2].UseProgram(bakedShader.ID);
+	baked.Record(lists[2], 0.5f);
+	mesh.RecordInstanced(lists[2], characterCount);
+
+	out << "skinning gpu: " << characterCount << " characters of " << vertices.size() << " vertices, " << jointCount << " bones\n";
+	const char* names[] = { "rigid", "bone palettes", "baked" };
+	GLuint query;
+	glGenQueries(1, &query);
+	float rigidMs = 0.0f;
+	for (unsigned int l = 0; l < lists.size(); l++)
+	{
+		// the queue points into the lists it merges
+		std::vector<CommandList> list(1, lists[l]);
+		CommandQueue queue;
+		queue.Merge(list);
+		// the first run compiles whatever the driver defers
+		queue.Execute(0, 255);
+		glFinish();
+
+		// the query is the gpu's own clock, the wall time to glFinish also counts
+		// submitting and is what a software renderer can be measured by
+		float ms = 0.0f;
+		float wallMs = 0.0f;
+		for (int it = 0; it < iterations; it++)
+		{
+			CpuTimer timer;
+			glBeginQuery(GL_TIME_ELAPSED, query);
+			queue.Execute(0, 255);
+			glEndQuery(GL_TIME_ELAPSED);
+			glFinish();
+			wallMs += timer.ElapsedMs();
+			GLuint64 elapsed = 0;
+			glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+			ms += static_cast<float>(elapsed) / 1000000.0f;
+		}
+		ms /= iterations;
+		wallMs /= iterations;
+		if (l == 0)
+			rigidMs = wallMs;
+		out << "  " << names[l] << ": gpu " << ms << " ms, to finish " << wallMs << " ms, "
+			<< wallMs * 1000000.0f / (characterCount * vertices.size()) << " ns per vertex";
+		if (l > 0)
+			out << ", skinning adds " << wallMs - rigidMs << " ms";
+		out << "\n";
+	}
+	glDeleteQueries(1, &query);
+	glDeleteBuffers(1, &instanceBuffer);
+}
+
+// the skinning clip at 10 seconds, raw against compressed at a few tolerances:
+// memory, sampling 1000 characters playing forward on one thread, and the
+// largest joint position difference to the raw clip
+inline void BenchmarkAnimationCompression(std::ostream& out)
+{
+	const unsigned int characterCount = 1000;
+	const unsigned int jointCount = 64;
+	const int iterations = 60;
+
+	Skeleton skeleton;
+	GenerateTestSkeleton(skeleton, jointCount);
+	AnimationClip clip;
+	GenerateTestClip(skeleton, clip, 10.0f, 30.0f);
+
+	std::vector<glm::mat4> locals = skeleton.GetBindLocals();
+	std::vector<glm::mat4> compressedLocals = locals;
+	std::vector<glm::mat4> worlds(jointCount), compressedWorlds(jointCount);
+	std::vector<glm::mat4> palette(skeleton.GetBoneCount());
+	std::vector<float> times(characterCount);
+	for (unsigned int i = 0; i < characterCount; i++)
+		times[i] = std::fmod(i * 0.37f, clip.Duration);
+
+	CpuTimer timer;
+	for (int it = 0; it < iterations; it++)
+	{
+		for (unsigned int i = 0; i < characterCount; i++)
+			clip.Sample(std::fmod(times[i] + it / 60.0f, clip.Duration), locals.data());
+	}
+	float rawMs = timer.ElapsedMs() / iterations;
+	out << "compression: " << characterCount << " characters, " << jointCount << " bones, raw clip " << clip.GetKeyCount() << " keys, "
+		<< clip.GetMemorySize() / 1024 << " KB, sampling " << rawMs << " ms\n";
+
+	const float tolerances[] = { 0.0001f, 0.0005f, 0.002f };
+	for (float tolerance : tolerances)
+	{
+		CompressionSettings settings;
+		settings.PositionTolerance = tolerance;
+		settings.RotationTolerance = tolerance;
+		settings.ScaleTolerance = tolerance;
+		CompressedClip compressed;
+		timer.Reset();
+		compressed.Compress(clip, settings);
+		float compressMs = timer.ElapsedMs();
+
+		std::vector<CompressedClipCursor> cursors(characterCount);
+		timer.Reset();
+		for (int it = 0; it < iterations; it++)
+		{
+			for (unsigned int i = 0; i < characterCount; i++)
+				compressed.Sample(std::fmod(times[i] + it / 60.0f, clip.Duration), cursors[i], compressedLocals.data());
+		}
+		float ms = timer.ElapsedMs() / iterations;
+
+		float error = 0.0f;
+		CompressedClipCursor cursor;
+		for (unsigned int f = 0; f <= 600; f++)
+		{
+			float time = clip.Duration * f / 600;
+			clip.Sample(time, locals.data());
+			compressed.Sample(time, cursor, compressedLocals.data());
+			skeleton.ComputePalette(locals.data(), worlds.data(), palette.data());
+			skeleton.ComputePalette(compressedLocals.data(), compressedWorlds.data(), palette.data());
+			for (unsigned int j = 0; j < jointCount; j++)
+				error = std::max(error, glm::length(glm::vec3(worlds[j][3]) - glm::vec3(compressedWorlds[j][3])));
+		}
+
+		out << "  tolerance " << tolerance << ": " << compressed.GetKeyCount() << " keys, " << compressed.GetMemorySize() / 1024 << " KB ("
+			<< static_cast<float>(clip.GetMemorySize()) / compressed.GetMemorySize() << "x smaller), compress " << compressMs << " ms, sampling "
+			<< ms << " ms (" << rawMs / ms << "x faster), max joint error " << error << "\n";
+	}
+}
+
+inline int RunBenchmarks(const std::string& name)
+{
+	bool all = name.empty() || name == "all";
+	bool ran = false;
+	if (all || name == "scenegraph")
+	{
+		BenchmarkSceneGraph(std::cout);
+		ran = true;
+	}
+	if (all || name == "jobs")
+	{
+		BenchmarkJobSystem(std::cout);
+		ran = true;
+	}
+	if (all || name == "lights")
+	{
+		BenchmarkClusteredLighting(std::cout);
+		ran = true;
+	}
+	if (all || name == "occlusion")
+	{
+		BenchmarkOcclusion(std::cout);
+		ran = true;
+	}
+	if (all || name == "sort")
+	{
+		BenchmarkTransparentSort(std::cout);
+		ran = true;
+	}
+	if (all || name == "skinning")
+	{
+		BenchmarkSkinning(std::cout);
+		ran = true;
+	}
+	if (all || name == "compression")
+	{
+		BenchmarkAnimationCompression(std::cout);
+		ran = true;
+	}
+	if (name == "skinning-gpu")
+	{
+		BenchmarkSkinningGpu(std::cout);
+		ran = true;
+	}
+
+	if (!ran)
+	{
+		std::cout << "Unknown benchmark: " << name << std::endl;
+		return -1;
+	}
+	return 0;
+}
+
+#endif // !BENCHMARKS_H
@@ -67,6 +67,16 @@ public:
 		return calculateLookAt(Position, Position + Front, Up);
 	}
 
+	// overwrites position and orientation, e.g. with an interpolated simulation state
+	void SetState(glm::vec3 position, float yaw, float pitch, float zoom)
+	{
+		Position = position;
+		Yaw = yaw;
+		Pitch = pitch;
+		Zoom = zoom;
+		updateCameraVectors();
+	}
+
 	void ProcessKeyboard(CameraMovement direction, float deltaTime)
 	{
 		float velocity = MovementSpeed * deltaTime;
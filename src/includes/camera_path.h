@@ -0,0 +1,118 @@
+#ifndef CAMERA_PATH_H
+#define CAMERA_PATH_H
+
+#include <glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "simulation.h"
+#include "LogHelper.h"
+
+struct CameraKey
+{
+	float Time = 0.0f;
+	CameraState State;
+};
+
+// Camera keys over time for scripted runs. Positions follow a Catmull-Rom
+// spline through the keys, angles and zoom are interpolated linearly.
+class CameraPath
+{
+public:
+	// One key per line: time x y z yaw pitch [zoom], seconds and degrees,
+	// lines starting with # are comments. Keys have to be sorted by time.
+	bool Load(const std::string& path)
+	{
+		std::ifstream file(path);
+		if (!file)
+		{
+			LOG("CAMERA_PATH:: Could not read " << path);
+			return false;
+		}
+
+		keys.clear();
+		std::string line;
+		while (std::getline(file, line))
+		{
+			if (line.empty() || line[0] == '#')
+				continue;
+
+			std::istringstream stream(line);
+			CameraKey key;
+			key.State.Zoom = ZOOM;
+			if (!(stream >> key.Time >> key.State.Position.x >> key.State.Position.y >> key.State.Position.z >> key.State.Yaw >> key.State.Pitch))
+				continue;
+			stream >> key.State.Zoom;
+			if (!keys.empty() && key.Time <= keys.back().Time)
+			{
+				LOG("CAMERA_PATH:: Keys are not sorted by time in " << path);
+				return false;
+			}
+			keys.push_back(key);
+		}
+		return !keys.empty();
+	}
+
+	// a full circle around center looking at it
+	void MakeOrbit(const glm::vec3& center, float radius, float height, float duration, int keyCount = 16)
+	{
+		keys.clear();
+		for (int i = 0; i <= keyCount; i++)
+		{
+			float t = static_cast<float>(i) / keyCount;
+			float angle = t * 2.0f * 3.14159265f;
+			CameraKey key;
+			key.Time = t * duration;
+			key.State.Position = center + glm::vec3(std::cos(angle) * radius, height, std::sin(angle) * radius);
+			// yaw 0 looks down +x, the camera looks back at the center
+			key.State.Yaw = glm::degrees(angle) + 180.0f;
+			key.State.Pitch = -glm::degrees(std::atan2(height, radius));
+			key.State.Zoom = ZOOM;
+			keys.push_back(key);
+		}
+	}
+
+	bool Empty() const { return keys.empty(); }
+	float GetDuration() const { return keys.empty() ? 0.0f : keys.back().Time; }
+
+	// clamps to the first and last key
+	CameraState Sample(float time) const
+	{
+		if (keys.size() == 1 || time <= keys.front().Time)
+			return keys.front().State;
+		if (time >= keys.back().Time)
+			return keys.back().State;
+
+		// first key after time
+		unsigned int next = 1;
+		while (keys[next].Time <= time)
+			next++;
+		const CameraKey& a = keys[next - 1];
+		const CameraKey& b = keys[next];
+		const CameraKey& before = keys[next > 1 ? next - 2 : next - 1];
+		const CameraKey& after = keys[std::min<size_t>(next + 1, keys.size() - 1)];
+		float t = (time - a.Time) / (b.Time - a.Time);
+
+		CameraState state;
+		float t2 = t * t;
+		float t3 = t2 * t;
+		state.Position = 0.5f * ((2.0f * a.State.Position) + (b.State.Position - before.State.Position) * t +
+			(2.0f * before.State.Position - 5.0f * a.State.Position + 4.0f * b.State.Position - after.State.Position) * t2 +
+			(3.0f * a.State.Position - before.State.Position - 3.0f * b.State.Position + after.State.Position) * t3);
+		state.Yaw = a.State.Yaw + (b.State.Yaw - a.State.Yaw) * t;
+		state.Pitch = a.State.Pitch + (b.State.Pitch - a.State.Pitch) * t;
+		state.Zoom = a.State.Zoom + (b.State.Zoom - a.State.Zoom) * t;
+		return state;
+	}
+
+private:
+	std::vector<CameraKey> keys;
+};
+
+#endif // !CAMERA_PATH_H
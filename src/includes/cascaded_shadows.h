@@ -0,0 +1,370 @@
+#ifndef CASCADED_SHADOWS_H
+#define CASCADED_SHADOWS_H
+
+#include <glad/glad.h>
+#include <glm.hpp>
+#include <gtc/matrix_transform.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "command_list.h"
+#include "gpu_timer.h"
+#include "mesh.h"
+#include "shader.h"
+#include "stats.h"
+#include "LogHelper.h"
+
+// cached cascades cover this much more than their slice
+const float SHADOW_CACHE_MARGIN = 1.5f;
+// how far towards the light casters outside a cascade are still kept
+const float SHADOW_CASTER_DISTANCE = 50.0f;
+
+// uniform names for Record, which keeps the pointers
+const char* const SHADOW_LIGHT_SPACE_NAMES[] = { "lightSpace[0]", "lightSpace[1]", "lightSpace[2]", "lightSpace[3]" };
+const char* const SHADOW_SPLIT_NAMES[] = { "cascadeSplits[0]", "cascadeSplits[1]", "cascadeSplits[2]", "cascadeSplits[3]" };
+const char* const SHADOW_TEXEL_NAMES[] = { "cascadeTexel[0]", "cascadeTexel[1]", "cascadeTexel[2]", "cascadeTexel[3]" };
+
+struct ShadowCaster
+{
+	// object space bounds and where they end up
+	AABB Bounds;
+	glm::mat4 Transform;
+	// static casters are the only ones drawn into cached cascades
+	bool Static;
+};
+
+// Cascaded shadow maps for the directional light, one layer of a depth texture
+// array per cascade, sampled by light_clustered.fsc and deferred_lighting.fsc.
+// Splits only depend on the near plane and the shadow distance, and every
+// cascade is fit to the bounding sphere of its frustum slice with the center
+// snapped to whole texels, so neither the size nor the texel grid of a cascade
+// changes while the camera moves or turns and the edges don't shimmer.
+// The cascades from FIRST_CACHED_CASCADE on cover a larger area than needed and
+// hold static casters only. They are re-rendered when the light or the static
+// casters change or the camera leaves the covered area, not every frame.
+class CascadedShadowMaps
+{
+public:
+	static const int CASCADES = 4;
+	static const int FIRST_CACHED_CASCADE = 2;
+	static const int RESOLUTION = 1024;
+	// after the cluster light buffers on 12-14
+	static const unsigned int TEXTURE_UNIT = 15;
+
+	~CascadedShadowMaps()
+	{
+		if (fbo)
+		{
+			glDeleteFramebuffers(1, &fbo);
+			glDeleteTextures(1, &depthTexture);
+		}
+	}
+
+	void Create()
+	{
+		GLCall(glGenTextures(1, &depthTexture));
+		GLCall(glBindTexture(GL_TEXTURE_2D_ARRAY, depthTexture));
+		GLCall(glTexImage3D(GL_TEXTURE_2D_ARRAY, 0, GL_DEPTH_COMPONENT24, RESOLUTION, RESOLUTION, CASCADES, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL));
+		// hardware 2x2 pcf through a shadow sampler
+		GLCall(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
+		GLCall(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+		GLCall(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+		GLCall(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+		GLCall(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE));
+		GLCall(glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL));
+		GLCall(glBindTexture(GL_TEXTURE_2D_ARRAY, 0));
+
+		GLCall(glGenFramebuffers(1, &fbo));
+		GLCall(glBindFramebuffer(GL_FRAMEBUFFER, fbo));
+		GLCall(glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depthTexture, 0, 0));
+		GLCall(glDrawBuffer(GL_NONE));
+		GLCall(glReadBuffer(GL_NONE));
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			LOG("ERROR::FRAMEBUFFER:: Shadow framebuffer is not complete!");
+		GLCall(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+	}
+
+	// direction the light travels in
+	void SetLightDirection(const glm::vec3& direction)
+	{
+		glm::vec3 normalized = glm::normalize(direction);
+		if (normalized == lightDirection)
+			return;
+
+		lightDirection = normalized;
+		glm::vec3 up = std::abs(lightDirection.y) > 0.99f ? glm::vec3(0.0f, 0.0f, 1.0f) : glm::vec3(0.0f, 1.0f, 0.0f);
+		lightView = glm::lookAt(glm::vec3(0.0f), lightDirection, up);
+		InvalidateCache();
+	}
+
+	void SetShadowDistance(float nearPlane, float distance)
+	{
+		if (nearPlane == this->nearPlane && distance == shadowDistance)
+			return;
+
+		this->nearPlane = nearPlane;
+		shadowDistance = distance;
+		// practical split scheme, mostly logarithmic
+		const float lambda = 0.8f;
+		for (int i = 0; i < CASCADES; i++)
+		{
+			float t = static_cast<float>(i + 1) / CASCADES;
+			float logSplit = nearPlane * std::pow(distance / nearPlane, t);
+			float linearSplit = nearPlane + (distance - nearPlane) * t;
+			splits[i] = lambda * logSplit + (1.0f - lambda) * linearSplit;
+		}
+		InvalidateCache();
+	}
+
+	void InvalidateCache()
+	{
+		for (int i = 0; i < CASCADES; i++)
+		{
+			cascades[i].Valid = false;
+		}
+	}
+
+	// fits the cascades to the camera and culls the casters of the ones that
+	// need to be drawn, cpu only. Bind/Record pick up the new matrices after this.
+	void Update(const glm::mat4& view, float fovY, float aspect, const std::vector<ShadowCaster>& casters)
+	{
+		CpuTimer cullTimer;
+		uint64_t staticHash = HashStatic(casters);
+		if (staticHash != lastStaticHash)
+		{
+			lastStaticHash = staticHash;
+			InvalidateCache();
+		}
+
+		glm::mat4 inverseView = glm::inverse(view);
+		float tanY = std::tan(fovY * 0.5f);
+		float tanX = tanY * aspect;
+
+		CulledCount = 0;
+		CascadesRendered = 0;
+		for (int i = 0; i < CASCADES; i++)
+		{
+			Cascade& cascade = cascades[i];
+			cascade.Render = false;
+
+			// bounding sphere of the slice, only depends on the split distances and the fov
+			float sliceNear = i == 0 ? nearPlane : splits[i - 1];
+			float sliceFar = splits[i];
+			float diagonal = tanX * tanX + tanY * tanY;
+			float center = std::min(0.5f * (sliceFar + sliceNear) * (1.0f + diagonal), sliceFar);
+			float radius = std::sqrt((sliceFar - center) * (sliceFar - center) + sliceFar * sliceFar * diagonal);
+			// rounded up so float noise can't change the texel size
+			radius = std::ceil(radius * 16.0f) / 16.0f;
+			glm::vec3 sphereCenter = glm::vec3(lightView * inverseView * glm::vec4(0.0f, 0.0f, -center, 1.0f));
+
+			bool cached = i >= FIRST_CACHED_CASCADE;
+			if (cached && cascade.Valid && IsCovered(cascade, sphereCenter, radius))
+				continue;
+
+			float extent = cached ? radius * SHADOW_CACHE_MARGIN : radius;
+			float texel = 2.0f * extent / RESOLUTION;
+			cascade.Center = glm::vec3(std::floor(sphereCenter.x / texel) * texel, std::floor(sphereCenter.y / texel) * texel, sphereCenter.z);
+			cascade.Extent = extent;
+			cascade.Texel = texel;
+			// light space looks down -z, casters up to SHADOW_CASTER_DISTANCE towards the light are kept
+			cascade.Projection = glm::ortho(cascade.Center.x - extent, cascade.Center.x + extent,
+				cascade.Center.y - extent, cascade.Center.y + extent,
+				-cascade.Center.z - extent - SHADOW_CASTER_DISTANCE, -cascade.Center.z + extent);
+			cascade.LightSpace = cascade.Projection * lightView;
+			cascade.Valid = true;
+			cascade.Render = true;
+
+			// per cascade culling in light space
+			cascade.Casters.clear();
+			for (unsigned int c = 0; c < casters.size(); c++)
+			{
+				if (cached && !casters[c].Static)
+					continue;
+
+				AABB bounds = TransformBounds(casters[c].Bounds, lightView * casters[c].Transform);
+				bool inside = bounds.Max.x >= cascade.Center.x - extent && bounds.Min.x <= cascade.Center.x + extent &&
+					bounds.Max.y >= cascade.Center.y - extent && bounds.Min.y <= cascade.Center.y + extent &&
+					// only receivers further away than the caster can be shadowed by it
+					bounds.Max.z >= cascade.Center.z - extent;
+				if (inside)
+					cascade.Casters.push_back(c);
+				else
+					CulledCount++;
+			}
+			CascadesRendered++;
+		}
+		CullTimeMs = cullTimer.ElapsedMs();
+	}
+
+	// draws the cascades picked by Update, drawCaster gets the caster index and
+	// only has to set "model" and draw. The current framebuffer, viewport, face
+	// culling, depth clamp and polygon offset are restored afterwards.
+	void Render(Shader& depthShader, const std::function<void(unsigned int)>& drawCaster)
+	{
+		DrawCount = 0;
+		if (CascadesRendered == 0)
+			return;
+
+		GLint previousFramebuffer = 0;
+		GLint previousViewport[4];
+		glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previousFramebuffer);
+		glGetIntegerv(GL_VIEWPORT, previousViewport);
+		GLboolean previousCull = glIsEnabled(GL_CULL_FACE);
+		GLboolean previousDepthClamp = glIsEnabled(GL_DEPTH_CLAMP);
+		GLboolean previousOffset = glIsEnabled(GL_POLYGON_OFFSET_FILL);
+		GLfloat previousOffsetFactor = 0.0f;
+		GLfloat previousOffsetUnits = 0.0f;
+		glGetFloatv(GL_POLYGON_OFFSET_FACTOR, &previousOffsetFactor);
+		glGetFloatv(GL_POLYGON_OFFSET_UNITS, &previousOffsetUnits);
+
+		timer.Begin();
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glViewport(0, 0, RESOLUTION, RESOLUTION);
+		glDisable(GL_CULL_FACE);
+		// casters in front of the near plane are flattened onto it instead of clipped
+		glEnable(GL_DEPTH_CLAMP);
+		glEnable(GL_POLYGON_OFFSET_FILL);
+		glPolygonOffset(1.5f, 2.0f);
+
+		depthShader.use();
+		depthShader.setMat4("view", lightView);
+		for (int i = 0; i < CASCADES; i++)
+		{
+			Cascade& cascade = cascades[i];
+			if (!cascade.Render)
+				continue;
+
+			glFramebufferTextureLayer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, depthTexture, 0, i);
+			glClear(GL_DEPTH_BUFFER_BIT);
+			depthShader.setMat4("projection", cascade.Projection);
+			for (unsigned int c = 0; c < cascade.Casters.size(); c++)
+			{
+				drawCaster(cascade.Casters[c]);
+			}
+			DrawCount += static_cast<unsigned int>(cascade.Casters.size());
+		}
+
+		SetEnabled(GL_POLYGON_OFFSET_FILL, previousOffset);
+		glPolygonOffset(previousOffsetFactor, previousOffsetUnits);
+		SetEnabled(GL_DEPTH_CLAMP, previousDepthClamp);
+		SetEnabled(GL_CULL_FACE, previousCull);
+		glBindFramebuffer(GL_FRAMEBUFFER, previousFramebuffer);
+		glViewport(previousViewport[0], previousViewport[1], previousViewport[2], previousViewport[3]);
+		timer.End();
+	}
+
+	void Bind(Shader& shader) const
+	{
+		glActiveTexture(GL_TEXTURE0 + TEXTURE_UNIT);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, depthTexture);
+		glActiveTexture(GL_TEXTURE0);
+
+		shader.setInt("shadowMap", TEXTURE_UNIT);
+		for (int i = 0; i < CASCADES; i++)
+		{
+			shader.setMat4(SHADOW_LIGHT_SPACE_NAMES[i], cascades[i].LightSpace);
+			shader.setFloat(SHADOW_SPLIT_NAMES[i], splits[i]);
+			shader.setFloat(SHADOW_TEXEL_NAMES[i], cascades[i].Texel);
+		}
+	}
+
+	unsigned int GetDepthTexture() const { return depthTexture; }
+
+	void Record(CommandList& list) const
+	{
+		list.BindTexture(GL_TEXTURE0 + TEXTURE_UNIT, GL_TEXTURE_2D_ARRAY, depthTexture);
+		list.SetInt("shadowMap", TEXTURE_UNIT);
+		for (int i = 0; i < CASCADES; i++)
+		{
+			list.SetMat4(SHADOW_LIGHT_SPACE_NAMES[i], cascades[i].LightSpace);
+			list.SetFloat(SHADOW_SPLIT_NAMES[i], splits[i]);
+			list.SetFloat(SHADOW_TEXEL_NAMES[i], cascades[i].Texel);
+		}
+	}
+
+	void ReportStats(FrameStats& stats) const
+	{
+		stats.Set("Shadow cascades drawn", static_cast<float>(CascadesRendered));
+		stats.Set("Shadow draws", static_cast<float>(DrawCount));
+		stats.Set("Shadow casters culled", static_cast<float>(CulledCount));
+		stats.Set("Shadow cull ms", CullTimeMs);
+		stats.Set("Shadow GPU ms", timer.ElapsedMs);
+	}
+
+	unsigned int CascadesRendered = 0;
+	unsigned int DrawCount = 0;
+	unsigned int CulledCount = 0;
+	float CullTimeMs = 0.0f;
+
+private:
+	struct Cascade
+	{
+		// light space center of the covered square and its half size
+		glm::vec3 Center = glm::vec3(0.0f);
+		float Extent = 0.0f;
+		// world size of one shadow map texel
+		float Texel = 0.0f;
+		glm::mat4 Projection = glm::mat4(1.0f);
+		glm::mat4 LightSpace = glm::mat4(1.0f);
+		bool Valid = false;
+		bool Render = false;
+		std::vector<unsigned int> Casters;
+	};
+
+	unsigned int fbo = 0;
+	unsigned int depthTexture = 0;
+	glm::vec3 lightDirection = glm::vec3(0.0f);
+	glm::mat4 lightView = glm::mat4(1.0f);
+	float nearPlane = 0.0f;
+	float shadowDistance = 0.0f;
+	float splits[CASCADES] = {};
+	Cascade cascades[CASCADES];
+	uint64_t lastStaticHash = 0;
+	GpuTimer timer;
+
+	static void SetEnabled(GLenum capability, GLboolean enabled)
+	{
+		if (enabled)
+			glEnable(capability);
+		else
+			glDisable(capability);
+	}
+
+	// true while the slice sphere is still inside what the cascade was rendered for
+	static bool IsCovered(const Cascade& cascade, const glm::vec3& center, float radius)
+	{
+		glm::vec3 offset = glm::abs(center - cascade.Center);
+		return offset.x + radius <= cascade.Extent && offset.y + radius <= cascade.Extent &&
+			offset.z + radius <= cascade.Extent;
+	}
+
+	// FNV-1a over the static casters, a change means the cached cascades are stale
+	static uint64_t HashStatic(const std::vector<ShadowCaster>& casters)
+	{
+		uint64_t hash = 14695981039346656037ull;
+		for (unsigned int i = 0; i < casters.size(); i++)
+		{
+			if (!casters[i].Static)
+				continue;
+
+			const unsigned char* bytes = reinterpret_cast<const unsigned char*>(&casters[i].Transform);
+			for (unsigned int b = 0; b < sizeof(glm::mat4); b++)
+			{
+				hash = (hash ^ bytes[b]) * 1099511628211ull;
+			}
+			bytes = reinterpret_cast<const unsigned char*>(&casters[i].Bounds);
+			for (unsigned int b = 0; b < sizeof(AABB); b++)
+			{
+				hash = (hash ^ bytes[b]) * 1099511628211ull;
+			}
+			hash = (hash ^ i) * 1099511628211ull;
+		}
+		return hash;
+	}
+};
+
+#endif // !CASCADED_SHADOWS_H
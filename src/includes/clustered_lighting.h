@@ -0,0 +1,497 @@
+#ifndef CLUSTERED_LIGHTING_H
+#define CLUSTERED_LIGHTING_H
+
+#include <glad/glad.h>
+#include <glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+#include "command_list.h"
+#include "job_system.h"
+#include "shader.h"
+#include "simd.h"
+#include "stats.h"
+
+enum LightType
+{
+	LIGHT_POINT,
+	LIGHT_SPOT
+};
+
+struct Light
+{
+	glm::vec3 Position;
+	// nothing is lit beyond this distance
+	float Range;
+	glm::vec3 Color;
+	LightType Type;
+	// spot lights only
+	glm::vec3 Direction;
+	float CosInnerCutOff;
+	float CosOuterCutOff;
+};
+
+// fills lights with count random point and spot lights around the demo scene
+inline void GenerateTestLights(std::vector<Light>& lights, unsigned int count, unsigned int seed = 1234)
+{
+	std::mt19937 random(seed);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+
+	lights.resize(count);
+	for (unsigned int i = 0; i < count; i++)
+	{
+		Light& light = lights[i];
+		light.Position = glm::vec3(unit(random) * 10.0f - 5.0f, unit(random) * 2.0f - 0.4f, unit(random) * 10.0f - 5.0f);
+		light.Range = 0.5f + unit(random) * 1.5f;
+		light.Color = glm::vec3(unit(random), unit(random), unit(random)) * 2.0f;
+		light.Type = (i % 4 == 3) ? LIGHT_SPOT : LIGHT_POINT;
+		light.Direction = glm::vec3(0.0f, -1.0f, 0.0f);
+		light.CosInnerCutOff = std::cos(glm::radians(20.0f));
+		light.CosOuterCutOff = std::cos(glm::radians(30.0f));
+	}
+}
+
+// Clustered forward shading. The view frustum is cut into CLUSTERS_X *
+// CLUSTERS_Y screen tiles and CLUSTERS_Z exponential depth slices, every
+// cluster gets the list of lights whose range sphere touches it. Assign()
+// only does cpu work (SSE light transforms, one job per depth slice), Upload()
+// puts the result into three buffer textures read by clustered_lights.glsl:
+//   lightGrid    RG32UI, offset and count into lightIndices per cluster
+//   lightIndices R32UI, light numbers
+//   lightData    RGBA32F, 4 texels per light
+class ClusteredLighting
+{
+public:
+	static const unsigned int CLUSTERS_X = 16;
+	static const unsigned int CLUSTERS_Y = 9;
+	static const unsigned int CLUSTERS_Z = 24;
+	static const unsigned int CLUSTER_COUNT = CLUSTERS_X * CLUSTERS_Y * CLUSTERS_Z;
+
+	// texture units used by Bind/Record, after the skybox on 11
+	static const unsigned int GRID_UNIT = 12;
+	static const unsigned int INDEX_UNIT = 13;
+	static const unsigned int LIGHT_UNIT = 14;
+
+	~ClusteredLighting()
+	{
+		if (buffers[0])
+		{
+			glDeleteTextures(3, textures);
+			glDeleteBuffers(3, buffers);
+		}
+	}
+
+	void SetJobSystem(JobSystem* jobs) { this->jobs = jobs; }
+
+	std::vector<Light>& GetLights() { return lights; }
+
+	// fovY in radians, same values as the projection matrix, width and height of the viewport
+	void Assign(const glm::mat4& view, float fovY, int width, int height, float nearPlane, float farPlane)
+	{
+		float projY = 1.0f / std::tan(fovY * 0.5f);
+		Assign(view, projY * height / width, projY, glm::vec2(0.0f), width, height, nearPlane, farPlane);
+	}
+
+	// any perspective projection, also off-center ones like the tiles of a poster
+	void Assign(const glm::mat4& view, const glm::mat4& projection, int width, int height, float nearPlane, float farPlane)
+	{
+		Assign(view, projection[0][0], projection[1][1], glm::vec2(-projection[2][0], -projection[2][1]), width, height, nearPlane, farPlane);
+	}
+
+	// ndc = view.xy / depth * (projX, projY) + offset
+	void Assign(const glm::mat4& view, float projX, float projY, const glm::vec2& offset, int width, int height, float nearPlane, float farPlane)
+	{
+		CpuTimer timer;
+		SetupClusters(projX, projY, offset, width, height, nearPlane, farPlane);
+		TransformLights(view);
+
+		if (jobs)
+		{
+			jobs->ParallelFor(CLUSTERS_Z, 1, [this](unsigned int begin, unsigned int end)
+			{
+				for (unsigned int slice = begin; slice < end; slice++)
+					AssignSlice(slice);
+			});
+		}
+		else
+		{
+			for (unsigned int slice = 0; slice < CLUSTERS_Z; slice++)
+				AssignSlice(slice);
+		}
+		MergeSlices();
+
+		AssignTimeMs = timer.ElapsedMs();
+	}
+
+	void Upload()
+	{
+		if (!buffers[0])
+		{
+			glGenBuffers(3, buffers);
+			glGenTextures(3, textures);
+		}
+
+		lightData.resize(std::max<size_t>(lights.size(), 1) * 16);
+		for (unsigned int i = 0; i < lights.size(); i++)
+		{
+			const Light& light = lights[i];
+			float* texels = &lightData[i * 16];
+			texels[0] = light.Position.x; texels[1] = light.Position.y; texels[2] = light.Position.z; texels[3] = light.Range;
+			texels[4] = light.Color.x; texels[5] = light.Color.y; texels[6] = light.Color.z; texels[7] = static_cast<float>(light.Type);
+			texels[8] = light.Direction.x; texels[9] = light.Direction.y; texels[10] = light.Direction.z; texels[11] = light.CosOuterCutOff;
+			texels[12] = light.CosInnerCutOff; texels[13] = 0.0f; texels[14] = 0.0f; texels[15] = 0.0f;
+		}
+		if (indices.empty())
+			indices.push_back(0);
+
+		UploadBuffer(0, GL_RG32UI, grid.data(), grid.size() * sizeof(uint32_t));
+		UploadBuffer(1, GL_R32UI, indices.data(), indices.size() * sizeof(uint32_t));
+		UploadBuffer(2, GL_RGBA32F, lightData.data(), lightData.size() * sizeof(float));
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+	}
+
+	// sets the samplers and cluster uniforms of a light_clustered program, shader has to be in use
+	void Bind(Shader& shader) const
+	{
+		const GLenum units[3] = { GRID_UNIT, INDEX_UNIT, LIGHT_UNIT };
+		for (int i = 0; i < 3; i++)
+		{
+			glActiveTexture(GL_TEXTURE0 + units[i]);
+			glBindTexture(GL_TEXTURE_BUFFER, textures[i]);
+		}
+		glActiveTexture(GL_TEXTURE0);
+
+		shader.setInt("lightGrid", GRID_UNIT);
+		shader.setInt("lightIndices", INDEX_UNIT);
+		shader.setInt("lightData", LIGHT_UNIT);
+		shader.setVec3("clusterScale", clusterScale);
+		shader.setFloat("clusterBias", clusterBias);
+	}
+
+	void Record(CommandList& list) const
+	{
+		list.BindTexture(GL_TEXTURE0 + GRID_UNIT, GL_TEXTURE_BUFFER, textures[0]);
+		list.BindTexture(GL_TEXTURE0 + INDEX_UNIT, GL_TEXTURE_BUFFER, textures[1]);
+		list.BindTexture(GL_TEXTURE0 + LIGHT_UNIT, GL_TEXTURE_BUFFER, textures[2]);
+		list.SetInt("lightGrid", GRID_UNIT);
+		list.SetInt("lightIndices", INDEX_UNIT);
+		list.SetInt("lightData", LIGHT_UNIT);
+		list.SetVec3("clusterScale", clusterScale);
+		list.SetFloat("clusterBias", clusterBias);
+	}
+
+	// two entries per cluster: offset into GetIndices() and light count
+	const std::vector<uint32_t>& GetGrid() const { return grid; }
+	const std::vector<uint32_t>& GetIndices() const { return indices; }
+
+	void ReportStats(FrameStats& stats) const
+	{
+		stats.Set("Lights", static_cast<float>(lights.size()));
+		stats.Set("Light assign ms", AssignTimeMs);
+		stats.Set("Light indices", static_cast<float>(IndexCount));
+		stats.Set("Max lights per cluster", static_cast<float>(MaxLightsPerCluster));
+	}
+
+	float AssignTimeMs = 0.0f;
+	unsigned int IndexCount = 0;
+	unsigned int MaxLightsPerCluster = 0;
+
+private:
+	struct ClusterBounds
+	{
+		glm::vec3 Min;
+		glm::vec3 Max;
+	};
+
+	// lights touching one depth slice, filled by its own job
+	struct Slice
+	{
+		std::vector<uint16_t> pairTiles;
+		std::vector<uint32_t> pairLights;
+		std::vector<uint32_t> tileCounts;
+		std::vector<uint32_t> tileOffsets;
+		std::vector<uint32_t> sorted;
+	};
+
+	JobSystem* jobs = nullptr;
+	std::vector<Light> lights;
+
+	// view space light data, structure of arrays so four lights go through SSE at once
+	std::vector<float> viewX, viewY, viewZ, radius;
+	// the world positions they come from, kept so a frame doesn't allocate
+	std::vector<float> worldX, worldY, worldZ;
+	// per light: slice range and screen tile rectangle
+	std::vector<int> firstSlice, lastSlice;
+	std::vector<uint8_t> tileX0, tileX1, tileY0, tileY1;
+
+	ClusterBounds clusters[CLUSTER_COUNT];
+	float projectionX = 0.0f, projectionY = 0.0f;
+	glm::vec2 projectionOffset = glm::vec2(0.0f);
+	float nearPlane = 0.0f, farPlane = 0.0f;
+	int viewportWidth = 0, viewportHeight = 0;
+	float sliceDepths[CLUSTERS_Z + 1];
+	glm::vec3 clusterScale = glm::vec3(0.0f);
+	float clusterBias = 0.0f;
+
+	Slice slices[CLUSTERS_Z];
+	std::vector<uint32_t> grid;
+	std::vector<uint32_t> indices;
+	std::vector<float> lightData;
+
+	GLuint buffers[3] = {};
+	GLuint textures[3] = {};
+
+	void SetupClusters(float projX, float projY, const glm::vec2& offset, int width, int height, float nearPlane, float farPlane)
+	{
+		if (projX == projectionX && projY == projectionY && offset == projectionOffset && nearPlane == this->nearPlane && farPlane == this->farPlane &&
+			width == viewportWidth && height == viewportHeight)
+			return;
+
+		viewportWidth = width;
+		viewportHeight = height;
+
+		projectionX = projX;
+		projectionY = projY;
+		projectionOffset = offset;
+		this->nearPlane = nearPlane;
+		this->farPlane = farPlane;
+
+		for (unsigned int z = 0; z <= CLUSTERS_Z; z++)
+		{
+			sliceDepths[z] = nearPlane * std::pow(farPlane / nearPlane, static_cast<float>(z) / CLUSTERS_Z);
+		}
+
+		// tile = gl_FragCoord.xy * scale.xy, slice = log(depth) * scale.z + bias
+		float logRatio = std::log(farPlane / nearPlane);
+		clusterScale = glm::vec3(static_cast<float>(CLUSTERS_X) / width, static_cast<float>(CLUSTERS_Y) / height, CLUSTERS_Z / logRatio);
+		clusterBias = -static_cast<float>(CLUSTERS_Z) * std::log(nearPlane) / logRatio;
+
+		for (unsigned int z = 0; z < CLUSTERS_Z; z++)
+		{
+			float depthNear = sliceDepths[z];
+			float depthFar = sliceDepths[z + 1];
+			for (unsigned int y = 0; y < CLUSTERS_Y; y++)
+			{
+				float ndcY0 = -1.0f + 2.0f * y / CLUSTERS_Y - offset.y;
+				float ndcY1 = -1.0f + 2.0f * (y + 1) / CLUSTERS_Y - offset.y;
+				for (unsigned int x = 0; x < CLUSTERS_X; x++)
+				{
+					float ndcX0 = -1.0f + 2.0f * x / CLUSTERS_X - offset.x;
+					float ndcX1 = -1.0f + 2.0f * (x + 1) / CLUSTERS_X - offset.x;
+
+					// the cluster is a frustum piece, its corners are at both slice depths,
+					// ndc is relative to the view axis here which an off-center projection moves
+					ClusterBounds& bounds = clusters[(z * CLUSTERS_Y + y) * CLUSTERS_X + x];
+					bounds.Min.x = std::min(ndcX0 * depthNear, ndcX0 * depthFar) / projX;
+					bounds.Max.x = std::max(ndcX1 * depthNear, ndcX1 * depthFar) / projX;
+					bounds.Min.y = std::min(ndcY0 * depthNear, ndcY0 * depthFar) / projY;
+					bounds.Max.y = std::max(ndcY1 * depthNear, ndcY1 * depthFar) / projY;
+					bounds.Min.z = -depthFar;
+					bounds.Max.z = -depthNear;
+				}
+			}
+		}
+	}
+
+	void TransformLights(const glm::mat4& view)
+	{
+		unsigned int count = static_cast<unsigned int>(lights.size());
+		// padded to a multiple of four for the SSE loop
+		unsigned int padded = (count + 3) & ~3u;
+		// the padding lanes are transformed too, they only have to be numbers
+		worldX.assign(padded, 0.0f);
+		worldY.assign(padded, 0.0f);
+		worldZ.assign(padded, 0.0f);
+		viewX.resize(padded);
+		viewY.resize(padded);
+		viewZ.resize(padded);
+		radius.resize(padded);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			worldX[i] = lights[i].Position.x;
+			worldY[i] = lights[i].Position.y;
+			worldZ[i] = lights[i].Position.z;
+			radius[i] = lights[i].Range;
+		}
+
+		const float* m = &view[0][0];
+#ifdef USE_SSE
+		for (unsigned int i = 0; i < padded; i += 4)
+		{
+			__m128 x = _mm_loadu_ps(&worldX[i]);
+			__m128 y = _mm_loadu_ps(&worldY[i]);
+			__m128 z = _mm_loadu_ps(&worldZ[i]);
+			for (int row = 0; row < 3; row++)
+			{
+				__m128 r = _mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(m[row])), _mm_mul_ps(y, _mm_set1_ps(m[4 + row])));
+				r = _mm_add_ps(r, _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(m[8 + row])), _mm_set1_ps(m[12 + row])));
+				float* out = row == 0 ? &viewX[i] : (row == 1 ? &viewY[i] : &viewZ[i]);
+				_mm_storeu_ps(out, r);
+			}
+		}
+#else
+		for (unsigned int i = 0; i < padded; i++)
+		{
+			viewX[i] = m[0] * worldX[i] + m[4] * worldY[i] + m[8] * worldZ[i] + m[12];
+			viewY[i] = m[1] * worldX[i] + m[5] * worldY[i] + m[9] * worldZ[i] + m[13];
+			viewZ[i] = m[2] * worldX[i] + m[6] * worldY[i] + m[10] * worldZ[i] + m[14];
+		}
+#endif
+
+		firstSlice.resize(count);
+		lastSlice.resize(count);
+		tileX0.resize(count);
+		tileX1.resize(count);
+		tileY0.resize(count);
+		tileY1.resize(count);
+
+		if (jobs)
+		{
+			jobs->ParallelFor(count, 256, [this](unsigned int begin, unsigned int end) { BoundLights(begin, end); });
+		}
+		else
+		{
+			BoundLights(0, count);
+		}
+	}
+
+	// conservative slice range and tile rectangle of every light sphere
+	void BoundLights(unsigned int begin, unsigned int end)
+	{
+		for (unsigned int i = begin; i < end; i++)
+		{
+			float depthMin = -viewZ[i] - radius[i];
+			float depthMax = -viewZ[i] + radius[i];
+			if (depthMax < nearPlane || depthMin > farPlane)
+			{
+				firstSlice[i] = 1;
+				lastSlice[i] = 0;
+				continue;
+			}
+
+			depthMin = std::max(depthMin, nearPlane);
+			depthMax = std::min(depthMax, farPlane);
+			firstSlice[i] = SliceOf(depthMin);
+			lastSlice[i] = SliceOf(depthMax);
+
+			// extremes of x / depth over the box around the sphere are at its corners
+			float x0 = viewX[i] - radius[i], x1 = viewX[i] + radius[i];
+			float y0 = viewY[i] - radius[i], y1 = viewY[i] + radius[i];
+			float ndcX0 = std::min(x0 / depthMin, x0 / depthMax) * projectionX + projectionOffset.x;
+			float ndcX1 = std::max(x1 / depthMin, x1 / depthMax) * projectionX + projectionOffset.x;
+			float ndcY0 = std::min(y0 / depthMin, y0 / depthMax) * projectionY + projectionOffset.y;
+			float ndcY1 = std::max(y1 / depthMin, y1 / depthMax) * projectionY + projectionOffset.y;
+
+			tileX0[i] = static_cast<uint8_t>(TileOf(ndcX0, CLUSTERS_X));
+			tileX1[i] = static_cast<uint8_t>(TileOf(ndcX1, CLUSTERS_X));
+			tileY0[i] = static_cast<uint8_t>(TileOf(ndcY0, CLUSTERS_Y));
+			tileY1[i] = static_cast<uint8_t>(TileOf(ndcY1, CLUSTERS_Y));
+			if (ndcX1 < -1.0f || ndcX0 > 1.0f || ndcY1 < -1.0f || ndcY0 > 1.0f)
+			{
+				firstSlice[i] = 1;
+				lastSlice[i] = 0;
+			}
+		}
+	}
+
+	int SliceOf(float depth) const
+	{
+		int slice = static_cast<int>(std::log(depth) * clusterScale.z + clusterBias);
+		return std::max(0, std::min(slice, static_cast<int>(CLUSTERS_Z) - 1));
+	}
+
+	static int TileOf(float ndc, unsigned int tiles)
+	{
+		int tile = static_cast<int>(std::floor((ndc * 0.5f + 0.5f) * tiles));
+		return std::max(0, std::min(tile, static_cast<int>(tiles) - 1));
+	}
+
+	void AssignSlice(unsigned int z)
+	{
+		Slice& slice = slices[z];
+		slice.pairTiles.clear();
+		slice.pairLights.clear();
+		slice.tileCounts.assign(CLUSTERS_X * CLUSTERS_Y, 0);
+
+		const ClusterBounds* sliceClusters = &clusters[z * CLUSTERS_X * CLUSTERS_Y];
+		int sliceIndex = static_cast<int>(z);
+		unsigned int count = static_cast<unsigned int>(lights.size());
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (sliceIndex < firstSlice[i] || sliceIndex > lastSlice[i])
+				continue;
+
+			glm::vec3 center(viewX[i], viewY[i], viewZ[i]);
+			float radiusSquared = radius[i] * radius[i];
+			for (unsigned int y = tileY0[i]; y <= tileY1[i]; y++)
+			{
+				for (unsigned int x = tileX0[i]; x <= tileX1[i]; x++)
+				{
+					unsigned int tile = y * CLUSTERS_X + x;
+					const ClusterBounds& bounds = sliceClusters[tile];
+					glm::vec3 closest = glm::clamp(center, bounds.Min, bounds.Max);
+					glm::vec3 d = center - closest;
+					if (glm::dot(d, d) > radiusSquared)
+						continue;
+
+					slice.pairTiles.push_back(static_cast<uint16_t>(tile));
+					slice.pairLights.push_back(i);
+					slice.tileCounts[tile]++;
+				}
+			}
+		}
+
+		// counting sort by tile, lights stay in ascending order inside a tile
+		std::vector<uint32_t>& offsets = slice.tileOffsets;
+		offsets.resize(CLUSTERS_X * CLUSTERS_Y);
+		uint32_t offset = 0;
+		for (unsigned int t = 0; t < offsets.size(); t++)
+		{
+			offsets[t] = offset;
+			offset += slice.tileCounts[t];
+		}
+		slice.sorted.resize(slice.pairLights.size());
+		for (unsigned int p = 0; p < slice.pairLights.size(); p++)
+		{
+			slice.sorted[offsets[slice.pairTiles[p]]++] = slice.pairLights[p];
+		}
+	}
+
+	void MergeSlices()
+	{
+		grid.resize(CLUSTER_COUNT * 2);
+		indices.clear();
+		MaxLightsPerCluster = 0;
+		for (unsigned int z = 0; z < CLUSTERS_Z; z++)
+		{
+			const Slice& slice = slices[z];
+			uint32_t offset = static_cast<uint32_t>(indices.size());
+			indices.insert(indices.end(), slice.sorted.begin(), slice.sorted.end());
+			for (unsigned int t = 0; t < CLUSTERS_X * CLUSTERS_Y; t++)
+			{
+				unsigned int cluster = z * CLUSTERS_X * CLUSTERS_Y + t;
+				grid[cluster * 2] = offset;
+				grid[cluster * 2 + 1] = slice.tileCounts[t];
+				offset += slice.tileCounts[t];
+				MaxLightsPerCluster = std::max(MaxLightsPerCluster, slice.tileCounts[t]);
+			}
+		}
+		IndexCount = static_cast<unsigned int>(indices.size());
+	}
+
+	void UploadBuffer(int i, GLenum format, const void* data, size_t size)
+	{
+		glBindBuffer(GL_TEXTURE_BUFFER, buffers[i]);
+		// new storage with the data in one call, the gpu may still read the old one
+		glBufferData(GL_TEXTURE_BUFFER, size, data, GL_STREAM_DRAW);
+		glBindTexture(GL_TEXTURE_BUFFER, textures[i]);
+		glTexBuffer(GL_TEXTURE_BUFFER, format, buffers[i]);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+	}
+};
+
+#endif // !CLUSTERED_LIGHTING_H
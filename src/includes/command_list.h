@@ -0,0 +1,431 @@
+#ifndef COMMAND_LIST_H
+#define COMMAND_LIST_H
+
+#include <glad/glad.h>
+#include <glm.hpp>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "stats.h"
+
+// Render commands recorded without touching gl, so any thread can build them.
+// Every command is a small POD payload behind a header in a flat byte arena.
+// Commands are grouped into packets carrying a 64 bit sort key, the top 8
+// bits of the key are the layer (opaque, sky, transparent, ...).
+enum class CommandType : uint16_t
+{
+	UseProgram,
+	BindVertexArray,
+	BindTexture,
+	BindBufferRange,
+	UniformInt,
+	UniformFloat,
+	UniformVec3,
+	UniformMat4,
+	Enable,
+	Disable,
+	CullFace,
+	DepthFunc,
+	DepthMask,
+	DrawArrays,
+	DrawElements,
+	DrawElementsInstanced
+};
+
+inline uint64_t MakeSortKey(uint8_t layer, uint64_t order)
+{
+	return (static_cast<uint64_t>(layer) << 56) | (order & 0x00FFFFFFFFFFFFFFull);
+}
+
+// Uniform names as small ids, handed out once per distinct text for the whole run.
+// The same name from different buffers gets the same id, and the text of an id
+// never moves, so executing a command is an index instead of a string lookup.
+class UniformNames
+{
+public:
+	static uint32_t Intern(const char* name)
+	{
+		Registry& registry = Get();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		std::map<std::string, uint32_t>::iterator it = registry.ids.find(name);
+		if (it != registry.ids.end())
+			return it->second;
+
+		uint32_t id = static_cast<uint32_t>(registry.names.size());
+		registry.names.push_back(name);
+		registry.ids[name] = id;
+		return id;
+	}
+
+	static const char* Text(uint32_t id)
+	{
+		Registry& registry = Get();
+		std::lock_guard<std::mutex> lock(registry.mutex);
+		return registry.names[id].c_str();
+	}
+
+private:
+	struct Registry
+	{
+		std::mutex mutex;
+		std::map<std::string, uint32_t> ids;
+		// a deque so the text stays where it is when names are added
+		std::deque<std::string> names;
+	};
+
+	static Registry& Get()
+	{
+		static Registry registry;
+		return registry;
+	}
+};
+
+class CommandList
+{
+public:
+	struct Header
+	{
+		CommandType type;
+		uint16_t size;
+	};
+
+	struct Packet
+	{
+		uint64_t key;
+		uint32_t begin;
+		uint32_t end;
+	};
+
+	// uniform names are stored as UniformNames ids
+	struct UseProgramCommand { GLuint program; };
+	struct BindVertexArrayCommand { GLuint vao; };
+	struct BindTextureCommand { GLenum unit; GLenum target; GLuint texture; };
+	struct BindBufferRangeCommand { GLenum target; GLuint index; GLuint buffer; GLintptr offset; GLsizeiptr size; };
+	struct UniformIntCommand { uint32_t name; GLint value; };
+	struct UniformFloatCommand { uint32_t name; float value; };
+	struct UniformVec3Command { uint32_t name; float value[3]; };
+	struct UniformMat4Command { uint32_t name; float value[16]; };
+	struct StateCommand { GLenum value; };
+	struct DrawArraysCommand { GLenum mode; GLint first; GLsizei count; };
+	struct DrawElementsCommand { GLenum mode; GLsizei count; GLenum type; uintptr_t offset; };
+	struct DrawElementsInstancedCommand { GLenum mode; GLsizei count; GLenum type; uintptr_t offset; GLsizei instances; };
+
+	void Reset()
+	{
+		data.clear();
+		packets.clear();
+	}
+
+	void BeginPacket(uint64_t key)
+	{
+		Packet packet;
+		packet.key = key;
+		packet.begin = static_cast<uint32_t>(data.size());
+		packet.end = packet.begin;
+		packets.push_back(packet);
+	}
+
+	void UseProgram(GLuint program) { Push(CommandType::UseProgram, UseProgramCommand{ program }); }
+	void BindVertexArray(GLuint vao) { Push(CommandType::BindVertexArray, BindVertexArrayCommand{ vao }); }
+	void BindTexture(GLenum unit, GLenum target, GLuint texture) { Push(CommandType::BindTexture, BindTextureCommand{ unit, target, texture }); }
+	void BindBufferRange(GLenum target, GLuint index, GLuint buffer, GLintptr offset, GLsizeiptr size) { Push(CommandType::BindBufferRange, BindBufferRangeCommand{ target, index, buffer, offset, size }); }
+	void SetInt(const char* name, GLint value) { Push(CommandType::UniformInt, UniformIntCommand{ NameId(name), value }); }
+	void SetFloat(const char* name, float value) { Push(CommandType::UniformFloat, UniformFloatCommand{ NameId(name), value }); }
+	void Enable(GLenum cap) { Push(CommandType::Enable, StateCommand{ cap }); }
+	void Disable(GLenum cap) { Push(CommandType::Disable, StateCommand{ cap }); }
+	void CullFace(GLenum mode) { Push(CommandType::CullFace, StateCommand{ mode }); }
+	void DepthFunc(GLenum func) { Push(CommandType::DepthFunc, StateCommand{ func }); }
+	void DepthMask(GLboolean flag) { Push(CommandType::DepthMask, StateCommand{ flag }); }
+	void DrawArrays(GLenum mode, GLint first, GLsizei count) { Push(CommandType::DrawArrays, DrawArraysCommand{ mode, first, count }); }
+	void DrawElements(GLenum mode, GLsizei count, GLenum type, uintptr_t offset) { Push(CommandType::DrawElements, DrawElementsCommand{ mode, count, type, offset }); }
+	void DrawElementsInstanced(GLenum mode, GLsizei count, GLenum type, uintptr_t offset, GLsizei instances) { Push(CommandType::DrawElementsInstanced, DrawElementsInstancedCommand{ mode, count, type, offset, instances }); }
+
+	void SetVec3(const char* name, const glm::vec3& value)
+	{
+		UniformVec3Command command;
+		command.name = NameId(name);
+		std::memcpy(command.value, &value[0], sizeof(command.value));
+		Push(CommandType::UniformVec3, command);
+	}
+
+	void SetMat4(const char* name, const glm::mat4& value)
+	{
+		UniformMat4Command command;
+		command.name = NameId(name);
+		std::memcpy(command.value, &value[0][0], sizeof(command.value));
+		Push(CommandType::UniformMat4, command);
+	}
+
+	const std::vector<uint8_t>& GetData() const { return data; }
+	const std::vector<Packet>& GetPackets() const { return packets; }
+
+private:
+	struct NameEntry
+	{
+		uint64_t hash;
+		const char* text;
+		uint32_t id;
+	};
+
+	std::vector<uint8_t> data;
+	std::vector<Packet> packets;
+	// the ids this list has seen, kept across frames so recording only takes
+	// the registry lock the first time a name comes by
+	std::vector<NameEntry> names;
+
+	uint32_t NameId(const char* name)
+	{
+		// fnv-1a, compared before the text so most entries are skipped on the hash
+		uint64_t hash = 14695981039346656037ull;
+		for (const char* c = name; *c; c++)
+			hash = (hash ^ static_cast<unsigned char>(*c)) * 1099511628211ull;
+		for (unsigned int i = 0; i < names.size(); i++)
+		{
+			if (names[i].hash == hash && std::strcmp(names[i].text, name) == 0)
+				return names[i].id;
+		}
+
+		NameEntry entry;
+		entry.hash = hash;
+		entry.id = UniformNames::Intern(name);
+		entry.text = UniformNames::Text(entry.id);
+		names.push_back(entry);
+		return entry.id;
+	}
+
+	template<typename T>
+	void Push(CommandType type, const T& payload)
+	{
+		// keep payloads 8 byte aligned relative to the arena
+		const size_t headerSize = 8;
+		const size_t payloadSize = (sizeof(T) + 7) & ~static_cast<size_t>(7);
+		Header header;
+		header.type = type;
+		header.size = static_cast<uint16_t>(payloadSize);
+
+		// before the command is written, so the packet begins at it
+		if (packets.empty())
+		{
+			BeginPacket(0);
+		}
+
+		size_t offset = data.size();
+		data.resize(offset + headerSize + payloadSize);
+		std::memcpy(&data[offset], &header, sizeof(header));
+		std::memcpy(&data[offset + headerSize], &payload, sizeof(T));
+		packets.back().end = static_cast<uint32_t>(data.size());
+	}
+};
+
+// Collects the packets of several command lists, orders them by key and
+// executes them on the gl thread. Packets with equal keys run in list order,
+// then recording order, so which list recorded a packet decides where it goes
+// among its equals. Packets whose order matters need keys of their own.
+class CommandQueue
+{
+public:
+	void Merge(const std::vector<CommandList>& lists)
+	{
+		CpuTimer timer;
+		this->lists = &lists;
+		entries.clear();
+		for (unsigned int l = 0; l < lists.size(); l++)
+		{
+			const std::vector<CommandList::Packet>& packets = lists[l].GetPackets();
+			for (unsigned int p = 0; p < packets.size(); p++)
+			{
+				Entry entry;
+				entry.key = packets[p].key;
+				entry.list = l;
+				entry.packet = p;
+				entries.push_back(entry);
+			}
+		}
+		std::sort(entries.begin(), entries.end());
+
+		CommandCount = 0;
+		ExecuteTimeMs = 0.0f;
+		MergeTimeMs = timer.ElapsedMs();
+	}
+
+	// runs every packet whose layer is in [firstLayer, lastLayer]
+	void Execute(uint8_t firstLayer, uint8_t lastLayer)
+	{
+		CpuTimer timer;
+		uint64_t first = MakeSortKey(firstLayer, 0);
+		uint64_t last = MakeSortKey(lastLayer, 0x00FFFFFFFFFFFFFFull);
+		for (unsigned int i = 0; i < entries.size(); i++)
+		{
+			if (entries[i].key < first || entries[i].key > last)
+				continue;
+
+			const CommandList& list = (*lists)[entries[i].list];
+			const CommandList::Packet& packet = list.GetPackets()[entries[i].packet];
+			ExecutePacket(list.GetData(), packet.begin, packet.end);
+		}
+		ExecuteTimeMs += timer.ElapsedMs();
+	}
+
+	void ReportStats(FrameStats& stats) const
+	{
+		stats.Set("Command packets", static_cast<float>(entries.size()));
+		stats.Set("Commands executed", static_cast<float>(CommandCount));
+		stats.Set("Submit merge ms", MergeTimeMs);
+		stats.Set("Submit execute ms", ExecuteTimeMs);
+	}
+
+	unsigned int CommandCount = 0;
+	float MergeTimeMs = 0.0f;
+	float ExecuteTimeMs = 0.0f;
+
+private:
+	struct Entry
+	{
+		uint64_t key;
+		unsigned int list;
+		unsigned int packet;
+
+		bool operator<(const Entry& other) const
+		{
+			if (key != other.key)
+				return key < other.key;
+			if (list != other.list)
+				return list < other.list;
+			return packet < other.packet;
+		}
+	};
+
+	const std::vector<CommandList>* lists = nullptr;
+	std::vector<Entry> entries;
+	GLuint currentProgram = 0;
+	// glGetUniformLocation per draw is expensive. Per program a table indexed by
+	// the name id, filled the first time the program sets that name.
+	std::map<GLuint, std::vector<GLint>> locations;
+	std::vector<GLint>* programLocations = nullptr;
+
+	GLint Location(uint32_t name)
+	{
+		// -1 is a valid answer, a name the program doesn't use
+		const GLint unresolved = -2;
+		if (!programLocations)
+			programLocations = &locations[currentProgram];
+		std::vector<GLint>& table = *programLocations;
+		if (name >= table.size())
+			table.resize(name + 1, unresolved);
+		if (table[name] == unresolved)
+			table[name] = glGetUniformLocation(currentProgram, UniformNames::Text(name));
+		return table[name];
+	}
+
+	template<typename T>
+	static T Read(const std::vector<uint8_t>& data, size_t offset)
+	{
+		T value;
+		std::memcpy(&value, &data[offset], sizeof(T));
+		return value;
+	}
+
+	void ExecutePacket(const std::vector<uint8_t>& data, size_t begin, size_t end)
+	{
+		const size_t headerSize = 8;
+		size_t offset = begin;
+		while (offset < end)
+		{
+			CommandList::Header header = Read<CommandList::Header>(data, offset);
+			size_t payload = offset + headerSize;
+			offset = payload + header.size;
+			CommandCount++;
+
+			switch (header.type)
+			{
+			case CommandType::UseProgram:
+				currentProgram = Read<CommandList::UseProgramCommand>(data, payload).program;
+				programLocations = &locations[currentProgram];
+				glUseProgram(currentProgram);
+				break;
+			case CommandType::BindVertexArray:
+				glBindVertexArray(Read<CommandList::BindVertexArrayCommand>(data, payload).vao);
+				break;
+			case CommandType::BindTexture:
+			{
+				CommandList::BindTextureCommand command = Read<CommandList::BindTextureCommand>(data, payload);
+				glActiveTexture(command.unit);
+				glBindTexture(command.target, command.texture);
+				break;
+			}
+			case CommandType::BindBufferRange:
+			{
+				CommandList::BindBufferRangeCommand command = Read<CommandList::BindBufferRangeCommand>(data, payload);
+				glBindBufferRange(command.target, command.index, command.buffer, command.offset, command.size);
+				break;
+			}
+			case CommandType::UniformInt:
+			{
+				CommandList::UniformIntCommand command = Read<CommandList::UniformIntCommand>(data, payload);
+				glUniform1i(Location(command.name), command.value);
+				break;
+			}
+			case CommandType::UniformFloat:
+			{
+				CommandList::UniformFloatCommand command = Read<CommandList::UniformFloatCommand>(data, payload);
+				glUniform1f(Location(command.name), command.value);
+				break;
+			}
+			case CommandType::UniformVec3:
+			{
+				CommandList::UniformVec3Command command = Read<CommandList::UniformVec3Command>(data, payload);
+				glUniform3fv(Location(command.name), 1, command.value);
+				break;
+			}
+			case CommandType::UniformMat4:
+			{
+				CommandList::UniformMat4Command command = Read<CommandList::UniformMat4Command>(data, payload);
+				glUniformMatrix4fv(Location(command.name), 1, GL_FALSE, command.value);
+				break;
+			}
+			case CommandType::Enable:
+				glEnable(Read<CommandList::StateCommand>(data, payload).value);
+				break;
+			case CommandType::Disable:
+				glDisable(Read<CommandList::StateCommand>(data, payload).value);
+				break;
+			case CommandType::CullFace:
+				glCullFace(Read<CommandList::StateCommand>(data, payload).value);
+				break;
+			case CommandType::DepthFunc:
+				glDepthFunc(Read<CommandList::StateCommand>(data, payload).value);
+				break;
+			case CommandType::DepthMask:
+				glDepthMask(static_cast<GLboolean>(Read<CommandList::StateCommand>(data, payload).value));
+				break;
+			case CommandType::DrawArrays:
+			{
+				CommandList::DrawArraysCommand command = Read<CommandList::DrawArraysCommand>(data, payload);
+				glDrawArrays(command.mode, command.first, command.count);
+				break;
+			}
+			case CommandType::DrawElements:
+			{
+				CommandList::DrawElementsCommand command = Read<CommandList::DrawElementsCommand>(data, payload);
+				glDrawElements(command.mode, command.count, command.type, reinterpret_cast<const void*>(command.offset));
+				break;
+			}
+			case CommandType::DrawElementsInstanced:
+			{
+				CommandList::DrawElementsInstancedCommand command = Read<CommandList::DrawElementsInstancedCommand>(data, payload);
+				glDrawElementsInstanced(command.mode, command.count, command.type, reinterpret_cast<const void*>(command.offset), command.instances);
+				break;
+			}
+			}
+		}
+	}
+};
+
+#endif // !COMMAND_LIST_H
@@ -0,0 +1,99 @@
+#ifndef DEFERRED_H
+#define DEFERRED_H
+
+#include <glad/glad.h>
+#include <glm.hpp>
+
+#include "clustered_lighting.h"
+#include "shader.h"
+#include "LogHelper.h"
+
+// Deferred shading on the offscreen framebuffer.
+// Three G-buffer targets are attached next to the OIT ones while the geometry
+// pass runs:
+//   GL_COLOR_ATTACHMENT3 RG16F: octahedral normal
+//   GL_COLOR_ATTACHMENT4 RGBA8: albedo (rgb), specular intensity (a)
+//   GL_COLOR_ATTACHMENT5 R32F:  linear view depth, a half float is off by
+//                               centimeters a few meters out
+// That is as many bytes per pixel as a single RGBA16F normal and depth target.
+// The geometry pass fills them, then one full screen pass lights every covered
+// pixel into attachment 0 using the cluster light lists of ClusteredLighting,
+// so each pixel only evaluates the lights of its own cluster.
+// The targets are transient render graph textures.
+class DeferredRenderer
+{
+public:
+	static const unsigned int NORMAL_UNIT = 0;
+	static const unsigned int ALBEDO_SPECULAR_UNIT = 1;
+	static const unsigned int DEPTH_UNIT = 2;
+	static const GLenum NORMAL_FORMAT = GL_RG16F;
+	static const GLenum ALBEDO_SPECULAR_FORMAT = GL_RGBA8;
+	static const GLenum DEPTH_FORMAT = GL_R32F;
+
+	// geometry drawn until EndGeometryPass goes into the G-buffer, depth is kept for the forward passes
+	void BeginGeometryPass(unsigned int normalTexture, unsigned int albedoSpecularTexture, unsigned int depthTexture)
+	{
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, GL_TEXTURE_2D, normalTexture, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT4, GL_TEXTURE_2D, albedoSpecularTexture, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT5, GL_TEXTURE_2D, depthTexture, 0);
+		GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT3, GL_COLOR_ATTACHMENT4, GL_COLOR_ATTACHMENT5 };
+		glDrawBuffers(3, drawBuffers);
+
+		// zero depth marks pixels without geometry
+		const float clear[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		glClearBufferfv(GL_COLOR, 0, clear);
+		glClearBufferfv(GL_COLOR, 1, clear);
+		glClearBufferfv(GL_COLOR, 2, clear);
+		glDisable(GL_BLEND);
+	}
+
+	// detaches the G-buffer so the lighting pass can sample it
+	void EndGeometryPass()
+	{
+		GLenum drawBuffer = GL_COLOR_ATTACHMENT0;
+		glDrawBuffers(1, &drawBuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT3, GL_TEXTURE_2D, 0, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT4, GL_TEXTURE_2D, 0, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT5, GL_TEXTURE_2D, 0, 0);
+		glEnable(GL_BLEND);
+	}
+
+	// lights the G-buffer into attachment 0, lights have been assigned and uploaded for this view
+	void LightingPass(Shader& lightingShader, unsigned int quadVAO, const ClusteredLighting& lights,
+		const glm::mat4& view, const glm::mat4& projection, const glm::vec3& viewPos,
+		unsigned int normalTexture, unsigned int albedoSpecularTexture, unsigned int depthTexture)
+	{
+		glDisable(GL_DEPTH_TEST);
+		glDepthMask(GL_FALSE);
+		glDisable(GL_BLEND);
+
+		lightingShader.use();
+		lightingShader.setInt("gNormal", NORMAL_UNIT);
+		lightingShader.setInt("gAlbedoSpecular", ALBEDO_SPECULAR_UNIT);
+		lightingShader.setInt("gDepth", DEPTH_UNIT);
+		lightingShader.setMat4("view", view);
+		lightingShader.setMat4("inverseView", glm::inverse(view));
+		lightingShader.setVec2("projectionScale", glm::vec2(1.0f / projection[0][0], 1.0f / projection[1][1]));
+		lightingShader.setVec2("projectionOffset", glm::vec2(-projection[2][0], -projection[2][1]));
+		lightingShader.setVec3("viewPos", viewPos);
+		lights.Bind(lightingShader);
+
+		glActiveTexture(GL_TEXTURE0 + NORMAL_UNIT);
+		glBindTexture(GL_TEXTURE_2D, normalTexture);
+		glActiveTexture(GL_TEXTURE0 + ALBEDO_SPECULAR_UNIT);
+		glBindTexture(GL_TEXTURE_2D, albedoSpecularTexture);
+		glActiveTexture(GL_TEXTURE0 + DEPTH_UNIT);
+		glBindTexture(GL_TEXTURE_2D, depthTexture);
+		glActiveTexture(GL_TEXTURE0);
+
+		glBindVertexArray(quadVAO);
+		glDrawArrays(GL_TRIANGLES, 0, 6);
+		glBindVertexArray(0);
+
+		glEnable(GL_BLEND);
+		glDepthMask(GL_TRUE);
+		glEnable(GL_DEPTH_TEST);
+	}
+};
+
+#endif // !DEFERRED_H
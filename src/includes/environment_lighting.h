@@ -0,0 +1,592 @@
+#ifndef ENVIRONMENT_LIGHTING_H
+#define ENVIRONMENT_LIGHTING_H
+
+#include <glad/glad.h>
+#include <glm.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "command_list.h"
+#include "job_system.h"
+#include "shader.h"
+#include "simd.h"
+#include "stats.h"
+#include "stb_image.h"
+#include "LogHelper.h"
+
+const char* const IBL_SH_NAMES[] =
+{
+	"shCoefficients[0]", "shCoefficients[1]", "shCoefficients[2]",
+	"shCoefficients[3]", "shCoefficients[4]", "shCoefficients[5]",
+	"shCoefficients[6]", "shCoefficients[7]", "shCoefficients[8]"
+};
+
+// Image based lighting baked once from the skybox cubemap:
+//   9 L2 spherical harmonics of the irradiance (constant cost diffuse)
+//   a cubemap whose mips are prefiltered for increasing GGX roughness
+//   the split sum BRDF lookup table (NdotV, roughness) -> scale, bias of F0
+// The SH projection runs on the cpu with SSE, spread over the job system, the
+// two textures are rendered on the gpu. Everything is stored in a cache file
+// next to the faces named after a hash of their files, so later runs only read it.
+class EnvironmentLighting
+{
+public:
+	static const int SH_COEFFICIENTS = 9;
+	static const int PREFILTER_SIZE = 128;
+	static const int PREFILTER_MIPS = 6;
+	static const int BRDF_LUT_SIZE = 128;
+	// before the skybox on 11
+	static const unsigned int PREFILTER_UNIT = 9;
+	static const unsigned int BRDF_LUT_UNIT = 10;
+
+	~EnvironmentLighting()
+	{
+		if (prefilteredTexture)
+			glDeleteTextures(1, &prefilteredTexture);
+		if (brdfLutTexture)
+			glDeleteTextures(1, &brdfLutTexture);
+	}
+
+	// environment is the cubemap made from faces, quadVAO a full screen quad for BufferShader.vs
+	void Bake(const std::vector<std::string>& faces, unsigned int environment, unsigned int quadVAO, JobSystem* jobSystem)
+	{
+		CpuTimer timer;
+		GLint previousViewport[4];
+		glGetIntegerv(GL_VIEWPORT, previousViewport);
+		// prefiltered mips would show their face edges otherwise
+		glEnable(GL_TEXTURE_CUBE_MAP_SEAMLESS);
+
+		std::string cachePath = GetCachePath(faces);
+		CacheHit = LoadCache(cachePath);
+		if (!CacheHit)
+		{
+			ProjectSH(faces, jobSystem);
+			SHTimeMs = timer.ElapsedMs();
+			RenderPrefiltered(environment, quadVAO);
+			RenderBrdfLut(quadVAO);
+			SaveCache(cachePath);
+		}
+		glViewport(previousViewport[0], previousViewport[1], previousViewport[2], previousViewport[3]);
+		BakeTimeMs = timer.ElapsedMs();
+
+		LOG("IBL " << (CacheHit ? "loaded from " : "baked into ") << cachePath << " in " << BakeTimeMs << " ms");
+	}
+
+	// uniforms are per program, call once per shader that uses them
+	void SetUniforms(Shader& shader) const
+	{
+		shader.use();
+		for (int i = 0; i < SH_COEFFICIENTS; i++)
+		{
+			shader.setVec3(IBL_SH_NAMES[i], coefficients[i]);
+		}
+		shader.setInt("prefilteredEnvironment", PREFILTER_UNIT);
+		shader.setInt("brdfLut", BRDF_LUT_UNIT);
+		shader.setFloat("prefilteredMaxLod", static_cast<float>(PREFILTER_MIPS - 1));
+	}
+
+	void Bind() const
+	{
+		glActiveTexture(GL_TEXTURE0 + PREFILTER_UNIT);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, prefilteredTexture);
+		glActiveTexture(GL_TEXTURE0 + BRDF_LUT_UNIT);
+		glBindTexture(GL_TEXTURE_2D, brdfLutTexture);
+		glActiveTexture(GL_TEXTURE0);
+	}
+
+	void Record(CommandList& list) const
+	{
+		list.BindTexture(GL_TEXTURE0 + PREFILTER_UNIT, GL_TEXTURE_CUBE_MAP, prefilteredTexture);
+		list.BindTexture(GL_TEXTURE0 + BRDF_LUT_UNIT, GL_TEXTURE_2D, brdfLutTexture);
+	}
+
+	// irradiance / pi for the normal, the same thing the shaders evaluate
+	glm::vec3 EvaluateSH(const glm::vec3& n) const
+	{
+		float basis[SH_COEFFICIENTS];
+		SHBasis(n.x, n.y, n.z, basis);
+		glm::vec3 result(0.0f);
+		for (int i = 0; i < SH_COEFFICIENTS; i++)
+		{
+			result += coefficients[i] * basis[i];
+		}
+		return result;
+	}
+
+	const glm::vec3* GetCoefficients() const { return coefficients; }
+	unsigned int GetPrefilteredTexture() const { return prefilteredTexture; }
+	unsigned int GetBrdfLutTexture() const { return brdfLutTexture; }
+
+	bool CacheHit = false;
+	float BakeTimeMs = 0.0f;
+	float SHTimeMs = 0.0f;
+
+private:
+	// bump when anything about the baked data changes
+	static const uint32_t CACHE_VERSION = 1;
+	static const uint32_t CACHE_MAGIC = 0x314C4249; // "IBL1"
+
+	glm::vec3 coefficients[SH_COEFFICIENTS];
+	unsigned int prefilteredTexture = 0;
+	unsigned int brdfLutTexture = 0;
+
+	static void SHBasis(float x, float y, float z, float* basis)
+	{
+		basis[0] = 0.282095f;
+		basis[1] = 0.488603f * y;
+		basis[2] = 0.488603f * z;
+		basis[3] = 0.488603f * x;
+		basis[4] = 1.092548f * x * y;
+		basis[5] = 1.092548f * y * z;
+		basis[6] = 0.315392f * (3.0f * z * z - 1.0f);
+		basis[7] = 1.092548f * x * z;
+		basis[8] = 0.546274f * (x * x - y * y);
+	}
+
+	// direction of a cubemap texel is Forward + u * Right + v * Down, u and v in [-1, 1]
+	struct FaceAxes
+	{
+		float Forward[3];
+		float Right[3];
+		float Down[3];
+	};
+
+	static const FaceAxes& GetFaceAxes(unsigned int face)
+	{
+		static const FaceAxes axes[6] =
+		{
+			{ { 1, 0, 0 }, { 0, 0, -1 }, { 0, -1, 0 } },
+			{ { -1, 0, 0 }, { 0, 0, 1 }, { 0, -1, 0 } },
+			{ { 0, 1, 0 }, { 1, 0, 0 }, { 0, 0, 1 } },
+			{ { 0, -1, 0 }, { 1, 0, 0 }, { 0, 0, -1 } },
+			{ { 0, 0, 1 }, { 1, 0, 0 }, { 0, -1, 0 } },
+			{ { 0, 0, -1 }, { -1, 0, 0 }, { 0, -1, 0 } }
+		};
+		return axes[face];
+	}
+
+	// Projects the radiance of every texel onto the SH basis, weighted by its
+	// solid angle, one job per batch of rows. Afterwards the coefficients are
+	// convolved with the clamped cosine and divided by pi, so evaluating them
+	// gives the diffuse light for an albedo of one.
+	void ProjectSH(const std::vector<std::string>& faces, JobSystem* jobSystem)
+	{
+		struct Face
+		{
+			unsigned char* Data = nullptr;
+			int Width = 0;
+			int Height = 0;
+			int Channels = 0;
+		};
+		std::vector<Face> images(faces.size());
+		stbi_set_flip_vertically_on_load(false);
+		unsigned int rows = 0;
+		for (unsigned int i = 0; i < faces.size(); i++)
+		{
+			images[i].Data = stbi_load(faces[i].c_str(), &images[i].Width, &images[i].Height, &images[i].Channels, 3);
+			images[i].Channels = 3;
+			if (!images[i].Data)
+				LOG("Error Loading cubemap at path : " << faces[i]);
+			rows = std::max(rows, static_cast<unsigned int>(images[i].Height));
+		}
+
+		// partial sums per row, added up in double afterwards
+		unsigned int totalRows = rows * static_cast<unsigned int>(faces.size());
+		std::vector<float> rowSums(static_cast<size_t>(totalRows) * SH_COEFFICIENTS * 3, 0.0f);
+		auto projectRows = [&](unsigned int begin, unsigned int end)
+		{
+			for (unsigned int row = begin; row < end; row++)
+			{
+				unsigned int face = row / rows;
+				unsigned int y = row % rows;
+				const Face& image = images[face];
+				if (!image.Data || y >= static_cast<unsigned int>(image.Height))
+					continue;
+
+				ProjectRow(image.Data, image.Width, image.Height, image.Channels, y, GetFaceAxes(face),
+					&rowSums[static_cast<size_t>(row) * SH_COEFFICIENTS * 3]);
+			}
+		};
+		if (jobSystem)
+			jobSystem->ParallelFor(totalRows, 16, projectRows);
+		else
+			projectRows(0, totalRows);
+
+		double sums[SH_COEFFICIENTS * 3] = {};
+		for (unsigned int row = 0; row < totalRows; row++)
+		{
+			for (int i = 0; i < SH_COEFFICIENTS * 3; i++)
+			{
+				sums[i] += rowSums[static_cast<size_t>(row) * SH_COEFFICIENTS * 3 + i];
+			}
+		}
+
+		for (unsigned int i = 0; i < images.size(); i++)
+		{
+			stbi_image_free(images[i].Data);
+		}
+
+		// clamped cosine convolution per band, / pi for lambert
+		const float bands[SH_COEFFICIENTS] = { 1.0f, 2.0f / 3.0f, 2.0f / 3.0f, 2.0f / 3.0f, 0.25f, 0.25f, 0.25f, 0.25f, 0.25f };
+		for (int i = 0; i < SH_COEFFICIENTS; i++)
+		{
+			coefficients[i] = glm::vec3(static_cast<float>(sums[i * 3]), static_cast<float>(sums[i * 3 + 1]),
+				static_cast<float>(sums[i * 3 + 2])) * bands[i];
+		}
+	}
+
+	// adds row y of one face to sums, laid out as coefficient * 3 + channel
+	static void ProjectRow(const unsigned char* data, int width, int height, int channels, unsigned int y,
+		const FaceAxes& axes, float* sums)
+	{
+		const float v = 2.0f * (y + 0.5f) / height - 1.0f;
+		// texel area on the unit cube face
+		const float area = 4.0f / (static_cast<float>(width) * height);
+		const unsigned char* pixels = data + static_cast<size_t>(y) * width * channels;
+		int x = 0;
+
+#ifdef USE_SSE
+		__m128 accumulators[SH_COEFFICIENTS * 3];
+		for (int i = 0; i < SH_COEFFICIENTS * 3; i++)
+		{
+			accumulators[i] = _mm_setzero_ps();
+		}
+
+		const __m128 one = _mm_set1_ps(1.0f);
+		const __m128 vv = _mm_set1_ps(v);
+		const __m128 baseX = _mm_set1_ps(axes.Forward[0] + v * axes.Down[0]);
+		const __m128 baseY = _mm_set1_ps(axes.Forward[1] + v * axes.Down[1]);
+		const __m128 baseZ = _mm_set1_ps(axes.Forward[2] + v * axes.Down[2]);
+		const __m128 scale = _mm_set1_ps(1.0f / 255.0f);
+		for (; x + 4 <= width; x += 4)
+		{
+			__m128 u = _mm_set_ps(x + 3.5f, x + 2.5f, x + 1.5f, x + 0.5f);
+			u = _mm_sub_ps(_mm_mul_ps(u, _mm_set1_ps(2.0f / width)), one);
+
+			__m128 dx = _mm_add_ps(baseX, _mm_mul_ps(u, _mm_set1_ps(axes.Right[0])));
+			__m128 dy = _mm_add_ps(baseY, _mm_mul_ps(u, _mm_set1_ps(axes.Right[1])));
+			__m128 dz = _mm_add_ps(baseZ, _mm_mul_ps(u, _mm_set1_ps(axes.Right[2])));
+
+			// 1 + u^2 + v^2 is the squared length of the unnormalized direction
+			__m128 lengthSquared = _mm_add_ps(one, _mm_add_ps(_mm_mul_ps(u, u), _mm_mul_ps(vv, vv)));
+			__m128 inverseLength = _mm_div_ps(one, _mm_sqrt_ps(lengthSquared));
+			dx = _mm_mul_ps(dx, inverseLength);
+			dy = _mm_mul_ps(dy, inverseLength);
+			dz = _mm_mul_ps(dz, inverseLength);
+			// solid angle of the texel
+			__m128 weight = _mm_mul_ps(_mm_set1_ps(area), _mm_mul_ps(inverseLength, _mm_mul_ps(inverseLength, inverseLength)));
+
+			const unsigned char* p = pixels + x * channels;
+			__m128 r = _mm_mul_ps(_mm_set_ps(p[3 * channels], p[2 * channels], p[channels], p[0]), scale);
+			__m128 g = _mm_mul_ps(_mm_set_ps(p[3 * channels + 1], p[2 * channels + 1], p[channels + 1], p[1]), scale);
+			__m128 b = _mm_mul_ps(_mm_set_ps(p[3 * channels + 2], p[2 * channels + 2], p[channels + 2], p[2]), scale);
+			r = _mm_mul_ps(r, weight);
+			g = _mm_mul_ps(g, weight);
+			b = _mm_mul_ps(b, weight);
+
+			__m128 basis[SH_COEFFICIENTS];
+			basis[0] = _mm_set1_ps(0.282095f);
+			basis[1] = _mm_mul_ps(_mm_set1_ps(0.488603f), dy);
+			basis[2] = _mm_mul_ps(_mm_set1_ps(0.488603f), dz);
+			basis[3] = _mm_mul_ps(_mm_set1_ps(0.488603f), dx);
+			basis[4] = _mm_mul_ps(_mm_set1_ps(1.092548f), _mm_mul_ps(dx, dy));
+			basis[5] = _mm_mul_ps(_mm_set1_ps(1.092548f), _mm_mul_ps(dy, dz));
+			basis[6] = _mm_mul_ps(_mm_set1_ps(0.315392f), _mm_sub_ps(_mm_mul_ps(_mm_set1_ps(3.0f), _mm_mul_ps(dz, dz)), one));
+			basis[7] = _mm_mul_ps(_mm_set1_ps(1.092548f), _mm_mul_ps(dx, dz));
+			basis[8] = _mm_mul_ps(_mm_set1_ps(0.546274f), _mm_sub_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)));
+
+			for (int i = 0; i < SH_COEFFICIENTS; i++)
+			{
+				accumulators[i * 3] = _mm_add_ps(accumulators[i * 3], _mm_mul_ps(basis[i], r));
+				accumulators[i * 3 + 1] = _mm_add_ps(accumulators[i * 3 + 1], _mm_mul_ps(basis[i], g));
+				accumulators[i * 3 + 2] = _mm_add_ps(accumulators[i * 3 + 2], _mm_mul_ps(basis[i], b));
+			}
+		}
+
+		for (int i = 0; i < SH_COEFFICIENTS * 3; i++)
+		{
+			float lanes[4];
+			_mm_storeu_ps(lanes, accumulators[i]);
+			sums[i] += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+		}
+#endif
+
+		// whatever is left, or everything without sse
+		for (; x < width; x++)
+		{
+			float u = 2.0f * (x + 0.5f) / width - 1.0f;
+			float inverseLength = 1.0f / std::sqrt(1.0f + u * u + v * v);
+			float dx = (axes.Forward[0] + u * axes.Right[0] + v * axes.Down[0]) * inverseLength;
+			float dy = (axes.Forward[1] + u * axes.Right[1] + v * axes.Down[1]) * inverseLength;
+			float dz = (axes.Forward[2] + u * axes.Right[2] + v * axes.Down[2]) * inverseLength;
+			float weight = area * inverseLength * inverseLength * inverseLength;
+
+			float basis[SH_COEFFICIENTS];
+			SHBasis(dx, dy, dz, basis);
+			const unsigned char* p = pixels + x * channels;
+			for (int i = 0; i < SH_COEFFICIENTS; i++)
+			{
+				for (int c = 0; c < 3; c++)
+				{
+					sums[i * 3 + c] += basis[i] * weight * (p[c] / 255.0f);
+				}
+			}
+		}
+	}
+
+	void RenderPrefiltered(unsigned int environment, unsigned int quadVAO)
+	{
+		// the importance samples read from the source mips to not alias
+		glBindTexture(GL_TEXTURE_CUBE_MAP, environment);
+		GLint sourceSize = 0;
+		glGetTexLevelParameteriv(GL_TEXTURE_CUBE_MAP_POSITIVE_X, 0, GL_TEXTURE_WIDTH, &sourceSize);
+		glGenerateMipmap(GL_TEXTURE_CUBE_MAP);
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+
+		CreatePrefilteredTexture();
+
+		Shader prefilterShader("src/shaders/BufferShader.vs", "src/shaders/ibl_prefilter.fsc");
+		prefilterShader.use();
+		prefilterShader.setInt("environment", 0);
+		prefilterShader.setFloat("sourceSize", static_cast<float>(sourceSize));
+
+		unsigned int fbo;
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glDisable(GL_DEPTH_TEST);
+		glDisable(GL_BLEND);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, environment);
+		glBindVertexArray(quadVAO);
+		for (int mip = 0; mip < PREFILTER_MIPS; mip++)
+		{
+			int size = PREFILTER_SIZE >> mip;
+			glViewport(0, 0, size, size);
+			prefilterShader.setFloat("faceSize", static_cast<float>(size));
+			prefilterShader.setFloat("roughness", static_cast<float>(mip) / (PREFILTER_MIPS - 1));
+			for (int face = 0; face < 6; face++)
+			{
+				glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, prefilteredTexture, mip);
+				prefilterShader.setInt("face", face);
+				glDrawArrays(GL_TRIANGLES, 0, 6);
+			}
+		}
+		glBindVertexArray(0);
+
+		// the skybox itself keeps sampling the sharp base level
+		glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glDeleteFramebuffers(1, &fbo);
+		glEnable(GL_BLEND);
+		glEnable(GL_DEPTH_TEST);
+	}
+
+	void RenderBrdfLut(unsigned int quadVAO)
+	{
+		CreateBrdfLutTexture();
+
+		Shader brdfShader("src/shaders/BufferShader.vs", "src/shaders/ibl_brdf.fsc");
+		brdfShader.use();
+
+		unsigned int fbo;
+		glGenFramebuffers(1, &fbo);
+		glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, brdfLutTexture, 0);
+		glDisable(GL_DEPTH_TEST);
+		glDisable(GL_BLEND);
+		glViewport(0, 0, BRDF_LUT_SIZE, BRDF_LUT_SIZE);
+		glBindVertexArray(quadVAO);
+		glDrawArrays(GL_TRIANGLES, 0, 6);
+		glBindVertexArray(0);
+
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glDeleteFramebuffers(1, &fbo);
+		glEnable(GL_BLEND);
+		glEnable(GL_DEPTH_TEST);
+	}
+
+	void CreatePrefilteredTexture()
+	{
+		GLCall(glGenTextures(1, &prefilteredTexture));
+		GLCall(glBindTexture(GL_TEXTURE_CUBE_MAP, prefilteredTexture));
+		for (int mip = 0; mip < PREFILTER_MIPS; mip++)
+		{
+			int size = PREFILTER_SIZE >> mip;
+			for (int face = 0; face < 6; face++)
+			{
+				GLCall(glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, mip, GL_RGB16F, size, size, 0, GL_RGB, GL_FLOAT, NULL));
+			}
+		}
+		GLCall(glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAX_LEVEL, PREFILTER_MIPS - 1));
+		GLCall(glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR));
+		GLCall(glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+		GLCall(glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+		GLCall(glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+		GLCall(glTexParameteri(GL_TEXTURE_CUBE_MAP, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE));
+	}
+
+	void CreateBrdfLutTexture()
+	{
+		GLCall(glGenTextures(1, &brdfLutTexture));
+		GLCall(glBindTexture(GL_TEXTURE_2D, brdfLutTexture));
+		GLCall(glTexImage2D(GL_TEXTURE_2D, 0, GL_RG16F, BRDF_LUT_SIZE, BRDF_LUT_SIZE, 0, GL_RG, GL_FLOAT, NULL));
+		GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
+		GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+		GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+		GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+	}
+
+	// FNV-1a over the bytes of every face file
+	static std::string GetCachePath(const std::vector<std::string>& faces)
+	{
+		uint64_t hash = 14695981039346656037ull;
+		for (unsigned int i = 0; i < faces.size(); i++)
+		{
+			std::ifstream file(faces[i], std::ios::binary);
+			char buffer[4096];
+			while (file.read(buffer, sizeof(buffer)) || file.gcount() > 0)
+			{
+				std::streamsize count = file.gcount();
+				for (std::streamsize b = 0; b < count; b++)
+				{
+					hash = (hash ^ static_cast<unsigned char>(buffer[b])) * 1099511628211ull;
+				}
+			}
+			// order of the faces matters too
+			hash = (hash ^ i) * 1099511628211ull;
+		}
+
+		std::string directory;
+		if (!faces.empty())
+		{
+			size_t slash = faces[0].find_last_of("/\\");
+			if (slash != std::string::npos)
+				directory = faces[0].substr(0, slash + 1);
+		}
+
+		char name[64];
+		std::snprintf(name, sizeof(name), "ibl_%016llx.cache", static_cast<unsigned long long>(hash));
+		return directory + name;
+	}
+
+	struct CacheHeader
+	{
+		uint32_t Magic;
+		uint32_t Version;
+		uint32_t PrefilterSize;
+		uint32_t PrefilterMips;
+		uint32_t BrdfLutSize;
+	};
+
+	static CacheHeader MakeHeader()
+	{
+		CacheHeader header;
+		header.Magic = CACHE_MAGIC;
+		header.Version = CACHE_VERSION;
+		header.PrefilterSize = PREFILTER_SIZE;
+		header.PrefilterMips = PREFILTER_MIPS;
+		header.BrdfLutSize = BRDF_LUT_SIZE;
+		return header;
+	}
+
+	// header, SH coefficients, prefiltered mips (RGB float, face by face), BRDF LUT (RG float)
+	bool LoadCache(const std::string& path)
+	{
+		std::ifstream file(path, std::ios::binary);
+		if (!file)
+			return false;
+
+		CacheHeader header;
+		CacheHeader expected = MakeHeader();
+		file.read(reinterpret_cast<char*>(&header), sizeof(header));
+		if (!file || std::memcmp(&header, &expected, sizeof(header)) != 0)
+			return false;
+
+		glm::vec3 loaded[SH_COEFFICIENTS];
+		file.read(reinterpret_cast<char*>(loaded), sizeof(loaded));
+
+		std::vector<std::vector<float>> mips(PREFILTER_MIPS * 6);
+		for (int mip = 0; mip < PREFILTER_MIPS; mip++)
+		{
+			int size = PREFILTER_SIZE >> mip;
+			for (int face = 0; face < 6; face++)
+			{
+				std::vector<float>& pixels = mips[mip * 6 + face];
+				pixels.resize(static_cast<size_t>(size) * size * 3);
+				file.read(reinterpret_cast<char*>(pixels.data()), pixels.size() * sizeof(float));
+			}
+		}
+		std::vector<float> lut(static_cast<size_t>(BRDF_LUT_SIZE) * BRDF_LUT_SIZE * 2);
+		file.read(reinterpret_cast<char*>(lut.data()), lut.size() * sizeof(float));
+		if (!file)
+			return false;
+
+		for (int i = 0; i < SH_COEFFICIENTS; i++)
+		{
+			coefficients[i] = loaded[i];
+		}
+
+		CreatePrefilteredTexture();
+		for (int mip = 0; mip < PREFILTER_MIPS; mip++)
+		{
+			int size = PREFILTER_SIZE >> mip;
+			for (int face = 0; face < 6; face++)
+			{
+				GLCall(glTexSubImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, mip, 0, 0, size, size, GL_RGB, GL_FLOAT, mips[mip * 6 + face].data()));
+			}
+		}
+		GLCall(glBindTexture(GL_TEXTURE_CUBE_MAP, 0));
+
+		CreateBrdfLutTexture();
+		GLCall(glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, BRDF_LUT_SIZE, BRDF_LUT_SIZE, GL_RG, GL_FLOAT, lut.data()));
+		GLCall(glBindTexture(GL_TEXTURE_2D, 0));
+		return true;
+	}
+
+	void SaveCache(const std::string& path) const
+	{
+		std::ofstream file(path, std::ios::binary);
+		if (!file)
+		{
+			LOG("IBL cache " << path << " can't be written");
+			return;
+		}
+
+		CacheHeader header = MakeHeader();
+		file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+		file.write(reinterpret_cast<const char*>(coefficients), sizeof(coefficients));
+
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glBindTexture(GL_TEXTURE_CUBE_MAP, prefilteredTexture);
+		std::vector<float> pixels;
+		for (int mip = 0; mip < PREFILTER_MIPS; mip++)
+		{
+			int size = PREFILTER_SIZE >> mip;
+			pixels.resize(static_cast<size_t>(size) * size * 3);
+			for (int face = 0; face < 6; face++)
+			{
+				glGetTexImage(GL_TEXTURE_CUBE_MAP_POSITIVE_X + face, mip, GL_RGB, GL_FLOAT, pixels.data());
+				file.write(reinterpret_cast<const char*>(pixels.data()), pixels.size() * sizeof(float));
+			}
+		}
+		glBindTexture(GL_TEXTURE_CUBE_MAP, 0);
+
+		glBindTexture(GL_TEXTURE_2D, brdfLutTexture);
+		pixels.resize(static_cast<size_t>(BRDF_LUT_SIZE) * BRDF_LUT_SIZE * 2);
+		glGetTexImage(GL_TEXTURE_2D, 0, GL_RG, GL_FLOAT, pixels.data());
+		file.write(reinterpret_cast<const char*>(pixels.data()), pixels.size() * sizeof(float));
+		glBindTexture(GL_TEXTURE_2D, 0);
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+	}
+};
+
+#endif // !ENVIRONMENT_LIGHTING_H
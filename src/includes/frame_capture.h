@@ -0,0 +1,521 @@
+#ifndef FRAME_CAPTURE_H
+#define FRAME_CAPTURE_H
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "stats.h"
+#include "LogHelper.h"
+
+enum CaptureFormat
+{
+	CAPTURE_PNG,
+	CAPTURE_PPM,
+	// one YUV4MPEG2 4:2:0 stream instead of a file per frame
+	CAPTURE_Y4M
+};
+
+inline bool ParseCaptureFormat(const std::string& name, CaptureFormat& format)
+{
+	if (name == "png")
+		format = CAPTURE_PNG;
+	else if (name == "ppm")
+		format = CAPTURE_PPM;
+	else if (name == "y4m")
+		format = CAPTURE_Y4M;
+	else
+		return false;
+	return true;
+}
+
+// Writes frames to disk without stalling the pipeline.
+// Capture() queues a glReadPixels into the next of RING_SIZE pixel pack
+// buffers and puts a fence behind it. The copy runs on the gpu while the cpu
+// goes on with the next frames, a buffer is only mapped once its fence has
+// passed, usually one or two frames later. The pixels are copied out and
+// handed to a writer thread that encodes them, so neither the map nor the
+// encoding happens in the frame. When the writer falls MAX_QUEUED frames
+// behind Capture() blocks instead of dropping frames, the time shows up as
+// "Capture stall ms".
+class FrameCapture
+{
+public:
+	static const int RING_SIZE = 3;
+	static const int MAX_QUEUED = 8;
+
+	// stops a running capture, which deletes the pixel buffers, so the context must still be current
+	~FrameCapture()
+	{
+		Stop();
+	}
+
+	// Frames go to prefix_00000.png / .ppm counting from firstIndex, or into prefix.y4m. Needs a current context.
+	bool Start(const std::string& prefix, CaptureFormat format, int width, int height, float framesPerSecond, unsigned long long firstIndex = 0)
+	{
+		Stop();
+		this->prefix = prefix;
+		this->firstIndex = firstIndex;
+		this->format = format;
+		this->width = width;
+		this->height = height;
+		issued = 0;
+		retired = 0;
+		written = 0;
+		stopping = false;
+
+		if (format == CAPTURE_Y4M)
+		{
+			stream = std::fopen((prefix + ".y4m").c_str(), "wb");
+			if (!stream)
+			{
+				LOG("CAPTURE:: Could not write " << prefix << ".y4m");
+				return false;
+			}
+			// C420jpeg: full range BT.601, chroma centered between the luma samples
+			std::fprintf(stream, "YUV4MPEG2 W%d H%d F%d:1000 Ip A1:1 C420jpeg\n", width, height, static_cast<int>(framesPerSecond * 1000.0f + 0.5f));
+		}
+
+		for (int i = 0; i < RING_SIZE; i++)
+		{
+			glGenBuffers(1, &slots[i].pbo);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, slots[i].pbo);
+			glBufferData(GL_PIXEL_PACK_BUFFER, GetFrameBytes(), NULL, GL_STREAM_READ);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+		writer = std::thread(&FrameCapture::WriterLoop, this);
+		capturing = true;
+		return true;
+	}
+
+	// waits for every captured frame to be on disk, needs the context the capture was started on
+	void Stop()
+	{
+		if (!capturing)
+			return;
+
+		while (retired < issued)
+			Retire();
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		queueChanged.notify_all();
+		writer.join();
+
+		for (int i = 0; i < RING_SIZE; i++)
+		{
+			glDeleteBuffers(1, &slots[i].pbo);
+			slots[i].pbo = 0;
+		}
+		if (stream)
+		{
+			std::fclose(stream);
+			stream = NULL;
+		}
+		spare.clear();
+		capturing = false;
+		LOG("CAPTURE:: " << written << " frames written to " << prefix << (format == CAPTURE_Y4M ? ".y4m" : "_*"));
+	}
+
+	bool IsCapturing() const { return capturing; }
+
+	// Queues the readback of framebuffer, false if its size doesn't match the capture any more.
+	bool Capture(unsigned int framebuffer, int width, int height)
+	{
+		if (!capturing)
+			return false;
+		if (width != this->width || height != this->height)
+		{
+			LOG("CAPTURE:: Frame size changed from " << this->width << "x" << this->height << " to " << width << "x" << height);
+			return false;
+		}
+
+		CpuTimer timer;
+		StallMs = 0.0f;
+		// the oldest frame has to leave its buffer first
+		if (issued - retired == RING_SIZE)
+			Retire();
+
+		Slot& slot = slots[issued % RING_SIZE];
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, framebuffer);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+		glPixelStorei(GL_PACK_ALIGNMENT, 4);
+		// rgba bytes are the format drivers copy without a conversion
+		glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, 0);
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		issued++;
+
+		// take whatever has finished, in order
+		while (retired < issued && IsReady(slots[retired % RING_SIZE]))
+			Retire();
+
+		CaptureMs = timer.ElapsedMs();
+		return true;
+	}
+
+	void ReportStats(FrameStats& stats)
+	{
+		if (!capturing)
+			return;
+		std::lock_guard<std::mutex> lock(mutex);
+		stats.Set("Capture ms", CaptureMs);
+		stats.Set("Capture stall ms", StallMs);
+		stats.Set("Capture in flight", static_cast<float>(issued - retired));
+		stats.Set("Capture queued", static_cast<float>(queue.size()));
+		stats.Set("Capture encode ms", EncodeMs);
+	}
+
+	unsigned long long GetFramesWritten()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return written;
+	}
+
+	// render thread time of the last Capture(), including StallMs
+	float CaptureMs = 0.0f;
+	// part of it spent waiting on a fence or on the writer
+	float StallMs = 0.0f;
+	// writer thread time for the last frame, guarded by the mutex
+	float EncodeMs = 0.0f;
+
+private:
+	struct Slot
+	{
+		GLuint pbo = 0;
+		GLsync fence = 0;
+	};
+
+	struct Frame
+	{
+		unsigned long long index = 0;
+		std::vector<unsigned char> pixels;
+	};
+
+	Slot slots[RING_SIZE];
+	unsigned long long issued = 0;
+	unsigned long long retired = 0;
+	unsigned long long firstIndex = 0;
+	std::string prefix;
+	CaptureFormat format = CAPTURE_PNG;
+	int width = 0;
+	int height = 0;
+	bool capturing = false;
+	FILE* stream = NULL;
+
+	std::thread writer;
+	std::mutex mutex;
+	std::condition_variable queueChanged;
+	std::deque<Frame> queue;
+	// pixel storage of written frames, reused so capturing doesn't allocate
+	std::vector<std::vector<unsigned char>> spare;
+	unsigned long long written = 0;
+	bool stopping = false;
+
+	size_t GetFrameBytes() const
+	{
+		return static_cast<size_t>(width) * height * 4;
+	}
+
+	static bool IsReady(const Slot& slot)
+	{
+		GLenum result = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		return result == GL_ALREADY_SIGNALED || result == GL_CONDITION_SATISFIED;
+	}
+
+	// copies the oldest frame out of its buffer and hands it to the writer
+	void Retire()
+	{
+		Slot& slot = slots[retired % RING_SIZE];
+		CpuTimer stall;
+		GLenum result = glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		while (result == GL_TIMEOUT_EXPIRED)
+		{
+			result = glClientWaitSync(slot.fence, 0, 1000000);
+		}
+		glDeleteSync(slot.fence);
+		slot.fence = 0;
+		StallMs += stall.ElapsedMs();
+
+		Frame frame;
+		frame.index = firstIndex + retired;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (!spare.empty())
+			{
+				frame.pixels.swap(spare.back());
+				spare.pop_back();
+			}
+		}
+		frame.pixels.resize(GetFrameBytes());
+
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pbo);
+		void* mapped = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, GetFrameBytes(), GL_MAP_READ_BIT);
+		if (mapped)
+		{
+			std::memcpy(frame.pixels.data(), mapped, GetFrameBytes());
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+		}
+		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+		retired++;
+
+		stall.Reset();
+		std::unique_lock<std::mutex> lock(mutex);
+		queueChanged.wait(lock, [this]() { return queue.size() < static_cast<size_t>(MAX_QUEUED); });
+		StallMs += stall.ElapsedMs();
+		queue.push_back(std::move(frame));
+		lock.unlock();
+		queueChanged.notify_all();
+	}
+
+	void WriterLoop()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		while (true)
+		{
+			queueChanged.wait(lock, [this]() { return !queue.empty() || stopping; });
+			if (queue.empty())
+				return;
+
+			Frame frame = std::move(queue.front());
+			queue.pop_front();
+			lock.unlock();
+			queueChanged.notify_all();
+
+			CpuTimer timer;
+			Write(frame);
+			float encodeMs = timer.ElapsedMs();
+
+			lock.lock();
+			EncodeMs = encodeMs;
+			written++;
+			spare.push_back(std::move(frame.pixels));
+		}
+	}
+
+	void Write(const Frame& frame)
+	{
+		if (format == CAPTURE_Y4M)
+		{
+			WriteY4mFrame(stream, frame.pixels.data(), width, height);
+			return;
+		}
+
+		char number[16];
+		std::snprintf(number, sizeof(number), "_%05llu", frame.index);
+		std::string path = prefix + number + (format == CAPTURE_PNG ? ".png" : ".ppm");
+		FILE* file = std::fopen(path.c_str(), "wb");
+		if (!file)
+		{
+			LOG("CAPTURE:: Could not write " << path);
+			return;
+		}
+		if (format == CAPTURE_PNG)
+			WritePng(file, frame.pixels.data(), width, height);
+		else
+			WritePpm(file, frame.pixels.data(), width, height);
+		std::fclose(file);
+	}
+
+	// the encoders take gl rows, bottom row first, and write the top row first
+
+	static void WritePpm(FILE* file, const unsigned char* rgba, int width, int height)
+	{
+		std::vector<unsigned char> row(static_cast<size_t>(width) * 3);
+		std::fprintf(file, "P6\n%d %d\n255\n", width, height);
+		for (int y = height - 1; y >= 0; y--)
+		{
+			const unsigned char* source = rgba + static_cast<size_t>(y) * width * 4;
+			for (int x = 0; x < width; x++)
+			{
+				row[x * 3 + 0] = source[x * 4 + 0];
+				row[x * 3 + 1] = source[x * 4 + 1];
+				row[x * 3 + 2] = source[x * 4 + 2];
+			}
+			std::fwrite(row.data(), 1, row.size(), file);
+		}
+	}
+
+	// Uncompressed deflate blocks: files are as large as a ppm, but there is
+	// no zlib to link and the writer keeps up with the frame rate.
+	static void WritePng(FILE* file, const unsigned char* rgba, int width, int height)
+	{
+		// filter byte and rgb per row
+		size_t rowBytes = static_cast<size_t>(width) * 3 + 1;
+		std::vector<unsigned char> raw(rowBytes * height);
+		for (int y = 0; y < height; y++)
+		{
+			const unsigned char* source = rgba + static_cast<size_t>(height - 1 - y) * width * 4;
+			unsigned char* target = &raw[y * rowBytes];
+			target[0] = 0;
+			for (int x = 0; x < width; x++)
+			{
+				target[1 + x * 3 + 0] = source[x * 4 + 0];
+				target[1 + x * 3 + 1] = source[x * 4 + 1];
+				target[1 + x * 3 + 2] = source[x * 4 + 2];
+			}
+		}
+
+		std::vector<unsigned char> zlib;
+		zlib.reserve(raw.size() + raw.size() / 65535 * 5 + 16);
+		zlib.push_back(0x78);
+		zlib.push_back(0x01);
+		size_t offset = 0;
+		do
+		{
+			size_t length = std::min<size_t>(raw.size() - offset, 65535);
+			bool last = offset + length == raw.size();
+			zlib.push_back(last ? 1 : 0);
+			zlib.push_back(static_cast<unsigned char>(length));
+			zlib.push_back(static_cast<unsigned char>(length >> 8));
+			zlib.push_back(static_cast<unsigned char>(~length));
+			zlib.push_back(static_cast<unsigned char>(~length >> 8));
+			zlib.insert(zlib.end(), raw.begin() + offset, raw.begin() + offset + length);
+			offset += length;
+		} while (offset < raw.size());
+		unsigned int adler = Adler32(raw.data(), raw.size());
+		PushBigEndian(zlib, adler);
+
+		static const unsigned char signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+		std::fwrite(signature, 1, sizeof(signature), file);
+
+		std::vector<unsigned char> header;
+		PushBigEndian(header, static_cast<unsigned int>(width));
+		PushBigEndian(header, static_cast<unsigned int>(height));
+		// 8 bit rgb, deflate, adaptive filters, no interlace
+		const unsigned char format[] = { 8, 2, 0, 0, 0 };
+		header.insert(header.end(), format, format + sizeof(format));
+		WritePngChunk(file, "IHDR", header);
+		WritePngChunk(file, "IDAT", zlib);
+		WritePngChunk(file, "IEND", std::vector<unsigned char>());
+	}
+
+	static void WritePngChunk(FILE* file, const char* type, const std::vector<unsigned char>& data)
+	{
+		std::vector<unsigned char> length;
+		PushBigEndian(length, static_cast<unsigned int>(data.size()));
+		std::fwrite(length.data(), 1, 4, file);
+		std::fwrite(type, 1, 4, file);
+		if (!data.empty())
+			std::fwrite(data.data(), 1, data.size(), file);
+
+		unsigned int crc = Crc32(0xFFFFFFFFu, reinterpret_cast<const unsigned char*>(type), 4);
+		crc = Crc32(crc, data.data(), data.size()) ^ 0xFFFFFFFFu;
+		std::vector<unsigned char> checksum;
+		PushBigEndian(checksum, crc);
+		std::fwrite(checksum.data(), 1, 4, file);
+	}
+
+	static void PushBigEndian(std::vector<unsigned char>& bytes, unsigned int value)
+	{
+		bytes.push_back(static_cast<unsigned char>(value >> 24));
+		bytes.push_back(static_cast<unsigned char>(value >> 16));
+		bytes.push_back(static_cast<unsigned char>(value >> 8));
+		bytes.push_back(static_cast<unsigned char>(value));
+	}
+
+	static unsigned int Crc32(unsigned int crc, const unsigned char* data, size_t size)
+	{
+		static unsigned int table[256];
+		static bool tableReady = false;
+		if (!tableReady)
+		{
+			for (unsigned int n = 0; n < 256; n++)
+			{
+				unsigned int c = n;
+				for (int k = 0; k < 8; k++)
+					c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+				table[n] = c;
+			}
+			tableReady = true;
+		}
+		for (size_t i = 0; i < size; i++)
+			crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+		return crc;
+	}
+
+	static unsigned int Adler32(const unsigned char* data, size_t size)
+	{
+		unsigned int a = 1, b = 0;
+		while (size > 0)
+		{
+			// largest run before b can overflow
+			size_t run = std::min<size_t>(size, 5552);
+			for (size_t i = 0; i < run; i++)
+			{
+				a += data[i];
+				b += a;
+			}
+			a %= 65521;
+			b %= 65521;
+			data += run;
+			size -= run;
+		}
+		return (b << 16) | a;
+	}
+
+	// full range BT.601, chroma averaged over 2x2 pixels
+	static void WriteY4mFrame(FILE* file, const unsigned char* rgba, int width, int height)
+	{
+		int chromaWidth = (width + 1) / 2;
+		int chromaHeight = (height + 1) / 2;
+		std::vector<unsigned char> luma(static_cast<size_t>(width) * height);
+		std::vector<unsigned char> u(static_cast<size_t>(chromaWidth) * chromaHeight);
+		std::vector<unsigned char> v(u.size());
+
+		for (int y = 0; y < height; y++)
+		{
+			const unsigned char* source = rgba + static_cast<size_t>(height - 1 - y) * width * 4;
+			for (int x = 0; x < width; x++)
+			{
+				float r = source[x * 4 + 0], g = source[x * 4 + 1], b = source[x * 4 + 2];
+				luma[static_cast<size_t>(y) * width + x] = ClampByte(0.299f * r + 0.587f * g + 0.114f * b);
+			}
+		}
+		for (int cy = 0; cy < chromaHeight; cy++)
+		{
+			for (int cx = 0; cx < chromaWidth; cx++)
+			{
+				float r = 0.0f, g = 0.0f, b = 0.0f;
+				for (int i = 0; i < 4; i++)
+				{
+					int x = std::min(cx * 2 + (i & 1), width - 1);
+					int y = std::min(cy * 2 + (i >> 1), height - 1);
+					const unsigned char* pixel = rgba + (static_cast<size_t>(height - 1 - y) * width + x) * 4;
+					r += pixel[0];
+					g += pixel[1];
+					b += pixel[2];
+				}
+				r *= 0.25f;
+				g *= 0.25f;
+				b *= 0.25f;
+				u[static_cast<size_t>(cy) * chromaWidth + cx] = ClampByte(128.0f - 0.168736f * r - 0.331264f * g + 0.5f * b);
+				v[static_cast<size_t>(cy) * chromaWidth + cx] = ClampByte(128.0f + 0.5f * r - 0.418688f * g - 0.081312f * b);
+			}
+		}
+
+		std::fputs("FRAME\n", file);
+		std::fwrite(luma.data(), 1, luma.size(), file);
+		std::fwrite(u.data(), 1, u.size(), file);
+		std::fwrite(v.data(), 1, v.size(), file);
+	}
+
+	static unsigned char ClampByte(float value)
+	{
+		return static_cast<unsigned char>(std::max(0.0f, std::min(value + 0.5f, 255.0f)));
+	}
+};
+
+#endif // !FRAME_CAPTURE_H
@@ -0,0 +1,161 @@
+#ifndef FRAME_PACING_H
+#define FRAME_PACING_H
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "stats.h"
+
+// Keeps the cpu from running more than a few frames ahead of the gpu.
+// EndFrame() puts a fence behind the work of a frame, BeginFrame() waits for
+// the fence of the frame that is maxFramesInFlight frames old before the next
+// one starts, so input is sampled as late as the queue depth allows.
+// Optionally also caps the frame rate with a sleep plus a short spin.
+class FramePacer
+{
+public:
+	static const int MAX_FRAMES_IN_FLIGHT = 3;
+
+	// needs a current context
+	FramePacer()
+	{
+		for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+		{
+			glGenQueries(2, frames[i].timestamps);
+		}
+		lastFrameStart = std::chrono::steady_clock::now();
+	}
+
+	~FramePacer()
+	{
+		for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; i++)
+		{
+			if (frames[i].fence)
+				glDeleteSync(frames[i].fence);
+			glDeleteQueries(2, frames[i].timestamps);
+		}
+	}
+
+	void SetMaxFramesInFlight(int count)
+	{
+		maxFramesInFlight = std::max(1, std::min(count, MAX_FRAMES_IN_FLIGHT));
+	}
+
+	// 0 turns the limiter off
+	void SetFrameRateLimit(int framesPerSecond)
+	{
+		frameRateLimit = std::max(framesPerSecond, 0);
+	}
+
+	void BeginFrame()
+	{
+		CpuTimer timer;
+		// the frame maxFramesInFlight back has to be done, older ones are too
+		for (int age = MAX_FRAMES_IN_FLIGHT; age >= maxFramesInFlight; age--)
+		{
+			if (frameIndex >= static_cast<unsigned long long>(age))
+				WaitForFrame(frames[(frameIndex - age) % MAX_FRAMES_IN_FLIGHT]);
+		}
+		FenceWaitMs = timer.ElapsedMs();
+
+		timer.Reset();
+		if (frameRateLimit > 0)
+		{
+			std::chrono::steady_clock::time_point target = lastFrameStart +
+				std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / frameRateLimit));
+			SleepUntil(target);
+		}
+		LimiterWaitMs = timer.ElapsedMs();
+		lastFrameStart = std::chrono::steady_clock::now();
+
+		Frame& frame = frames[frameIndex % MAX_FRAMES_IN_FLIGHT];
+		glGetInteger64v(GL_TIMESTAMP, &frame.startTime);
+		glQueryCounter(frame.timestamps[0], GL_TIMESTAMP);
+	}
+
+	// call after the swap so the fence covers it
+	void EndFrame()
+	{
+		Frame& frame = frames[frameIndex % MAX_FRAMES_IN_FLIGHT];
+		glQueryCounter(frame.timestamps[1], GL_TIMESTAMP);
+		frame.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		frame.pending = true;
+		frameIndex++;
+	}
+
+	void ReportStats(FrameStats& stats) const
+	{
+		stats.Set("Frames in flight", static_cast<float>(maxFramesInFlight));
+		stats.Set("Fence wait ms", FenceWaitMs);
+		stats.Set("Limiter wait ms", LimiterWaitMs);
+		stats.Set("GPU busy ms", GpuBusyMs);
+		stats.Set("GPU latency ms", LatencyMs);
+	}
+
+	// cpu time blocked on fences this frame
+	float FenceWaitMs = 0.0f;
+	float LimiterWaitMs = 0.0f;
+	// gpu time between the first and last command of the last finished frame
+	float GpuBusyMs = 0.0f;
+	// from BeginFrame of the last finished frame until the gpu was done with it
+	float LatencyMs = 0.0f;
+
+private:
+	struct Frame
+	{
+		GLsync fence = 0;
+		GLuint timestamps[2] = {};
+		// gpu clock when the cpu started the frame
+		GLint64 startTime = 0;
+		bool pending = false;
+	};
+
+	Frame frames[MAX_FRAMES_IN_FLIGHT];
+	unsigned long long frameIndex = 0;
+	int maxFramesInFlight = 2;
+	int frameRateLimit = 0;
+	std::chrono::steady_clock::time_point lastFrameStart;
+
+	void WaitForFrame(Frame& frame)
+	{
+		if (!frame.pending)
+			return;
+
+		// the flush makes sure the fence is actually on its way to the gpu
+		GLenum result = glClientWaitSync(frame.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 0);
+		while (result == GL_TIMEOUT_EXPIRED)
+		{
+			result = glClientWaitSync(frame.fence, 0, 1000000);
+		}
+		glDeleteSync(frame.fence);
+		frame.fence = 0;
+		frame.pending = false;
+
+		// everything before the fence is finished, so are the queries
+		GLuint64 begin = 0, end = 0;
+		glGetQueryObjectui64v(frame.timestamps[0], GL_QUERY_RESULT, &begin);
+		glGetQueryObjectui64v(frame.timestamps[1], GL_QUERY_RESULT, &end);
+		GpuBusyMs = static_cast<float>(end - begin) / 1000000.0f;
+		LatencyMs = static_cast<float>(static_cast<GLint64>(end) - frame.startTime) / 1000000.0f;
+	}
+
+	// sleeps most of the way, the scheduler is only good to about a millisecond
+	static void SleepUntil(std::chrono::steady_clock::time_point target)
+	{
+		const std::chrono::microseconds spinTime(1500);
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		if (target - now > spinTime)
+		{
+			std::this_thread::sleep_for(target - now - spinTime);
+		}
+		while (std::chrono::steady_clock::now() < target)
+		{
+			std::this_thread::yield();
+		}
+	}
+};
+
+#endif // !FRAME_PACING_H
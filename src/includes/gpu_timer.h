@@ -0,0 +1,148 @@
+#ifndef GPU_TIMER_H
+#define GPU_TIMER_H
+
+#include <glad/glad.h>
+
+// Measures gpu time between Begin() and End() with timestamp queries, so it
+// can be nested with anything else. Results are read a few frames later to
+// not stall the pipeline, ElapsedMs is the newest value that is available.
+class GpuTimer
+{
+public:
+	static const int LATENCY = 4;
+
+	~GpuTimer()
+	{
+		if (created)
+			glDeleteQueries(LATENCY * 2, &queries[0][0]);
+	}
+
+	void Begin()
+	{
+		if (!created)
+		{
+			glGenQueries(LATENCY * 2, &queries[0][0]);
+			created = true;
+		}
+
+		int slot = index % LATENCY;
+		if (pending[slot])
+		{
+			// the slot is LATENCY frames old, waiting for it is the exception
+			Resolve(slot);
+		}
+		glQueryCounter(queries[slot][0], GL_TIMESTAMP);
+	}
+
+	void End()
+	{
+		int slot = index % LATENCY;
+		glQueryCounter(queries[slot][1], GL_TIMESTAMP);
+		pending[slot] = true;
+		index++;
+
+		// pick up whatever finished in the meantime
+		for (int age = LATENCY - 1; age >= 1; age--)
+		{
+			int old = (index - 1 - age + LATENCY * 2) % LATENCY;
+			if (pending[old] && IsAvailable(old))
+				Resolve(old);
+		}
+	}
+
+	float ElapsedMs = 0.0f;
+
+private:
+	GLuint queries[LATENCY][2] = {};
+	bool pending[LATENCY] = {};
+	int index = 0;
+	bool created = false;
+
+	bool IsAvailable(int slot) const
+	{
+		GLint available = 0;
+		glGetQueryObjectiv(queries[slot][1], GL_QUERY_RESULT_AVAILABLE, &available);
+		return available != 0;
+	}
+
+	void Resolve(int slot)
+	{
+		GLuint64 begin = 0, end = 0;
+		glGetQueryObjectui64v(queries[slot][0], GL_QUERY_RESULT, &begin);
+		glGetQueryObjectui64v(queries[slot][1], GL_QUERY_RESULT, &end);
+		ElapsedMs = static_cast<float>(end - begin) / 1000000.0f;
+		pending[slot] = false;
+	}
+};
+
+// Counts fragments between Begin() and End(), read back with the same latency
+// as GpuTimer. Uses fragment shader invocations where pipeline statistics are
+// core (4.6), otherwise samples that passed the depth test, which with early
+// depth testing is the number of fragments that got shaded.
+// The samples passed flavor can't overlap other occlusion queries.
+class FragmentCounter
+{
+public:
+	static const int LATENCY = 4;
+
+	~FragmentCounter()
+	{
+		if (created)
+			glDeleteQueries(LATENCY, queries);
+	}
+
+	bool CountsInvocations() const { return GLAD_GL_VERSION_4_6 != 0; }
+
+	void Begin()
+	{
+		if (!created)
+		{
+			glGenQueries(LATENCY, queries);
+			target = CountsInvocations() ? GL_FRAGMENT_SHADER_INVOCATIONS : GL_SAMPLES_PASSED;
+			created = true;
+		}
+
+		int slot = index % LATENCY;
+		if (pending[slot])
+			Resolve(slot);
+		glBeginQuery(target, queries[slot]);
+	}
+
+	void End()
+	{
+		glEndQuery(target);
+		pending[index % LATENCY] = true;
+		index++;
+
+		for (int age = LATENCY - 1; age >= 1; age--)
+		{
+			int old = (index - 1 - age + LATENCY * 2) % LATENCY;
+			if (pending[old] && IsAvailable(old))
+				Resolve(old);
+		}
+	}
+
+	GLuint64 Count = 0;
+
+private:
+	GLuint queries[LATENCY] = {};
+	bool pending[LATENCY] = {};
+	int index = 0;
+	bool created = false;
+	GLenum target = GL_SAMPLES_PASSED;
+
+	bool IsAvailable(int slot) const
+	{
+		GLint available = 0;
+		glGetQueryObjectiv(queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+		return available != 0;
+	}
+
+	void Resolve(int slot)
+	{
+		glGetQueryObjectui64v(queries[slot], GL_QUERY_RESULT, &Count);
+		pending[slot] = false;
+	}
+};
+
+#endif // !GPU_TIMER_H
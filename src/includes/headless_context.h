@@ -0,0 +1,331 @@
+#ifndef HEADLESS_CONTEXT_H
+#define HEADLESS_CONTEXT_H
+
+#include <glad/glad.h>
+#include <GLFW/glfw3.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#if defined(MAKETRIANGLES_EGL)
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#elif defined(MAKETRIANGLES_OSMESA)
+#include <GL/osmesa.h>
+#endif
+
+#include "poster_render.h"
+#include "LogHelper.h"
+
+// Command line of a headless run:
+//   --headless [--size WIDTHxHEIGHT] [--frames N] [--fps N] [--path camera.txt] [--out directory] [--format png|ppm|y4m]
+//              [--workers N] [--range FIRST COUNT] [--progress] [--part] [--poster WIDTHxHEIGHT]
+// --character model [--characters N] [--baked] also work with a window.
+struct HeadlessOptions
+{
+	bool Enabled = false;
+	int Width = 1280;
+	int Height = 720;
+	int Frames = 240;
+	float FramesPerSecond = 60.0f;
+	// camera key file, see CameraPath::Load, an orbit around the scene if empty
+	std::string CameraPath;
+	// frames are written here, nothing is written if empty
+	std::string OutputDirectory;
+	// see ParseCaptureFormat
+	std::string OutputFormat = "png";
+	// more than one splits the frames across worker processes, see RunBatch
+	int Workers = 0;
+	// the part of the frames this process renders, all of them by default
+	int RangeFirst = 0;
+	int RangeCount = -1;
+	// "PROGRESS n" on stdout after every frame, for the batch coordinator
+	bool Progress = false;
+	// set by the batch coordinator for its workers, their output is put together by the coordinator
+	bool Part = false;
+	// a single still of this size in tiles of Width x Height, the frames are the tiles
+	int PosterWidth = 0;
+	int PosterHeight = 0;
+	// an animated model, drawn CharacterCount times next to the boxes
+	std::string CharacterPath;
+	int CharacterCount = 1;
+	// the characters start out with baked animation textures instead of palettes
+	bool BakedAnimation = false;
+};
+
+// false on arguments it doesn't understand
+inline bool ParseHeadlessOptions(int argc, char** argv, HeadlessOptions& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--headless")
+			options.Enabled = true;
+		else if (arg == "--size" && hasValue)
+		{
+			if (std::sscanf(argv[++i], "%dx%d", &options.Width, &options.Height) != 2 || options.Width <= 0 || options.Height <= 0)
+				return false;
+		}
+		else if (arg == "--frames" && hasValue)
+			options.Frames = std::atoi(argv[++i]);
+		else if (arg == "--fps" && hasValue)
+			options.FramesPerSecond = static_cast<float>(std::atof(argv[++i]));
+		else if (arg == "--path" && hasValue)
+			options.CameraPath = argv[++i];
+		else if (arg == "--out" && hasValue)
+			options.OutputDirectory = argv[++i];
+		else if (arg == "--format" && hasValue)
+			options.OutputFormat = argv[++i];
+		else if (arg == "--workers" && hasValue)
+			options.Workers = std::atoi(argv[++i]);
+		else if (arg == "--range" && i + 2 < argc)
+		{
+			options.RangeFirst = std::atoi(argv[++i]);
+			options.RangeCount = std::atoi(argv[++i]);
+		}
+		else if (arg == "--character" && hasValue)
+			options.CharacterPath = argv[++i];
+		else if (arg == "--characters" && hasValue)
+			options.CharacterCount = std::atoi(argv[++i]);
+		else if (arg == "--baked")
+			options.BakedAnimation = true;
+		else if (arg == "--progress")
+			options.Progress = true;
+		else if (arg == "--part")
+			options.Part = true;
+		else if (arg == "--poster" && hasValue)
+		{
+			if (std::sscanf(argv[++i], "%dx%d", &options.PosterWidth, &options.PosterHeight) != 2 || options.PosterWidth <= 0 || options.PosterHeight <= 0)
+				return false;
+		}
+		else
+			return false;
+	}
+	if (options.PosterWidth > 0)
+		options.Frames = PosterTiles(options.PosterWidth, options.PosterHeight, options.Width, options.Height).GetTileCount();
+	if (options.RangeCount < 0)
+		options.RangeCount = options.Frames - options.RangeFirst;
+	return options.FramesPerSecond > 0.0f && options.CharacterCount >= 0 && options.RangeFirst >= 0 && options.RangeFirst + options.RangeCount <= options.Frames;
+}
+
+// OpenGL 3.3 core context without a window or display, for build machines
+// that have neither (Mesa llvmpipe does the rendering on the cpu).
+// Compiled in with one of
+//   MAKETRIANGLES_EGL:    surfaceless EGL display (EGL_MESA_platform_surfaceless), link EGL
+//   MAKETRIANGLES_OSMESA: OSMesa context, link OSMesa
+// Without either Create() fails and the app needs a window.
+// There is no default framebuffer to present to, the app renders into
+// GetFramebuffer() instead, an RGBA8 color target of the requested size.
+class HeadlessContext
+{
+public:
+	~HeadlessContext()
+	{
+		Destroy();
+	}
+
+	// Creates the context and makes it current, gl calls need gladLoadGLLoader(GetProcAddress) first.
+	// Builds with MAKETRIANGLES_EGL or MAKETRIANGLES_OSMESA need no display. Without them, or when
+	// they fail, it is a hidden GLFW window, which does need one (Xvfb on a build farm).
+	bool Create(int width, int height)
+	{
+		this->width = width;
+		this->height = height;
+		UsesWindow() = false;
+		if (CreateOffscreen())
+			return true;
+		return CreateHiddenWindow();
+	}
+
+	// EGL or OSMesa, whichever the build has
+	bool CreateOffscreen()
+	{
+#if defined(MAKETRIANGLES_EGL)
+		PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+			reinterpret_cast<PFNEGLGETPLATFORMDISPLAYEXTPROC>(eglGetProcAddress("eglGetPlatformDisplayEXT"));
+		display = getPlatformDisplay ? getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL) : EGL_NO_DISPLAY;
+		// drivers without the surfaceless platform may still hand out a display
+		if (display == EGL_NO_DISPLAY)
+			display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+		EGLint major = 0, minor = 0;
+		if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+		{
+			LOG("HEADLESS::EGL:: No display");
+			return false;
+		}
+
+		const EGLint configAttributes[] = {
+			EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+			EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+			EGL_NONE
+		};
+		EGLConfig config;
+		EGLint configCount = 0;
+		if (!eglChooseConfig(display, configAttributes, &config, 1, &configCount) || configCount == 0)
+		{
+			LOG("HEADLESS::EGL:: No desktop OpenGL config");
+			return false;
+		}
+
+		eglBindAPI(EGL_OPENGL_API);
+		const EGLint contextAttributes[] = {
+			EGL_CONTEXT_MAJOR_VERSION, 3,
+			EGL_CONTEXT_MINOR_VERSION, 3,
+			EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+			EGL_NONE
+		};
+		context = eglCreateContext(display, config, EGL_NO_CONTEXT, contextAttributes);
+		// no surface at all, EGL_KHR_surfaceless_context
+		if (context == EGL_NO_CONTEXT || !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, context))
+		{
+			LOG("HEADLESS::EGL:: Could not create a 3.3 core context");
+			return false;
+		}
+		LOG("HEADLESS::EGL " << major << "." << minor);
+		return true;
+#elif defined(MAKETRIANGLES_OSMESA)
+		const int attributes[] = {
+			OSMESA_FORMAT, OSMESA_RGBA,
+			OSMESA_DEPTH_BITS, 0,
+			OSMESA_PROFILE, OSMESA_CORE_PROFILE,
+			OSMESA_CONTEXT_MAJOR_VERSION, 3,
+			OSMESA_CONTEXT_MINOR_VERSION, 3,
+			0
+		};
+		context = OSMesaCreateContextAttribs(attributes, NULL);
+		// OSMesa wants a buffer to be current, the app draws into its own framebuffer anyway
+		osmesaBuffer.resize(static_cast<size_t>(width) * height * 4);
+		if (!context || !OSMesaMakeCurrent(context, osmesaBuffer.data(), GL_UNSIGNED_BYTE, width, height))
+		{
+			LOG("HEADLESS::OSMESA:: Could not create a 3.3 core context");
+			return false;
+		}
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	// the app draws into its own framebuffer, the window is never shown
+	bool CreateHiddenWindow()
+	{
+		if (!glfwInit())
+		{
+			LOG("HEADLESS::GLFW:: Could not initialize, a hidden window needs a display");
+			return false;
+		}
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+		glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+		glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+#ifdef __APPLE__
+		glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+#endif
+		glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
+		window = glfwCreateWindow(1, 1, "MakeTriangles", NULL, NULL);
+		if (!window)
+		{
+			LOG("HEADLESS::GLFW:: Could not create a hidden 3.3 core window");
+			glfwTerminate();
+			return false;
+		}
+		glfwMakeContextCurrent(window);
+		UsesWindow() = true;
+		LOG("HEADLESS:: No offscreen context, rendering through a hidden window");
+		return true;
+	}
+
+	// for gladLoadGLLoader
+	static void* GetProcAddress(const char* name)
+	{
+		if (UsesWindow())
+			return reinterpret_cast<void*>(glfwGetProcAddress(name));
+#if defined(MAKETRIANGLES_EGL)
+		return reinterpret_cast<void*>(eglGetProcAddress(name));
+#elif defined(MAKETRIANGLES_OSMESA)
+		return reinterpret_cast<void*>(OSMesaGetProcAddress(name));
+#else
+		return nullptr;
+#endif
+	}
+
+	// the stand-in for the default framebuffer, needs a loaded context
+	void CreateFramebuffer()
+	{
+		GLCall(glGenFramebuffers(1, &fbo));
+		GLCall(glBindFramebuffer(GL_FRAMEBUFFER, fbo));
+		GLCall(glGenRenderbuffers(1, &colorBuffer));
+		GLCall(glBindRenderbuffer(GL_RENDERBUFFER, colorBuffer));
+		GLCall(glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height));
+		GLCall(glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, colorBuffer));
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			LOG("ERROR::HEADLESS:: Framebuffer is not complete!");
+		GLCall(glBindRenderbuffer(GL_RENDERBUFFER, 0));
+		GLCall(glBindFramebuffer(GL_FRAMEBUFFER, 0));
+	}
+
+	unsigned int GetFramebuffer() const { return fbo; }
+	int GetWidth() const { return width; }
+	int GetHeight() const { return height; }
+
+	void Destroy()
+	{
+		if (fbo)
+		{
+			glDeleteFramebuffers(1, &fbo);
+			glDeleteRenderbuffers(1, &colorBuffer);
+			fbo = 0;
+		}
+#if defined(MAKETRIANGLES_EGL)
+		if (context != EGL_NO_CONTEXT)
+		{
+			eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+			eglDestroyContext(display, context);
+			context = EGL_NO_CONTEXT;
+		}
+		if (display != EGL_NO_DISPLAY)
+		{
+			eglTerminate(display);
+			display = EGL_NO_DISPLAY;
+		}
+#elif defined(MAKETRIANGLES_OSMESA)
+		if (context)
+		{
+			OSMesaDestroyContext(context);
+			context = NULL;
+		}
+#endif
+		if (window)
+		{
+			glfwDestroyWindow(window);
+			glfwTerminate();
+			window = nullptr;
+		}
+	}
+
+private:
+	int width = 0;
+	int height = 0;
+	unsigned int fbo = 0;
+	unsigned int colorBuffer = 0;
+#if defined(MAKETRIANGLES_EGL)
+	EGLDisplay display = EGL_NO_DISPLAY;
+	EGLContext context = EGL_NO_CONTEXT;
+#elif defined(MAKETRIANGLES_OSMESA)
+	OSMesaContext context = NULL;
+	std::vector<unsigned char> osmesaBuffer;
+#endif
+	GLFWwindow* window = nullptr;
+
+	// GetProcAddress is static, it has to know which one Create() ended up with
+	static bool& UsesWindow()
+	{
+		static bool usesWindow = false;
+		return usesWindow;
+	}
+};
+
+#endif // !HEADLESS_CONTEXT_H
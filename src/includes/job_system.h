@@ -0,0 +1,435 @@
+#ifndef JOB_SYSTEM_H
+#define JOB_SYSTEM_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Counts unfinished jobs. Jobs that depend on others wait on their counter,
+// waiting threads keep executing other jobs in the meantime.
+struct JobCounter
+{
+	std::atomic<int> value{ 0 };
+
+	bool IsDone() const
+	{
+		return value.load(std::memory_order_acquire) == 0;
+	}
+};
+
+struct Job;
+
+// Free jobs of one thread. A job always goes back to the pool that allocated it,
+// jobs finished on another thread are pushed onto returned, which the owning
+// thread takes over in one exchange once its own list runs dry.
+struct JobPool
+{
+	std::vector<Job*> jobs;
+	std::atomic<Job*> returned{ nullptr };
+
+	~JobPool();
+};
+
+struct Job
+{
+	std::function<void()> task;
+	JobCounter* counter = nullptr;
+	JobPool* pool = nullptr;
+	Job* next = nullptr;
+};
+
+inline JobPool::~JobPool()
+{
+	for (unsigned int i = 0; i < jobs.size(); i++)
+		delete jobs[i];
+	Job* job = returned.exchange(nullptr);
+	while (job)
+	{
+		Job* next = job->next;
+		delete job;
+		job = next;
+	}
+}
+
+// Chase-Lev work stealing deque. The owning thread pushes and pops at the
+// bottom, every other thread steals from the top.
+class JobQueue
+{
+public:
+	static const int64_t CAPACITY = 4096;
+
+	bool Push(Job* job)
+	{
+		int64_t b = bottom.load(std::memory_order_relaxed);
+		int64_t t = top.load(std::memory_order_acquire);
+		if (b - t >= CAPACITY)
+			return false;
+
+		buffer[b & (CAPACITY - 1)].store(job, std::memory_order_release);
+		bottom.store(b + 1, std::memory_order_release);
+		return true;
+	}
+
+	Job* Pop()
+	{
+		int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+		bottom.store(b, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t t = top.load(std::memory_order_relaxed);
+
+		if (t > b)
+		{
+			bottom.store(b + 1, std::memory_order_relaxed);
+			return nullptr;
+		}
+
+		Job* job = buffer[b & (CAPACITY - 1)].load(std::memory_order_relaxed);
+		if (t == b)
+		{
+			// last item, race against thieves for it
+			if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			{
+				job = nullptr;
+			}
+			bottom.store(b + 1, std::memory_order_relaxed);
+		}
+		return job;
+	}
+
+	Job* Steal()
+	{
+		int64_t t = top.load(std::memory_order_acquire);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		int64_t b = bottom.load(std::memory_order_acquire);
+		if (t >= b)
+			return nullptr;
+
+		Job* job = buffer[t & (CAPACITY - 1)].load(std::memory_order_acquire);
+		if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+			return nullptr;
+		return job;
+	}
+
+private:
+	std::atomic<int64_t> top{ 0 };
+	std::atomic<int64_t> bottom{ 0 };
+	std::atomic<Job*> buffer[CAPACITY];
+};
+
+// Fixed pool of worker threads with one deque each. The thread that creates
+// the system owns queue 0 and takes part in the work whenever it waits. Other
+// threads that are not part of the pool hand their jobs in through a locked queue.
+class JobSystem
+{
+public:
+	// GetThreadIndex of a thread outside the pool
+	static const unsigned int NOT_A_POOL_THREAD = 0xFFFFFFFFu;
+
+	// threadCount counts the creating thread, 0 uses every hardware thread
+	JobSystem(unsigned int threadCount = 0)
+	{
+		if (threadCount == 0)
+		{
+			threadCount = std::max(std::thread::hardware_concurrency(), 1u);
+		}
+
+		queues.resize(threadCount);
+		for (unsigned int i = 0; i < threadCount; i++)
+		{
+			queues[i] = new JobQueue();
+		}
+
+		ThreadIndex() = 0;
+		ThreadOwner() = this;
+		for (unsigned int i = 1; i < threadCount; i++)
+		{
+			workers.push_back(std::thread(&JobSystem::WorkerLoop, this, i));
+		}
+	}
+
+	~JobSystem()
+	{
+		running.store(false);
+		wake.notify_all();
+		for (unsigned int i = 0; i < workers.size(); i++)
+		{
+			workers[i].join();
+		}
+		for (unsigned int i = 0; i < queues.size(); i++)
+		{
+			delete queues[i];
+		}
+		if (ThreadOwner() == this)
+		{
+			ThreadOwner() = nullptr;
+		}
+	}
+
+	unsigned int GetThreadCount() const { return static_cast<unsigned int>(queues.size()); }
+	// index of the calling pool thread in [0, GetThreadCount()), handy for per thread data.
+	// A thread outside the pool that helps in Wait gets NOT_A_POOL_THREAD, not the
+	// creating thread's index 0, whose data it would be sharing without a lock.
+	unsigned int GetThreadIndex() const { return ThreadOwner() == this ? ThreadIndex() : NOT_A_POOL_THREAD; }
+
+	void Run(const std::function<void()>& task, JobCounter* counter = nullptr)
+	{
+		Job* job = AllocateJob();
+		job->task = task;
+		job->counter = counter;
+		if (counter)
+		{
+			counter->value.fetch_add(1, std::memory_order_relaxed);
+		}
+
+		if (ThreadOwner() == this)
+		{
+			// queue full, just do it now
+			if (!queues[ThreadIndex()]->Push(job))
+			{
+				Execute(job);
+				return;
+			}
+		}
+		else
+		{
+			std::lock_guard<std::mutex> lock(injectMutex);
+			injected.push_back(job);
+			injectedCount.fetch_add(1, std::memory_order_release);
+		}
+
+		if (sleeping.load(std::memory_order_relaxed) > 0)
+		{
+			wake.notify_one();
+		}
+	}
+
+	// runs task once dependency has finished
+	void Run(const std::function<void()>& task, JobCounter* counter, JobCounter* dependency)
+	{
+		Run([this, task, dependency]()
+		{
+			Wait(*dependency);
+			task();
+		}, counter);
+	}
+
+	// helps out with other jobs until the counter reaches zero
+	void Wait(const JobCounter& counter)
+	{
+		while (!counter.IsDone())
+		{
+			Job* job = FindJob();
+			if (job)
+			{
+				Execute(job);
+			}
+			else
+			{
+				std::this_thread::yield();
+			}
+		}
+	}
+
+	// calls func(begin, end) over [0, count) in batches of batchSize and waits for all of them
+	void ParallelFor(unsigned int count, unsigned int batchSize, const std::function<void(unsigned int, unsigned int)>& func)
+	{
+		if (count == 0)
+			return;
+
+		batchSize = std::max(batchSize, 1u);
+		if (count <= batchSize || GetThreadCount() == 1)
+		{
+			func(0, count);
+			return;
+		}
+
+		JobCounter counter;
+		for (unsigned int begin = 0; begin < count; begin += batchSize)
+		{
+			unsigned int end = std::min(begin + batchSize, count);
+			Run([&func, begin, end]() { func(begin, end); }, &counter);
+		}
+		Wait(counter);
+	}
+
+private:
+	std::vector<JobQueue*> queues;
+	std::vector<std::thread> workers;
+	std::atomic<bool> running{ true };
+
+	std::mutex injectMutex;
+	std::deque<Job*> injected;
+	std::atomic<int> injectedCount{ 0 };
+
+	std::mutex sleepMutex;
+	std::condition_variable wake;
+	std::atomic<int> sleeping{ 0 };
+
+	// jobs of threads outside the pool. Such a thread may exit while its jobs are
+	// still queued, so they come from here, which lives as long as the system.
+	std::mutex sharedPoolMutex;
+	JobPool sharedPool;
+
+	static unsigned int& ThreadIndex()
+	{
+		static thread_local unsigned int index = 0;
+		return index;
+	}
+
+	static JobSystem*& ThreadOwner()
+	{
+		static thread_local JobSystem* owner = nullptr;
+		return owner;
+	}
+
+	// Jobs are recycled through a pool per pool thread, so allocating takes no lock.
+	// The pool dies with its thread: the workers' when the destructor joins them,
+	// the creating thread's at its exit, with no jobs in flight by then.
+	static JobPool& ThreadPool()
+	{
+		static thread_local JobPool pool;
+		return pool;
+	}
+
+	Job* AllocateJob()
+	{
+		if (ThreadOwner() != this)
+		{
+			std::lock_guard<std::mutex> lock(sharedPoolMutex);
+			return TakeJob(sharedPool);
+		}
+		return TakeJob(ThreadPool());
+	}
+
+	static Job* TakeJob(JobPool& pool)
+	{
+		if (pool.jobs.empty())
+		{
+			// only the owner, or the holder of the shared pool's lock, ever takes from returned,
+			// so there is no ABA to worry about
+			Job* returned = pool.returned.exchange(nullptr, std::memory_order_acquire);
+			while (returned)
+			{
+				pool.jobs.push_back(returned);
+				returned = returned->next;
+			}
+		}
+		if (pool.jobs.empty())
+		{
+			Job* job = new Job();
+			job->pool = &pool;
+			return job;
+		}
+
+		Job* job = pool.jobs.back();
+		pool.jobs.pop_back();
+		return job;
+	}
+
+	void FreeJob(Job* job)
+	{
+		JobPool* pool = job->pool;
+		// outside threads never touch their own thread_local pool
+		if (ThreadOwner() == this && pool == &ThreadPool())
+		{
+			pool->jobs.push_back(job);
+			return;
+		}
+
+		Job* head = pool->returned.load(std::memory_order_relaxed);
+		do
+		{
+			job->next = head;
+		} while (!pool->returned.compare_exchange_weak(head, job, std::memory_order_release, std::memory_order_relaxed));
+	}
+
+	void Execute(Job* job)
+	{
+		job->task();
+		JobCounter* counter = job->counter;
+		job->task = nullptr;
+		job->counter = nullptr;
+		FreeJob(job);
+
+		if (counter)
+		{
+			counter->value.fetch_sub(1, std::memory_order_acq_rel);
+		}
+	}
+
+	Job* FindJob()
+	{
+		Job* job = nullptr;
+		unsigned int self = ThreadOwner() == this ? ThreadIndex() : 0;
+		if (ThreadOwner() == this)
+		{
+			job = queues[self]->Pop();
+			if (job)
+				return job;
+		}
+
+		// steal, starting next to ourselves so thieves spread out
+		unsigned int count = GetThreadCount();
+		for (unsigned int i = 1; i <= count; i++)
+		{
+			unsigned int victim = (self + i) % count;
+			if (victim == self && ThreadOwner() == this)
+				continue;
+			job = queues[victim]->Steal();
+			if (job)
+				return job;
+		}
+
+		if (injectedCount.load(std::memory_order_acquire) == 0)
+			return nullptr;
+
+		std::lock_guard<std::mutex> lock(injectMutex);
+		if (!injected.empty())
+		{
+			job = injected.front();
+			injected.pop_front();
+			injectedCount.fetch_sub(1, std::memory_order_relaxed);
+		}
+		return job;
+	}
+
+	void WorkerLoop(unsigned int index)
+	{
+		ThreadIndex() = index;
+		ThreadOwner() = this;
+
+		int idleSpins = 0;
+		while (running.load(std::memory_order_relaxed))
+		{
+			Job* job = FindJob();
+			if (job)
+			{
+				Execute(job);
+				idleSpins = 0;
+				continue;
+			}
+
+			if (++idleSpins < 64)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+
+			// nothing to do for a while, sleep until new work shows up
+			std::unique_lock<std::mutex> lock(sleepMutex);
+			sleeping.fetch_add(1);
+			wake.wait_for(lock, std::chrono::milliseconds(1));
+			sleeping.fetch_sub(1);
+			idleSpins = 0;
+		}
+	}
+};
+
+#endif // !JOB_SYSTEM_H
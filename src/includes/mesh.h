@@ -6,8 +6,10 @@
 #include <glm.hpp>
 #include <gtc/matrix_transform.hpp>
 
+#include "command_list.h"
 #include "shader.h"
 
+#include <cfloat>
 #include <string>
 #include <vector>
 #define MAX_BONE_INFLUENCE 4
@@ -26,6 +28,38 @@ struct Vertex
 	float m_Weights[MAX_BONE_INFLUENCE];
 };
 
+// per instance attributes of instanced draws, Model at locations 7 to 10 and Params at 11
+struct InstanceData
+{
+	glm::mat4 Model;
+	// up to the shader, the baked animation crowd keeps its clip and time here
+	glm::vec4 Params;
+};
+
+struct AABB
+{
+	glm::vec3 Min;
+	glm::vec3 Max;
+};
+
+// axis aligned bounds of a box after transformation
+inline AABB TransformBounds(const AABB& bounds, const glm::mat4& transform)
+{
+	AABB result;
+	result.Min = glm::vec3(FLT_MAX);
+	result.Max = glm::vec3(-FLT_MAX);
+	for (int i = 0; i < 8; i++)
+	{
+		glm::vec3 corner((i & 1) ? bounds.Max.x : bounds.Min.x,
+			(i & 2) ? bounds.Max.y : bounds.Min.y,
+			(i & 4) ? bounds.Max.z : bounds.Min.z);
+		glm::vec3 p = glm::vec3(transform * glm::vec4(corner, 1.0f));
+		result.Min = glm::min(result.Min, p);
+		result.Max = glm::max(result.Max, p);
+	}
+	return result;
+}
+
 struct Texture 
 {
 	unsigned int id;
@@ -40,14 +74,35 @@ public:
 	std::vector<Vertex> vertices;
 	std::vector<unsigned int> indices;
 	std::vector<Texture> textures;
+	// vertices[i].Position packed tightly, built once for the cpu occlusion culler and depth passes
+	std::vector<glm::vec3> positions;
+	// object space bounds of the vertex positions
+	AABB bounds;
+	// vertices carry bone weights, the bone palette places them in the model instead of the node transform
+	bool skinned = false;
 
 	Mesh(std::vector<Vertex> vertices, std::vector<unsigned int> indices, std::vector<Texture> textures);
 	void Draw(Shader& shader);
+	// same as Draw, but into a command list that is executed later on the gl thread
+	void Record(CommandList& list) const;
+	// positions only and no textures, for depth only passes
+	void DrawDepth();
+	void RecordDepth(CommandList& list) const;
+	// feeds the InstanceData attributes from buffer, for RecordInstanced
+	void SetInstanceBuffer(unsigned int buffer);
+	// Record as one draw of count instances
+	void RecordInstanced(CommandList& list, GLsizei count) const;
 private:
 	// render data
 	unsigned int VAO, VBO, EBO;
+	// tightly packed positions sharing EBO, depth passes fetch 12 bytes per vertex instead of the whole Vertex
+	unsigned int depthVAO, positionVBO;
+	// "material.texture_diffuse1" etc., one per texture, built once
+	std::vector<std::string> samplerNames;
 
 	void SetupMesh();
+	void ComputeBounds();
+	void SetupSamplerNames();
 };
 
 Mesh::Mesh(std::vector<Vertex> vertices, std::vector<unsigned int> indices, std::vector<Texture> textures)
@@ -56,9 +111,60 @@ Mesh::Mesh(std::vector<Vertex> vertices, std::vector<unsigned int> indices, std:
 	this->indices = indices;
 	this->textures = textures;
 
+	ComputeBounds();
+	SetupSamplerNames();
 	SetupMesh();
 }
 
+void Mesh::SetupSamplerNames()
+{
+	unsigned int diffuseNr = 1;
+	unsigned int specularNr = 1;
+	unsigned int normalNr = 1;
+	unsigned int heightNr = 1;
+
+	samplerNames.clear();
+	for (unsigned int i = 0; i < textures.size(); i++)
+	{
+		std::string number;
+		std::string name = textures[i].type;
+		if (name == "texture_diffuse")
+		{
+			number = std::to_string(diffuseNr++);
+		}
+		else if (name == "texture_specular")
+		{
+			number = std::to_string(specularNr++);
+		}
+		else if (name == "texture_normal")
+		{
+			number = std::to_string(normalNr++);
+		}
+		else if (name == "texture_height")
+		{
+			number = std::to_string(heightNr++);
+		}
+
+		samplerNames.push_back("material." + name + number);
+	}
+}
+
+void Mesh::ComputeBounds()
+{
+	bounds.Min = glm::vec3(0.0f);
+	bounds.Max = glm::vec3(0.0f);
+	if (vertices.empty())
+		return;
+
+	bounds.Min = vertices[0].Position;
+	bounds.Max = vertices[0].Position;
+	for (unsigned int i = 1; i < vertices.size(); i++)
+	{
+		bounds.Min = glm::min(bounds.Min, vertices[i].Position);
+		bounds.Max = glm::max(bounds.Max, vertices[i].Position);
+	}
+}
+
 void Mesh::SetupMesh()
 {
 	glGenVertexArrays(1, &VAO);
@@ -91,9 +197,9 @@ void Mesh::SetupMesh()
 	glEnableVertexAttribArray(4);
 	glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, Bitangent));
 
-	// bone ids
+	// bone ids, integers all the way to the shader, -1 for no bone
 	glEnableVertexAttribArray(5);
-	glVertexAttribPointer(5, 4, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)offsetof(Vertex, m_BoneIDs));
+	glVertexAttribIPointer(5, 4, GL_INT, sizeof(Vertex), (void*)offsetof(Vertex, m_BoneIDs));
 
 	// weights
 	glEnableVertexAttribArray(6);
@@ -101,39 +207,32 @@ void Mesh::SetupMesh()
 
 	glBindVertexArray(0);
 
+	positions.resize(vertices.size());
+	for (unsigned int i = 0; i < vertices.size(); i++)
+	{
+		positions[i] = vertices[i].Position;
+	}
+
+	glGenVertexArrays(1, &depthVAO);
+	glGenBuffers(1, &positionVBO);
+
+	glBindVertexArray(depthVAO);
+	glBindBuffer(GL_ARRAY_BUFFER, positionVBO);
+	glBufferData(GL_ARRAY_BUFFER, positions.size() * sizeof(glm::vec3), &positions[0], GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, EBO);
+
+	glEnableVertexAttribArray(0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(glm::vec3), (void*)0);
+
+	glBindVertexArray(0);
 }
 
 void Mesh::Draw(Shader& shader) 
 {
-	unsigned int diffuseNr = 1;
-	unsigned int specularNr = 1;
-	unsigned int normalNr = 1;
-	unsigned int heightNr = 1;
-
 	for (unsigned int i = 0; i < textures.size(); i++)
 	{
 		glActiveTexture(GL_TEXTURE0 + i);
-
-		std::string number;
-		std::string name = textures[i].type;
-		if (name == "texture_diffuse")
-		{
-			number = std::to_string(diffuseNr++);
-		}
-		else if (name == "texture_specular")
-		{
-			number = std::to_string(specularNr++);
-		}
-		else if (name == "texture_normal")
-		{
-			number = std::to_string(normalNr++);
-		}
-		else if (name == "texture_height")
-		{
-			number = std::to_string(heightNr++);
-		}
-
-		shader.setInt(("material." + name + number).c_str(), i);
+		shader.setInt(samplerNames[i].c_str(), i);
 		glBindTexture(GL_TEXTURE_2D, textures[i].id);
 	}
 	glActiveTexture(GL_TEXTURE0);
@@ -143,4 +242,58 @@ void Mesh::Draw(Shader& shader)
 	glBindVertexArray(0);
 }
 
+void Mesh::Record(CommandList& list) const
+{
+	// the sampler names live as long as the mesh
+	for (unsigned int i = 0; i < textures.size(); i++)
+	{
+		list.SetInt(samplerNames[i].c_str(), i);
+		list.BindTexture(GL_TEXTURE0 + i, GL_TEXTURE_2D, textures[i].id);
+	}
+
+	list.BindVertexArray(VAO);
+	list.DrawElements(GL_TRIANGLES, static_cast<GLsizei>(indices.size()), GL_UNSIGNED_INT, 0);
+}
+
+void Mesh::SetInstanceBuffer(unsigned int buffer)
+{
+	glBindVertexArray(VAO);
+	glBindBuffer(GL_ARRAY_BUFFER, buffer);
+	// a mat4 takes four locations, one column each
+	for (int i = 0; i < 4; i++)
+	{
+		glEnableVertexAttribArray(7 + i);
+		glVertexAttribPointer(7 + i, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)(offsetof(InstanceData, Model) + i * sizeof(glm::vec4)));
+		glVertexAttribDivisor(7 + i, 1);
+	}
+	glEnableVertexAttribArray(11);
+	glVertexAttribPointer(11, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData), (void*)offsetof(InstanceData, Params));
+	glVertexAttribDivisor(11, 1);
+	glBindVertexArray(0);
+}
+
+void Mesh::RecordInstanced(CommandList& list, GLsizei count) const
+{
+	for (unsigned int i = 0; i < textures.size(); i++)
+	{
+		list.SetInt(samplerNames[i].c_str(), i);
+		list.BindTexture(GL_TEXTURE0 + i, GL_TEXTURE_2D, textures[i].id);
+	}
+	list.BindVertexArray(VAO);
+	list.DrawElementsInstanced(GL_TRIANGLES, static_cast<GLsizei>(indices.size()), GL_UNSIGNED_INT, 0, count);
+}
+
+void Mesh::DrawDepth()
+{
+	glBindVertexArray(depthVAO);
+	glDrawElements(GL_TRIANGLES, static_cast<unsigned int>(indices.size()), GL_UNSIGNED_INT, 0);
+	glBindVertexArray(0);
+}
+
+void Mesh::RecordDepth(CommandList& list) const
+{
+	list.BindVertexArray(depthVAO);
+	list.DrawElements(GL_TRIANGLES, static_cast<GLsizei>(indices.size()), GL_UNSIGNED_INT, 0);
+}
+
 #endif // !MESH_H
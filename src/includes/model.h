@@ -1,44 +1,164 @@
 #ifndef MODEL_H
 #define MODEL_H
 
+#include "job_system.h"
 #include "mesh.h"
+#include "scene_graph.h"
+#include "skeletal_animation.h"
 #include <assimp/Importer.hpp>
 #include <assimp/scene.h>
 #include <assimp/postprocess.h>
 #include "stb_image.h"
 
 unsigned int TextureFromFile(const char* path, const std::string& director, bool gamma);
+void UploadTexture(unsigned int textureID, unsigned char* data, int width, int height, int nrComponents);
 
 class Model
 {
 public:
-	Model(const char* path)
+	// with a job system the textures of the model are decoded in parallel
+	Model(const char* path, JobSystem* jobs = nullptr)
 	{
+		this->jobs = jobs;
 		LoadModel(path);
 	}
 
-	void Draw(Shader& shader);
+	// sets the "model" uniform of every mesh to transform * node world matrix
+	void Draw(Shader& shader, const glm::mat4& transform);
+	// records what Draw would do, safe to call from any thread once the model is loaded
+	void Record(CommandList& list, const glm::mat4& transform) const;
+	// depth only flavors of the above, shader only needs "model" and binds no textures,
+	// skinned meshes come out in the bind pose, Record with a skinning shader poses them
+	void DrawDepth(Shader& shader, const glm::mat4& transform);
+	void RecordDepth(CommandList& list, const glm::mat4& transform) const;
+	// every mesh takes its per instance attributes from buffer, an array of InstanceData
+	void SetInstanceBuffer(unsigned int buffer);
+	// one draw per mesh for count instances, the instance matrix goes in front of "model"
+	void RecordInstanced(CommandList& list, GLsizei count) const;
+
+	const std::vector<Mesh>& GetMeshes() const { return meshes; }
+	// world matrix of the node a mesh hangs off, relative to the model root
+	const glm::mat4& GetMeshTransform(unsigned int mesh) const { return nodes.GetWorld(meshNodes[mesh]); }
+	SceneGraph& GetNodes() { return nodes; }
+	// union of all mesh bounds, in model space
+	const AABB& GetBounds() const { return bounds; }
+	// the joints are the nodes, empty without skinned meshes
+	const Skeleton& GetSkeleton() const { return skeleton; }
+	const std::vector<AnimationClip>& GetAnimations() const { return animations; }
+	bool IsSkinned() const { return skeleton.GetBoneCount() > 0; }
 private:
 	std::vector<Mesh> meshes;
+	AABB bounds{};
+	// aiNode hierarchy, meshNodes[i] is the node of meshes[i]
+	SceneGraph nodes;
+	Skeleton skeleton;
+	std::vector<AnimationClip> animations;
+	std::vector<unsigned int> meshNodes;
+	glm::mat4 identity = glm::mat4(1.0f);
 	std::string directory;
 	std::vector<Texture> textures_loaded;
+	JobSystem* jobs = nullptr;
+
+	// texture names are handed out while the meshes are built, the images
+	// themselves are decoded all at once afterwards
+	struct PendingTexture
+	{
+		std::string path;
+		unsigned int id;
+		unsigned char* data;
+		int width, height, nrComponents;
+	};
+	std::vector<PendingTexture> pendingTextures;
+
+	// skinned meshes get their node transform through the bone palette
+	const glm::mat4& GetDrawTransform(unsigned int mesh) const { return meshes[mesh].skinned ? identity : GetMeshTransform(mesh); }
+
 	void LoadModel(std::string path);
+	void LoadPendingTextures();
 
-	void ProcessNode(aiNode* node, const aiScene* scene);
+	void ProcessNode(aiNode* node, const aiScene* scene, unsigned int parent);
 	Mesh ProcessMesh(aiMesh* mesh, const aiScene* scene);
+	void ProcessBones(aiMesh* mesh, std::vector<Vertex>& vertices);
+	void LoadAnimations(const aiScene* scene);
 	std::vector<Texture> LoadMaterialTextures(aiMaterial* mat, aiTextureType type, std::string typeName);
 };
 
-void Model::Draw(Shader& shader)
+glm::mat4 AssimpToGlm(const aiMatrix4x4& m)
+{
+	// assimp matrices are row major
+	return glm::mat4(
+		glm::vec4(m.a1, m.b1, m.c1, m.d1),
+		glm::vec4(m.a2, m.b2, m.c2, m.d2),
+		glm::vec4(m.a3, m.b3, m.c3, m.d3),
+		glm::vec4(m.a4, m.b4, m.c4, m.d4));
+}
+
+void Model::Draw(Shader& shader, const glm::mat4& transform)
 {
+	glm::mat4 model;
 	for (unsigned int i = 0; i < meshes.size(); i++)
+	{
+		MultiplyMat4(transform, GetDrawTransform(i), model);
+		shader.setMat4("model", model);
 		meshes[i].Draw(shader);
+	}
+}
+
+void Model::Record(CommandList& list, const glm::mat4& transform) const
+{
+	glm::mat4 model;
+	for (unsigned int i = 0; i < meshes.size(); i++)
+	{
+		MultiplyMat4(transform, GetDrawTransform(i), model);
+		list.SetMat4("model", model);
+		meshes[i].Record(list);
+	}
+}
+
+void Model::DrawDepth(Shader& shader, const glm::mat4& transform)
+{
+	glm::mat4 model;
+	for (unsigned int i = 0; i < meshes.size(); i++)
+	{
+		MultiplyMat4(transform, GetMeshTransform(i), model);
+		shader.setMat4("model", model);
+		meshes[i].DrawDepth();
+	}
+}
+
+void Model::RecordDepth(CommandList& list, const glm::mat4& transform) const
+{
+	glm::mat4 model;
+	for (unsigned int i = 0; i < meshes.size(); i++)
+	{
+		MultiplyMat4(transform, GetMeshTransform(i), model);
+		list.SetMat4("model", model);
+		meshes[i].RecordDepth(list);
+	}
+}
+
+void Model::SetInstanceBuffer(unsigned int buffer)
+{
+	for (unsigned int i = 0; i < meshes.size(); i++)
+	{
+		meshes[i].SetInstanceBuffer(buffer);
+	}
+}
+
+void Model::RecordInstanced(CommandList& list, GLsizei count) const
+{
+	for (unsigned int i = 0; i < meshes.size(); i++)
+	{
+		list.SetMat4("model", GetDrawTransform(i));
+		meshes[i].RecordInstanced(list, count);
+	}
 }
 
 void Model::LoadModel(std::string path) 
 {
 	Assimp::Importer import;
-	const aiScene* scene = import.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs | aiProcess_GenSmoothNormals | aiProcess_CalcTangentSpace);
+	const aiScene* scene = import.ReadFile(path, aiProcess_Triangulate | aiProcess_FlipUVs | aiProcess_GenSmoothNormals | aiProcess_CalcTangentSpace |
+		aiProcess_LimitBoneWeights);
 
 	if (!scene || scene->mFlags & AI_SCENE_FLAGS_INCOMPLETE || !scene->mRootNode)
 	{
@@ -47,20 +167,45 @@ void Model::LoadModel(std::string path)
 	}
 	directory = path.substr(0, path.find_last_of('/'));
 
-	ProcessNode(scene->mRootNode, scene);
+	ProcessNode(scene->mRootNode, scene, SceneGraph::NO_PARENT);
+	nodes.Update();
+	skeleton.ResolveBones();
+	if (skeleton.GetBoneCount() > SkinningPalettes::MAX_BONES)
+	{
+		std::cout << "MODEL::" << skeleton.GetBoneCount() << " bones, vertices only follow the first " << SkinningPalettes::MAX_BONES << std::endl;
+	}
+	LoadAnimations(scene);
+	LoadPendingTextures();
+
+	for (unsigned int i = 0; i < meshes.size(); i++)
+	{
+		AABB meshBounds = TransformBounds(meshes[i].bounds, GetMeshTransform(i));
+		if (i == 0)
+		{
+			bounds = meshBounds;
+			continue;
+		}
+		bounds.Min = glm::min(bounds.Min, meshBounds.Min);
+		bounds.Max = glm::max(bounds.Max, meshBounds.Max);
+	}
 }
 
-void Model::ProcessNode(aiNode* node, const aiScene* scene)
+void Model::ProcessNode(aiNode* node, const aiScene* scene, unsigned int parent)
 {
+	// depth first, so parents always end up before their children
+	unsigned int index = nodes.AddNode(parent, AssimpToGlm(node->mTransformation));
+	skeleton.AddJoint(node->mName.C_Str(), parent, AssimpToGlm(node->mTransformation));
+
 	for (unsigned int i = 0; i < node->mNumMeshes; i++)
 	{
 		aiMesh* mesh = scene->mMeshes[node->mMeshes[i]];
 		meshes.push_back(ProcessMesh(mesh, scene));
+		meshNodes.push_back(index);
 	}
 
 	for (unsigned int i = 0; i < node->mNumChildren; i++) 
 	{
-		ProcessNode(node->mChildren[i], scene);
+		ProcessNode(node->mChildren[i], scene, index);
 	}
 }
 
@@ -112,8 +257,15 @@ Mesh Model::ProcessMesh(aiMesh* mesh, const aiScene* scene)
 			vertex.TexCoords = glm::vec2(0.0f, 0.0f);
 		}
 		
+		for (int j = 0; j < MAX_BONE_INFLUENCE; j++)
+		{
+			vertex.m_BoneIDs[j] = -1;
+			vertex.m_Weights[j] = 0.0f;
+		}
+		
 		vertices.push_back(vertex);
 	}
+	ProcessBones(mesh, vertices);
 
 	for (unsigned int i = 0; i < mesh->mNumFaces; i++)
 	{
@@ -137,7 +289,97 @@ Mesh Model::ProcessMesh(aiMesh* mesh, const aiScene* scene)
 		textures.insert(textures.end(), heightMaps.begin(), heightMaps.end());
 	}
 	
-	return Mesh(vertices, indices, textures);
+	Mesh result(vertices, indices, textures);
+	result.skinned = mesh->HasBones();
+	return result;
+}
+
+void Model::ProcessBones(aiMesh* mesh, std::vector<Vertex>& vertices)
+{
+	// aiProcess_LimitBoneWeights leaves at most MAX_BONE_INFLUENCE weights per vertex
+	unsigned int dropped = 0;
+	for (unsigned int i = 0; i < mesh->mNumBones; i++)
+	{
+		aiBone* bone = mesh->mBones[i];
+		int boneID = static_cast<int>(skeleton.AddBone(bone->mName.C_Str(), AssimpToGlm(bone->mOffsetMatrix)));
+		// the palette block only has room for MAX_BONES, ids past it would read outside the bound range
+		if (boneID >= static_cast<int>(SkinningPalettes::MAX_BONES))
+		{
+			dropped += bone->mNumWeights;
+			continue;
+		}
+		for (unsigned int w = 0; w < bone->mNumWeights; w++)
+		{
+			Vertex& vertex = vertices[bone->mWeights[w].mVertexId];
+			for (int j = 0; j < MAX_BONE_INFLUENCE; j++)
+			{
+				if (vertex.m_BoneIDs[j] < 0)
+				{
+					vertex.m_BoneIDs[j] = boneID;
+					vertex.m_Weights[j] = bone->mWeights[w].mWeight;
+					break;
+				}
+			}
+		}
+	}
+	if (dropped == 0)
+		return;
+
+	// the bones that are left take over the weight, vertices without any stay in the bind pose
+	std::cout << "MODEL::" << mesh->mName.C_Str() << " drops " << dropped << " weights of bones past " << SkinningPalettes::MAX_BONES << std::endl;
+	for (Vertex& vertex : vertices)
+	{
+		float sum = 0.0f;
+		for (int j = 0; j < MAX_BONE_INFLUENCE; j++)
+			sum += vertex.m_BoneIDs[j] >= 0 ? vertex.m_Weights[j] : 0.0f;
+		if (sum <= 0.0f)
+			continue;
+		for (int j = 0; j < MAX_BONE_INFLUENCE; j++)
+			vertex.m_Weights[j] /= sum;
+	}
+}
+
+void Model::LoadAnimations(const aiScene* scene)
+{
+	for (unsigned int i = 0; i < scene->mNumAnimations; i++)
+	{
+		const aiAnimation* animation = scene->mAnimations[i];
+		// keys are in ticks, exporters that leave the rate out mean 25 per second
+		double ticksPerSecond = animation->mTicksPerSecond > 0.0 ? animation->mTicksPerSecond : 25.0;
+		AnimationClip clip;
+		clip.Name = animation->mName.C_Str();
+		clip.Duration = static_cast<float>(animation->mDuration / ticksPerSecond);
+
+		for (unsigned int c = 0; c < animation->mNumChannels; c++)
+		{
+			const aiNodeAnim* nodeAnim = animation->mChannels[c];
+			AnimationChannel channel;
+			channel.Joint = skeleton.FindJoint(nodeAnim->mNodeName.C_Str());
+			if (channel.Joint == Skeleton::NO_JOINT || !nodeAnim->mNumPositionKeys || !nodeAnim->mNumRotationKeys || !nodeAnim->mNumScalingKeys)
+				continue;
+
+			for (unsigned int k = 0; k < nodeAnim->mNumPositionKeys; k++)
+			{
+				const aiVectorKey& key = nodeAnim->mPositionKeys[k];
+				VectorKey position = { static_cast<float>(key.mTime / ticksPerSecond), glm::vec3(key.mValue.x, key.mValue.y, key.mValue.z) };
+				channel.Positions.push_back(position);
+			}
+			for (unsigned int k = 0; k < nodeAnim->mNumRotationKeys; k++)
+			{
+				const aiQuatKey& key = nodeAnim->mRotationKeys[k];
+				RotationKey rotation = { static_cast<float>(key.mTime / ticksPerSecond), glm::quat(key.mValue.w, key.mValue.x, key.mValue.y, key.mValue.z) };
+				channel.Rotations.push_back(rotation);
+			}
+			for (unsigned int k = 0; k < nodeAnim->mNumScalingKeys; k++)
+			{
+				const aiVectorKey& key = nodeAnim->mScalingKeys[k];
+				VectorKey scale = { static_cast<float>(key.mTime / ticksPerSecond), glm::vec3(key.mValue.x, key.mValue.y, key.mValue.z) };
+				channel.Scales.push_back(scale);
+			}
+			clip.Channels.push_back(channel);
+		}
+		animations.push_back(clip);
+	}
 }
 
 std::vector<Texture> Model::LoadMaterialTextures(aiMaterial* mat, aiTextureType type, std::string typeName)
@@ -161,7 +403,13 @@ std::vector<Texture> Model::LoadMaterialTextures(aiMaterial* mat, aiTextureType
 		{
 			Texture texture;
 			std::cout << str.C_Str() << std::endl;
-			texture.id = TextureFromFile(str.C_Str(), directory, false);
+			PendingTexture pending;
+			pending.path = directory + '/' + std::string(str.C_Str());
+			pending.data = NULL;
+			glGenTextures(1, &pending.id);
+			pendingTextures.push_back(pending);
+
+			texture.id = pending.id;
 			texture.type = typeName;
 			texture.path = str.C_Str();
 			textures.push_back(texture);
@@ -173,6 +421,44 @@ std::vector<Texture> Model::LoadMaterialTextures(aiMaterial* mat, aiTextureType
 	return textures;
 }
 
+void Model::LoadPendingTextures()
+{
+	// stbi_load is thread safe, only the upload has to happen on the gl thread
+	std::function<void(unsigned int, unsigned int)> decode = [this](unsigned int begin, unsigned int end)
+	{
+		for (unsigned int i = begin; i < end; i++)
+		{
+			PendingTexture& pending = pendingTextures[i];
+			pending.data = stbi_load(pending.path.c_str(), &pending.width, &pending.height, &pending.nrComponents, 0);
+		}
+	};
+
+	unsigned int count = static_cast<unsigned int>(pendingTextures.size());
+	if (jobs)
+	{
+		jobs->ParallelFor(count, 1, decode);
+	}
+	else
+	{
+		decode(0, count);
+	}
+
+	for (unsigned int i = 0; i < pendingTextures.size(); i++)
+	{
+		PendingTexture& pending = pendingTextures[i];
+		if (pending.data)
+		{
+			UploadTexture(pending.id, pending.data, pending.width, pending.height, pending.nrComponents);
+		}
+		else
+		{
+			std::cout << "Texture failed to load at path: " << pending.path << std::endl;
+		}
+		stbi_image_free(pending.data);
+	}
+	pendingTextures.clear();
+}
+
 unsigned int TextureFromFile(const char* path, const std::string &director, bool gamma)
 {
 	std::string filename = std::string(path);
@@ -187,28 +473,7 @@ unsigned int TextureFromFile(const char* path, const std::string &director, bool
 
 	if (data)
 	{
-		GLenum format;
-		if (nrComponents == 1)
-		{
-			format = GL_RED;
-		}
-		else if (nrComponents == 3)
-		{
-			format = GL_RGB;
-		}
-		else if (nrComponents == 4)
-		{
-			format = GL_RGBA;
-		}
-
-		glBindTexture(GL_TEXTURE_2D, textureID);
-		glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
-		glGenerateMipmap(GL_TEXTURE_2D);
-
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		UploadTexture(textureID, data, width, height, nrComponents);
 	}
 	else 
 	{
@@ -219,5 +484,31 @@ unsigned int TextureFromFile(const char* path, const std::string &director, bool
 	return textureID;
 }
 
+void UploadTexture(unsigned int textureID, unsigned char* data, int width, int height, int nrComponents)
+{
+	GLenum format;
+	if (nrComponents == 1)
+	{
+		format = GL_RED;
+	}
+	else if (nrComponents == 3)
+	{
+		format = GL_RGB;
+	}
+	else if (nrComponents == 4)
+	{
+		format = GL_RGBA;
+	}
+
+	glBindTexture(GL_TEXTURE_2D, textureID);
+	glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format, GL_UNSIGNED_BYTE, data);
+	glGenerateMipmap(GL_TEXTURE_2D);
+
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+}
+
 #endif // !MODEL_H
 
@@ -0,0 +1,457 @@
+#ifndef OCCLUSION_H
+#define OCCLUSION_H
+
+#include <glm.hpp>
+
+#include <algorithm>
+#include <vector>
+
+#include "job_system.h"
+#include "model.h"
+#include "simd.h"
+#include "stats.h"
+
+// Software occlusion culler.
+// Occluder triangles are rasterized on the cpu into a small depth buffer. The
+// buffer stores 1/w, so larger values are nearer and the cleared value 0 means
+// "nothing here". 1/w is linear in screen space which keeps the per pixel
+// interpolation exact. On top of it a min hierarchy is built where every texel
+// holds the farthest occluder of its block, and bounding boxes are tested
+// against the level that covers them with a handful of texels.
+class OcclusionCuller
+{
+public:
+	static const int TILE_WIDTH = 32;
+	static const int TILE_HEIGHT = 16;
+
+	OcclusionCuller(int width = 256, int height = 128);
+
+	// tiles are rasterized on the job system when one is set
+	void SetJobSystem(JobSystem* jobs) { this->jobs = jobs; }
+
+	void BeginFrame(const glm::mat4& viewProjection);
+	void AddOccluder(const std::vector<glm::vec3>& positions, const std::vector<unsigned int>& indices, const glm::mat4& model);
+	void AddOccluder(const Mesh& mesh, const glm::mat4& model);
+	void AddOccluder(const Model& model, const glm::mat4& transform);
+	// bins and rasterizes all occluders, then builds the depth hierarchy
+	void Rasterize();
+
+	// false when the box is completely hidden behind the occluders
+	bool IsVisible(const AABB& bounds, const glm::mat4& model);
+
+	void ReportStats(FrameStats& stats) const;
+
+	int GetWidth() const { return width; }
+	int GetHeight() const { return height; }
+	// 1/w of the nearest occluder at a pixel of the given hierarchy level
+	float GetDepth(int x, int y, int level = 0) const;
+	int GetLevelCount() const { return static_cast<int>(levels.size()); }
+
+	unsigned int TestedCount = 0;
+	unsigned int OccludedCount = 0;
+	unsigned int OccluderTriangleCount = 0;
+	float RasterTimeMs = 0.0f;
+	float TestTimeMs = 0.0f;
+
+private:
+	struct ScreenTriangle
+	{
+		float x[3];
+		float y[3];
+		float invW[3];
+	};
+
+	struct Level
+	{
+		int width;
+		int height;
+		std::vector<float> depth;
+	};
+
+	int width, height;
+	int tilesX, tilesY;
+	JobSystem* jobs = nullptr;
+	glm::mat4 viewProjection;
+
+	std::vector<ScreenTriangle> triangles;
+	std::vector<std::vector<unsigned int>> bins;
+	std::vector<glm::vec4> clipScratch;
+	// level 0 is the rasterized depth buffer
+	std::vector<Level> levels;
+
+	void BinTriangles();
+	void RasterizeTile(int tile);
+	void BuildHierarchy();
+};
+
+OcclusionCuller::OcclusionCuller(int width, int height)
+{
+	tilesX = (width + TILE_WIDTH - 1) / TILE_WIDTH;
+	tilesY = (height + TILE_HEIGHT - 1) / TILE_HEIGHT;
+	this->width = tilesX * TILE_WIDTH;
+	this->height = tilesY * TILE_HEIGHT;
+
+	bins.resize(tilesX * tilesY);
+
+	int levelWidth = this->width;
+	int levelHeight = this->height;
+	while (true)
+	{
+		Level level;
+		level.width = levelWidth;
+		level.height = levelHeight;
+		level.depth.assign(levelWidth * levelHeight, 0.0f);
+		levels.push_back(level);
+
+		if (levelWidth == 1 && levelHeight == 1)
+			break;
+		levelWidth = std::max(1, (levelWidth + 1) / 2);
+		levelHeight = std::max(1, (levelHeight + 1) / 2);
+	}
+}
+
+void OcclusionCuller::BeginFrame(const glm::mat4& viewProjection)
+{
+	this->viewProjection = viewProjection;
+	triangles.clear();
+	for (unsigned int i = 0; i < bins.size(); i++)
+	{
+		bins[i].clear();
+	}
+
+	TestedCount = 0;
+	OccludedCount = 0;
+	OccluderTriangleCount = 0;
+	RasterTimeMs = 0.0f;
+	TestTimeMs = 0.0f;
+}
+
+void OcclusionCuller::AddOccluder(const std::vector<glm::vec3>& positions, const std::vector<unsigned int>& indices, const glm::mat4& model)
+{
+	CpuTimer timer;
+	glm::mat4 mvp = viewProjection * model;
+
+	clipScratch.resize(positions.size());
+	for (unsigned int i = 0; i < positions.size(); i++)
+	{
+		clipScratch[i] = mvp * glm::vec4(positions[i], 1.0f);
+	}
+
+	const float nearW = 1e-4f;
+	for (unsigned int i = 0; i + 2 < indices.size(); i += 3)
+	{
+		const glm::vec4& a = clipScratch[indices[i]];
+		const glm::vec4& b = clipScratch[indices[i + 1]];
+		const glm::vec4& c = clipScratch[indices[i + 2]];
+
+		// triangles crossing the near plane are dropped, missing an occluder
+		// only ever makes the result more conservative
+		if (a.w <= nearW || b.w <= nearW || c.w <= nearW)
+			continue;
+
+		ScreenTriangle tri;
+		const glm::vec4* v[3] = { &a, &b, &c };
+		for (int k = 0; k < 3; k++)
+		{
+			float invW = 1.0f / v[k]->w;
+			tri.x[k] = (v[k]->x * invW * 0.5f + 0.5f) * width;
+			tri.y[k] = (v[k]->y * invW * 0.5f + 0.5f) * height;
+			tri.invW[k] = invW;
+		}
+
+		// back facing or degenerate
+		float area = (tri.x[1] - tri.x[0]) * (tri.y[2] - tri.y[0]) - (tri.x[2] - tri.x[0]) * (tri.y[1] - tri.y[0]);
+		if (area <= 0.0f)
+			continue;
+
+		float minX = std::min(tri.x[0], std::min(tri.x[1], tri.x[2]));
+		float maxX = std::max(tri.x[0], std::max(tri.x[1], tri.x[2]));
+		float minY = std::min(tri.y[0], std::min(tri.y[1], tri.y[2]));
+		float maxY = std::max(tri.y[0], std::max(tri.y[1], tri.y[2]));
+		if (maxX < 0.0f || maxY < 0.0f || minX >= width || minY >= height)
+			continue;
+
+		triangles.push_back(tri);
+	}
+
+	OccluderTriangleCount = static_cast<unsigned int>(triangles.size());
+	RasterTimeMs += timer.ElapsedMs();
+}
+
+void OcclusionCuller::AddOccluder(const Mesh& mesh, const glm::mat4& model)
+{
+	AddOccluder(mesh.positions, mesh.indices, model);
+}
+
+void OcclusionCuller::AddOccluder(const Model& model, const glm::mat4& transform)
+{
+	const std::vector<Mesh>& meshes = model.GetMeshes();
+	for (unsigned int i = 0; i < meshes.size(); i++)
+	{
+		AddOccluder(meshes[i], transform * model.GetMeshTransform(i));
+	}
+}
+
+void OcclusionCuller::Rasterize()
+{
+	CpuTimer timer;
+
+	BinTriangles();
+
+	// every tile is owned by exactly one job and its triangles are walked
+	// in submission order, so the result does not depend on scheduling
+	int tileCount = tilesX * tilesY;
+	if (!jobs || triangles.empty())
+	{
+		for (int tile = 0; tile < tileCount; tile++)
+		{
+			RasterizeTile(tile);
+		}
+	}
+	else
+	{
+		jobs->ParallelFor(tileCount, 2, [this](unsigned int begin, unsigned int end)
+		{
+			for (unsigned int tile = begin; tile < end; tile++)
+			{
+				RasterizeTile(tile);
+			}
+		});
+	}
+
+	BuildHierarchy();
+
+	RasterTimeMs += timer.ElapsedMs();
+}
+
+void OcclusionCuller::BinTriangles()
+{
+	for (unsigned int i = 0; i < triangles.size(); i++)
+	{
+		const ScreenTriangle& tri = triangles[i];
+		float minX = std::min(tri.x[0], std::min(tri.x[1], tri.x[2]));
+		float maxX = std::max(tri.x[0], std::max(tri.x[1], tri.x[2]));
+		float minY = std::min(tri.y[0], std::min(tri.y[1], tri.y[2]));
+		float maxY = std::max(tri.y[0], std::max(tri.y[1], tri.y[2]));
+
+		int tx0 = static_cast<int>(std::max(minX, 0.0f)) / TILE_WIDTH;
+		int tx1 = static_cast<int>(std::min(maxX, width - 1.0f)) / TILE_WIDTH;
+		int ty0 = static_cast<int>(std::max(minY, 0.0f)) / TILE_HEIGHT;
+		int ty1 = static_cast<int>(std::min(maxY, height - 1.0f)) / TILE_HEIGHT;
+
+		for (int ty = ty0; ty <= ty1; ty++)
+		{
+			for (int tx = tx0; tx <= tx1; tx++)
+			{
+				bins[ty * tilesX + tx].push_back(i);
+			}
+		}
+	}
+}
+
+void OcclusionCuller::RasterizeTile(int tile)
+{
+	float* depth = &levels[0].depth[0];
+	int tileX = (tile % tilesX) * TILE_WIDTH;
+	int tileY = (tile / tilesX) * TILE_HEIGHT;
+
+	for (int y = tileY; y < tileY + TILE_HEIGHT; y++)
+	{
+		std::fill(depth + y * width + tileX, depth + y * width + tileX + TILE_WIDTH, 0.0f);
+	}
+
+	const std::vector<unsigned int>& bin = bins[tile];
+	for (unsigned int i = 0; i < bin.size(); i++)
+	{
+		const ScreenTriangle& tri = triangles[bin[i]];
+
+		// edge functions E(x, y) = A * x + B * y + C, positive inside for ccw triangles
+		float edgeA[3], edgeB[3], edgeC[3];
+		for (int e = 0; e < 3; e++)
+		{
+			int a = e;
+			int b = (e + 1) % 3;
+			edgeA[e] = tri.y[a] - tri.y[b];
+			edgeB[e] = tri.x[b] - tri.x[a];
+			edgeC[e] = -(edgeA[e] * tri.x[a] + edgeB[e] * tri.y[a]);
+		}
+
+		// depth plane z(x, y) = z0 + dzdx * (x - x0) + dzdy * (y - y0)
+		float dx1 = tri.x[1] - tri.x[0], dy1 = tri.y[1] - tri.y[0];
+		float dx2 = tri.x[2] - tri.x[0], dy2 = tri.y[2] - tri.y[0];
+		float dz1 = tri.invW[1] - tri.invW[0], dz2 = tri.invW[2] - tri.invW[0];
+		float area = dx1 * dy2 - dx2 * dy1;
+		float dzdx = (dz1 * dy2 - dz2 * dy1) / area;
+		float dzdy = (dx1 * dz2 - dx2 * dz1) / area;
+		float z0 = tri.invW[0] - dzdx * tri.x[0] - dzdy * tri.y[0];
+
+		float minX = std::min(tri.x[0], std::min(tri.x[1], tri.x[2]));
+		float maxX = std::max(tri.x[0], std::max(tri.x[1], tri.x[2]));
+		float minY = std::min(tri.y[0], std::min(tri.y[1], tri.y[2]));
+		float maxY = std::max(tri.y[0], std::max(tri.y[1], tri.y[2]));
+
+		// clamp to the tile, x is aligned down to groups of four pixels
+		int x0 = static_cast<int>(std::max(minX, static_cast<float>(tileX))) & ~3;
+		int x1 = static_cast<int>(std::min(maxX, tileX + TILE_WIDTH - 1.0f));
+		int y0 = static_cast<int>(std::max(minY, static_cast<float>(tileY)));
+		int y1 = static_cast<int>(std::min(maxY, tileY + TILE_HEIGHT - 1.0f));
+
+		for (int y = y0; y <= y1; y++)
+		{
+			float py = y + 0.5f;
+			float* row = depth + y * width;
+#ifdef USE_SSE
+			__m128 offsets = _mm_setr_ps(0.5f, 1.5f, 2.5f, 3.5f);
+			__m128 rowE0 = _mm_set1_ps(edgeB[0] * py + edgeC[0]);
+			__m128 rowE1 = _mm_set1_ps(edgeB[1] * py + edgeC[1]);
+			__m128 rowE2 = _mm_set1_ps(edgeB[2] * py + edgeC[2]);
+			__m128 rowZ = _mm_set1_ps(dzdy * py + z0);
+			__m128 a0 = _mm_set1_ps(edgeA[0]);
+			__m128 a1 = _mm_set1_ps(edgeA[1]);
+			__m128 a2 = _mm_set1_ps(edgeA[2]);
+			__m128 dz = _mm_set1_ps(dzdx);
+			__m128 zero = _mm_setzero_ps();
+
+			for (int x = x0; x <= x1; x += 4)
+			{
+				__m128 px = _mm_add_ps(_mm_set1_ps(static_cast<float>(x)), offsets);
+				__m128 e0 = _mm_add_ps(_mm_mul_ps(a0, px), rowE0);
+				__m128 e1 = _mm_add_ps(_mm_mul_ps(a1, px), rowE1);
+				__m128 e2 = _mm_add_ps(_mm_mul_ps(a2, px), rowE2);
+				__m128 inside = _mm_and_ps(_mm_cmpge_ps(e0, zero), _mm_and_ps(_mm_cmpge_ps(e1, zero), _mm_cmpge_ps(e2, zero)));
+				if (_mm_movemask_ps(inside) == 0)
+					continue;
+
+				__m128 z = _mm_add_ps(_mm_mul_ps(dz, px), rowZ);
+				__m128 old = _mm_loadu_ps(row + x);
+				__m128 nearest = _mm_max_ps(old, z);
+				_mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, old)));
+			}
+#else
+			for (int x = x0; x <= x1; x++)
+			{
+				float px = x + 0.5f;
+				float e0 = edgeA[0] * px + edgeB[0] * py + edgeC[0];
+				float e1 = edgeA[1] * px + edgeB[1] * py + edgeC[1];
+				float e2 = edgeA[2] * px + edgeB[2] * py + edgeC[2];
+				if (e0 < 0.0f || e1 < 0.0f || e2 < 0.0f)
+					continue;
+
+				float z = z0 + dzdx * px + dzdy * py;
+				row[x] = std::max(row[x], z);
+			}
+#endif
+		}
+	}
+}
+
+void OcclusionCuller::BuildHierarchy()
+{
+	for (unsigned int l = 1; l < levels.size(); l++)
+	{
+		const Level& src = levels[l - 1];
+		Level& dst = levels[l];
+		for (int y = 0; y < dst.height; y++)
+		{
+			int sy0 = std::min(y * 2, src.height - 1);
+			int sy1 = std::min(y * 2 + 1, src.height - 1);
+			for (int x = 0; x < dst.width; x++)
+			{
+				int sx0 = std::min(x * 2, src.width - 1);
+				int sx1 = std::min(x * 2 + 1, src.width - 1);
+				float a = std::min(src.depth[sy0 * src.width + sx0], src.depth[sy0 * src.width + sx1]);
+				float b = std::min(src.depth[sy1 * src.width + sx0], src.depth[sy1 * src.width + sx1]);
+				dst.depth[y * dst.width + x] = std::min(a, b);
+			}
+		}
+	}
+}
+
+bool OcclusionCuller::IsVisible(const AABB& bounds, const glm::mat4& model)
+{
+	CpuTimer timer;
+	TestedCount++;
+
+	glm::mat4 mvp = viewProjection * model;
+	float minX = FLT_MAX, minY = FLT_MAX, maxX = -FLT_MAX, maxY = -FLT_MAX;
+	float nearestInvW = 0.0f;
+	for (int i = 0; i < 8; i++)
+	{
+		glm::vec3 corner((i & 1) ? bounds.Max.x : bounds.Min.x,
+			(i & 2) ? bounds.Max.y : bounds.Min.y,
+			(i & 4) ? bounds.Max.z : bounds.Min.z);
+		glm::vec4 clip = mvp * glm::vec4(corner, 1.0f);
+
+		// touching the near plane, treat as visible
+		if (clip.w <= 1e-4f)
+		{
+			TestTimeMs += timer.ElapsedMs();
+			return true;
+		}
+
+		float invW = 1.0f / clip.w;
+		float x = (clip.x * invW * 0.5f + 0.5f) * width;
+		float y = (clip.y * invW * 0.5f + 0.5f) * height;
+		minX = std::min(minX, x);
+		maxX = std::max(maxX, x);
+		minY = std::min(minY, y);
+		maxY = std::max(maxY, y);
+		nearestInvW = std::max(nearestInvW, invW);
+	}
+
+	// outside of the screen is the frustum culler's business
+	if (maxX < 0.0f || maxY < 0.0f || minX >= width || minY >= height)
+	{
+		TestTimeMs += timer.ElapsedMs();
+		return true;
+	}
+
+	int x0 = static_cast<int>(std::max(minX, 0.0f));
+	int x1 = static_cast<int>(std::min(maxX, width - 1.0f));
+	int y0 = static_cast<int>(std::max(minY, 0.0f));
+	int y1 = static_cast<int>(std::min(maxY, height - 1.0f));
+
+	// pick the level at which the rectangle spans at most 2x2 texels
+	unsigned int level = 0;
+	while (level + 1 < levels.size() && ((x1 >> level) - (x0 >> level) > 1 || (y1 >> level) - (y0 >> level) > 1))
+	{
+		level++;
+	}
+
+	const Level& hiz = levels[level];
+	float farthestOccluder = FLT_MAX;
+	for (int y = y0 >> level; y <= (y1 >> level); y++)
+	{
+		for (int x = x0 >> level; x <= (x1 >> level); x++)
+		{
+			farthestOccluder = std::min(farthestOccluder, hiz.depth[y * hiz.width + x]);
+		}
+	}
+
+	bool visible = nearestInvW >= farthestOccluder;
+	if (!visible)
+	{
+		OccludedCount++;
+	}
+
+	TestTimeMs += timer.ElapsedMs();
+	return visible;
+}
+
+float OcclusionCuller::GetDepth(int x, int y, int level) const
+{
+	const Level& hiz = levels[level];
+	return hiz.depth[y * hiz.width + x];
+}
+
+void OcclusionCuller::ReportStats(FrameStats& stats) const
+{
+	stats.Set("Occlusion tested", static_cast<float>(TestedCount));
+	stats.Set("Occlusion culled", static_cast<float>(OccludedCount));
+	stats.Set("Occluder triangles", static_cast<float>(OccluderTriangleCount));
+	stats.Set("Occlusion raster ms", RasterTimeMs);
+	stats.Set("Occlusion test ms", TestTimeMs);
+	stats.Set("Occlusion total ms", RasterTimeMs + TestTimeMs);
+}
+
+#endif // !OCCLUSION_H
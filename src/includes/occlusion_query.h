@@ -0,0 +1,158 @@
+#ifndef OCCLUSION_QUERY_H
+#define OCCLUSION_QUERY_H
+
+#include <glad/glad.h>
+
+#include <vector>
+
+#include "stats.h"
+
+// Hardware occlusion queries, one small ring of query objects per tracked object.
+// Results are read back without blocking once GL_QUERY_RESULT_AVAILABLE says so,
+// usually one or two frames after they were issued. Only when every query of an
+// object is still in flight the oldest one is waited on, which is counted as a stall.
+class OcclusionQueryPool
+{
+public:
+	static const unsigned int QUERIES_PER_OBJECT = 3;
+
+	OcclusionQueryPool()
+	{
+		// the conservative target is cheaper where available (4.3), it may report
+		// false positives but never hides a visible object
+		target = GLAD_GL_VERSION_4_3 ? GL_ANY_SAMPLES_PASSED_CONSERVATIVE : GL_ANY_SAMPLES_PASSED;
+	}
+
+	~OcclusionQueryPool()
+	{
+		Release();
+	}
+
+	void Resize(unsigned int objectCount)
+	{
+		Release();
+		objects.resize(objectCount);
+		for (unsigned int i = 0; i < objects.size(); i++)
+		{
+			glGenQueries(QUERIES_PER_OBJECT, objects[i].queries);
+		}
+	}
+
+	void BeginFrame()
+	{
+		frame++;
+		IssuedCount = 0;
+		StaleCount = 0;
+		StallCount = 0;
+		ConditionalCount = 0;
+	}
+
+	// collect finished results of an object, call before WasVisible/BeginQuery
+	void Poll(unsigned int object)
+	{
+		Object& obj = objects[object];
+		while (obj.pending > 0)
+		{
+			unsigned int slot = (obj.head + QUERIES_PER_OBJECT - obj.pending) % QUERIES_PER_OBJECT;
+			GLint available = 0;
+			glGetQueryObjectiv(obj.queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+
+			// ring is full, the only way to issue a new query is to wait
+			if (!available && obj.pending == QUERIES_PER_OBJECT)
+			{
+				StallCount++;
+				available = 1;
+			}
+			if (!available)
+				break;
+
+			GLuint result = 0;
+			glGetQueryObjectuiv(obj.queries[slot], GL_QUERY_RESULT, &result);
+			obj.visible = result != 0;
+			obj.resultFrame = obj.issuedFrame[slot];
+			obj.pending--;
+		}
+
+		// no result from the last two frames, the decision runs on old data
+		if (frame - obj.resultFrame > 2)
+		{
+			StaleCount++;
+		}
+	}
+
+	// latest known result, objects that were never queried count as visible
+	bool WasVisible(unsigned int object) const
+	{
+		return objects[object].visible;
+	}
+
+	void BeginQuery(unsigned int object)
+	{
+		Object& obj = objects[object];
+		obj.issuedFrame[obj.head] = frame;
+		glBeginQuery(target, obj.queries[obj.head]);
+		IssuedCount++;
+	}
+
+	void EndQuery(unsigned int object)
+	{
+		Object& obj = objects[object];
+		glEndQuery(target);
+		obj.last = obj.queries[obj.head];
+		obj.head = (obj.head + 1) % QUERIES_PER_OBJECT;
+		obj.pending++;
+	}
+
+	// let the gpu skip the following draws if this frame's query found nothing
+	void BeginConditionalRender(unsigned int object)
+	{
+		ConditionalCount++;
+		glBeginConditionalRender(objects[object].last, GL_QUERY_WAIT);
+	}
+
+	void EndConditionalRender()
+	{
+		glEndConditionalRender();
+	}
+
+	void ReportStats(FrameStats& stats) const
+	{
+		stats.Set("Queries issued", static_cast<float>(IssuedCount));
+		stats.Set("Queries stale", static_cast<float>(StaleCount));
+		stats.Set("Queries stalled", static_cast<float>(StallCount));
+		stats.Set("Conditional draws", static_cast<float>(ConditionalCount));
+	}
+
+	unsigned int IssuedCount = 0;
+	unsigned int StaleCount = 0;
+	unsigned int StallCount = 0;
+	unsigned int ConditionalCount = 0;
+
+private:
+	struct Object
+	{
+		GLuint queries[QUERIES_PER_OBJECT] = {};
+		unsigned long long issuedFrame[QUERIES_PER_OBJECT] = {};
+		// most recently ended query, used for conditional rendering
+		GLuint last = 0;
+		unsigned int head = 0;
+		unsigned int pending = 0;
+		bool visible = true;
+		unsigned long long resultFrame = 0;
+	};
+
+	GLenum target;
+	unsigned long long frame = 0;
+	std::vector<Object> objects;
+
+	void Release()
+	{
+		for (unsigned int i = 0; i < objects.size(); i++)
+		{
+			glDeleteQueries(QUERIES_PER_OBJECT, objects[i].queries);
+		}
+		objects.clear();
+	}
+};
+
+#endif // !OCCLUSION_QUERY_H
@@ -0,0 +1,82 @@
+#ifndef OIT_H
+#define OIT_H
+
+#include <glad/glad.h>
+
+#include "shader.h"
+#include "LogHelper.h"
+
+// Weighted blended order independent transparency.
+// Two targets are attached to the offscreen framebuffer for the transparent
+// pass: an RGBA16F accumulation target (premultiplied color * weight,
+// alpha * weight) and an R8 revealage target (product of 1 - alpha).
+// Transparent geometry is drawn into them in any order and a single full
+// screen pass composites the result over the opaque image in attachment 0.
+// The targets are transient render graph textures, only needed between the two.
+class WeightedBlendedOIT
+{
+public:
+	static const GLenum ACCUM_FORMAT = GL_RGBA16F;
+	static const GLenum REVEALAGE_FORMAT = GL_R8;
+
+	// per draw buffer blend functions are core since 4.0
+	bool IsSupported() const
+	{
+		return GLAD_GL_VERSION_4_0 != 0;
+	}
+
+	// expects the offscreen framebuffer to be bound with the opaque depth in it,
+	// attaches the targets as GL_COLOR_ATTACHMENT1 and 2
+	void BeginTransparentPass(unsigned int accumTexture, unsigned int revealageTexture)
+	{
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, accumTexture, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, revealageTexture, 0);
+		GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT1, GL_COLOR_ATTACHMENT2 };
+		glDrawBuffers(2, drawBuffers);
+
+		const float clearAccum[] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		const float clearRevealage[] = { 1.0f, 0.0f, 0.0f, 0.0f };
+		glClearBufferfv(GL_COLOR, 0, clearAccum);
+		glClearBufferfv(GL_COLOR, 1, clearRevealage);
+
+		// depth tested against the opaque scene but never written
+		glDepthMask(GL_FALSE);
+		glEnable(GL_BLEND);
+		glBlendFunci(0, GL_ONE, GL_ONE);
+		glBlendFunci(1, GL_ZERO, GL_ONE_MINUS_SRC_COLOR);
+	}
+
+	// detaches the targets again, their textures may be reused for something else
+	void EndTransparentPass()
+	{
+		GLenum drawBuffer = GL_COLOR_ATTACHMENT0;
+		glDrawBuffers(1, &drawBuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, 0, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT2, GL_TEXTURE_2D, 0, 0);
+		glDepthMask(GL_TRUE);
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	}
+
+	// blends the resolved transparency over attachment 0 with a screen quad
+	void Composite(Shader& compositeShader, unsigned int quadVAO, unsigned int accumTexture, unsigned int revealageTexture)
+	{
+		glDisable(GL_DEPTH_TEST);
+		compositeShader.use();
+		compositeShader.setInt("accumTexture", 0);
+		compositeShader.setInt("revealageTexture", 1);
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, accumTexture);
+		glActiveTexture(GL_TEXTURE1);
+		glBindTexture(GL_TEXTURE_2D, revealageTexture);
+
+		glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+		glBindVertexArray(quadVAO);
+		glDrawArrays(GL_TRIANGLES, 0, 6);
+		glBindVertexArray(0);
+
+		glActiveTexture(GL_TEXTURE0);
+		glEnable(GL_DEPTH_TEST);
+	}
+};
+
+#endif // !OIT_H
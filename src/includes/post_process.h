@@ -0,0 +1,379 @@
+#ifndef POST_PROCESS_H
+#define POST_PROCESS_H
+
+#include <glad/glad.h>
+
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "render_graph.h"
+#include "shader.h"
+#include "stats.h"
+#include "LogHelper.h"
+
+// One step of the post process stack. Code is the body of a glsl function
+// that returns the new color, Params are exposed to it as floats of the same
+// name and are set from the cpu every frame.
+// Per pixel effects get `vec3 color` and `vec2 uv` (0..1 over the whole image,
+// which is more than the output when it is a tile, see SetScreenWindow).
+// Neighborhood effects get `vec2 uv` and `vec2 texel` (one source pixel in uv)
+// and read their input with Fetch(uv), so they need the previous result in a
+// texture and start a new pass.
+struct PostEffect
+{
+	std::string Name;
+	std::string Code;
+	bool Neighborhood = false;
+	bool Enabled = true;
+	std::vector<std::pair<std::string, float>> Params;
+
+	float* GetParam(const std::string& name)
+	{
+		for (unsigned int i = 0; i < Params.size(); i++)
+		{
+			if (Params[i].first == name)
+				return &Params[i].second;
+		}
+		return nullptr;
+	}
+};
+
+// Ordered list of effects between the scene and the screen.
+// Effects are grouped into passes: a pass starts with a plain fetch of its
+// input or with a neighborhood effect, and every per pixel effect after it is
+// fused into the same generated fragment shader. So the stack always costs one
+// full screen pass (the upscale to the window was needed anyway) plus one per
+// enabled neighborhood effect. Programs are generated when the set of enabled
+// effects changes and kept, toggling back and forth doesn't recompile.
+// The passes run in the render graph, which also times them.
+class PostStack
+{
+public:
+	// vertexPath is the full screen quad vertex shader the passes share
+	explicit PostStack(const char* vertexPath)
+	{
+		std::ifstream file(vertexPath);
+		std::stringstream stream;
+		stream << file.rdbuf();
+		vertexCode = stream.str();
+		if (vertexCode.empty())
+			LOG("ERROR::POST_PROCESS:: Could not read " << vertexPath);
+	}
+
+	~PostStack()
+	{
+		for (std::map<std::string, std::unique_ptr<Shader>>::iterator it = programs.begin(); it != programs.end(); ++it)
+			glDeleteProgram(it->second->ID);
+	}
+
+	// returns the index the effect can be found under with GetEffect()
+	int Add(const PostEffect& effect)
+	{
+		effects.push_back(effect);
+		return effects.size() - 1;
+	}
+
+	PostEffect& GetEffect(int index) { return effects[index]; }
+
+	// The part of the whole image the output is, offset and size in 0..1 of it.
+	// A poster tile sets its window so a vignette spans the poster, not every tile.
+	void SetScreenWindow(const glm::vec2& offset, const glm::vec2& scale)
+	{
+		screenOffset = offset;
+		screenScale = scale;
+	}
+	unsigned int GetEffectCount() const { return effects.size(); }
+
+	// Adds the passes to the graph: the first reads the lower left uvScale part
+	// of source, the last writes output (bound as outputFramebuffer, 0 for the
+	// window) at width x height. The targets in between are transient graph
+	// textures, so consecutive passes ping-pong between two aliased textures.
+	void AddPasses(RenderGraph& graph, RenderGraphResource source, float uvScaleX, float uvScaleY,
+		RenderGraphResource output, unsigned int outputFramebuffer, int width, int height, unsigned int quadVAO)
+	{
+		Plan();
+
+		RenderGraphTextureDesc desc;
+		desc.Width = width;
+		desc.Height = height;
+		// half floats so chained effects don't band
+		desc.Format = GL_RGB16F;
+
+		for (unsigned int i = 0; i < passes.size(); i++)
+		{
+			bool last = i + 1 == passes.size();
+			RenderGraphResource target = last ? output : graph.CreateTexture("Post " + std::to_string(i), desc);
+			glm::vec2 uvScale = i == 0 ? glm::vec2(uvScaleX, uvScaleY) : glm::vec2(1.0f);
+			glm::vec2 windowOffset = screenOffset;
+			glm::vec2 windowScale = screenScale;
+
+			graph.AddPass("Post " + std::to_string(i), [=](RenderGraphBuilder& builder)
+			{
+				builder.Read(source);
+				builder.Overwrite(target);
+				if (last)
+					builder.SideEffect();
+			},
+			[=](RenderGraphContext& context)
+			{
+				glBindFramebuffer(GL_FRAMEBUFFER, last ? outputFramebuffer : context.GetFramebuffer(target));
+				glViewport(0, 0, width, height);
+				glDisable(GL_DEPTH_TEST);
+
+				Pass& pass = passes[i];
+				pass.program->use();
+				pass.program->setInt("source", 0);
+				pass.program->setVec2("uvScale", uvScale);
+				pass.program->setVec2("screenOffset", windowOffset);
+				pass.program->setVec2("screenScale", windowScale);
+				for (unsigned int e = 0; e < pass.effects.size(); e++)
+				{
+					PostEffect& effect = effects[pass.effects[e]];
+					for (unsigned int p = 0; p < effect.Params.size(); p++)
+						pass.program->setFloat(UniformName(pass.effects[e], effect.Params[p].first), effect.Params[p].second);
+				}
+				glActiveTexture(GL_TEXTURE0);
+				glBindTexture(GL_TEXTURE_2D, context.GetTexture(source));
+				glBindVertexArray(quadVAO);
+				glDrawArrays(GL_TRIANGLES, 0, 6);
+				glBindVertexArray(0);
+			});
+			source = target;
+		}
+	}
+
+	void ReportStats(FrameStats& stats)
+	{
+		unsigned int fused = 0;
+		for (unsigned int i = 0; i < passes.size(); i++)
+			fused += passes[i].effects.size();
+
+		stats.Set("Post passes", static_cast<float>(passes.size()));
+		stats.Set("Post effects", static_cast<float>(fused));
+		stats.Set("Post programs", static_cast<float>(programs.size()));
+	}
+
+	// effect names of each pass, for showing how the stack was fused
+	std::string Describe() const
+	{
+		std::string text;
+		for (unsigned int i = 0; i < passes.size(); i++)
+		{
+			text += std::to_string(i) + ": ";
+			if (passes[i].effects.empty() || !effects[passes[i].effects[0]].Neighborhood)
+				text += "fetch";
+			for (unsigned int e = 0; e < passes[i].effects.size(); e++)
+			{
+				if (e > 0 || !effects[passes[i].effects[0]].Neighborhood)
+					text += " + ";
+				text += effects[passes[i].effects[e]].Name;
+			}
+			text += "\n";
+		}
+		return text;
+	}
+
+private:
+	struct Pass
+	{
+		std::vector<int> effects;
+		Shader* program = nullptr;
+	};
+
+	std::vector<PostEffect> effects;
+	std::vector<Pass> passes;
+	std::map<std::string, std::unique_ptr<Shader>> programs;
+	std::string vertexCode;
+	glm::vec2 screenOffset = glm::vec2(0.0f);
+	glm::vec2 screenScale = glm::vec2(1.0f);
+
+	static std::string UniformName(int effect, const std::string& param)
+	{
+		return "e" + std::to_string(effect) + "_" + param;
+	}
+
+	// groups the enabled effects into passes and finds their programs
+	void Plan()
+	{
+		passes.clear();
+		passes.push_back(Pass());
+		for (unsigned int i = 0; i < effects.size(); i++)
+		{
+			if (!effects[i].Enabled)
+				continue;
+			// the first pass can start with a neighborhood effect itself
+			if (effects[i].Neighborhood && !passes.back().effects.empty())
+				passes.push_back(Pass());
+			passes.back().effects.push_back(i);
+		}
+
+		for (unsigned int i = 0; i < passes.size(); i++)
+		{
+			// effect indices identify a program, the code of an effect doesn't change
+			std::string key;
+			for (unsigned int e = 0; e < passes[i].effects.size(); e++)
+				key += std::to_string(passes[i].effects[e]) + ",";
+
+			std::unique_ptr<Shader>& program = programs[key];
+			if (!program)
+				program.reset(new Shader(Shader::FromSource(vertexCode, Generate(passes[i].effects))));
+			passes[i].program = program.get();
+		}
+	}
+
+	std::string Generate(const std::vector<int>& passEffects) const
+	{
+		std::stringstream code;
+		code << "#version 330 core\n"
+			"out vec4 FragColor;\n"
+			"\n"
+			"in vec2 TexCoords;\n"
+			"\n"
+			"uniform sampler2D source;\n"
+			"// part of source that holds the image\n"
+			"uniform vec2 uvScale;\n"
+			"// where the output is in the whole image\n"
+			"uniform vec2 screenOffset;\n"
+			"uniform vec2 screenScale;\n"
+			"\n"
+			"vec3 Fetch(vec2 uv)\n"
+			"{\n"
+			"\t// kept half a texel inside so nothing outside the image bleeds in\n"
+			"\tvec2 halfTexel = 0.5 / vec2(textureSize(source, 0));\n"
+			"\treturn texture(source, clamp(uv * uvScale, halfTexel, uvScale - halfTexel)).rgb;\n"
+			"}\n";
+
+		for (unsigned int e = 0; e < passEffects.size(); e++)
+		{
+			const PostEffect& effect = effects[passEffects[e]];
+			std::string name = "e" + std::to_string(passEffects[e]);
+
+			code << "\n// " << effect.Name << "\n";
+			for (unsigned int p = 0; p < effect.Params.size(); p++)
+				code << "uniform float " << UniformName(passEffects[e], effect.Params[p].first) << ";\n";
+			if (effect.Neighborhood)
+				code << "vec3 " << name << "(vec2 uv, vec2 texel)\n{\n";
+			else
+				code << "vec3 " << name << "(vec3 color, vec2 uv)\n{\n";
+			for (unsigned int p = 0; p < effect.Params.size(); p++)
+				code << "\tfloat " << effect.Params[p].first << " = " << UniformName(passEffects[e], effect.Params[p].first) << ";\n";
+			code << effect.Code << "\n}\n";
+		}
+
+		code << "\nvoid main()\n{\n"
+			"\tvec2 uv = TexCoords;\n";
+		unsigned int first = 0;
+		if (!passEffects.empty() && effects[passEffects[0]].Neighborhood)
+		{
+			code << "\tvec2 texel = 1.0 / (vec2(textureSize(source, 0)) * uvScale);\n"
+				"\tvec3 color = e" << passEffects[0] << "(uv, texel);\n";
+			first = 1;
+		}
+		else
+		{
+			code << "\tvec3 color = Fetch(uv);\n";
+		}
+		if (first < passEffects.size())
+			code << "\tvec2 screen = screenOffset + uv * screenScale;\n";
+		for (unsigned int e = first; e < passEffects.size(); e++)
+			code << "\tcolor = e" << passEffects[e] << "(color, screen);\n";
+		code << "\tFragColor = vec4(color, 1.0);\n}";
+		return code.str();
+	}
+};
+
+// the effects BufferShader.fsc used to carry in comments, plus the usual ones
+
+inline PostEffect ColorGradingEffect()
+{
+	PostEffect effect;
+	effect.Name = "Color grading";
+	effect.Params = { { "brightness", 0.0f }, { "contrast", 1.0f }, { "saturation", 1.0f } };
+	effect.Code =
+		"\tcolor = (color - 0.5) * contrast + 0.5 + brightness;\n"
+		"\tfloat luminance = dot(color, vec3(0.2126, 0.7152, 0.0722));\n"
+		"\treturn max(mix(vec3(luminance), color, saturation), 0.0);";
+	return effect;
+}
+
+inline PostEffect GrayscaleEffect()
+{
+	PostEffect effect;
+	effect.Name = "Grayscale";
+	effect.Code = "\treturn vec3(dot(color, vec3(0.2126, 0.7152, 0.0722)));";
+	return effect;
+}
+
+inline PostEffect InvertEffect()
+{
+	PostEffect effect;
+	effect.Name = "Invert";
+	effect.Code = "\treturn 1.0 - color;";
+	return effect;
+}
+
+inline PostEffect VignetteEffect()
+{
+	PostEffect effect;
+	effect.Name = "Vignette";
+	effect.Params = { { "radius", 0.5f }, { "strength", 0.6f } };
+	effect.Code =
+		"\t// 1 in the corners\n"
+		"\tfloat edge = length(uv - 0.5) * 1.41421;\n"
+		"\treturn color * (1.0 - strength * smoothstep(radius, 1.0, edge));";
+	return effect;
+}
+
+inline PostEffect TonemapEffect()
+{
+	PostEffect effect;
+	effect.Name = "Tonemap";
+	effect.Params = { { "exposure", 1.0f } };
+	effect.Code =
+		"\t// ACES fit by Krzysztof Narkowicz\n"
+		"\tcolor *= exposure;\n"
+		"\treturn clamp((color * (2.51 * color + 0.03)) / (color * (2.43 * color + 0.59) + 0.14), 0.0, 1.0);";
+	return effect;
+}
+
+inline PostEffect SharpenEffect()
+{
+	PostEffect effect;
+	effect.Name = "Sharpen";
+	effect.Neighborhood = true;
+	effect.Params = { { "amount", 0.5f } };
+	effect.Code =
+		"\tvec3 center = Fetch(uv);\n"
+		"\tvec3 neighbors = Fetch(uv + vec2(texel.x, 0.0)) + Fetch(uv - vec2(texel.x, 0.0))\n"
+		"\t\t+ Fetch(uv + vec2(0.0, texel.y)) + Fetch(uv - vec2(0.0, texel.y));\n"
+		"\treturn max(center + amount * (4.0 * center - neighbors), 0.0);";
+	return effect;
+}
+
+inline PostEffect BlurEffect()
+{
+	PostEffect effect;
+	effect.Name = "Blur";
+	effect.Neighborhood = true;
+	effect.Params = { { "radius", 1.0f } };
+	effect.Code =
+		"\t// 3x3 gaussian, radius spreads the taps\n"
+		"\tvec3 sum = vec3(0.0);\n"
+		"\tfor (int y = -1; y <= 1; y++)\n"
+		"\t{\n"
+		"\t\tfor (int x = -1; x <= 1; x++)\n"
+		"\t\t{\n"
+		"\t\t\tfloat weight = (2.0 - abs(float(x))) * (2.0 - abs(float(y)));\n"
+		"\t\t\tsum += weight * Fetch(uv + vec2(x, y) * texel * radius);\n"
+		"\t\t}\n"
+		"\t}\n"
+		"\treturn sum / 16.0;";
+	return effect;
+}
+
+#endif // !POST_PROCESS_H
@@ -0,0 +1,160 @@
+#ifndef POSTER_RENDER_H
+#define POSTER_RENDER_H
+
+#include <glad/glad.h>
+#include <glm.hpp>
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "LogHelper.h"
+
+// 64 bit offsets, posters go past 2 GB
+#ifdef _WIN32
+#define POSTER_FSEEK _fseeki64
+#else
+#define POSTER_FSEEK fseeko
+#endif
+
+// Stills larger than a framebuffer can be, rendered tile by tile.
+// The poster frustum is cut into sub-frustums, each one rendered into the
+// normal offscreen targets at their normal size with an off-center
+// projection. Tiles overlap by GUARD_BAND pixels on every side so the screen
+// space filters of the post stack see the same neighbors as in a single
+// render, only the inner part of a tile is kept.
+// The image is a binary PPM with a fixed header, CreateImage() sizes the file
+// up front and WriteTile() seeks to the rows of a tile, so only one tile is
+// ever in memory and separate processes can fill in tiles of the same file.
+// Per pixel post effects see where a tile is in the poster, see GetTileWindow().
+class PosterTiles
+{
+public:
+	static const int GUARD_BAND = 16;
+
+	// targetWidth x targetHeight is the render target every tile is drawn into
+	PosterTiles(int width, int height, int targetWidth, int targetHeight)
+		: width(width), height(height), targetWidth(targetWidth), targetHeight(targetHeight)
+	{
+		innerWidth = std::max(targetWidth - 2 * GUARD_BAND, 1);
+		innerHeight = std::max(targetHeight - 2 * GUARD_BAND, 1);
+		tilesX = (width + innerWidth - 1) / innerWidth;
+		tilesY = (height + innerHeight - 1) / innerHeight;
+	}
+
+	int GetTileCount() const { return tilesX * tilesY; }
+	float GetAspect() const { return static_cast<float>(width) / height; }
+
+	// Part of projection, the one of the whole poster, that lands in the render target of tile.
+	// Scales and shifts clip space so the tile window becomes [-1, 1].
+	glm::mat4 GetTileProjection(int tile, const glm::mat4& projection) const
+	{
+		int x, y;
+		GetTileOrigin(tile, x, y);
+		float left = -1.0f + 2.0f * (x - GUARD_BAND) / width;
+		float right = -1.0f + 2.0f * (x - GUARD_BAND + targetWidth) / width;
+		float bottom = -1.0f + 2.0f * (y - GUARD_BAND) / height;
+		float top = -1.0f + 2.0f * (y - GUARD_BAND + targetHeight) / height;
+
+		glm::mat4 window(1.0f);
+		window[0][0] = 2.0f / (right - left);
+		window[1][1] = 2.0f / (top - bottom);
+		window[3][0] = -(right + left) / (right - left);
+		window[3][1] = -(top + bottom) / (top - bottom);
+		return window * projection;
+	}
+
+	// The part of the poster the render target of tile covers, guard band included,
+	// as offset and size in 0..1 of the poster. For PostStack::SetScreenWindow().
+	void GetTileWindow(int tile, glm::vec2& offset, glm::vec2& scale) const
+	{
+		int x, y;
+		GetTileOrigin(tile, x, y);
+		offset = glm::vec2(static_cast<float>(x - GUARD_BAND) / width, static_cast<float>(y - GUARD_BAND) / height);
+		scale = glm::vec2(static_cast<float>(targetWidth) / width, static_cast<float>(targetHeight) / height);
+	}
+
+	// header and full size, the tiles are written into it afterwards
+	bool CreateImage(const std::string& path) const
+	{
+		FILE* file = std::fopen(path.c_str(), "wb");
+		if (!file)
+		{
+			LOG("POSTER:: Could not write " << path);
+			return false;
+		}
+		WriteHeader(file);
+		// the last byte makes the file as large as the image
+		POSTER_FSEEK(file, GetRowOffset(height - 1) + static_cast<long long>(width) * 3 - 1, SEEK_SET);
+		std::fputc(0, file);
+		std::fclose(file);
+		LOG("POSTER:: " << width << "x" << height << " in " << tilesX << "x" << tilesY << " tiles of " << targetWidth << "x" << targetHeight);
+		return true;
+	}
+
+	// Reads tile from the bound read framebuffer and writes its inner part into the image.
+	bool WriteTile(const std::string& path, int tile) const
+	{
+		int x, y;
+		GetTileOrigin(tile, x, y);
+		int tileWidth = std::min(innerWidth, width - x);
+		int tileHeight = std::min(innerHeight, height - y);
+
+		// one readback per tile, a stall is nothing next to drawing a tile
+		std::vector<unsigned char> pixels(static_cast<size_t>(tileWidth) * tileHeight * 3);
+		glPixelStorei(GL_PACK_ALIGNMENT, 1);
+		glReadPixels(GUARD_BAND, GUARD_BAND, tileWidth, tileHeight, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+
+		FILE* file = std::fopen(path.c_str(), "r+b");
+		if (!file)
+		{
+			LOG("POSTER:: Could not open " << path);
+			return false;
+		}
+		// gl rows start at the bottom, the image at the top
+		for (int row = 0; row < tileHeight; row++)
+		{
+			POSTER_FSEEK(file, GetRowOffset(height - 1 - (y + row)) + static_cast<long long>(x) * 3, SEEK_SET);
+			std::fwrite(&pixels[static_cast<size_t>(row) * tileWidth * 3], 1, static_cast<size_t>(tileWidth) * 3, file);
+		}
+		std::fclose(file);
+		return true;
+	}
+
+private:
+	int width;
+	int height;
+	int targetWidth;
+	int targetHeight;
+	int innerWidth;
+	int innerHeight;
+	int tilesX;
+	int tilesY;
+
+	// bottom left poster pixel of the inner part, tiles go row by row from the bottom
+	void GetTileOrigin(int tile, int& x, int& y) const
+	{
+		x = (tile % tilesX) * innerWidth;
+		y = (tile / tilesX) * innerHeight;
+	}
+
+	int GetHeaderSize() const
+	{
+		return std::snprintf(NULL, 0, "P6\n%d %d\n255\n", width, height);
+	}
+
+	void WriteHeader(FILE* file) const
+	{
+		std::fprintf(file, "P6\n%d %d\n255\n", width, height);
+	}
+
+	// row 0 is the top of the image
+	long long GetRowOffset(int row) const
+	{
+		return GetHeaderSize() + static_cast<long long>(row) * width * 3;
+	}
+};
+
+#endif // !POSTER_RENDER_H
@@ -0,0 +1,567 @@
+#ifndef RENDER_GRAPH_H
+#define RENDER_GRAPH_H
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <functional>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "gpu_timer.h"
+#include "stats.h"
+#include "LogHelper.h"
+
+struct RenderGraphTextureDesc
+{
+	int Width = 0;
+	int Height = 0;
+	GLenum Format = GL_RGBA8;
+	int Layers = 1;
+};
+
+// index of a texture in the graph of the current frame
+typedef int RenderGraphResource;
+const RenderGraphResource INVALID_RENDER_GRAPH_RESOURCE = -1;
+
+inline float BytesPerPixel(GLenum format)
+{
+	switch (format)
+	{
+	case GL_R8: return 1.0f;
+	case GL_RGB8: return 3.0f;
+	case GL_RGB: return 3.0f;
+	case GL_RGBA8: return 4.0f;
+	case GL_DEPTH24_STENCIL8: return 4.0f;
+	case GL_DEPTH_COMPONENT24: return 4.0f;
+	case GL_RGB16F: return 6.0f;
+	case GL_RGBA16F: return 8.0f;
+	case GL_RG16F: return 4.0f;
+	case GL_R32F: return 4.0f;
+	default: return 4.0f;
+	}
+}
+
+inline float TextureMegabytes(const RenderGraphTextureDesc& desc)
+{
+	return desc.Width * desc.Height * desc.Layers * BytesPerPixel(desc.Format) / (1024.0f * 1024.0f);
+}
+
+// Passes declare what they do with each resource while they are set up.
+class RenderGraphBuilder
+{
+public:
+	// sampled or otherwise read
+	void Read(RenderGraphResource resource) { reads.push_back(resource); }
+	// drawn into on top of what earlier passes left there
+	void Write(RenderGraphResource resource) { writes.push_back(resource); }
+	// cleared or fully covered, earlier contents are not needed
+	void Overwrite(RenderGraphResource resource) { overwrites.push_back(resource); }
+	// the pass is needed even if nothing reads its outputs (presenting, caches)
+	void SideEffect() { sideEffect = true; }
+
+private:
+	friend class RenderGraph;
+	std::vector<RenderGraphResource> reads;
+	std::vector<RenderGraphResource> writes;
+	std::vector<RenderGraphResource> overwrites;
+	bool sideEffect = false;
+};
+
+class RenderGraph;
+
+// What a pass gets when it runs, the gl objects behind its resources.
+class RenderGraphContext
+{
+public:
+	unsigned int GetTexture(RenderGraphResource resource) const;
+	// framebuffer with the texture as color attachment 0, transient textures only
+	unsigned int GetFramebuffer(RenderGraphResource resource) const;
+
+private:
+	friend class RenderGraph;
+	explicit RenderGraphContext(RenderGraph& graph) : graph(graph) {}
+	RenderGraph& graph;
+};
+
+// Frame graph: passes are added every frame with the resources they read and
+// write, Compile() then
+//   - orders them so every pass runs after the passes it depends on, consumers
+//     are pulled right behind their producers to keep transient lifetimes short,
+//   - culls passes whose outputs nobody reads (walking back from the passes
+//     with side effects),
+//   - places transient textures whose lifetimes don't overlap on the same gl
+//     texture. The gl textures are kept across frames and freed when they went
+//     unused for a while, so a steady frame allocates nothing.
+// Imported resources (window sized targets, shadow maps, the backbuffer) are
+// owned outside and only take part in ordering and culling.
+// Transient textures have undefined contents when their first pass starts.
+// Passes set all the gl state they depend on themselves, the order can change.
+// Every pass gets a gpu timer, reported by name.
+class RenderGraph
+{
+public:
+	static const unsigned int UNUSED_FRAMES = 60;
+
+	~RenderGraph()
+	{
+		for (unsigned int i = 0; i < physical.size(); i++)
+			Free(physical[i]);
+	}
+
+	// starts a new frame, handles of the previous one are invalid after this
+	void Reset()
+	{
+		resources.clear();
+		passes.clear();
+		order.clear();
+	}
+
+	RenderGraphResource CreateTexture(const std::string& name, const RenderGraphTextureDesc& desc)
+	{
+		Resource resource;
+		resource.name = name;
+		resource.desc = desc;
+		resources.push_back(resource);
+		return resources.size() - 1;
+	}
+
+	RenderGraphResource ImportTexture(const std::string& name, unsigned int texture, const RenderGraphTextureDesc& desc)
+	{
+		Resource resource;
+		resource.name = name;
+		resource.desc = desc;
+		resource.imported = true;
+		resource.texture = texture;
+		resources.push_back(resource);
+		return resources.size() - 1;
+	}
+
+	void AddPass(const std::string& name, const std::function<void(RenderGraphBuilder&)>& setup,
+		const std::function<void(RenderGraphContext&)>& execute)
+	{
+		Pass pass;
+		pass.name = name;
+		setup(pass.builder);
+		pass.execute = execute;
+		passes.push_back(pass);
+	}
+
+	void Compile()
+	{
+		CpuTimer compileTimer;
+		Order();
+		Cull();
+		Allocate();
+		CompileMs = compileTimer.ElapsedMs();
+	}
+
+	void Execute()
+	{
+		RenderGraphContext context(*this);
+		for (unsigned int i = 0; i < order.size(); i++)
+		{
+			Pass& pass = passes[order[i]];
+			if (pass.culled)
+				continue;
+
+			PassTimer& timer = timers[pass.name];
+			if (!timer.timer)
+				timer.timer.reset(new GpuTimer());
+			timer.lastFrame = frame;
+			timer.timer->Begin();
+			pass.execute(context);
+			timer.timer->End();
+		}
+
+		frame++;
+		for (unsigned int i = 0; i < physical.size(); )
+		{
+			if (frame - physical[i].lastUsedFrame > UNUSED_FRAMES)
+			{
+				Free(physical[i]);
+				physical.erase(physical.begin() + i);
+			}
+			else
+			{
+				i++;
+			}
+		}
+	}
+
+	void ReportStats(FrameStats& stats) const
+	{
+		unsigned int culled = 0;
+		for (unsigned int i = 0; i < passes.size(); i++)
+		{
+			if (passes[i].culled)
+				culled++;
+		}
+
+		unsigned int transient = 0;
+		float transientMb = 0.0f;
+		float importedMb = 0.0f;
+		for (unsigned int i = 0; i < resources.size(); i++)
+		{
+			if (resources[i].imported)
+			{
+				importedMb += TextureMegabytes(resources[i].desc);
+			}
+			else if (resources[i].physical >= 0)
+			{
+				transient++;
+				transientMb += TextureMegabytes(resources[i].desc);
+			}
+		}
+
+		// textures idle this frame are on their way out and don't count
+		float physicalMb = 0.0f;
+		for (unsigned int i = 0; i < physical.size(); i++)
+		{
+			if (physical[i].lastUsedFrame + 1 == frame)
+				physicalMb += TextureMegabytes(physical[i].desc);
+		}
+
+		stats.Set("Graph passes", static_cast<float>(passes.size() - culled));
+		stats.Set("Graph passes culled", static_cast<float>(culled));
+		stats.Set("Graph transient textures", static_cast<float>(transient));
+		stats.Set("Graph gl textures", static_cast<float>(physical.size()));
+		// what the transients would take without aliasing against what they do take
+		stats.Set("Graph transient MB", transientMb);
+		stats.Set("Graph aliased MB", physicalMb);
+		stats.Set("Graph imported MB", importedMb);
+		stats.Set("Graph allocations", static_cast<float>(Allocations));
+		stats.Set("Graph compile ms", CompileMs);
+		for (std::map<std::string, PassTimer>::const_iterator it = timers.begin(); it != timers.end(); ++it)
+			stats.Set("Pass " + it->first + " ms", GetPassMs(it->first));
+	}
+
+	// gpu time of a pass that ran in the last frame, 0 for culled or missing ones
+	float GetPassMs(const std::string& name) const
+	{
+		std::map<std::string, PassTimer>::const_iterator it = timers.find(name);
+		if (it == timers.end() || it->second.lastFrame + 1 != frame)
+			return 0.0f;
+		return it->second.timer->ElapsedMs;
+	}
+
+	// pass order and which gl texture each transient landed on
+	std::string Describe() const
+	{
+		std::string text;
+		for (unsigned int i = 0; i < order.size(); i++)
+		{
+			const Pass& pass = passes[order[i]];
+			text += pass.culled ? "  (culled) " : "  ";
+			text += pass.name + "\n";
+		}
+		for (unsigned int i = 0; i < resources.size(); i++)
+		{
+			const Resource& resource = resources[i];
+			if (resource.imported || resource.physical < 0)
+				continue;
+			text += "  " + resource.name + " -> texture " + std::to_string(resource.texture) +
+				" [" + std::to_string(resource.firstUse) + ", " + std::to_string(resource.lastUse) + "]\n";
+		}
+		return text;
+	}
+
+	unsigned int Allocations = 0;
+	float CompileMs = 0.0f;
+
+private:
+	friend class RenderGraphContext;
+
+	struct Resource
+	{
+		std::string name;
+		RenderGraphTextureDesc desc;
+		bool imported = false;
+		unsigned int texture = 0;
+		// transient only: gl texture and the span of kept passes using it
+		int physical = -1;
+		int firstUse = -1;
+		int lastUse = -1;
+	};
+
+	struct Pass
+	{
+		std::string name;
+		RenderGraphBuilder builder;
+		std::function<void(RenderGraphContext&)> execute;
+		std::vector<unsigned int> dependencies;
+		bool culled = false;
+	};
+
+	struct Physical
+	{
+		RenderGraphTextureDesc desc;
+		unsigned int texture = 0;
+		unsigned int fbo = 0;
+		unsigned int lastUsedFrame = 0;
+		// position of the last pass using it in the frame being compiled
+		int busyUntil = -1;
+	};
+
+	struct PassTimer
+	{
+		std::unique_ptr<GpuTimer> timer;
+		unsigned int lastFrame = 0;
+	};
+
+	std::vector<Resource> resources;
+	std::vector<Pass> passes;
+	std::map<std::string, PassTimer> timers;
+	std::vector<unsigned int> order;
+	std::vector<Physical> physical;
+	unsigned int frame = 0;
+
+	// Dependencies follow from the declaration order: a pass depends on the last
+	// writer of everything it touches, and writers also wait for the readers
+	// of the previous contents.
+	void Order()
+	{
+		std::vector<int> lastWriter(resources.size(), -1);
+		std::vector<std::vector<unsigned int>> readers(resources.size());
+		for (unsigned int p = 0; p < passes.size(); p++)
+		{
+			Pass& pass = passes[p];
+			pass.culled = false;
+			pass.dependencies.clear();
+			const RenderGraphBuilder& builder = pass.builder;
+
+			for (unsigned int i = 0; i < builder.reads.size(); i++)
+			{
+				RenderGraphResource r = builder.reads[i];
+				if (lastWriter[r] >= 0)
+					pass.dependencies.push_back(lastWriter[r]);
+				readers[r].push_back(p);
+			}
+			for (int kind = 0; kind < 2; kind++)
+			{
+				const std::vector<RenderGraphResource>& written = kind == 0 ? builder.writes : builder.overwrites;
+				for (unsigned int i = 0; i < written.size(); i++)
+				{
+					RenderGraphResource r = written[i];
+					if (lastWriter[r] >= 0)
+						pass.dependencies.push_back(lastWriter[r]);
+					for (unsigned int reader = 0; reader < readers[r].size(); reader++)
+					{
+						if (readers[r][reader] != p)
+							pass.dependencies.push_back(readers[r][reader]);
+					}
+					lastWriter[r] = p;
+					readers[r].clear();
+				}
+			}
+		}
+
+		// Kahn's algorithm, of the passes that are ready the one whose newest
+		// dependency was scheduled last goes first, declaration order breaks ties
+		std::vector<int> position(passes.size(), -1);
+		order.clear();
+		while (order.size() < passes.size())
+		{
+			int best = -1;
+			int bestRecency = -2;
+			for (unsigned int p = 0; p < passes.size(); p++)
+			{
+				if (position[p] >= 0)
+					continue;
+
+				bool ready = true;
+				int recency = -1;
+				for (unsigned int d = 0; d < passes[p].dependencies.size(); d++)
+				{
+					int dependency = position[passes[p].dependencies[d]];
+					if (dependency < 0)
+					{
+						ready = false;
+						break;
+					}
+					recency = std::max(recency, dependency);
+				}
+				if (ready && recency > bestRecency)
+				{
+					best = p;
+					bestRecency = recency;
+				}
+			}
+			position[best] = order.size();
+			order.push_back(best);
+		}
+	}
+
+	// walks back from the end keeping the set of resources whose current
+	// contents are still needed
+	void Cull()
+	{
+		std::set<RenderGraphResource> live;
+		for (int i = static_cast<int>(order.size()) - 1; i >= 0; i--)
+		{
+			Pass& pass = passes[order[i]];
+			const RenderGraphBuilder& builder = pass.builder;
+
+			bool needed = builder.sideEffect;
+			for (unsigned int w = 0; w < builder.writes.size() && !needed; w++)
+				needed = live.count(builder.writes[w]) > 0;
+			for (unsigned int w = 0; w < builder.overwrites.size() && !needed; w++)
+				needed = live.count(builder.overwrites[w]) > 0;
+
+			pass.culled = !needed;
+			if (pass.culled)
+				continue;
+
+			for (unsigned int w = 0; w < builder.overwrites.size(); w++)
+				live.erase(builder.overwrites[w]);
+			// writing on top of something needs that something
+			for (unsigned int w = 0; w < builder.writes.size(); w++)
+				live.insert(builder.writes[w]);
+			for (unsigned int r = 0; r < builder.reads.size(); r++)
+				live.insert(builder.reads[r]);
+		}
+	}
+
+	void Allocate()
+	{
+		int kept = 0;
+		for (unsigned int i = 0; i < order.size(); i++)
+		{
+			const Pass& pass = passes[order[i]];
+			if (pass.culled)
+				continue;
+
+			const RenderGraphBuilder& builder = pass.builder;
+			for (int kind = 0; kind < 3; kind++)
+			{
+				const std::vector<RenderGraphResource>& used = kind == 0 ? builder.reads : (kind == 1 ? builder.writes : builder.overwrites);
+				for (unsigned int u = 0; u < used.size(); u++)
+				{
+					Resource& resource = resources[used[u]];
+					if (resource.firstUse < 0)
+						resource.firstUse = kept;
+					resource.lastUse = kept;
+				}
+			}
+			kept++;
+		}
+
+		for (unsigned int i = 0; i < physical.size(); i++)
+			physical[i].busyUntil = -1;
+
+		// first come first served over the passes, a texture is free again once
+		// the last pass of the previous resource on it is done
+		std::vector<unsigned int> transients;
+		for (unsigned int i = 0; i < resources.size(); i++)
+		{
+			if (!resources[i].imported && resources[i].firstUse >= 0)
+				transients.push_back(i);
+		}
+		std::sort(transients.begin(), transients.end(), [this](unsigned int a, unsigned int b)
+		{
+			return resources[a].firstUse < resources[b].firstUse;
+		});
+
+		for (unsigned int t = 0; t < transients.size(); t++)
+		{
+			Resource& resource = resources[transients[t]];
+			int match = -1;
+			for (unsigned int i = 0; i < physical.size(); i++)
+			{
+				const RenderGraphTextureDesc& desc = physical[i].desc;
+				if (physical[i].busyUntil < resource.firstUse && desc.Width == resource.desc.Width &&
+					desc.Height == resource.desc.Height && desc.Format == resource.desc.Format && desc.Layers == resource.desc.Layers)
+				{
+					match = i;
+					break;
+				}
+			}
+			if (match < 0)
+			{
+				physical.push_back(CreatePhysical(resource.desc));
+				match = physical.size() - 1;
+			}
+
+			physical[match].busyUntil = resource.lastUse;
+			physical[match].lastUsedFrame = frame;
+			resource.physical = match;
+			resource.texture = physical[match].texture;
+		}
+	}
+
+	Physical CreatePhysical(const RenderGraphTextureDesc& desc)
+	{
+		Physical result;
+		result.desc = desc;
+		GLCall(glGenTextures(1, &result.texture));
+		GLCall(glBindTexture(GL_TEXTURE_2D, result.texture));
+		GLCall(glTexImage2D(GL_TEXTURE_2D, 0, desc.Format, desc.Width, desc.Height, 0, PixelFormat(desc.Format), PixelType(desc.Format), NULL));
+		GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
+		GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+		GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+		GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+		GLCall(glBindTexture(GL_TEXTURE_2D, 0));
+		Allocations++;
+		return result;
+	}
+
+	unsigned int GetFramebuffer(RenderGraphResource resource)
+	{
+		Physical& target = physical[resources[resource].physical];
+		if (!target.fbo)
+		{
+			GLint previous = 0;
+			glGetIntegerv(GL_DRAW_FRAMEBUFFER_BINDING, &previous);
+			GLCall(glGenFramebuffers(1, &target.fbo));
+			GLCall(glBindFramebuffer(GL_FRAMEBUFFER, target.fbo));
+			GLCall(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, target.texture, 0));
+			if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+				LOG("ERROR::RENDER_GRAPH:: Framebuffer is not complete!");
+			GLCall(glBindFramebuffer(GL_FRAMEBUFFER, previous));
+		}
+		return target.fbo;
+	}
+
+	static GLenum PixelFormat(GLenum format)
+	{
+		switch (format)
+		{
+		case GL_R8: case GL_R32F: return GL_RED;
+		case GL_RG16F: return GL_RG;
+		case GL_RGB8: case GL_RGB16F: return GL_RGB;
+		default: return GL_RGBA;
+		}
+	}
+
+	static GLenum PixelType(GLenum format)
+	{
+		switch (format)
+		{
+		case GL_RG16F: case GL_RGB16F: case GL_RGBA16F: return GL_HALF_FLOAT;
+		case GL_R32F: return GL_FLOAT;
+		default: return GL_UNSIGNED_BYTE;
+		}
+	}
+
+	void Free(Physical& target)
+	{
+		if (target.fbo)
+			glDeleteFramebuffers(1, &target.fbo);
+		glDeleteTextures(1, &target.texture);
+	}
+};
+
+inline unsigned int RenderGraphContext::GetTexture(RenderGraphResource resource) const
+{
+	return graph.resources[resource].texture;
+}
+
+inline unsigned int RenderGraphContext::GetFramebuffer(RenderGraphResource resource) const
+{
+	return graph.GetFramebuffer(resource);
+}
+
+#endif // !RENDER_GRAPH_H
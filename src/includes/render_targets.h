@@ -0,0 +1,149 @@
+#ifndef RENDER_TARGETS_H
+#define RENDER_TARGETS_H
+
+#include <glad/glad.h>
+
+#include <algorithm>
+#include <cmath>
+
+#include "stats.h"
+#include "LogHelper.h"
+
+// dynamic scaling never goes below half the window resolution
+const float MIN_RENDER_SCALE = 0.5f;
+
+// Owns the offscreen framebuffer the 3d scene is drawn into: an RGB color
+// texture on attachment 0 and a depth/stencil renderbuffer. The OIT and
+// G-buffer passes attach their render graph textures to the same framebuffer
+// while they run.
+// The targets are allocated at window size, the scene is drawn into the
+// lower left GetRenderWidth() x GetRenderHeight() of them. With dynamic scaling
+// that part shrinks when the gpu misses its frame time target and grows back
+// when there is room, the screen pass stretches it over the window with GetUvScaleX/Y().
+class RenderTargets
+{
+public:
+	~RenderTargets()
+	{
+		if (fbo)
+		{
+			glDeleteFramebuffers(1, &fbo);
+			glDeleteTextures(1, &colorTexture);
+			glDeleteRenderbuffers(1, &depthStencil);
+		}
+	}
+
+	// leaves the framebuffer bound so more attachments can be added
+	void Create(int width, int height)
+	{
+		GLCall(glGenFramebuffers(1, &fbo));
+		GLCall(glBindFramebuffer(GL_FRAMEBUFFER, fbo));
+
+		GLCall(glGenTextures(1, &colorTexture));
+		GLCall(glBindTexture(GL_TEXTURE_2D, colorTexture));
+		// linear, the screen pass upscales with it
+		GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR));
+		GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR));
+		GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE));
+		GLCall(glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE));
+		GLCall(glGenRenderbuffers(1, &depthStencil));
+
+		AllocateStorage(width, height);
+
+		GLCall(glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, colorTexture, 0));
+		GLCall(glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, depthStencil));
+		GLCall(glBindTexture(GL_TEXTURE_2D, 0));
+	}
+
+	// reallocates for a new window size, returns true if anything changed so
+	// the other attachments of the framebuffer need to follow
+	bool Resize(int width, int height)
+	{
+		// minimized
+		if (width <= 0 || height <= 0)
+			return false;
+		if (width == this->width && height == this->height)
+			return false;
+
+		AllocateStorage(width, height);
+		GLCall(glBindTexture(GL_TEXTURE_2D, 0));
+		Resizes++;
+		return true;
+	}
+
+	void SetDynamicScale(bool enabled, float targetGpuMs)
+	{
+		dynamicScale = enabled;
+		this->targetGpuMs = std::max(targetGpuMs, 1.0f);
+		if (!dynamicScale)
+			scale = 1.0f;
+	}
+
+	// Feeds the gpu time of a finished frame. Cost is about proportional to the
+	// pixel count, so the scale that would have hit the target is
+	// scale * sqrt(target / time). It is approached slowly since the
+	// measurement is a few frames old, and small changes are ignored.
+	void UpdateScale(float gpuMs)
+	{
+		if (!dynamicScale || gpuMs <= 0.0f)
+			return;
+
+		float ideal = scale * std::sqrt(targetGpuMs / gpuMs);
+		ideal = std::max(MIN_RENDER_SCALE, std::min(ideal, 1.0f));
+		if (std::abs(ideal - scale) < 0.02f)
+			return;
+
+		scale += (ideal - scale) * 0.1f;
+		scale = std::max(MIN_RENDER_SCALE, std::min(scale, 1.0f));
+	}
+
+	unsigned int GetFramebuffer() const { return fbo; }
+	unsigned int GetColorTexture() const { return colorTexture; }
+	unsigned int GetDepthStencil() const { return depthStencil; }
+	int GetWidth() const { return width; }
+	int GetHeight() const { return height; }
+	float GetScale() const { return scale; }
+	int GetRenderWidth() const { return std::max(1, static_cast<int>(width * scale + 0.5f)); }
+	int GetRenderHeight() const { return std::max(1, static_cast<int>(height * scale + 0.5f)); }
+
+	// part of the targets that holds the scene, in texture coordinates
+	float GetUvScaleX() const { return static_cast<float>(GetRenderWidth()) / width; }
+	float GetUvScaleY() const { return static_cast<float>(GetRenderHeight()) / height; }
+
+	void ReportStats(FrameStats& stats) const
+	{
+		stats.Set("Render scale", scale);
+		stats.Set("Render width", static_cast<float>(GetRenderWidth()));
+		stats.Set("Render height", static_cast<float>(GetRenderHeight()));
+		stats.Set("Target resizes", static_cast<float>(Resizes));
+	}
+
+	unsigned int Resizes = 0;
+
+private:
+	unsigned int fbo = 0;
+	unsigned int colorTexture = 0;
+	unsigned int depthStencil = 0;
+	int width = 0;
+	int height = 0;
+
+	bool dynamicScale = false;
+	float targetGpuMs = 16.0f;
+	float scale = 1.0f;
+
+	void AllocateStorage(int width, int height)
+	{
+		this->width = width;
+		this->height = height;
+
+		GLCall(glBindTexture(GL_TEXTURE_2D, colorTexture));
+		GLCall(glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, NULL));
+
+		// use a single renderbuffer object for both a depth AND stencil buffer.
+		GLCall(glBindRenderbuffer(GL_RENDERBUFFER, depthStencil));
+		GLCall(glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height));
+		GLCall(glBindRenderbuffer(GL_RENDERBUFFER, 0));
+	}
+};
+
+#endif // !RENDER_TARGETS_H
@@ -0,0 +1,120 @@
+#ifndef SCENE_GRAPH_H
+#define SCENE_GRAPH_H
+
+#include <glm.hpp>
+
+#include <cstdint>
+#include <vector>
+
+#include "simd.h"
+#include "stats.h"
+
+// Flat, data oriented transform hierarchy.
+// Nodes are stored parent before child in contiguous arrays of local and world
+// matrices. Changing a local matrix only flags the node, Update() then walks the
+// arrays once starting at the first flagged node, and a node is recomputed only
+// if it or one of its ancestors changed.
+class SceneGraph
+{
+public:
+	static const unsigned int NO_PARENT = 0xFFFFFFFF;
+
+	void Reserve(unsigned int count)
+	{
+		parents.reserve(count);
+		locals.reserve(count);
+		worlds.reserve(count);
+		dirty.reserve(count);
+	}
+
+	void Clear()
+	{
+		parents.clear();
+		locals.clear();
+		worlds.clear();
+		dirty.clear();
+		firstDirty = 0;
+	}
+
+	// parent has to be added before its children
+	unsigned int AddNode(unsigned int parent, const glm::mat4& local)
+	{
+		unsigned int node = static_cast<unsigned int>(parents.size());
+		parents.push_back(parent);
+		locals.push_back(local);
+		worlds.push_back(local);
+		dirty.push_back(1);
+		if (firstDirty > node)
+			firstDirty = node;
+		return node;
+	}
+
+	void SetLocal(unsigned int node, const glm::mat4& local)
+	{
+		locals[node] = local;
+		dirty[node] = 1;
+		if (firstDirty > node)
+			firstDirty = node;
+	}
+
+	const glm::mat4& GetLocal(unsigned int node) const { return locals[node]; }
+	const glm::mat4& GetWorld(unsigned int node) const { return worlds[node]; }
+	unsigned int GetParent(unsigned int node) const { return parents[node]; }
+	unsigned int Size() const { return static_cast<unsigned int>(parents.size()); }
+
+	// recomputes the world matrices of changed subtrees
+	void Update()
+	{
+		CpuTimer timer;
+		UpdatedCount = 0;
+
+		unsigned int count = Size();
+		for (unsigned int i = firstDirty; i < count; i++)
+		{
+			unsigned int parent = parents[i];
+			if (parent != NO_PARENT && dirty[parent])
+			{
+				dirty[i] = 1;
+			}
+			if (!dirty[i])
+				continue;
+
+			if (parent == NO_PARENT)
+			{
+				worlds[i] = locals[i];
+			}
+			else
+			{
+				MultiplyMat4(worlds[parent], locals[i], worlds[i]);
+			}
+			UpdatedCount++;
+		}
+
+		// flags are only needed while walking, children always come later
+		for (unsigned int i = firstDirty; i < count; i++)
+		{
+			dirty[i] = 0;
+		}
+		firstDirty = count;
+
+		UpdateTimeMs = timer.ElapsedMs();
+	}
+
+	void ReportStats(FrameStats& stats, const std::string& name) const
+	{
+		stats.Set(name + " nodes updated", static_cast<float>(UpdatedCount));
+		stats.Set(name + " update ms", UpdateTimeMs);
+	}
+
+	unsigned int UpdatedCount = 0;
+	float UpdateTimeMs = 0.0f;
+
+private:
+	std::vector<unsigned int> parents;
+	std::vector<glm::mat4> locals;
+	std::vector<glm::mat4> worlds;
+	std::vector<uint8_t> dirty;
+	unsigned int firstDirty = 0;
+};
+
+#endif // !SCENE_GRAPH_H
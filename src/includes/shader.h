@@ -42,8 +42,8 @@ public:
 			vShaderFile.close();
 			fShaderFile.close();
 			// convert stream into strings
-			vertexCode = vShaderStream.str();
-			fragmentCode = fShaderStream.str();
+			vertexCode = ResolveIncludes(vShaderStream.str(), vertexPath);
+			fragmentCode = ResolveIncludes(fShaderStream.str(), fragmentPath);
 		}
 		catch (std::ifstream::failure e) 
 		{
@@ -83,6 +83,98 @@ public:
 		glDeleteShader(vertex);
 		glDeleteShader(fragment);
 	};
+
+	// vertex stage only, for depth only passes where no fragment shader is needed
+	explicit Shader(const char* vertexPath)
+	{
+		std::string vertexCode;
+		std::ifstream vShaderFile;
+		vShaderFile.exceptions(std::ifstream::failbit | std::ifstream::badbit);
+		try
+		{
+			vShaderFile.open(vertexPath);
+			std::stringstream vShaderStream;
+			vShaderStream << vShaderFile.rdbuf();
+			vShaderFile.close();
+			vertexCode = ResolveIncludes(vShaderStream.str(), vertexPath);
+		}
+		catch (std::ifstream::failure e)
+		{
+			std::cout << "ERROR::SHADER::FILE_NOT_SUCCESSFULLY_READ" << std::endl;
+		}
+
+		const char* vShaderCode = vertexCode.c_str();
+		unsigned int vertex = glCreateShader(GL_VERTEX_SHADER);
+		glShaderSource(vertex, 1, &vShaderCode, NULL);
+		glCompileShader(vertex);
+		checkCompilationErrors(vertex, VERTEX);
+
+		ID = glCreateProgram();
+		glAttachShader(ID, vertex);
+		glLinkProgram(ID);
+		checkCompilationErrors(ID, PROGRAM);
+
+		glDeleteShader(vertex);
+	}
+
+	// Pastes the file of every `#include "name"` line in place, looked up next to path.
+	// GLSL has no includes of its own, this is how shaders share their functions.
+	static std::string ResolveIncludes(const std::string& code, const std::string& path)
+	{
+		std::string directory = path.substr(0, path.find_last_of("/\\") + 1);
+		std::stringstream lines(code);
+		std::string result;
+		std::string line;
+		while (std::getline(lines, line))
+		{
+			size_t start = line.find_first_not_of(" \t");
+			if (start == std::string::npos || line.compare(start, 10, "#include \"") != 0)
+			{
+				result += line + "\n";
+				continue;
+			}
+
+			std::string name = directory + line.substr(start + 10, line.find('"', start + 10) - start - 10);
+			std::ifstream file(name);
+			if (!file)
+			{
+				std::cout << "ERROR::SHADER::INCLUDE_NOT_FOUND " << name << std::endl;
+				continue;
+			}
+			std::stringstream included;
+			included << file.rdbuf();
+			result += ResolveIncludes(included.str(), name) + "\n";
+		}
+		return result;
+	}
+
+	// builds from source code instead of files, for generated shaders
+	static Shader FromSource(const std::string& vertexCode, const std::string& fragmentCode)
+	{
+		Shader shader;
+		const char* vShaderCode = vertexCode.c_str();
+		const char* fShaderCode = fragmentCode.c_str();
+
+		unsigned int vertex = glCreateShader(GL_VERTEX_SHADER);
+		glShaderSource(vertex, 1, &vShaderCode, NULL);
+		glCompileShader(vertex);
+		shader.checkCompilationErrors(vertex, shader.VERTEX);
+		unsigned int fragment = glCreateShader(GL_FRAGMENT_SHADER);
+		glShaderSource(fragment, 1, &fShaderCode, NULL);
+		glCompileShader(fragment);
+		shader.checkCompilationErrors(fragment, shader.FRAGMENT);
+
+		shader.ID = glCreateProgram();
+		glAttachShader(shader.ID, vertex);
+		glAttachShader(shader.ID, fragment);
+		glLinkProgram(shader.ID);
+		shader.checkCompilationErrors(shader.ID, shader.PROGRAM);
+
+		glDeleteShader(vertex);
+		glDeleteShader(fragment);
+		return shader;
+	}
+
 	// use/activate shader
 	void use() 
 	{
@@ -144,6 +236,8 @@ public:
 		const std::string PROGRAM{ "PROGRAM" };
 
 	private:
+		Shader() : ID(0) {}
+
 		void checkCompilationErrors(unsigned int shader, std::string type)
 		{
 			int success;
@@ -0,0 +1,42 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+#include <glm.hpp>
+
+// SSE2 is always there on x64 and is enabled by /arch on x86 builds
+#if defined(_M_X64) || defined(_M_IX86) || defined(__SSE2__)
+#include <emmintrin.h>
+#define USE_SSE 1
+#endif
+
+// out = a * b for column major matrices, out may alias a or b
+inline void MultiplyMat4(const glm::mat4& a, const glm::mat4& b, glm::mat4& out)
+{
+#ifdef USE_SSE
+	const float* pa = &a[0][0];
+	const float* pb = &b[0][0];
+	float* po = &out[0][0];
+
+	__m128 a0 = _mm_loadu_ps(pa);
+	__m128 a1 = _mm_loadu_ps(pa + 4);
+	__m128 a2 = _mm_loadu_ps(pa + 8);
+	__m128 a3 = _mm_loadu_ps(pa + 12);
+	__m128 columns[4];
+	for (int c = 0; c < 4; c++)
+	{
+		__m128 r = _mm_mul_ps(a0, _mm_set1_ps(pb[c * 4 + 0]));
+		r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_set1_ps(pb[c * 4 + 1])));
+		r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_set1_ps(pb[c * 4 + 2])));
+		r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_set1_ps(pb[c * 4 + 3])));
+		columns[c] = r;
+	}
+	for (int c = 0; c < 4; c++)
+	{
+		_mm_storeu_ps(po + c * 4, columns[c]);
+	}
+#else
+	out = a * b;
+#endif
+}
+
+#endif // !SIMD_H
@@ -0,0 +1,318 @@
+#ifndef SIMULATION_H
+#define SIMULATION_H
+
+#include <glm.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "camera.h"
+#include "stats.h"
+
+// Single producer, single consumer mailbox. The writer always has a buffer of
+// its own, Publish() swaps it with the shared middle one and the reader swaps
+// the middle one out again in Acquire(). Neither side ever blocks, the reader
+// just sees the latest published value.
+template<typename T>
+class TripleBuffer
+{
+public:
+	T& GetWriteBuffer() { return buffers[back]; }
+	const T& GetReadBuffer() const { return buffers[front]; }
+
+	void Publish()
+	{
+		uint8_t old = middle.exchange(static_cast<uint8_t>(back | FRESH), std::memory_order_acq_rel);
+		back = old & INDEX_MASK;
+	}
+
+	// true while the last published value has not been acquired
+	bool HasUnread() const
+	{
+		return (middle.load(std::memory_order_acquire) & FRESH) != 0;
+	}
+
+	// returns true if there was something new
+	bool Acquire()
+	{
+		if ((middle.load(std::memory_order_relaxed) & FRESH) == 0)
+			return false;
+
+		uint8_t old = middle.exchange(front, std::memory_order_acq_rel);
+		front = old & INDEX_MASK;
+		return true;
+	}
+
+	// back to nothing published, only while neither side is using it
+	void Reset()
+	{
+		for (int i = 0; i < 3; i++)
+			buffers[i] = T();
+		back = 0;
+		front = 1;
+		middle.store(2, std::memory_order_release);
+	}
+
+private:
+	static const uint8_t FRESH = 4;
+	static const uint8_t INDEX_MASK = 3;
+
+	T buffers[3];
+	uint8_t back = 0;
+	uint8_t front = 1;
+	std::atomic<uint8_t> middle{ 2 };
+};
+
+// seconds on the clock shared by input sampling, simulation and rendering
+inline double SimulationNow()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Input gathered on the window thread. Held keys are a state, mouse and
+// scroll are deltas that add up until something consumes them.
+struct SimulationInput
+{
+	bool Move[6] = {};
+	float MouseX = 0.0f;
+	float MouseY = 0.0f;
+	float Scroll = 0.0f;
+	// when the oldest unconsumed event was sampled, 0 if there is none
+	double EventTime = 0.0;
+
+	void MarkEvent()
+	{
+		if (EventTime == 0.0)
+			EventTime = SimulationNow();
+	}
+
+	void ClearEvents()
+	{
+		MouseX = 0.0f;
+		MouseY = 0.0f;
+		Scroll = 0.0f;
+		EventTime = 0.0;
+	}
+};
+
+// moves the camera the way the old per frame processInput/mouse callbacks did
+inline void ApplyInput(Camera& camera, const SimulationInput& input, float deltaTime)
+{
+	for (int i = 0; i < 6; i++)
+	{
+		if (input.Move[i])
+			camera.ProcessKeyboard(static_cast<CameraMovement>(i), deltaTime);
+	}
+	if (input.MouseX != 0.0f || input.MouseY != 0.0f)
+		camera.ProcessMouseMovement(input.MouseX, input.MouseY);
+	if (input.Scroll != 0.0f)
+		camera.ProcessMouseScroll(input.Scroll);
+}
+
+struct CameraState
+{
+	glm::vec3 Position = glm::vec3(0.0f);
+	float Yaw = 0.0f;
+	float Pitch = 0.0f;
+	float Zoom = 0.0f;
+};
+
+// Everything the renderer needs from one simulation tick. Previous is the
+// state one step earlier, so the renderer can blend between the two.
+struct FrameSnapshot
+{
+	uint64_t Tick = 0;
+	// when Current was computed
+	double Time = 0.0;
+	double Step = 0.0;
+	CameraState Previous;
+	CameraState Current;
+	std::vector<glm::mat4> Transforms;
+	glm::vec3 LightPosition = glm::vec3(0.0f);
+	// oldest input in this snapshot that no acquired snapshot showed yet, 0
+	// if none. Can repeat an already shown time, readers should skip those.
+	double InputTime = 0.0;
+
+	// state at renderTime, which lags one step behind the simulation so it
+	// falls between Previous, computed at Time - Step, and Current
+	CameraState Interpolate(double renderTime) const
+	{
+		float alpha = Step > 0.0 ? static_cast<float>((renderTime - (Time - Step)) / Step) : 1.0f;
+		alpha = glm::clamp(alpha, 0.0f, 1.0f);
+
+		CameraState state;
+		state.Position = glm::mix(Previous.Position, Current.Position, alpha);
+		state.Yaw = glm::mix(Previous.Yaw, Current.Yaw, alpha);
+		state.Pitch = glm::mix(Previous.Pitch, Current.Pitch, alpha);
+		state.Zoom = glm::mix(Previous.Zoom, Current.Zoom, alpha);
+		return state;
+	}
+};
+
+// Runs camera movement (and whatever else gets simulated later) at a fixed
+// rate on its own thread, independent of how long frames take to render.
+class Simulation
+{
+public:
+	Simulation(double step = 1.0 / 120.0) : step(step)
+	{
+	}
+
+	~Simulation()
+	{
+		Stop();
+	}
+
+	void Start(const Camera& camera, const std::vector<glm::mat4>& transforms, const glm::vec3& lightPosition)
+	{
+		if (running.load())
+			return;
+
+		this->camera = camera;
+		this->transforms = transforms;
+		this->lightPosition = lightPosition;
+		previous = GetState();
+		pending = SimulationInput();
+		lastInputTime = 0.0;
+		// a snapshot left over from before the last Stop() would snap the camera back
+		snapshots.Reset();
+
+		running.store(true);
+		thread = std::thread(&Simulation::Loop, this);
+	}
+
+	void Stop()
+	{
+		if (!running.load())
+			return;
+
+		running.store(false);
+		thread.join();
+	}
+
+	bool IsRunning() const { return running.load(); }
+	double GetStep() const { return step; }
+
+	// hands the current input to the simulation, deltas are added up
+	void PostInput(const SimulationInput& input)
+	{
+		std::lock_guard<std::mutex> lock(inputMutex);
+		for (int i = 0; i < 6; i++)
+			pending.Move[i] = input.Move[i];
+		pending.MouseX += input.MouseX;
+		pending.MouseY += input.MouseY;
+		pending.Scroll += input.Scroll;
+		if (pending.EventTime == 0.0)
+			pending.EventTime = input.EventTime;
+	}
+
+	// picks up the newest snapshot, returns true if it changed since the last call
+	bool Acquire()
+	{
+		return snapshots.Acquire();
+	}
+
+	// valid until the next Acquire()
+	const FrameSnapshot& GetSnapshot() const { return snapshots.GetReadBuffer(); }
+
+	void ReportStats(FrameStats& stats) const
+	{
+		stats.Set("Sim tick ms", TickTimeMs.load());
+		stats.Set("Sim ticks dropped", static_cast<float>(DroppedTicks.load()));
+	}
+
+	std::atomic<float> TickTimeMs{ 0.0f };
+	std::atomic<unsigned int> DroppedTicks{ 0 };
+
+private:
+	double step;
+	std::atomic<bool> running{ false };
+	std::thread thread;
+
+	// owned by the simulation thread while it runs
+	Camera camera;
+	std::vector<glm::mat4> transforms;
+	glm::vec3 lightPosition = glm::vec3(0.0f);
+	CameraState previous;
+	uint64_t tick = 0;
+	double lastInputTime = 0.0;
+
+	std::mutex inputMutex;
+	SimulationInput pending;
+
+	TripleBuffer<FrameSnapshot> snapshots;
+
+	CameraState GetState() const
+	{
+		CameraState state;
+		state.Position = camera.Position;
+		state.Yaw = camera.Yaw;
+		state.Pitch = camera.Pitch;
+		state.Zoom = camera.Zoom;
+		return state;
+	}
+
+	void Loop()
+	{
+		double next = SimulationNow();
+		while (running.load(std::memory_order_relaxed))
+		{
+			double now = SimulationNow();
+			if (now < next)
+			{
+				std::this_thread::sleep_for(std::chrono::duration<double>(next - now));
+				continue;
+			}
+
+			// after a long stall skip ahead instead of running a burst of ticks
+			if (now - next > 0.25)
+			{
+				DroppedTicks.fetch_add(static_cast<unsigned int>((now - next) / step));
+				next = now;
+			}
+
+			Tick();
+			next += step;
+		}
+	}
+
+	void Tick()
+	{
+		CpuTimer timer;
+
+		SimulationInput input;
+		{
+			std::lock_guard<std::mutex> lock(inputMutex);
+			input = pending;
+			pending.ClearEvents();
+		}
+		ApplyInput(camera, input, static_cast<float>(step));
+
+		FrameSnapshot& snapshot = snapshots.GetWriteBuffer();
+		snapshot.Tick = ++tick;
+		snapshot.Time = SimulationNow();
+		snapshot.Step = step;
+		snapshot.Previous = previous;
+		snapshot.Current = GetState();
+		snapshot.Transforms = transforms;
+		snapshot.LightPosition = lightPosition;
+
+		// input of a snapshot the renderer skipped shows up in this one
+		double inputTime = input.EventTime;
+		if (snapshots.HasUnread() && lastInputTime != 0.0 && (inputTime == 0.0 || lastInputTime < inputTime))
+			inputTime = lastInputTime;
+		snapshot.InputTime = inputTime;
+		lastInputTime = inputTime;
+
+		previous = snapshot.Current;
+		snapshots.Publish();
+
+		TickTimeMs.store(timer.ElapsedMs());
+	}
+};
+
+#endif // !SIMULATION_H
@@ -0,0 +1,329 @@
+#ifndef SKELETAL_ANIMATION_H
+#define SKELETAL_ANIMATION_H
+
+#include <glad/glad.h>
+#include <glm.hpp>
+#include <gtc/matrix_transform.hpp>
+#include <gtc/quaternion.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "animation_clip.h"
+#include "animation_compression.h"
+#include "command_list.h"
+#include "job_system.h"
+#include "shader.h"
+#include "simd.h"
+#include "stats.h"
+#include "LogHelper.h"
+
+// Node hierarchy of a skinned model, joints are stored parent before child
+// like the SceneGraph of the model, with the same indices. Bones are the
+// joints that meshes are skinned to, the vertex bone ids index the bones.
+// The palette matrix of a bone is world(joint) * offset, offset takes a
+// vertex from mesh space in the bind pose to the space of the joint.
+class Skeleton
+{
+public:
+	static const unsigned int NO_PARENT = 0xFFFFFFFF;
+	static const unsigned int NO_JOINT = 0xFFFFFFFF;
+
+	// parent has to be added before its children
+	unsigned int AddJoint(const std::string& name, unsigned int parent, const glm::mat4& local)
+	{
+		jointNames.push_back(name);
+		parents.push_back(parent);
+		bindLocals.push_back(local);
+		return static_cast<unsigned int>(parents.size() - 1);
+	}
+
+	// bone of name, added the first time a mesh refers to it
+	unsigned int AddBone(const std::string& name, const glm::mat4& offset)
+	{
+		for (unsigned int i = 0; i < boneNames.size(); i++)
+		{
+			if (boneNames[i] == name)
+				return i;
+		}
+		boneNames.push_back(name);
+		boneOffsets.push_back(offset);
+		boneJoints.push_back(FindJoint(name));
+		return static_cast<unsigned int>(boneNames.size() - 1);
+	}
+
+	// bones can be added before the joints they hang off, looks them up once the hierarchy is complete
+	void ResolveBones()
+	{
+		for (unsigned int i = 0; i < boneNames.size(); i++)
+		{
+			boneJoints[i] = FindJoint(boneNames[i]);
+			if (boneJoints[i] == NO_JOINT)
+				LOG("SKELETON:: No node for bone " << boneNames[i]);
+		}
+	}
+
+	unsigned int FindJoint(const std::string& name) const
+	{
+		for (unsigned int i = 0; i < jointNames.size(); i++)
+		{
+			if (jointNames[i] == name)
+				return i;
+		}
+		return NO_JOINT;
+	}
+
+	unsigned int GetJointCount() const { return static_cast<unsigned int>(parents.size()); }
+	unsigned int GetBoneCount() const { return static_cast<unsigned int>(boneNames.size()); }
+	unsigned int GetParent(unsigned int joint) const { return parents[joint]; }
+	unsigned int GetBoneJoint(unsigned int bone) const { return boneJoints[bone]; }
+	const glm::mat4& GetBoneOffset(unsigned int bone) const { return boneOffsets[bone]; }
+	// local matrices of the bind pose, the starting point of every sampled pose
+	const std::vector<glm::mat4>& GetBindLocals() const { return bindLocals; }
+
+	// locals and worlds have a matrix per joint, palette one per bone
+	void ComputePalette(const glm::mat4* locals, glm::mat4* worlds, glm::mat4* palette) const
+	{
+		unsigned int jointCount = GetJointCount();
+		for (unsigned int i = 0; i < jointCount; i++)
+		{
+			if (parents[i] == NO_PARENT)
+				worlds[i] = locals[i];
+			else
+				MultiplyMat4(worlds[parents[i]], locals[i], worlds[i]);
+		}
+
+		unsigned int boneCount = GetBoneCount();
+		for (unsigned int i = 0; i < boneCount; i++)
+		{
+			if (boneJoints[i] == NO_JOINT)
+				palette[i] = glm::mat4(1.0f);
+			else
+				MultiplyMat4(worlds[boneJoints[i]], boneOffsets[i], palette[i]);
+		}
+	}
+
+private:
+	std::vector<std::string> jointNames;
+	std::vector<unsigned int> parents;
+	std::vector<glm::mat4> bindLocals;
+	std::vector<std::string> boneNames;
+	std::vector<unsigned int> boneJoints;
+	std::vector<glm::mat4> boneOffsets;
+};
+
+// A skinned character, Rig and Clip belong to a loaded model.
+// Compressed is sampled instead of Clip when set, Clip still gives the duration.
+struct AnimatedInstance
+{
+	const Skeleton* Rig = nullptr;
+	const AnimationClip* Clip = nullptr;
+	const CompressedClip* Compressed = nullptr;
+	CompressedClipCursor Cursor;
+	float Time = 0.0f;
+	float Speed = 1.0f;
+};
+
+// Bone palettes of every animated instance, computed on the job system and
+// uploaded into a single uniform buffer per frame. Every instance has its own
+// aligned range of the buffer, bound to the "BonePalette" block of the
+// skinning shader with glBindBufferRange right before its draws.
+class SkinningPalettes
+{
+public:
+	// has to match MAX_BONES in skinned.vs, 100 matrices are 6400 bytes of the 16 KB every GL 3.3 implementation allows per block
+	static const unsigned int MAX_BONES = 100;
+	static const unsigned int BLOCK_BINDING = 0;
+
+	~SkinningPalettes()
+	{
+		if (buffer)
+		{
+			glDeleteBuffers(1, &buffer);
+		}
+	}
+
+	void SetJobSystem(JobSystem* jobs) { this->jobs = jobs; }
+	std::vector<AnimatedInstance>& GetInstances() { return instances; }
+
+	// needs a context, without it the ranges assume a 256 byte offset alignment
+	void Create()
+	{
+		glGenBuffers(1, &buffer);
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+	}
+
+	// points the "BonePalette" block of shader at BLOCK_BINDING
+	static void BindBlock(const Shader& shader)
+	{
+		GLuint index = glGetUniformBlockIndex(shader.ID, "BonePalette");
+		if (index != GL_INVALID_INDEX)
+		{
+			glUniformBlockBinding(shader.ID, index, BLOCK_BINDING);
+		}
+	}
+
+	// advances the clips and computes the palettes
+	void Update(float deltaTime)
+	{
+		CpuTimer timer;
+
+		// the ranges start on the offset alignment of the buffer
+		size_t matrixAlignment = std::max<size_t>(alignment / sizeof(glm::mat4), 1);
+		offsets.resize(instances.size());
+		size_t total = 0;
+		BoneCount = 0;
+		for (unsigned int i = 0; i < instances.size(); i++)
+		{
+			offsets[i] = total;
+			unsigned int bones = instances[i].Rig->GetBoneCount();
+			bones = bones < MAX_BONES ? bones : MAX_BONES;
+			total += (bones + matrixAlignment - 1) / matrixAlignment * matrixAlignment;
+			BoneCount += bones;
+		}
+		// a range is always bound with the size of the whole block, the last one included
+		palettes.resize(total + MAX_BONES);
+
+		std::function<void(unsigned int, unsigned int)> update = [this, deltaTime](unsigned int begin, unsigned int end)
+		{
+			std::vector<glm::mat4> locals;
+			std::vector<glm::mat4> worlds;
+			std::vector<glm::mat4> palette;
+			for (unsigned int i = begin; i < end; i++)
+			{
+				AnimatedInstance& instance = instances[i];
+				const Skeleton& rig = *instance.Rig;
+				locals = rig.GetBindLocals();
+				if (instance.Clip && instance.Clip->Duration > 0.0f)
+				{
+					instance.Time = std::fmod(instance.Time + deltaTime * instance.Speed, instance.Clip->Duration);
+					if (instance.Time < 0.0f)
+						instance.Time += instance.Clip->Duration;
+					if (instance.Compressed)
+						instance.Compressed->Sample(instance.Time, instance.Cursor, locals.data());
+					else
+						instance.Clip->Sample(instance.Time, locals.data());
+				}
+				worlds.resize(rig.GetJointCount());
+				if (rig.GetBoneCount() <= MAX_BONES)
+				{
+					rig.ComputePalette(locals.data(), worlds.data(), &palettes[offsets[i]]);
+					continue;
+				}
+				// bones past MAX_BONES are dropped
+				palette.resize(rig.GetBoneCount());
+				rig.ComputePalette(locals.data(), worlds.data(), palette.data());
+				std::copy(palette.begin(), palette.begin() + MAX_BONES, palettes.begin() + offsets[i]);
+			}
+		};
+
+		unsigned int count = static_cast<unsigned int>(instances.size());
+		if (jobs)
+		{
+			jobs->ParallelFor(count, 16, update);
+		}
+		else
+		{
+			update(0, count);
+		}
+		UpdateTimeMs = timer.ElapsedMs();
+	}
+
+	void Upload()
+	{
+		CpuTimer timer;
+		GLsizeiptr size = static_cast<GLsizeiptr>(palettes.size() * sizeof(glm::mat4));
+		glBindBuffer(GL_UNIFORM_BUFFER, buffer);
+		// new storage with the data in one call, the gpu may still read last frame's palettes
+		glBufferData(GL_UNIFORM_BUFFER, size, palettes.data(), GL_STREAM_DRAW);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		UploadedBytes = static_cast<unsigned int>(size);
+		UploadTimeMs = timer.ElapsedMs();
+	}
+
+	void Bind(unsigned int instance) const
+	{
+		glBindBufferRange(GL_UNIFORM_BUFFER, BLOCK_BINDING, buffer, offsets[instance] * sizeof(glm::mat4), MAX_BONES * sizeof(glm::mat4));
+	}
+
+	void Record(CommandList& list, unsigned int instance) const
+	{
+		list.BindBufferRange(GL_UNIFORM_BUFFER, BLOCK_BINDING, buffer, offsets[instance] * sizeof(glm::mat4), MAX_BONES * sizeof(glm::mat4));
+	}
+
+	const glm::mat4* GetPalette(unsigned int instance) const { return &palettes[offsets[instance]]; }
+
+	void ReportStats(FrameStats& stats) const
+	{
+		stats.Set("Skinned instances", static_cast<float>(instances.size()));
+		stats.Set("Skinning bones", static_cast<float>(BoneCount));
+		stats.Set("Skinning update ms", UpdateTimeMs);
+		stats.Set("Skinning upload ms", UploadTimeMs);
+		stats.Set("Skinning upload KB", UploadedBytes / 1024.0f);
+	}
+
+	unsigned int BoneCount = 0;
+	unsigned int UploadedBytes = 0;
+	float UpdateTimeMs = 0.0f;
+	float UploadTimeMs = 0.0f;
+
+private:
+	JobSystem* jobs = nullptr;
+	std::vector<AnimatedInstance> instances;
+	// first matrix of every instance in palettes
+	std::vector<size_t> offsets;
+	std::vector<glm::mat4> palettes;
+	GLuint buffer = 0;
+	GLint alignment = 256;
+};
+
+// A humanoid sized test rig, a spine with limbs branching off it, and a looping
+// clip that swings every joint, for benchmarks without an animated asset.
+inline void GenerateTestSkeleton(Skeleton& skeleton, unsigned int jointCount)
+{
+	skeleton = Skeleton();
+	for (unsigned int i = 0; i < jointCount; i++)
+	{
+		// chains of 4, every chain starts at one of the first joints
+		unsigned int parent = i == 0 ? Skeleton::NO_PARENT : (i % 4 == 1 ? (i / 4) % 4 : i - 1);
+		std::string name = "joint" + std::to_string(i);
+		glm::mat4 local = glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, 0.1f, 0.0f));
+		skeleton.AddJoint(name, parent, local);
+		skeleton.AddBone(name, glm::translate(glm::mat4(1.0f), glm::vec3(0.0f, -0.1f * (i + 1), 0.0f)));
+	}
+	skeleton.ResolveBones();
+}
+
+inline void GenerateTestClip(const Skeleton& skeleton, AnimationClip& clip, float duration, float keysPerSecond)
+{
+	clip = AnimationClip();
+	clip.Name = "test";
+	clip.Duration = duration;
+	unsigned int keyCount = std::max(2u, static_cast<unsigned int>(duration * keysPerSecond) + 1);
+	for (unsigned int j = 0; j < skeleton.GetJointCount(); j++)
+	{
+		AnimationChannel channel;
+		channel.Joint = j;
+		for (unsigned int k = 0; k < keyCount; k++)
+		{
+			float time = duration * k / (keyCount - 1);
+			float angle = 0.5f * std::sin(6.2831853f * time / duration + j);
+			RotationKey rotation = { time, glm::angleAxis(angle, glm::normalize(glm::vec3(1.0f, 0.5f * (j % 3), 0.25f))) };
+			channel.Rotations.push_back(rotation);
+
+			// like exported clips, a key per frame on every track, only the root moves
+			float bob = j == 0 ? 0.05f * std::sin(12.566371f * time / duration) : 0.0f;
+			VectorKey position = { time, glm::vec3(0.0f, 0.1f + bob, 0.0f) };
+			VectorKey scale = { time, glm::vec3(1.0f) };
+			channel.Positions.push_back(position);
+			channel.Scales.push_back(scale);
+		}
+		clip.Channels.push_back(channel);
+	}
+}
+
+#endif // !SKELETAL_ANIMATION_H
@@ -0,0 +1,163 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "imgui/imgui.h"
+
+// Simple wall clock timer for measuring cpu side work.
+class CpuTimer
+{
+public:
+	CpuTimer()
+	{
+		Reset();
+	}
+
+	void Reset()
+	{
+		start = std::chrono::high_resolution_clock::now();
+	}
+
+	float ElapsedMs() const
+	{
+		std::chrono::duration<float, std::milli> elapsed = std::chrono::high_resolution_clock::now() - start;
+		return elapsed.count();
+	}
+
+private:
+	std::chrono::high_resolution_clock::time_point start;
+};
+
+// Mean and standard deviation over the last WINDOW samples, used for jitter.
+class RollingStats
+{
+public:
+	static const int WINDOW = 120;
+
+	void Add(float value)
+	{
+		samples[offset] = value;
+		offset = (offset + 1) % WINDOW;
+		if (count < WINDOW)
+			count++;
+	}
+
+	float Mean() const
+	{
+		float sum = 0.0f;
+		for (int i = 0; i < count; i++)
+			sum += samples[i];
+		return count > 0 ? sum / count : 0.0f;
+	}
+
+	float StdDev() const
+	{
+		float mean = Mean();
+		float sum = 0.0f;
+		for (int i = 0; i < count; i++)
+			sum += (samples[i] - mean) * (samples[i] - mean);
+		return count > 1 ? std::sqrt(sum / (count - 1)) : 0.0f;
+	}
+
+private:
+	float samples[WINDOW] = {};
+	int offset = 0;
+	int count = 0;
+};
+
+// Per frame counters. Systems report named values every frame, EndFrame()
+// pushes them into a short history and Draw() shows them in an imgui window.
+class FrameStats
+{
+public:
+	static const int HISTORY_SIZE = 120;
+
+	void Set(const std::string& name, float value)
+	{
+		GetEntry(name).value = value;
+	}
+
+	void Add(const std::string& name, float value)
+	{
+		GetEntry(name).value += value;
+	}
+
+	float Get(const std::string& name) const
+	{
+		std::map<std::string, size_t>::const_iterator it = lookup.find(name);
+		return it == lookup.end() ? 0.0f : entries[it->second].value;
+	}
+
+	void EndFrame()
+	{
+		for (unsigned int i = 0; i < entries.size(); i++)
+		{
+			Entry& entry = entries[i];
+			entry.history[entry.offset] = entry.value;
+			entry.offset = (entry.offset + 1) % HISTORY_SIZE;
+			if (entry.accumulate)
+				entry.value = 0.0f;
+		}
+	}
+
+	// values added through Add() start from zero again every frame
+	void MarkAccumulating(const std::string& name)
+	{
+		GetEntry(name).accumulate = true;
+	}
+
+	void Draw()
+	{
+		ImGui::Begin("Stats");
+		for (unsigned int i = 0; i < entries.size(); i++)
+		{
+			const Entry& entry = entries[i];
+			ImGui::PlotLines(entry.name.c_str(), entry.history, HISTORY_SIZE, entry.offset, NULL, FLT_MAX, FLT_MAX, ImVec2(120.0f, 20.0f));
+			ImGui::SameLine();
+			ImGui::Text("%.3f", entry.value);
+		}
+		ImGui::End();
+	}
+
+	void Print(std::ostream& out) const
+	{
+		for (unsigned int i = 0; i < entries.size(); i++)
+		{
+			out << entries[i].name << ": " << entries[i].value << "\n";
+		}
+	}
+
+private:
+	struct Entry
+	{
+		std::string name;
+		float value = 0.0f;
+		bool accumulate = false;
+		int offset = 0;
+		float history[HISTORY_SIZE] = {};
+	};
+
+	std::vector<Entry> entries;
+	std::map<std::string, size_t> lookup;
+
+	Entry& GetEntry(const std::string& name)
+	{
+		std::map<std::string, size_t>::iterator it = lookup.find(name);
+		if (it != lookup.end())
+			return entries[it->second];
+
+		lookup[name] = entries.size();
+		entries.push_back(Entry());
+		entries.back().name = name;
+		return entries.back();
+	}
+};
+
+#endif // !STATS_H
@@ -0,0 +1,134 @@
+#ifndef TRANSPARENT_SORT_H
+#define TRANSPARENT_SORT_H
+
+#include <glm.hpp>
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "stats.h"
+
+// Back to front ordering of transparent objects.
+// Items are (key, index) pairs in flat arrays that are reused every frame, the
+// key is the view space depth turned into an unsigned integer so a stable
+// LSD radix sort can order them. Objects at the same depth keep the order in
+// which they were added instead of replacing each other.
+class TransparentSorter
+{
+public:
+	void Reserve(unsigned int count)
+	{
+		items.reserve(count);
+		scratch.reserve(count);
+	}
+
+	void Clear()
+	{
+		items.clear();
+	}
+
+	// depth is the distance along the view direction, larger is farther away
+	void Add(unsigned int index, float depth)
+	{
+		Item item;
+		item.key = ~FloatToSortable(depth);
+		item.index = index;
+		items.push_back(item);
+	}
+
+	// view space depth of every position, index i refers to positions[i]
+	void Add(const std::vector<glm::vec3>& positions, const glm::mat4& view)
+	{
+		for (unsigned int i = 0; i < positions.size(); i++)
+		{
+			const glm::vec3& p = positions[i];
+			float viewZ = view[0][2] * p.x + view[1][2] * p.y + view[2][2] * p.z + view[3][2];
+			Add(i, -viewZ);
+		}
+	}
+
+	// farthest first, ties stay in insertion order
+	void Sort()
+	{
+		CpuTimer timer;
+		scratch.resize(items.size());
+
+		unsigned int histogram[4][256];
+		std::memset(histogram, 0, sizeof(histogram));
+		for (unsigned int i = 0; i < items.size(); i++)
+		{
+			uint32_t key = items[i].key;
+			histogram[0][key & 0xFF]++;
+			histogram[1][(key >> 8) & 0xFF]++;
+			histogram[2][(key >> 16) & 0xFF]++;
+			histogram[3][key >> 24]++;
+		}
+
+		Item* src = items.data();
+		Item* dst = scratch.data();
+		unsigned int count = static_cast<unsigned int>(items.size());
+		for (int pass = 0; pass < 4; pass++)
+		{
+			int shift = pass * 8;
+			// all keys share this byte, nothing to do
+			if (count == 0 || histogram[pass][(src[0].key >> shift) & 0xFF] == count)
+				continue;
+
+			unsigned int offsets[256];
+			unsigned int sum = 0;
+			for (int b = 0; b < 256; b++)
+			{
+				offsets[b] = sum;
+				sum += histogram[pass][b];
+			}
+			for (unsigned int i = 0; i < count; i++)
+			{
+				dst[offsets[(src[i].key >> shift) & 0xFF]++] = src[i];
+			}
+
+			Item* tmp = src;
+			src = dst;
+			dst = tmp;
+		}
+
+		if (src != items.data())
+		{
+			items.swap(scratch);
+		}
+
+		SortTimeMs = timer.ElapsedMs();
+	}
+
+	unsigned int Size() const { return static_cast<unsigned int>(items.size()); }
+	// index of the i-th object to draw
+	unsigned int operator[](unsigned int i) const { return items[i].index; }
+
+	void ReportStats(FrameStats& stats) const
+	{
+		stats.Set("Transparent objects", static_cast<float>(items.size()));
+		stats.Set("Transparent sort ms", SortTimeMs);
+	}
+
+	float SortTimeMs = 0.0f;
+
+private:
+	struct Item
+	{
+		uint32_t key;
+		uint32_t index;
+	};
+
+	std::vector<Item> items;
+	std::vector<Item> scratch;
+
+	// maps floats onto unsigned integers with the same ordering
+	static uint32_t FloatToSortable(float value)
+	{
+		uint32_t bits;
+		std::memcpy(&bits, &value, sizeof(bits));
+		return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+	}
+};
+
+#endif // !TRANSPARENT_SORT_H
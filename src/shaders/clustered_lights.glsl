@@ -0,0 +1,98 @@
+// Clustered point and spot lights and cascaded shadows, shared by
+// light_clustered.fsc and deferred_lighting.fsc. Shader pastes it in where
+// they say #include "clustered_lights.glsl".
+
+// filled by ClusteredLighting, see clustered_lighting.h
+uniform usamplerBuffer lightGrid;
+uniform usamplerBuffer lightIndices;
+uniform samplerBuffer lightData;
+uniform vec3 clusterScale;
+uniform float clusterBias;
+
+// filled by CascadedShadowMaps, see cascaded_shadows.h
+uniform sampler2DArrayShadow shadowMap;
+uniform mat4 lightSpace[4];
+// far view depth of each cascade
+uniform float cascadeSplits[4];
+// world size of a shadow map texel per cascade
+uniform float cascadeTexel[4];
+uniform int shadowsEnabled;
+
+#define CLUSTERS_X 16
+#define CLUSTERS_Y 9
+#define CLUSTERS_Z 24
+
+float CalcShadow(vec3 fragPos, vec3 normal, float viewDepth, vec3 lightDir)
+{
+	if (shadowsEnabled == 0 || viewDepth > cascadeSplits[3])
+		return 1.0;
+
+	int cascade = 0;
+	for (int i = 0; i < 3; i++)
+	{
+		if (viewDepth > cascadeSplits[i])
+			cascade = i + 1;
+	}
+
+	// pushed out along the normal, more on slopes, against shadow acne
+	float slope = 1.0 - max(dot(normal, lightDir), 0.0);
+	vec3 offsetPos = fragPos + normal * cascadeTexel[cascade] * (0.5 + 1.5 * slope);
+	vec3 coords = (lightSpace[cascade] * vec4(offsetPos, 1.0)).xyz * 0.5 + 0.5;
+
+	// 3x3 taps on top of the 2x2 hardware filter
+	vec2 texel = 1.0 / vec2(textureSize(shadowMap, 0).xy);
+	float lit = 0.0;
+	for (int x = -1; x <= 1; x++)
+	{
+		for (int y = -1; y <= 1; y++)
+		{
+			lit += texture(shadowMap, vec4(coords.xy + vec2(x, y) * texel, float(cascade), coords.z));
+		}
+	}
+	return lit / 9.0;
+}
+
+vec3 CalcLight(int index, vec3 normal, vec3 fragPos, vec3 viewDir, vec3 diffuseColor, vec3 specularColor, float shininess)
+{
+	vec4 positionRange = texelFetch(lightData, index * 4);
+	vec4 colorType = texelFetch(lightData, index * 4 + 1);
+
+	vec3 toLight = positionRange.xyz - fragPos;
+	float distance = length(toLight);
+	vec3 lightDir = toLight / max(distance, 0.0001);
+
+	float diff = max(dot(normal, lightDir), 0.0);
+	vec3 reflectDir = reflect(-lightDir, normal);
+	float spec = pow(max(dot(viewDir, reflectDir), 0.0), shininess);
+
+	// inverse square, windowed so it reaches zero at the light range
+	float falloff = clamp(1.0 - pow(distance / positionRange.w, 4.0), 0.0, 1.0);
+	float attenuation = falloff * falloff / (1.0 + distance * distance);
+
+	if (colorType.w > 0.5)
+	{
+		vec4 directionOuter = texelFetch(lightData, index * 4 + 2);
+		float inner = texelFetch(lightData, index * 4 + 3).x;
+		float theta = dot(lightDir, normalize(-directionOuter.xyz));
+		attenuation *= clamp((theta - directionOuter.w) / max(inner - directionOuter.w, 0.0001), 0.0, 1.0);
+	}
+
+	return colorType.rgb * (diff * diffuseColor + spec * specularColor) * attenuation;
+}
+
+// every light of the cluster the fragment is in, viewDepth is its linear view depth
+vec3 CalcClusterLights(float viewDepth, vec3 normal, vec3 fragPos, vec3 viewDir, vec3 diffuseColor, vec3 specularColor, float shininess)
+{
+	int slice = clamp(int(log(viewDepth) * clusterScale.z + clusterBias), 0, CLUSTERS_Z - 1);
+	ivec2 tile = clamp(ivec2(gl_FragCoord.xy * clusterScale.xy), ivec2(0), ivec2(CLUSTERS_X - 1, CLUSTERS_Y - 1));
+	int cluster = (slice * CLUSTERS_Y + tile.y) * CLUSTERS_X + tile.x;
+
+	vec3 result = vec3(0.0);
+	uvec2 range = texelFetch(lightGrid, cluster).xy;
+	for (uint i = 0u; i < range.y; i++)
+	{
+		int index = int(texelFetch(lightIndices, int(range.x + i)).x);
+		result += CalcLight(index, normal, fragPos, viewDir, diffuseColor, specularColor, shininess);
+	}
+	return result;
+}
\ No newline at end of file
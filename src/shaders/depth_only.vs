@@ -0,0 +1,14 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+
+// must come out bit identical to the shading pass, which tests with GL_EQUAL
+invariant gl_Position;
+
+void main()
+{
+	gl_Position = projection * view * model * vec4(aPos, 1.0);
+}
\ No newline at end of file
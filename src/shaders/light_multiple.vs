@@ -13,6 +13,9 @@ out vec3 FragPos;
 out vec3 LightPos;	
 out vec2 TexCoords;
 
+// the depth prepass relies on the same positions
+invariant gl_Position;
+
 void main()
 {
 	gl_Position = projection * view * model * vec4(aPos, 1.0f);
@@ -11,6 +11,9 @@ uniform mat4 model;
 uniform mat4 view;
 uniform mat4 projection;
 
+// the depth prepass relies on the same positions
+invariant gl_Position;
+
 void main()
 {
 	TexCoords = aTexCoords;
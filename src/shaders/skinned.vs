@@ -0,0 +1,60 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aNormal;
+layout (location = 2) in vec2 aTexCoords;
+layout (location = 5) in ivec4 aBoneIds;
+layout (location = 6) in vec4 aWeights;
+
+out vec2 TexCoords;
+out vec3 Position;
+out vec3 Normal;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+
+// has to match SkinningPalettes::MAX_BONES
+const int MAX_BONES = 100;
+
+// the range of the palette buffer that belongs to the instance being drawn
+layout (std140) uniform BonePalette
+{
+	mat4 bones[MAX_BONES];
+};
+
+// the depth prepass runs the same shader
+invariant gl_Position;
+
+// Inverse transpose of m up to a scale, for normals, the fragment shaders normalize them.
+// The cofactor matrix costs three cross products where inverse() per vertex costs far more,
+// and it stays right under non uniform scale.
+mat3 NormalMatrix(mat3 m)
+{
+	mat3 cofactor = mat3(cross(m[1], m[2]), cross(m[2], m[0]), cross(m[0], m[1]));
+	// the determinant, negative for a mirroring transform which would flip the normal
+	return dot(m[0], cofactor[0]) < 0.0 ? -cofactor : cofactor;
+}
+
+void main()
+{
+	// unused influences have id -1, meshes without bones keep their node transform in model.
+	// Model drops ids past MAX_BONES when loading, the bound check keeps a bad id inside the range anyway.
+	mat4 skin = mat4(0.0);
+	float weight = 0.0;
+	for (int i = 0; i < 4; i++)
+	{
+		if (aBoneIds[i] >= 0 && aBoneIds[i] < MAX_BONES)
+		{
+			skin += bones[aBoneIds[i]] * aWeights[i];
+			weight += aWeights[i];
+		}
+	}
+	if (weight == 0.0)
+		skin = mat4(1.0);
+
+	mat4 skinnedModel = model * skin;
+	TexCoords = aTexCoords;
+	Normal = NormalMatrix(mat3(skinnedModel)) * aNormal;
+	Position = vec3(skinnedModel * vec4(aPos, 1.0));
+	gl_Position = projection * view * skinnedModel * vec4(aPos, 1.0);
+}
\ No newline at end of file
@@ -0,0 +1,70 @@
+#version 330 core
+layout (location = 0) in vec3 aPos;
+layout (location = 1) in vec3 aNormal;
+layout (location = 2) in vec2 aTexCoords;
+layout (location = 5) in ivec4 aBoneIds;
+layout (location = 6) in vec4 aWeights;
+// per instance, see InstanceData
+layout (location = 7) in mat4 aInstanceModel;
+// first row of the clip, rows in the loop, time offset, rows per second
+layout (location = 11) in vec4 aAnimation;
+
+out vec2 TexCoords;
+out vec3 Position;
+out vec3 Normal;
+
+uniform mat4 model;
+uniform mat4 view;
+uniform mat4 projection;
+
+// see BakedAnimations, a row per frame, three texels per bone
+uniform sampler2D bakedBones;
+uniform float animationTime;
+
+// the depth prepass runs the same shader
+invariant gl_Position;
+
+mat4 FetchBone(int bone, float y)
+{
+	float width = float(textureSize(bakedBones, 0).x);
+	vec4 r0 = texture(bakedBones, vec2((bone * 3 + 0.5) / width, y));
+	vec4 r1 = texture(bakedBones, vec2((bone * 3 + 1.5) / width, y));
+	vec4 r2 = texture(bakedBones, vec2((bone * 3 + 2.5) / width, y));
+	return transpose(mat4(r0, r1, r2, vec4(0.0, 0.0, 0.0, 1.0)));
+}
+
+// Inverse transpose of m up to a scale, for normals, the fragment shaders normalize them.
+// The cofactor matrix costs three cross products where inverse() per vertex costs far more,
+// and it stays right under non uniform scale.
+mat3 NormalMatrix(mat3 m)
+{
+	mat3 cofactor = mat3(cross(m[1], m[2]), cross(m[2], m[0]), cross(m[0], m[1]));
+	// the determinant, negative for a mirroring transform which would flip the normal
+	return dot(m[0], cofactor[0]) < 0.0 ? -cofactor : cofactor;
+}
+
+void main()
+{
+	// the filter blends the two rows around the frame, or picks the closer one
+	float frame = mod((animationTime + aAnimation.z) * aAnimation.w, aAnimation.y);
+	float y = (aAnimation.x + frame + 0.5) / float(textureSize(bakedBones, 0).y);
+
+	mat4 skin = mat4(0.0);
+	float weight = 0.0;
+	for (int i = 0; i < 4; i++)
+	{
+		if (aBoneIds[i] >= 0)
+		{
+			skin += FetchBone(aBoneIds[i], y) * aWeights[i];
+			weight += aWeights[i];
+		}
+	}
+	if (weight == 0.0)
+		skin = mat4(1.0);
+
+	mat4 skinnedModel = aInstanceModel * model * skin;
+	TexCoords = aTexCoords;
+	Normal = NormalMatrix(mat3(skinnedModel)) * aNormal;
+	Position = vec3(skinnedModel * vec4(aPos, 1.0));
+	gl_Position = projection * view * skinnedModel * vec4(aPos, 1.0);
+}
\ No newline at end of file
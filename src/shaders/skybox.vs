@@ -1,14 +1,15 @@
 #version 330 core
-layout (location = 0) in vec3 aPos;
+// one triangle over the whole screen from gl_VertexID, no vertex buffer
+out vec3 Direction;
 
-out vec3 TexCoords;
-
-uniform mat4 projection;
-uniform mat4 view;
+// of the projection and the view without its translation
+uniform mat4 inverseViewProjection;
 
 void main()
 {
-	TexCoords = aPos;
-	vec4 pos = projection * view * vec4(aPos, 1.0);
-	gl_Position = pos.xyww;
+	vec2 ndc = vec2(float((gl_VertexID & 1) << 2) - 1.0, float((gl_VertexID & 2) << 1) - 1.0);
+	// just inside the far plane: passes GL_LESS where nothing was drawn, fails everywhere else
+	gl_Position = vec4(ndc, 0.99999, 1.0);
+	// linear in ndc so it interpolates exactly, w is positive and the direction needs no divide
+	Direction = (inverseViewProjection * vec4(ndc, 1.0, 1.0)).xyz;
 }
\ No newline at end of file